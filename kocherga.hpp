@@ -27,6 +27,8 @@
 
 #include <tuple>
 #include <array>
+#include <atomic>
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <cassert>
@@ -55,6 +57,20 @@ static constexpr std::int16_t ErrInvalidState           = 1001;
 static constexpr std::int16_t ErrAppImageTooLarge       = 1002;
 static constexpr std::int16_t ErrROMWriteFailure        = 1003;
 static constexpr std::int16_t ErrInvalidParams          = 1004;
+static constexpr std::int16_t ErrAppDescriptorNotFound  = 1005;
+static constexpr std::int16_t ErrAppImageRejected       = 1006;
+static constexpr std::int16_t ErrAppAlreadyInstalled    = 1007;     ///< Terminates the download; see below
+static constexpr std::int16_t ErrROMReadFailure         = 1008;
+
+/**
+ * Successful result of @ref BootloaderController::upgradeApp() if the image being downloaded is already installed,
+ * in which case the download is terminated early and the storage is left intact.
+ * To terminate the download, the download sink returns -@ref ErrAppAlreadyInstalled; the protocols shall stop
+ * delivering the data and return it from @ref IProtocol::downloadImage(), but report the outcome to the remote
+ * as a success. A protocol that cannot stop the sender without reporting an error to it (e.g., YMODEM) shall
+ * receive and discard the rest of the image instead.
+ */
+static constexpr std::int16_t ResultAppUnchanged        = 1;
 
 /**
  * The library performs operations on data blocks not larger than this.
@@ -108,6 +124,117 @@ public:
     }
 
     std::uint64_t get() const { return crc_ ^ 0xFFFFFFFFFFFFFFFFULL; }
+
+    /**
+     * The CRC of a block of data computed separately, starting from the zero register instead of the initial value
+     * and without the output xor. The CRC is linear, so such partial CRCs can be combined; see @ref combine().
+     */
+    static std::uint64_t computePartial(const void* data, std::size_t len)
+    {
+        CRC64 crc;
+        crc.crc_ = 0;
+        crc.add(data, len);
+        return crc.crc_;
+    }
+
+    /**
+     * The factor that moves a partial CRC over the specified number of zero bytes, i.e., x^(8*len) mod P.
+     */
+    static std::uint64_t computeShiftFactor(std::size_t len)
+    {
+        std::uint64_t factor = 1;                           // x^0
+        std::uint64_t square = std::uint64_t(1) << 8U;      // x^8, squared for every bit of the length
+        for (; len > 0; len >>= 1U)
+        {
+            if ((len & 1U) != 0)
+            {
+                factor = multiply(factor, square);
+            }
+            square = multiply(square, square);
+        }
+        return factor;
+    }
+
+    /**
+     * Updates the CRC as if the block of data whose partial CRC is given were added with @ref add();
+     * the shift factor shall be computed for the size of the block. The cost does not depend on the size.
+     */
+    void combine(std::uint64_t partial, std::uint64_t shift_factor)
+    {
+        crc_ = multiply(crc_, shift_factor) ^ partial;
+    }
+
+    /**
+     * Multiplication of two polynomials modulo the CRC polynomial.
+     */
+    static std::uint64_t multiply(std::uint64_t a, std::uint64_t b)
+    {
+        std::uint64_t product = 0;
+        for (std::uint8_t i = 0; i < 64U; i++)
+        {
+            product = (product & Mask) ? (product << 1U) ^ Poly : product << 1U;
+            if ((b & Mask) != 0)
+            {
+                product ^= a;
+            }
+            b <<= 1U;
+        }
+        return product;
+    }
+};
+
+/**
+ * A value that is written under a mutex but can be read from other threads without locking: the readers never
+ * block, even if the writer holds the mutex for a long time; they retry if the value is being modified meanwhile.
+ * The value is stored as relaxed atomic words, so a torn read is detected by the sequence counter rather than
+ * being undefined behavior. The writers shall be serialized externally.
+ */
+template <typename T>
+class Seqlock
+{
+    static_assert(std::is_trivially_copyable_v<T>, "The value is copied word by word");
+
+    static constexpr std::size_t NumWords = (sizeof(T) + sizeof(std::uint32_t) - 1U) / sizeof(std::uint32_t);
+
+    std::atomic<std::uint32_t> sequence_{0};                   ///< Odd while the value is being modified
+    std::array<std::atomic<std::uint32_t>, NumWords> words_{};
+
+public:
+    void store(const T& value)
+    {
+        std::array<std::uint32_t, NumWords> words{};
+        std::memcpy(words.data(), &value, sizeof(T));
+
+        const auto sequence = sequence_.load(std::memory_order_relaxed);
+        sequence_.store(sequence + 1U, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t i = 0; i < NumWords; i++)
+        {
+            words_[i].store(words[i], std::memory_order_relaxed);
+        }
+        sequence_.store(sequence + 2U, std::memory_order_release);
+    }
+
+    T load() const
+    {
+        std::array<std::uint32_t, NumWords> words{};
+        for (;;)
+        {
+            const auto before = sequence_.load(std::memory_order_acquire);
+            for (std::size_t i = 0; i < NumWords; i++)
+            {
+                words[i] = words_[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (((before & 1U) == 0) && (sequence_.load(std::memory_order_relaxed) == before))
+            {
+                break;
+            }
+        }
+        T value{};
+        std::memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+        return value;
+    }
 };
 
 /**
@@ -186,6 +313,188 @@ struct AppInfo
 
 static_assert(std::is_standard_layout_v<AppInfo>, "AppInfo is not standard layout; check your compiler");
 
+/**
+ * Defines how much of the downloaded image is read back from the storage to verify it after the upgrade;
+ * see @ref UpgradeOptions::readback. The CRC of the image is computed while it is being written,
+ * so the policies other than Full rely on the backend to report write failures.
+ */
+enum class ReadbackPolicy : std::uint8_t
+{
+    Full,                                   ///< Read back and verify the entire image, ignoring the streamed CRC
+    Descriptor,                             ///< Read back only the app descriptor and compare it with the written one
+    None                                    ///< Trust the streamed CRC, e.g., if the backend verifies every write
+};
+
+/**
+ * Optional behaviors of the application upgrade process; see @ref BootloaderController.
+ * The defaults are chosen to work with any backend.
+ */
+struct UpgradeOptions
+{
+    /**
+     * Before writing a buffer, read the existing contents of the storage at the same location and skip the write
+     * if it is identical. This saves both upgrade time and flash endurance when the new image differs from the
+     * old one only slightly. Only useful with backends that do not erase the storage in beginUpgrade().
+     * If the erasing is managed by the controller (see @ref IROMBackend::getSectorSize()), a buffer can be skipped
+     * only if it does not share an erase sector with data that needs to be written.
+     */
+    bool skip_unchanged_pages = false;
+
+    /**
+     * If the erasing is managed by the controller, keep up to this many sectors past the current write position
+     * erased in the background using @ref IROMBackend::startSectorErase(), so that the erase latency is hidden
+     * behind the data transfer instead of stalling the writes. Zero erases each sector on first touch.
+     * The sectors are never erased past the end of the image if its size is known in advance; otherwise, up to
+     * this many sectors past the end of the image may be erased. Ignored if @ref skip_unchanged_pages is set,
+     * because the sectors erased ahead of time could not be compared with the new data anymore.
+     */
+    std::uint8_t erase_ahead_sectors = 0;
+
+    /**
+     * How the downloaded image is verified; see @ref ReadbackPolicy. If the image could not be verified while it
+     * was being written (e.g., it is not valid), it is always read back entirely.
+     */
+    ReadbackPolicy readback = ReadbackPolicy::Full;
+
+    /**
+     * If non-zero, the upgrade is aborted with @ref ErrAppDescriptorNotFound if the app descriptor signature is not
+     * found within this many bytes from the beginning of the image, so that a wrong file is rejected early instead of
+     * being downloaded entirely. The descriptor is normally located close to the beginning of the image.
+     * Zero disables the limit.
+     */
+    std::uint32_t app_descriptor_search_limit = 0;
+
+    /**
+     * If non-zero, every page is read back right after it is written and compared with the data it was written
+     * from, so that a bad write is detected and repaired immediately instead of failing the final verification.
+     * A mismatching page is written again, up to this many attempts in total, before the upgrade is aborted with
+     * @ref ErrROMWriteFailure. This costs one extra read per page. With flash memories, rewriting the page
+     * reprograms the bits that have failed to program; bits that are programmed but should not be cannot be
+     * repaired without an erase, so such pages still fail after the last attempt.
+     * The pages written asynchronously are read back once their writes are completed; before a page is written
+     * again, all pending writes are completed.
+     * Backends that are known to program the bits wrong occasionally may also use @ref ReadbackPolicy::None
+     * or @ref ReadbackPolicy::Descriptor with this option, because every page has been verified already.
+     */
+    std::uint8_t write_verify_attempts = 0;
+
+    /**
+     * If set, new images are downloaded into this memory instead of the storage, and they are verified there
+     * (the descriptor, the CRC, and the signature, if any) before the storage is touched. Only a valid image is then
+     * programmed into the storage, all at once and directly from this memory, so the installed application remains
+     * intact until the new image has been downloaded entirely, and the link is never stalled by the flash.
+     * The images (with the signature, if any) that do not fit into the buffer are rejected with
+     * @ref ErrAppImageTooLarge. The buffer must stay valid as long as the controller exists.
+     * Ignored in the staging mode; see @ref SecondaryROMRole::Staging.
+     */
+    std::uint8_t* ram_buffer = nullptr;
+    std::uint32_t ram_buffer_size = 0;              ///< Size of @ref ram_buffer, in bytes
+
+    /**
+     * If set, the CRCs of the 1 KiB pages of the primary storage are cached here when the image is verified,
+     * so that the next verification reads only the pages that have been written or erased since then, and the cost
+     * of verifying the image after a small change does not depend on the size of the image.
+     * The pages past the end of the cache are always read. The cache is not used if the images are signed,
+     * because the digest has to be computed over the entire image anyway (see @ref ISignatureVerifier).
+     * The controller can keep track of the changes only if it manages the erasing
+     * (see @ref IROMBackend::getSectorSize()); otherwise, the cache is dropped entirely at every upgrade.
+     * The storage must not be modified other than by the controller while it exists.
+     * The cache must stay valid as long as the controller exists.
+     */
+    std::uint64_t* page_crc_cache = nullptr;
+    std::uint32_t page_crc_cache_size = 0;          ///< Number of entries in @ref page_crc_cache, one per page
+};
+
+/**
+ * Counters describing the last application upgrade; see @ref BootloaderController::getLastUpgradeStatistics().
+ * A page is a chunk of data that is written into the backend at once; see the download buffer size.
+ */
+struct UpgradeStatistics
+{
+    std::uint32_t bytes_received = 0;       ///< Total amount of data received from the protocol; updated at the end
+    std::uint32_t bytes_decoded  = 0;       ///< Amount of data delivered to the storage; see @ref IStreamFilter
+    std::uint32_t pages_written  = 0;       ///< Pages that were written into the backend
+    std::uint32_t pages_skipped  = 0;       ///< Pages that were not written because the storage was up to date
+    std::uint32_t sectors_erased = 0;       ///< Sectors erased by the controller; see IROMBackend::eraseSector()
+    std::uint32_t pages_in_holes = 0;       ///< Pages that were not written because they were erased; see handleHole()
+    std::uint32_t resume_offset  = 0;       ///< Where the download was resumed from; see @ref UpgradeJournal
+    std::uint32_t bytes_installed = 0;      ///< Copied from the staging area or from UpgradeOptions::ram_buffer
+    std::uint32_t pages_rewritten = 0;      ///< Written again after a mismatch; see write_verify_attempts
+};
+
+/**
+ * A record of the progress of an interrupted upgrade that allows the next attempt to resume the download
+ * instead of starting from scratch; see @ref IPlatform::storeUpgradeJournal().
+ * The journal is maintained only if the erasing is managed by the controller (see @ref IROMBackend::getSectorSize())
+ * and the protocol can identify the image and resume from an offset (see @ref IDownloadSink::getResumeOffset()).
+ */
+struct UpgradeJournal
+{
+    std::uint64_t image_id = 0;             ///< Identity of the image as defined by the protocol, or the staged image CRC
+    std::uint32_t offset   = 0;             ///< Everything below this sector boundary has been written successfully
+    std::uint64_t crc      = 0;             ///< CRC-64-WE of the storage contents below the offset
+};
+
+/**
+ * Defines how @ref BootloaderController uses the secondary ROM backend, if one is provided.
+ */
+enum class SecondaryROMRole : std::uint8_t
+{
+    /**
+     * A/B dual-slot operation: the primary backend is slot 0, the secondary backend is slot 1.
+     * Each slot holds a complete application image. New images are always downloaded into the slot that does not
+     * contain the application selected for booting, so a bootable image is retained even if the upgrade fails.
+     * If both slots contain valid images, the newest one is selected; see @ref BootloaderController::getAppSlot().
+     */
+    AlternateSlot,
+
+    /**
+     * Staging area: the primary backend holds the application that is booted, and the secondary backend
+     * (e.g., a large external SPI flash) is used as an intermediate storage. New images are downloaded into
+     * the staging area at the full link speed and verified there; only then are they copied into the primary
+     * backend, so the application remains bootable during the download.
+     * The copy is journaled via @ref IPlatform::storeUpgradeJournal() with the image ID set to the CRC of
+     * the staged image. If it is interrupted, e.g., by a power loss, the controller resumes it upon construction
+     * from the last completed sector of the primary backend (or from the beginning if the primary backend erases
+     * the storage by itself). Hence, the platform must implement the upgrade journal to use this mode.
+     */
+    Staging
+};
+
+/**
+ * Verifies the cryptographic signature of the application image, e.g., Ed25519 (see kocherga_ed25519.hpp);
+ * see @ref IPlatform::getSignatureVerifier(). Implement this interface to use a hardware hash engine.
+ * The signature is stored right after the image, i.e., at the offset equal to the image size specified in the app
+ * descriptor, so it is not covered by the image size nor by the CRC; the storage must accommodate it.
+ * The signed digest covers the entire image as it is stored, including the CRC field of the app descriptor.
+ * The digest is computed in the same pass over the data as the CRC, both while the image is being downloaded
+ * and when it is verified before boot, so the image is never read just to check its signature.
+ * The methods are invoked only when the storage mutex is locked.
+ */
+class ISignatureVerifier
+{
+public:
+    static constexpr std::uint8_t MaxSignatureSize = 128;
+
+    virtual ~ISignatureVerifier() = default;
+
+    /**
+     * The size of the signature in bytes; must be constant and not exceed @ref MaxSignatureSize.
+     */
+    virtual std::uint8_t getSignatureSize() const = 0;
+
+    /**
+     * Begins a new digest. The image is then supplied sequentially from the beginning, in pieces of arbitrary size.
+     */
+    virtual void reset() = 0;
+    virtual void update(const void* data, std::size_t size) = 0;
+
+    /**
+     * @return true if the signature matches the digest of the data supplied since the last reset()
+     */
+    virtual bool verify(const std::uint8_t* signature) = 0;
+};
+
 /**
  * This interface abstracts the platform-specific functionality.
  * The implementation depends on the hardware and whether there is an operating system.
@@ -201,16 +510,98 @@ public:
      * Single-thread environments and also environments where the bootloader's instance is not
      * shared across different threads should not implement these methods.
      * Note that the mutex must be recursive.
+     * This mutex guards the state of the controller; it is never held while the storage is accessed,
+     * unless the storage mutex below is the same mutex.
      */
     virtual void lockMutex() { }
     virtual void unlockMutex() { }
 
+    /**
+     * The storage mutex guards the storage backends and the upgrade process, which can take a long time;
+     * implementing it as a separate recursive mutex allows the state queries and transitions (such as cancelBoot())
+     * to run concurrently with the storage operations. If both mutexes are needed, the storage mutex is locked first.
+     * By default, the mutex above is used for both purposes.
+     */
+    virtual void lockStorageMutex()   { lockMutex(); }
+    virtual void unlockStorageMutex() { unlockMutex(); }
+
     /**
      * Returns the time since boot as a monotonic (i.e., steady) clock.
      * The clock must never overflow.
      * This method is invoked only when the mutex is locked.
      */
     virtual std::chrono::microseconds getMonotonicUptime() const = 0;
+
+    /**
+     * Persistent storage for the @ref UpgradeJournal, optional; allows interrupted upgrades to be resumed,
+     * e.g., after a power loss. The journal should be kept in a non-volatile memory outside of the application
+     * storage. It is stored at most once per erase sector during the download, and erased (the argument is an
+     * empty option) once the download is completed. Stale or corrupted journals are harmless because the storage
+     * contents are verified against the CRC before resuming.
+     * The default implementation does not store anything, so the upgrades are never resumed.
+     * These methods are invoked only when the storage mutex is locked.
+     */
+    virtual std::optional<UpgradeJournal> loadUpgradeJournal() { return {}; }
+    virtual void storeUpgradeJournal(const std::optional<UpgradeJournal>& journal)
+    {
+        (void) journal;
+    }
+
+    /**
+     * Invoked during the upgrade as soon as the app descriptor of the new image is received, before the data that
+     * follows it is written. Returning false aborts the upgrade with @ref ErrAppImageRejected; this can be used to
+     * reject images built for different hardware or downgrades. The image may still turn out to be invalid later.
+     * The default implementation accepts any image.
+     * This method is invoked only when the storage mutex is locked.
+     */
+    virtual bool isAppCompatible(const AppInfo& app_info)
+    {
+        (void) app_info;
+        return true;
+    }
+
+    /**
+     * Provides the key for decrypting encrypted images; see kocherga_aes.hpp. The key ID is specified in the header
+     * of the image, so that the keys can be rotated; the key shall be written into the buffer of key_size bytes.
+     * The keys would normally be kept in a protected memory (e.g., a one-time programmable area or a secure element).
+     * The default implementation has no keys, so encrypted images are rejected.
+     * This method is invoked only when the mutex is locked.
+     * @return true if the key is available
+     */
+    virtual bool getDecryptionKey(std::uint8_t key_id, std::uint8_t* key, std::uint8_t key_size)
+    {
+        (void) key_id;
+        (void) key;
+        (void) key_size;
+        return false;
+    }
+
+    /**
+     * If the application images are signed, returns the verifier of their signatures; an image whose signature is
+     * missing or invalid is then treated like an image with an invalid CRC: it is never booted.
+     * The default implementation returns nullptr, so the images are not expected to be signed.
+     * This method is invoked once by the constructor of the controller; the object must outlive the controller.
+     */
+    virtual ISignatureVerifier* getSignatureVerifier() { return nullptr; }
+};
+
+/**
+ * A contiguous region of memory; a list of these describes data that is scattered across several buffers,
+ * e.g., the payloads of consecutive protocol frames. See @ref IROMBackend::writeGather().
+ */
+struct DataSpan
+{
+    const void* data = nullptr;
+    std::uint16_t size = 0;
+};
+
+/**
+ * A contiguous region of memory where the data can be placed; see @ref IDownloadSink::acquire().
+ */
+struct WritableDataSpan
+{
+    void* data = nullptr;
+    std::uint16_t size = 0;
 };
 
 /**
@@ -240,6 +631,43 @@ public:
      */
     virtual std::int16_t write(std::size_t offset, const void* data, std::uint16_t size) = 0;
 
+    /**
+     * Gather write API, optional.
+     * Backends that can program the storage from several memory regions at once (e.g., using chained
+     * DMA descriptors) should override @ref writeGather() and return the maximum number of regions per call here.
+     * The controller then writes the data directly from the buffers of the protocol instead of copying it into
+     * its own buffer first even if a page is split between them. The writes have the same offsets and sizes
+     * either way.
+     * The default implementation returns one, meaning that only contiguous pages are written without copying.
+     */
+    virtual std::uint8_t getMaxWriteSpans() const { return 1; }
+
+    /**
+     * Writes the data collected from several memory regions into the storage contiguously starting at the
+     * specified offset. See @ref getMaxWriteSpans().
+     * The total size cannot exceed 32767 bytes.
+     * The default implementation invokes @ref write() for each region.
+     * @return number of bytes written; negative on error
+     */
+    virtual std::int16_t writeGather(std::size_t offset, const DataSpan* spans, std::uint8_t count)
+    {
+        std::uint16_t written = 0;
+        for (std::uint8_t i = 0; i < count; i++)
+        {
+            const auto res = write(offset + written, spans[i].data, spans[i].size);
+            if (res < 0)
+            {
+                return res;
+            }
+            written = std::uint16_t(written + res);
+            if (res != int(spans[i].size))
+            {
+                break;
+            }
+        }
+        return std::int16_t(written);
+    }
+
     /**
      * @return 0 on success, negative on error
      */
@@ -250,6 +678,110 @@ public:
      * @return number of bytes read; negative on error
      */
     virtual std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const = 0;
+
+    /**
+     * Asynchronous write API, optional.
+     * Backends that can program the storage in the background (e.g., using DMA, or letting the flash controller
+     * run while the CPU is receiving the next data chunk) should return the maximum number of write operations
+     * that can be pending simultaneously. In that case the controller will use @ref submitWrite() and
+     * @ref awaitWrite() instead of @ref write().
+     * The default implementation returns zero, meaning that only synchronous writes are supported.
+     */
+    virtual std::uint8_t getMaxPendingWrites() const { return 0; }
+
+    /**
+     * Starts a write operation and returns immediately without waiting for its completion.
+     * The data buffer will remain valid and unmodified until the operation is reported completed via
+     * @ref awaitWrite(). The controller never submits more than @ref getMaxPendingWrites() operations at once.
+     * The size cannot exceed 32767 bytes.
+     * @return 0 if the operation was accepted; negative on error
+     */
+    virtual std::int16_t submitWrite(std::size_t offset, const void* data, std::uint16_t size)
+    {
+        (void) offset;
+        (void) data;
+        (void) size;
+        return -ErrInvalidState;
+    }
+
+    /**
+     * Reports completion of the oldest pending write operation; operations must complete in the order
+     * of their submission. If blocking is true, the method waits until the operation is completed;
+     * otherwise it returns zero immediately if the operation is still in progress.
+     * @return number of bytes written; zero if not completed yet; negative on error
+     */
+    virtual std::int16_t awaitWrite(bool blocking)
+    {
+        (void) blocking;
+        return -ErrInvalidState;
+    }
+
+    /**
+     * Invoked after beginUpgrade() once the protocol has learned the size of the image being downloaded,
+     * which may happen at any moment during the download, or never. Backends that erase the storage by themselves
+     * can use this information to avoid erasing more than necessary.
+     * The default implementation does nothing.
+     */
+    virtual void handleImageSizeHint(std::size_t image_size)
+    {
+        (void) image_size;
+    }
+
+    /**
+     * Sector erase API, optional.
+     * If the backend returns a non-zero size here, the controller takes over erasing: the backend shall not erase
+     * the storage in beginUpgrade(), and the controller will erase each sector with @ref eraseSector() just before
+     * the first write into it (erase on first touch). Sectors past the end of the image are never erased.
+     * The sectors are contiguous starting from offset zero; their sizes may differ.
+     * The default implementation returns zero, meaning that the backend erases the storage by itself.
+     * @return size of the sector that begins at the specified offset; zero if there is no such sector
+     */
+    virtual std::size_t getSectorSize(std::size_t offset) const
+    {
+        (void) offset;
+        return 0;
+    }
+
+    /**
+     * Erases the sector that begins at the specified offset. See @ref getSectorSize().
+     * @return 0 on success, negative on error
+     */
+    virtual std::int16_t eraseSector(std::size_t offset)
+    {
+        (void) offset;
+        return -ErrInvalidState;
+    }
+
+    /**
+     * Asynchronous sector erase API, optional; used if @ref UpgradeOptions::erase_ahead_sectors is non-zero.
+     * Begins erasing the sector that begins at the specified offset and returns immediately.
+     * The controller never starts a new erase until the previous one is reported complete by
+     * @ref awaitSectorErase(), and it never writes into a sector that is being erased.
+     * The default implementation erases the sector synchronously, so that it is complete upon return.
+     * @return 0 on success, negative on error
+     */
+    virtual std::int16_t startSectorErase(std::size_t offset)
+    {
+        return eraseSector(offset);
+    }
+
+    /**
+     * Checks whether the erase started by @ref startSectorErase() is complete.
+     * If blocking is true, waits for the completion; the function shall not return zero in that case.
+     * @return 1 if the erase is complete, 0 if it is still in progress, negative on error
+     */
+    virtual std::int16_t awaitSectorErase(bool blocking)
+    {
+        (void) blocking;
+        return 1;
+    }
+
+    /**
+     * The value of the bytes of an erased sector. If the erasing is managed by the controller and this is 0xFF,
+     * the holes in sparse images are erased but not written; see @ref IDownloadSink::handleHole().
+     * The default implementation returns 0xFF, which is the case with most flash memories.
+     */
+    virtual std::uint8_t getErasedByteValue() const { return 0xFF; }
 };
 
 /**
@@ -265,250 +797,2404 @@ public:
      * @return Negative on error, non-negative on success.
      */
     virtual std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) = 0;
-};
-
-/**
- * Inherit this class to implement firmware loading protocol, from remote to the local storage.
- */
-class IProtocol
-{
-public:
-    virtual ~IProtocol() = default;
 
     /**
-     * Performs the download operation synchronously.
-     * Every received data chunk is fed into the sink using the corresponding method (refer to the interface
-     * definition). If the sink returns error, downloading will be aborted.
-     * @return Negative on error, 0 on success.
+     * Delivers the data that is scattered across several buffers, e.g., the payloads of the frames that make up
+     * one protocol message, so that the protocol does not have to reassemble them in a contiguous buffer.
+     * Each chunk cannot exceed 32767 bytes.
+     * The default implementation delivers the chunks one by one via @ref handleNextDataChunk().
+     * @return Negative on error, non-negative on success.
      */
-    virtual std::int16_t downloadImage(IDownloadSink& sink) = 0;
-};
+    virtual std::int16_t handleNextDataChunks(const DataSpan* spans, std::uint8_t count)
+    {
+        for (std::uint8_t i = 0; i < count; i++)
+        {
+            if (const auto res = handleNextDataChunk(spans[i].data, spans[i].size); res < 0)
+            {
+                return res;
+            }
+        }
+        return ErrOK;
+    }
 
-/**
- * Main bootloader controller.
- * Beware that this class has a large buffer field used to cache ROM reads. Do not allocate it on the stack.
- * See the @ref State enum definition for state transition logic.
- */
-class BootloaderController final
-{
     /**
-     * RAII mutex manager.
+     * Zero-copy delivery: returns a region of up to max_size bytes in the memory of the sink (e.g., in its page
+     * buffer) where the protocol can receive the next data directly, which is then delivered with @ref commit()
+     * instead of @ref handleNextDataChunk(), so that the data is not copied from the buffer of the protocol.
+     * The returned region may be shorter than requested, or empty if the sink cannot provide it at the moment;
+     * the protocol then receives the data into its own buffer and delivers it with @ref handleNextDataChunk().
+     * The region remains valid until any other method of the sink is invoked; the data that has been received
+     * but not committed (e.g., a block with a bad checksum) is discarded, so the same region is acquired again.
+     * The default implementation returns an empty region.
      */
-    class MutexLocker final
+    virtual WritableDataSpan acquire(std::uint16_t max_size)
     {
-        IPlatform& pl_;
-    public:
-        explicit MutexLocker(IPlatform& pl) : pl_(pl) { pl_.lockMutex(); }
-        ~MutexLocker()                                { pl_.unlockMutex(); }
-    };
+        (void) max_size;
+        return {};
+    }
 
     /**
-     * A proxy that streams the data from the protocol into the application storage.
-     * Note that every access to the storage backend is protected with the mutex!
+     * Delivers the first size bytes of the region returned by the last @ref acquire().
+     * @return Negative on error, non-negative on success.
      */
-    class ProxySink : public IDownloadSink
+    virtual std::int16_t commit(std::uint16_t size)
     {
-        IPlatform& platform_;
-        IROMBackend& backend_;
-        const std::size_t max_image_size_;
-        std::size_t offset_ = 0;
+        (void) size;
+        return -ErrInvalidState;
+    }
+
+    /**
+     * Protocols that can learn the size of the image before it is downloaded (e.g., from the file metadata)
+     * should report it here as early as possible. This allows the sink to reject images that are too large
+     * right away, and lets the storage avoid erasing more than necessary.
+     * @return Negative on error (the download should be aborted), non-negative on success.
+     */
+    virtual std::int16_t handleImageSizeHint(std::uint32_t image_size)
+    {
+        (void) image_size;
+        return ErrOK;
+    }
+
+    /**
+     * Protocols that can request the image data starting from an arbitrary offset should invoke this method
+     * before the first data chunk and the image size hint, passing an identifier that is unique for the image being downloaded
+     * (e.g., a hash of its name and size). If an earlier download of the same image has been interrupted,
+     * the returned value is the offset where the download should be resumed; the data below it shall not be
+     * delivered. Otherwise, as well as if the method is never invoked, the download starts from zero.
+     * See @ref UpgradeJournal.
+     */
+    virtual std::uint32_t getResumeOffset(std::uint64_t image_id)
+    {
+        (void) image_id;
+        return 0;
+    }
+
+    /**
+     * Delivers a hole: the specified number of bytes of the image that are all 0xFF, like erased flash memory.
+     * Protocols and stream filters that know the location of such regions (e.g., the padding between the sections
+     * of the image) can report them here instead of delivering the data, so that the storage can skip writing them.
+     * The default implementation delivers the bytes via @ref handleNextDataChunk().
+     * @return Negative on error, non-negative on success.
+     */
+    virtual std::int16_t handleHole(std::uint32_t size)
+    {
+        std::array<std::uint8_t, 64> erased{};
+        erased.fill(0xFF);
+        while (size > 0)
+        {
+            const auto n = std::uint16_t(std::min<std::uint32_t>(size, erased.size()));
+            if (const auto res = handleNextDataChunk(erased.data(), n); res < 0)
+            {
+                return res;
+            }
+            size -= n;
+        }
+        return ErrOK;
+    }
+};
+
+/**
+ * Read-only access to the application image that is currently installed; see @ref IStreamFilter.
+ */
+class IReferenceImage
+{
+public:
+    virtual ~IReferenceImage() = default;
+
+    /**
+     * Returns info about the installed application, if there is one that remains intact during the upgrade.
+     * This is the case with A/B dual-slot operation (see @ref SecondaryROMRole::AlternateSlot), in the staging mode,
+     * and if the images are downloaded into a RAM buffer (see @ref UpgradeOptions::ram_buffer).
+     * Otherwise returns an empty option, and the image shall not be read.
+     */
+    virtual std::optional<AppInfo> getAppInfo() const = 0;
+
+    /**
+     * Same semantics as @ref IROMBackend::read().
+     */
+    virtual std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const = 0;
+};
+
+/**
+ * A stage of the download pipeline that decodes an encoded image stream (e.g., compressed) on the fly.
+ * A stream is recognized as encoded if it begins with the magic of one of the filters registered with
+ * @ref BootloaderController::addStreamFilter(); such stream, including the magic, is delivered to the filter
+ * via handleNextDataChunk(), and the filter delivers the decoded data into the output sink.
+ * The output of a filter is recognized in the same way, so different filters can be chained.
+ * Streams that do not begin with a known magic are delivered to the storage as-is.
+ */
+class IStreamFilter : public IDownloadSink
+{
+public:
+    static constexpr std::uint8_t MagicSize = 8;
+
+    using Magic = std::array<std::uint8_t, MagicSize>;
+
+    /**
+     * The magic sequence the encoded stream begins with.
+     */
+    virtual Magic getMagic() const = 0;
+
+    /**
+     * Invoked when a stream is recognized, before its data is delivered.
+     * The filter may report the size of the decoded image to the output via IDownloadSink::handleImageSizeHint().
+     * @return 0 on success, negative error code to abort the upgrade
+     */
+    virtual std::int16_t beginStream(IDownloadSink& output, const IReferenceImage& reference) = 0;
+
+    /**
+     * Invoked after the entire stream has been delivered successfully. The filter shall deliver the remaining
+     * decoded data to the output and make sure that the stream is complete.
+     * @return 0 on success, negative error code to abort the upgrade
+     */
+    virtual std::int16_t endStream() = 0;
+
+    /**
+     * Invoked if the upgrade fails after beginStream(), whatever the reason: the protocol has failed (e.g., timeout
+     * or loss of the link), the download has been terminated early (see @ref ErrAppAlreadyInstalled), this or
+     * another filter of the chain has reported an error, or the storage has failed after endStream().
+     * Filters that hold resources while the stream is being processed (e.g., keys, storage regions between
+     * IROMBackend::beginUpgrade() and IROMBackend::endUpgrade()) shall release them here; otherwise they would be
+     * held until the next stream. The output shall not be used here. May be invoked after endStream().
+     */
+    virtual void abortStream() { }
+};
+
+namespace detail
+{
+/**
+ * RAII mutex manager; see @ref IPlatform::lockMutex(). Also used by the stream filters that access the platform.
+ */
+class MutexLocker final
+{
+    IPlatform& pl_;
+public:
+    explicit MutexLocker(IPlatform& pl) : pl_(pl) { pl_.lockMutex(); }
+    ~MutexLocker()                                { pl_.unlockMutex(); }
+};
+
+/**
+ * Parses the record headers of the stream filter formats that describe the output image as a sequence of records,
+ * each beginning with an unsigned LEB128 varint (length << 1) | kind, where length is never zero; see
+ * kocherga_delta.hpp and kocherga_sparse.hpp. Keeps track of the position in the output image, while the payload
+ * of the records is handled by the filter.
+ */
+class RecordReader
+{
+    std::uint32_t varint_ = 0;
+    std::uint8_t varint_shift_ = 0;
+
+    std::uint32_t output_size_ = 0;
+    std::uint32_t output_offset_ = 0;
+    std::uint32_t record_length_ = 0;               ///< The remaining part of the current record
+    std::uint8_t record_kind_ = 0;
+
+public:
+    void reset(std::uint32_t output_size)
+    {
+        (void) takeVarint();
+        output_size_ = output_size;
+        output_offset_ = 0;
+        record_length_ = 0;
+        record_kind_ = 0;
+    }
+
+    /**
+     * The values are 32-bit, so the fifth byte is the last one and carries only four bits;
+     * longer varints are rejected rather than truncated.
+     * @return 1 if the varint is complete, 0 if more bytes are needed, negative if it is malformed
+     */
+    std::int8_t accumulateVarint(std::uint8_t byte)
+    {
+        if ((varint_shift_ == 28) && ((byte & 0xF0U) != 0))
+        {
+            return -1;
+        }
+        varint_ |= std::uint32_t(byte & 0x7FU) << varint_shift_;
+        varint_shift_ = std::uint8_t(varint_shift_ + 7U);
+        return ((byte & 0x80U) == 0) ? 1 : 0;
+    }
+
+    std::uint32_t takeVarint()
+    {
+        const auto out = varint_;
+        varint_ = 0;
+        varint_shift_ = 0;
+        return out;
+    }
+
+    /**
+     * Takes the accumulated varint as the header of the next record.
+     * @return false if the length is zero or exceeds the rest of the output image
+     */
+    bool beginRecord()
+    {
+        const auto tag = takeVarint();
+        record_length_ = tag >> 1U;
+        record_kind_ = std::uint8_t(tag & 1U);
+        return (record_length_ > 0) && (record_length_ <= (output_size_ - output_offset_));
+    }
+
+    /**
+     * Accounts for a part of the current record that has been delivered to the output.
+     */
+    void advance(std::uint32_t size)
+    {
+        record_length_ -= size;
+        output_offset_ += size;
+    }
+
+    /**
+     * Accounts for the rest of the current record.
+     * @return true if more records follow, false if the output image is complete
+     */
+    bool completeRecord()
+    {
+        advance(record_length_);
+        return !isImageComplete();
+    }
+
+    bool isImageComplete() const { return output_offset_ >= output_size_; }
+
+    std::uint8_t  getRecordKind()   const { return record_kind_; }
+    std::uint32_t getRecordLength() const { return record_length_; }
+    std::uint32_t getOutputOffset() const { return output_offset_; }
+};
+
+}
+
+/**
+ * Inherit this class to implement firmware loading protocol, from remote to the local storage.
+ */
+class IProtocol
+{
+public:
+    virtual ~IProtocol() = default;
+
+    /**
+     * Performs the download operation synchronously.
+     * Every received data chunk is fed into the sink using the corresponding method (refer to the interface
+     * definition). If the sink returns error, downloading will be aborted.
+     * @return Negative on error, 0 on success.
+     */
+    virtual std::int16_t downloadImage(IDownloadSink& sink) = 0;
+};
+
+/**
+ * Main bootloader controller.
+ * Beware that this class has a large buffer field used to cache ROM reads. Do not allocate it on the stack.
+ * See the @ref State enum definition for state transition logic.
+ */
+class BootloaderController final
+{
+    using MutexLocker = detail::MutexLocker;
+
+    /**
+     * RAII storage mutex manager; see @ref IPlatform::lockStorageMutex().
+     */
+    class StorageLocker final
+    {
+        IPlatform& pl_;
+    public:
+        explicit StorageLocker(IPlatform& pl) : pl_(pl) { pl_.lockStorageMutex(); }
+        ~StorageLocker()                                { pl_.unlockStorageMutex(); }
+    };
+
+    /**
+     * Refer to the Brickproof Bootloader specs.
+     * Note that the structure must be aligned at 8 bytes boundary, and the image must be padded to 8 bytes!
+     */
+    struct AppDescriptor
+    {
+        static constexpr std::size_t ImagePaddingBytes = 8;
+
+        alignas(8) std::array<std::uint8_t, 8> signature{};
+        alignas(8) AppInfo app_info;                            // Being explicit about expected memory layout
+
+        static constexpr std::array<std::uint8_t, 8> getSignatureValue()
+        {
+            return {{'A','P','D','e','s','c','0','0'}};
+        }
+
+        bool isValid(const std::uint32_t max_application_image_size) const
+        {
+            const auto sgn = getSignatureValue();
+            return std::equal(std::begin(signature), std::end(signature), std::begin(sgn)) &&
+                   (app_info.image_size > 0) &&
+                   (app_info.image_size <= max_application_image_size) &&
+                   ((app_info.image_size % ImagePaddingBytes) == 0);
+        }
+    };
+    static_assert(sizeof(AppDescriptor) == 32, "Invalid packing");
+    static_assert(std::is_standard_layout_v<AppDescriptor>, "AppInfo is not standard layout; check your compiler");
+    static_assert(offsetof(AppDescriptor, app_info) + offsetof(AppInfo, image_crc) == 8);
+
+    /**
+     * Partial CRCs of the pages of the primary storage computed when the images were verified, so that the unchanged
+     * pages do not have to be read again; see @ref UpgradeOptions::page_crc_cache and @ref CRC64::combine().
+     * A page is invalidated before it is erased or written by the controller.
+     */
+    class PageCRCCache final
+    {
+    public:
+        static constexpr std::uint16_t PageSize = 1024;
+
+    private:
+        /// A page whose partial CRC happens to be equal to this is simply never cached
+        static constexpr std::uint64_t Invalid = 0xFFFFFFFFFFFFFFFFULL;
+
+        std::uint64_t* const entries_;
+        const std::uint32_t capacity_;
+
+    public:
+        PageCRCCache(std::uint64_t* entries, std::uint32_t capacity) :
+            entries_(entries),
+            capacity_((entries != nullptr) ? capacity : 0U)
+        {
+            invalidateAll();
+        }
+
+        /**
+         * The offset shall be page-aligned.
+         */
+        std::optional<std::uint64_t> get(std::size_t offset) const
+        {
+            const auto index = offset / PageSize;
+            if ((index < capacity_) && (entries_[index] != Invalid))
+            {
+                return entries_[index];
+            }
+            return {};
+        }
+
+        /**
+         * The offset shall be page-aligned.
+         */
+        void put(std::size_t offset, std::uint64_t partial_crc)
+        {
+            const auto index = offset / PageSize;
+            if (index < capacity_)
+            {
+                entries_[index] = partial_crc;
+            }
+        }
+
+        void invalidate(std::size_t offset, std::size_t size)
+        {
+            for (auto index = offset / PageSize; (index < capacity_) && ((index * PageSize) < (offset + size)); index++)
+            {
+                entries_[index] = Invalid;
+            }
+        }
+
+        void invalidateAll() { invalidate(0, std::size_t(capacity_) * PageSize); }
+    };
+
+    /**
+     * Computes the CRC of the application image while it is being written, so that the image does not have to be
+     * read back entirely to be verified after the upgrade; see @ref UpgradeOptions::readback.
+     * Only the first app descriptor signature in the stream is considered; if that descriptor is not valid,
+     * the verification is left to @ref locateAppDescriptor(), which looks further.
+     * If the images are signed, the digest is computed alongside the CRC and the signature that follows the image
+     * is checked as soon as it is received; see @ref ISignatureVerifier.
+     */
+    class ImageVerifier final
+    {
+        enum class Stage : std::uint8_t
+        {
+            Searching,                                  ///< Looking for the signature
+            Descriptor,                                 ///< Collecting the descriptor
+            Image,                                      ///< Collecting the rest of the image
+            Signature,                                  ///< Collecting the signature that follows the image
+            Done,
+            Failed
+        };
+
+        static constexpr std::uint8_t WordSize = AppDescriptor::ImagePaddingBytes;
+
+        std::uint32_t max_image_size_;
+        ISignatureVerifier* signature_verifier_;
+        Stage stage_ = Stage::Searching;
+        CRC64 crc_;
+        std::size_t size_ = 0;                          ///< Amount of data processed, excepting the staged word
+        std::array<std::uint8_t, WordSize> word_{};     ///< The descriptor is aligned at 8 bytes
+        std::uint8_t word_fill_ = 0;
+        std::array<std::uint8_t, sizeof(AppDescriptor)> descriptor_{};
+        std::uint8_t descriptor_fill_ = 0;
+        std::size_t descriptor_offset_ = 0;
+        std::array<std::uint8_t, ISignatureVerifier::MaxSignatureSize> signature_{};
+        std::uint8_t signature_fill_ = 0;
+        bool signature_valid_ = false;
+
+        AppDescriptor getDescriptor() const
+        {
+            AppDescriptor desc;
+            std::memcpy(&desc, descriptor_.data(), sizeof(desc));
+            return desc;
+        }
+
+        void acceptDescriptor()
+        {
+            const auto desc = getDescriptor();
+            if (!desc.isValid(max_image_size_) || (desc.app_info.image_size < size_))
+            {
+                stage_ = Stage::Failed;
+                return;
+            }
+            static const std::uint8_t dummy[8]{0};
+            constexpr auto CRCOffset = offsetof(AppDescriptor, app_info) + offsetof(AppInfo, image_crc);
+            crc_.add(&descriptor_[0], CRCOffset);
+            crc_.add(&dummy[0], sizeof(dummy));
+            crc_.add(&descriptor_[CRCOffset + sizeof(dummy)], descriptor_.size() - CRCOffset - sizeof(dummy));
+            addToDigest(descriptor_.data(), descriptor_.size());   // The digest covers the actual CRC
+            stage_ = Stage::Image;
+            if (desc.app_info.image_size == size_)
+            {
+                completeImage();
+            }
+        }
+
+        void addToDigest(const void* data, std::size_t size)
+        {
+            if (signature_verifier_ != nullptr)
+            {
+                signature_verifier_->update(data, size);
+            }
+        }
+
+        void completeImage()
+        {
+            stage_ = (signature_verifier_ != nullptr) ? Stage::Signature : Stage::Done;
+        }
+
+        /**
+         * The costly signature verification is skipped if the CRC is wrong anyway.
+         */
+        void verifySignature()
+        {
+            stage_ = Stage::Done;
+            if (crc_.get() == getDescriptor().app_info.image_crc)
+            {
+                signature_valid_ = signature_verifier_->verify(signature_.data());
+                if (!signature_valid_)
+                {
+                    KOCHERGA_TRACE("App image signature is invalid\n");
+                }
+            }
+        }
+
+        void processWord()
+        {
+            if (stage_ == Stage::Searching)
+            {
+                if (word_ == AppDescriptor::getSignatureValue())
+                {
+                    stage_ = Stage::Descriptor;
+                    descriptor_offset_ = size_;
+                }
+                else
+                {
+                    crc_.add(word_.data(), word_.size());
+                    addToDigest(word_.data(), word_.size());
+                }
+            }
+            if (stage_ == Stage::Descriptor)
+            {
+                std::copy(word_.begin(), word_.end(), &descriptor_[descriptor_fill_]);
+                descriptor_fill_ = std::uint8_t(descriptor_fill_ + WordSize);
+            }
+            size_ += WordSize;
+            word_fill_ = 0;
+            if ((stage_ == Stage::Descriptor) && (descriptor_fill_ >= descriptor_.size()))
+            {
+                acceptDescriptor();
+            }
+        }
+
+    public:
+        /**
+         * The signature verifier is optional; it is reset when the first data is supplied.
+         */
+        ImageVerifier(std::uint32_t max_image_size, ISignatureVerifier* signature_verifier) :
+            max_image_size_(max_image_size),
+            signature_verifier_(signature_verifier)
+        { }
+
+        /**
+         * The data shall be supplied sequentially starting from offset zero of the storage.
+         */
+        void update(const void* data, std::size_t size)
+        {
+            if ((signature_verifier_ != nullptr) && (size > 0) && (size_ == 0) && (word_fill_ == 0))
+            {
+                signature_verifier_->reset();
+            }
+            auto bytes = static_cast<const std::uint8_t*>(data);
+            while ((size > 0) && (stage_ != Stage::Done) && (stage_ != Stage::Failed))
+            {
+                std::size_t n = 0;
+                if (stage_ == Stage::Image)
+                {
+                    n = std::min<std::size_t>(size, getDescriptor().app_info.image_size - size_);
+                    crc_.add(bytes, n);
+                    addToDigest(bytes, n);
+                    size_ += n;
+                    if (size_ == getDescriptor().app_info.image_size)
+                    {
+                        completeImage();
+                    }
+                }
+                else if (stage_ == Stage::Signature)
+                {
+                    n = std::min<std::size_t>(size, signature_verifier_->getSignatureSize() - signature_fill_);
+                    std::copy_n(bytes, n, &signature_[signature_fill_]);
+                    signature_fill_ = std::uint8_t(signature_fill_ + n);
+                    if (signature_fill_ >= signature_verifier_->getSignatureSize())
+                    {
+                        verifySignature();
+                    }
+                }
+                else if ((stage_ == Stage::Searching) && (word_fill_ == 0) && (size >= WordSize))
+                {
+                    // Fast path: the aligned words that do not contain the signature are added at once
+                    const auto signature = AppDescriptor::getSignatureValue();
+                    while (((n + WordSize) <= size) &&
+                           !std::equal(signature.begin(), signature.end(), &bytes[n]))
+                    {
+                        n += WordSize;
+                    }
+                    crc_.add(bytes, n);
+                    addToDigest(bytes, n);
+                    size_ += n;
+                    if (n == 0)
+                    {
+                        std::copy_n(bytes, WordSize, word_.begin());
+                        n = WordSize;
+                        processWord();
+                    }
+                }
+                else
+                {
+                    n = std::min<std::size_t>(size, WordSize - word_fill_);
+                    std::copy_n(bytes, n, &word_[word_fill_]);
+                    word_fill_ = std::uint8_t(word_fill_ + n);
+                    if (word_fill_ >= WordSize)
+                    {
+                        processWord();
+                    }
+                }
+                bytes += n;
+                size -= n;
+            }
+        }
+
+        /**
+         * Returns the first app descriptor found in the stream as soon as it is received, whether it is valid or not.
+         */
+        std::optional<AppDescriptor> getFirstAppDescriptor() const
+        {
+            if (descriptor_fill_ >= descriptor_.size())
+            {
+                return getDescriptor();
+            }
+            return {};
+        }
+
+        /**
+         * Amount of data searched for the app descriptor signature so far; the search stops once it is found.
+         */
+        std::size_t getSearchedSize() const
+        {
+            return (stage_ == Stage::Searching) ? (size_ + word_fill_) : descriptor_offset_;
+        }
+
+        /**
+         * Returns the app descriptor if the image is complete and its CRC is correct, and so is its signature
+         * if the images are signed; the offset of the descriptor in the storage is returned via the argument.
+         */
+        std::optional<AppDescriptor> getAppDescriptor(std::size_t& out_offset) const
+        {
+            if (stage_ == Stage::Done)
+            {
+                const auto desc = getDescriptor();
+                if ((crc_.get() == desc.app_info.image_crc) && ((signature_verifier_ == nullptr) || signature_valid_))
+                {
+                    out_offset = descriptor_offset_;
+                    return desc;
+                }
+            }
+            return {};
+        }
+    };
+
+    /**
+     * A proxy that streams the data from the protocol into the application storage.
+     * Incoming chunks are coalesced into buffers of a fixed size, which are then written into the backend.
+     * If the backend supports asynchronous writes, the buffers are used in a round-robin fashion, so that the
+     * protocol can receive the next chunk while the previous buffer is still being programmed.
+     * Note that every access to the storage backend is protected with the storage mutex!
+     */
+    class ProxySink : public IDownloadSink
+    {
+    public:
+        static constexpr std::uint16_t BufferSize  = 1024;
+        static constexpr std::uint8_t  BufferCount = 2;
+
+        using Buffers = std::array<std::array<std::uint8_t, BufferSize>, BufferCount>;
+
+    private:
+        IPlatform& platform_;
+        IROMBackend& backend_;
+        const std::size_t max_image_size_;
+        Buffers& buffers_;
+        const std::uint8_t max_pending_writes_;         ///< Zero if the backend is synchronous
+        const bool gather_writes_;                      ///< True if a page can be written from two buffers
+        const UpgradeOptions& options_;
+        UpgradeStatistics& statistics_;
+        std::array<std::uint8_t, BufferSize>& scratch_; ///< Used for reading the storage back
+
+        const bool erase_by_sectors_;                   ///< True if erasing is managed by the controller
+        const bool skip_holes_;                         ///< True if holes are erased but not written
+        const std::uint8_t erase_ahead_sectors_;        ///< Zero if sectors are erased on first touch
+        std::size_t erased_until_ = 0;                  ///< Everything below this offset is erased or up to date
+        std::size_t erase_limit_;                       ///< Sectors starting at or above this offset are not erased ahead
+        std::size_t erasing_sector_size_ = 0;           ///< Size of the sector being erased at erased_until_, if any
+
+        std::size_t offset_ = 0;                        ///< Offset of the first byte of the current buffer
+        std::uint16_t fill_ = 0;                        ///< Number of bytes in the current buffer
+        bool buffer_erased_ = false;                    ///< The current buffer contains nothing but a hole
+        DataSpan direct_{};                             ///< The end of the current page in the memory of the caller
+        std::uint8_t current_ = 0;                      ///< Index of the buffer that is being filled
+        std::uint8_t pending_ = 0;                      ///< Number of buffers submitted but not yet completed
+        std::array<std::uint16_t, BufferCount> pending_sizes_{};
+        std::array<std::size_t, BufferCount> pending_offsets_{};
+
+        std::optional<std::uint64_t> image_id_;        ///< Set if the progress is journaled; see UpgradeJournal
+        CRC64 crc_;                                     ///< Of everything below offset_, if journaled
+        std::size_t next_checkpoint_ = 0;               ///< Sector boundary where the next journal record is taken
+        std::optional<UpgradeJournal> checkpoint_;      ///< Not stored yet because the writes below it are pending
+
+        ISignatureVerifier* const signature_verifier_;
+        ImageVerifier verifier_;
+        bool app_descriptor_checked_ = false;
+
+        const std::optional<AppInfo> installed_app_;    ///< Used to detect re-uploads of the same image
+        const bool overwrites_installed_app_;           ///< False if the installed app is in another slot
+        bool app_unchanged_ = false;
+
+        PageCRCCache* const page_crc_cache_;            ///< Null unless the backend is the primary storage
+
+        void invalidateCachedCRCs(std::size_t offset, std::size_t size)
+        {
+            if (page_crc_cache_ != nullptr)
+            {
+                page_crc_cache_->invalidate(offset, size);
+            }
+        }
+
+        std::uint8_t getOldestPending() const
+        {
+            return std::uint8_t((current_ + BufferCount - pending_) % BufferCount);
+        }
+
+        /**
+         * The current page is kept in the current buffer, except for its last direct_.size bytes, which may be
+         * left in the memory of the caller until the page is written; see handleData().
+         */
+        std::array<DataSpan, 2> getPage() const
+        {
+            return {{
+                DataSpan{buffers_[current_].data(), std::uint16_t(fill_ - direct_.size)},
+                direct_
+            }};
+        }
+
+        std::int16_t completeOldestWrite(bool blocking)
+        {
+            assert(pending_ > 0);
+            const auto oldest = getOldestPending();
+
+            const auto res = backend_.awaitWrite(blocking);
+            if (res == 0)
+            {
+                return 0;                               // Still in progress
+            }
+            pending_--;
+            if (res != int(pending_sizes_[oldest]))
+            {
+                disableJournal();                       // The storage contents are unknown now
+            }
+            if ((res > 0) && (res != int(pending_sizes_[oldest])))
+            {
+                return -ErrROMWriteFailure;
+            }
+            if ((res > 0) && (options_.write_verify_attempts > 0))
+            {
+                const std::array<DataSpan, 2> page{{DataSpan{buffers_[oldest].data(), pending_sizes_[oldest]}, {}}};
+                if (const auto verify_res = verifyWrite(pending_offsets_[oldest], page); verify_res < 0)
+                {
+                    return verify_res;
+                }
+            }
+            return res;
+        }
+
+        /**
+         * Writes the page and waits for the completion. An asynchronous backend is used this way only to write
+         * a page again when no other writes are pending; see verifyWrite().
+         * @return 0 on success, negative on error
+         */
+        std::int16_t writePage(std::size_t offset, const std::array<DataSpan, 2>& page)
+        {
+            const std::uint16_t size = std::uint16_t(page[0].size + page[1].size);
+            invalidateCachedCRCs(offset, size);
+            std::int16_t res = 0;
+            if (max_pending_writes_ > 0)
+            {
+                assert((pending_ == 0) && (page[1].size == 0));
+                res = backend_.submitWrite(offset, page[0].data, page[0].size);
+                res = (res < 0) ? res : backend_.awaitWrite(true);
+            }
+            else
+            {
+                res = (page[0].size == 0) ? backend_.write(offset, page[1].data, page[1].size) :
+                      (page[1].size == 0) ? backend_.write(offset, page[0].data, page[0].size) :
+                      backend_.writeGather(offset, page.data(), std::uint8_t(page.size()));
+            }
+            if (res < 0)
+            {
+                return res;
+            }
+            return (res == int(size)) ? ErrOK : -ErrROMWriteFailure;
+        }
+
+        /**
+         * Reads the page back after it is written and writes it again if it does not match;
+         * see @ref UpgradeOptions::write_verify_attempts.
+         */
+        std::int16_t verifyWrite(std::size_t offset, const std::array<DataSpan, 2>& page)
+        {
+            std::uint8_t attempts = 1;
+            while (!isStored(offset, page))
+            {
+                if (attempts >= options_.write_verify_attempts)
+                {
+                    KOCHERGA_TRACE("Write verification failed at offset %u\n", unsigned(offset));
+                    disableJournal();                   // The storage contents are unknown now
+                    return -ErrROMWriteFailure;
+                }
+                attempts++;
+                KOCHERGA_TRACE("Write verification failed at offset %u, writing again\n", unsigned(offset));
+                while (pending_ > 0)
+                {
+                    if (const auto res = completeOldestWrite(true); res < 0)
+                    {
+                        return res;
+                    }
+                }
+                if (const auto res = writePage(offset, page); res < 0)
+                {
+                    return res;
+                }
+                statistics_.pages_rewritten++;
+            }
+            return ErrOK;
+        }
+
+        /**
+         * Updates the running CRC with the current buffer and takes a checkpoint at every sector boundary
+         * the buffer reaches. The checkpoint is stored once the writes below it are completed.
+         */
+        void updateJournal()
+        {
+            if (!image_id_)
+            {
+                return;
+            }
+            std::size_t pos = offset_;
+            for (const auto& span : getPage())
+            {
+                if (span.size == 0)
+                {
+                    continue;
+                }
+                auto bytes = static_cast<const std::uint8_t*>(span.data);
+                const auto end = pos + span.size;
+                while (next_checkpoint_ <= end)
+                {
+                    crc_.add(bytes, next_checkpoint_ - pos);
+                    bytes += next_checkpoint_ - pos;
+                    pos = next_checkpoint_;
+                    checkpoint_ = UpgradeJournal{*image_id_, std::uint32_t(pos), crc_.get()};
+
+                    const auto sector_size = backend_.getSectorSize(pos);
+                    if (sector_size == 0)
+                    {
+                        image_id_.reset();              // End of the storage, nothing to journal past it
+                        return;
+                    }
+                    next_checkpoint_ += sector_size;
+                }
+                crc_.add(bytes, end - pos);
+                pos = end;
+            }
+        }
+
+        void storeCheckpoint()
+        {
+            const auto written_until = (pending_ > 0) ? pending_offsets_[getOldestPending()] : offset_;
+            if (checkpoint_ && (written_until >= checkpoint_->offset))
+            {
+                KOCHERGA_TRACE("Upgrade journal checkpoint at offset %u\n", unsigned(checkpoint_->offset));
+                platform_.storeUpgradeJournal(checkpoint_);
+                checkpoint_.reset();
+            }
+        }
+
+        /**
+         * Returns true if the storage contains the data of the page at the specified offset.
+         * Read errors are not reported; the data is simply assumed to be different.
+         */
+        bool isStored(std::size_t offset, const std::array<DataSpan, 2>& page)
+        {
+            for (const auto& span : page)
+            {
+                const auto bytes = static_cast<const std::uint8_t*>(span.data);
+                for (std::uint16_t i = 0; i < span.size;)
+                {
+                    const auto res = backend_.read(offset + i, scratch_.data(), std::uint16_t(span.size - i));
+                    if ((res <= 0) || (std::memcmp(scratch_.data(), bytes + i, std::size_t(res)) != 0))
+                    {
+                        return false;
+                    }
+                    i = std::uint16_t(i + res);
+                }
+                offset += span.size;
+            }
+            return true;
+        }
+
+        std::int16_t startSectorErase()
+        {
+            const auto sector_size = backend_.getSectorSize(erased_until_);
+            if (sector_size == 0)
+            {
+                return -ErrAppImageTooLarge;
+            }
+            invalidateCachedCRCs(erased_until_, sector_size);
+            if (const auto res = backend_.startSectorErase(erased_until_); res < 0)
+            {
+                return res;
+            }
+            erasing_sector_size_ = sector_size;
+            return ErrOK;
+        }
+
+        /**
+         * @return 1 if the erase in progress is complete, 0 if it is not, negative on error
+         */
+        std::int16_t completeSectorErase(bool blocking)
+        {
+            assert(erasing_sector_size_ > 0);
+            const auto res = backend_.awaitSectorErase(blocking);
+            if (res > 0)
+            {
+                erased_until_ += erasing_sector_size_;
+                erasing_sector_size_ = 0;
+                statistics_.sectors_erased++;
+            }
+            return res;
+        }
+
+        /**
+         * Erases the sectors up to the specified offset, unless they have been erased already.
+         */
+        std::int16_t eraseUntil(std::size_t end)
+        {
+            while (erase_by_sectors_ && (erased_until_ < end))
+            {
+                if (erasing_sector_size_ == 0)
+                {
+                    if (const auto res = startSectorErase(); res < 0)
+                    {
+                        return res;
+                    }
+                }
+                if (const auto res = completeSectorErase(true); res < 0)
+                {
+                    return res;
+                }
+            }
+            return ErrOK;
+        }
+
+        /**
+         * Collects the background erase if it is complete and starts the next one if the erased area does not
+         * extend far enough past the current position. Never blocks.
+         */
+        std::int16_t eraseAhead()
+        {
+            if (erase_ahead_sectors_ == 0)
+            {
+                return ErrOK;
+            }
+            if (erasing_sector_size_ > 0)
+            {
+                if (const auto res = completeSectorErase(false); res <= 0)
+                {
+                    return res;
+                }
+            }
+            const auto lookahead = std::size_t(erase_ahead_sectors_) * backend_.getSectorSize(erased_until_);
+            if ((lookahead > 0) && (erased_until_ < erase_limit_) && (erased_until_ < (offset_ + fill_ + lookahead)))
+            {
+                return startSectorErase();
+            }
+            return ErrOK;
+        }
+
+        /**
+         * If the erasing is managed by the controller, an unchanged buffer can be left as-is only if all of the
+         * sectors it overlaps with either have been erased already or do not contain anything but this buffer.
+         */
+        bool canSkipCurrentBuffer()
+        {
+            const auto end = offset_ + fill_;
+            if (erase_by_sectors_ && (erased_until_ < end))
+            {
+                std::size_t sector_end = erased_until_;
+                while (sector_end < end)
+                {
+                    const auto sector_size = backend_.getSectorSize(sector_end);
+                    if ((sector_size == 0) || (sector_end < offset_))
+                    {
+                        return false;
+                    }
+                    sector_end += sector_size;
+                }
+                if (sector_end != end)
+                {
+                    return false;
+                }
+            }
+            return isStored(offset_, getPage());
+        }
+
+        bool isInstalledApp(const AppInfo& app_info) const
+        {
+            return installed_app_ &&
+                   (installed_app_->image_crc == app_info.image_crc) &&
+                   (installed_app_->image_size == app_info.image_size);
+        }
+
+        /**
+         * The installed app remains intact if it is in another slot, or if nothing has been erased or written yet.
+         * Backends that erase the storage by themselves may have erased it in beginUpgrade() already.
+         */
+        bool canKeepInstalledApp() const
+        {
+            return !overwrites_installed_app_ ||
+                   (erase_by_sectors_ && (offset_ == 0) && (erased_until_ == 0) && (erasing_sector_size_ == 0));
+        }
+
+        /**
+         * Rejects the image as soon as its app descriptor is received, before the buffer that contains it is
+         * written, if the image is too large or not compatible with the platform; see @ref IPlatform::isAppCompatible().
+         * Other defects are not reported here because the final verification may find another descriptor further.
+         * If the image is already installed, the download is terminated with @ref ErrAppAlreadyInstalled.
+         */
+        std::int16_t checkAppDescriptor()
+        {
+            if (app_descriptor_checked_)
+            {
+                return ErrOK;
+            }
+            if (const auto appdesc = verifier_.getFirstAppDescriptor())
+            {
+                app_descriptor_checked_ = true;
+                if (appdesc->app_info.image_size > max_image_size_)
+                {
+                    KOCHERGA_TRACE("App image too large: %u bytes\n", unsigned(appdesc->app_info.image_size));
+                    return -ErrAppImageTooLarge;
+                }
+                if (appdesc->isValid(std::uint32_t(max_image_size_)) && !platform_.isAppCompatible(appdesc->app_info))
+                {
+                    KOCHERGA_TRACE("App image rejected by the platform\n");
+                    return -ErrAppImageRejected;
+                }
+                if (isInstalledApp(appdesc->app_info) && canKeepInstalledApp())
+                {
+                    KOCHERGA_TRACE("App image is already installed\n");
+                    app_unchanged_ = true;
+                    return -ErrAppAlreadyInstalled;
+                }
+            }
+            else if ((options_.app_descriptor_search_limit > 0) &&
+                     (verifier_.getSearchedSize() >= options_.app_descriptor_search_limit))
+            {
+                KOCHERGA_TRACE("App descriptor not found in the first %u bytes\n",
+                               unsigned(options_.app_descriptor_search_limit));
+                return -ErrAppDescriptorNotFound;
+            }
+            return ErrOK;
+        }
+
+        std::int16_t flush()
+        {
+            if (fill_ == 0)
+            {
+                return ErrOK;
+            }
+
+            updateJournal();
+            for (const auto& span : getPage())
+            {
+                if (span.size > 0)
+                {
+                    verifier_.update(span.data, span.size);
+                }
+            }
+            if (const auto res = checkAppDescriptor(); res < 0)
+            {
+                return res;
+            }
+
+            if (buffer_erased_ && skip_holes_)
+            {
+                if (const auto res = eraseUntil(offset_ + fill_); res < 0)
+                {
+                    return res;
+                }
+                statistics_.pages_in_holes++;
+            }
+            else if (options_.skip_unchanged_pages && canSkipCurrentBuffer())
+            {
+                statistics_.pages_skipped++;
+                erased_until_ = std::max(erased_until_, offset_ + fill_);
+            }
+            else if (const auto res = eraseUntil(offset_ + fill_); res < 0)
+            {
+                return res;
+            }
+            else if (max_pending_writes_ > 0)
+            {
+                while (pending_ >= max_pending_writes_)
+                {
+                    if (const auto res = completeOldestWrite(true); res < 0)
+                    {
+                        return res;
+                    }
+                }
+
+                invalidateCachedCRCs(offset_, fill_);
+                const auto res = backend_.submitWrite(offset_, buffers_[current_].data(), fill_);
+                if (res < 0)
+                {
+                    return res;
+                }
+                pending_sizes_[current_] = fill_;
+                pending_offsets_[current_] = offset_;
+                pending_++;
+                current_ = std::uint8_t((current_ + 1U) % BufferCount);
+                statistics_.pages_written++;
+            }
+            else
+            {
+                const auto page = getPage();
+                if (const auto res = writePage(offset_, page); res < 0)
+                {
+                    return res;
+                }
+                statistics_.pages_written++;
+                if (options_.write_verify_attempts > 0)
+                {
+                    if (const auto res = verifyWrite(offset_, page); res < 0)
+                    {
+                        return res;
+                    }
+                }
+            }
+
+            offset_ += fill_;
+            fill_ = 0;
+            return ErrOK;
+        }
+
+        std::int16_t flushIfFull()
+        {
+            if (fill_ < BufferSize)
+            {
+                return ErrOK;
+            }
+            if (const auto res = flush(); res < 0)
+            {
+                return res;
+            }
+            // Right after the write, so that the erase overlaps with the reception of the next buffer
+            return eraseAhead();
+        }
+
+        /**
+         * Collects the writes that have completed in the meantime, so that errors are reported early.
+         */
+        std::int16_t collectCompletedWrites()
+        {
+            while (pending_ > 0)
+            {
+                const auto res = completeOldestWrite(false);
+                if (res < 0)
+                {
+                    return res;
+                }
+                if (res == 0)
+                {
+                    break;
+                }
+            }
+            return ErrOK;
+        }
+
+        /**
+         * If the backend is synchronous, the data that completes the current page is written directly from the
+         * memory of the caller instead of being copied into the buffer, as long as the backend can write
+         * the page from there; see @ref IROMBackend::getMaxWriteSpans().
+         */
+        std::int16_t handleData(const void* data, std::uint16_t size)
+        {
+            statistics_.bytes_decoded += size;
+
+            auto bytes = static_cast<const std::uint8_t*>(data);
+            std::uint16_t remaining = size;
+            while (remaining > 0)
+            {
+                const auto n = std::min<std::uint16_t>(remaining, std::uint16_t(BufferSize - fill_));
+                if ((max_pending_writes_ == 0) && (n == (BufferSize - fill_)) && ((fill_ == 0) || gather_writes_))
+                {
+                    direct_ = DataSpan{bytes, n};
+                }
+                else
+                {
+                    std::memcpy(&buffers_[current_][fill_], bytes, n);
+                }
+                fill_ = std::uint16_t(fill_ + n);
+                buffer_erased_ = false;
+                bytes += n;
+                remaining = std::uint16_t(remaining - n);
+
+                const auto res = flushIfFull();
+                direct_ = DataSpan{};
+                if (res < 0)
+                {
+                    return res;
+                }
+            }
+            return ErrOK;
+        }
+
+        std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) final
+        {
+            if (size > MaxDataBlockSize)
+            {
+                return -ErrInvalidParams;
+            }
+
+            StorageLocker slock(platform_);
+
+            if ((offset_ + fill_ + size) > max_image_size_)
+            {
+                return -ErrAppImageTooLarge;
+            }
+            if (const auto res = collectCompletedWrites(); res < 0)
+            {
+                return res;
+            }
+            if (const auto res = handleData(data, size); res < 0)
+            {
+                return res;
+            }
+
+            storeCheckpoint();
+            return std::int16_t(size);
+        }
+
+        /**
+         * The region is the free part of the current buffer, so the committed data is not copied before it is
+         * written. The current buffer is never being written asynchronously; see getOldestPending().
+         */
+        WritableDataSpan acquire(std::uint16_t max_size) final
+        {
+            StorageLocker slock(platform_);
+            const auto size = std::min<std::size_t>({max_size,
+                                                     std::size_t(BufferSize - fill_),
+                                                     max_image_size_ - (offset_ + fill_)});
+            return {&buffers_[current_][fill_], std::uint16_t(size)};
+        }
+
+        std::int16_t commit(std::uint16_t size) final
+        {
+            StorageLocker slock(platform_);
+
+            if (size > (BufferSize - fill_))
+            {
+                return -ErrInvalidParams;
+            }
+            if ((offset_ + fill_ + size) > max_image_size_)
+            {
+                return -ErrAppImageTooLarge;
+            }
+            if (const auto res = collectCompletedWrites(); res < 0)
+            {
+                return res;
+            }
+
+            statistics_.bytes_decoded += size;
+            fill_ = std::uint16_t(fill_ + size);
+            if (size > 0)
+            {
+                buffer_erased_ = false;
+            }
+            if (const auto res = flushIfFull(); res < 0)
+            {
+                return res;
+            }
+
+            storeCheckpoint();
+            return std::int16_t(size);
+        }
+
+        std::int16_t handleNextDataChunks(const DataSpan* spans, std::uint8_t count) final
+        {
+            std::size_t total_size = 0;
+            for (std::uint8_t i = 0; i < count; i++)
+            {
+                if (spans[i].size > MaxDataBlockSize)
+                {
+                    return -ErrInvalidParams;
+                }
+                total_size += spans[i].size;
+            }
+
+            StorageLocker slock(platform_);
+
+            if ((offset_ + fill_ + total_size) > max_image_size_)
+            {
+                return -ErrAppImageTooLarge;
+            }
+            if (const auto res = collectCompletedWrites(); res < 0)
+            {
+                return res;
+            }
+            for (std::uint8_t i = 0; i < count; i++)
+            {
+                if (const auto res = handleData(spans[i].data, spans[i].size); res < 0)
+                {
+                    return res;
+                }
+            }
+
+            storeCheckpoint();
+            return ErrOK;
+        }
+
+        /**
+         * The holes are collected in the buffers like the data, so that the writes remain aligned.
+         * Buffers that contain nothing but a hole are not written if the erased storage is known to match them.
+         */
+        std::int16_t handleHole(std::uint32_t size) final
+        {
+            StorageLocker slock(platform_);
+
+            if (size > (max_image_size_ - (offset_ + fill_)))
+            {
+                return -ErrAppImageTooLarge;
+            }
+
+            statistics_.bytes_decoded += size;
+
+            while (size > 0)
+            {
+                if (fill_ == 0)
+                {
+                    buffer_erased_ = true;
+                }
+                const auto n = std::uint16_t(std::min<std::uint32_t>(size, std::uint32_t(BufferSize - fill_)));
+                std::memset(&buffers_[current_][fill_], 0xFF, n);
+                fill_ = std::uint16_t(fill_ + n);
+                size -= n;
+
+                if (const auto res = flushIfFull(); res < 0)
+                {
+                    return res;
+                }
+            }
+
+            storeCheckpoint();
+            return ErrOK;
+        }
+
+        std::int16_t handleImageSizeHint(std::uint32_t image_size) final
+        {
+            if (image_size > max_image_size_)
+            {
+                return -ErrAppImageTooLarge;
+            }
+
+            StorageLocker slock(platform_);
+            backend_.handleImageSizeHint(image_size);
+            erase_limit_ = image_size;
+            if (overwrites_installed_app_ && installed_app_ && !app_descriptor_checked_)
+            {
+                return ErrOK;       // The installed app may turn out to be the same, so the erasing is postponed
+            }
+            return eraseAhead();
+        }
+
+        /**
+         * The download can be resumed only if the storage below the journaled offset has not been erased since
+         * the journal was stored, which is verified using the CRC.
+         */
+        std::uint32_t getResumeOffset(std::uint64_t image_id) final
+        {
+            StorageLocker slock(platform_);
+
+            if (!erase_by_sectors_ || image_id_ || ((offset_ + fill_) > 0))
+            {
+                return 0;
+            }
+            image_id_ = image_id;
+            next_checkpoint_ = backend_.getSectorSize(0);
+
+            const auto journal = platform_.loadUpgradeJournal();
+            if (!journal || (journal->image_id != image_id) || (journal->offset > max_image_size_))
+            {
+                return 0;
+            }
+
+            std::size_t sector_end = 0;
+            while (sector_end < journal->offset)
+            {
+                const auto sector_size = backend_.getSectorSize(sector_end);
+                if (sector_size == 0)
+                {
+                    return 0;
+                }
+                sector_end += sector_size;
+            }
+            if (sector_end != journal->offset)
+            {
+                return 0;                               // Not a sector boundary
+            }
+
+            CRC64 crc;
+            ImageVerifier verifier{std::uint32_t(max_image_size_), signature_verifier_};
+            for (std::size_t i = 0; i < journal->offset;)
+            {
+                const auto res = backend_.read(i, scratch_.data(),
+                                               std::uint16_t(std::min<std::size_t>(scratch_.size(),
+                                                                                   journal->offset - i)));
+                if (res <= 0)
+                {
+                    return 0;
+                }
+                crc.add(scratch_.data(), std::size_t(res));
+                verifier.update(scratch_.data(), std::size_t(res));
+                i += std::size_t(res);
+            }
+            if (crc.get() != journal->crc)
+            {
+                KOCHERGA_TRACE("Upgrade journal does not match the storage\n");
+                return 0;
+            }
+
+            offset_ = journal->offset;
+            erased_until_ = offset_;
+            crc_ = crc;
+            verifier_ = verifier;
+            next_checkpoint_ = offset_ + backend_.getSectorSize(offset_);
+            statistics_.resume_offset = journal->offset;
+            KOCHERGA_TRACE("Resuming the download from offset %u\n", unsigned(offset_));
+            return journal->offset;
+        }
+
+    public:
+        ProxySink(IPlatform& pl,
+                  IROMBackend& back,
+                  std::size_t max_image_size,
+                  Buffers& buffers,
+                  std::array<std::uint8_t, BufferSize>& scratch,
+                  const UpgradeOptions& options,
+                  UpgradeStatistics& statistics,
+                  const std::optional<AppInfo>& installed_app,
+                  bool overwrites_installed_app,
+                  ISignatureVerifier* signature_verifier,
+                  PageCRCCache* page_crc_cache) :
+            platform_(pl),
+            backend_(back),
+            max_image_size_(max_image_size),
+            buffers_(buffers),
+            max_pending_writes_(std::min<std::uint8_t>(back.getMaxPendingWrites(), BufferCount - 1U)),
+            gather_writes_(back.getMaxWriteSpans() >= 2),
+            options_(options),
+            statistics_(statistics),
+            scratch_(scratch),
+            erase_by_sectors_(back.getSectorSize(0) > 0),
+            skip_holes_(erase_by_sectors_ && (back.getErasedByteValue() == 0xFF)),
+            erase_ahead_sectors_((erase_by_sectors_ && !options.skip_unchanged_pages) ?
+                                 options.erase_ahead_sectors : 0U),
+            erase_limit_(max_image_size),
+            signature_verifier_(signature_verifier),
+            verifier_(std::uint32_t(max_image_size), signature_verifier),
+            installed_app_(installed_app),
+            overwrites_installed_app_(overwrites_installed_app),
+            page_crc_cache_(page_crc_cache)
+        { }
+
+        /**
+         * Stops journaling the progress. Used if the stream is decoded by a filter, because the offsets in the
+         * stream do not match the offsets in the storage then.
+         */
+        void disableJournal()
+        {
+            image_id_.reset();
+            checkpoint_.reset();
+        }
+
+        bool isJournaling() const { return image_id_.has_value(); }
+
+        /**
+         * True if the download has been terminated because the image is already installed.
+         */
+        bool isAppUnchanged() const { return app_unchanged_; }
+
+        /**
+         * See @ref ImageVerifier::getAppDescriptor(). Only meaningful after a successful finalization.
+         */
+        std::optional<AppDescriptor> getVerifiedAppDescriptor(std::size_t& out_offset) const
+        {
+            return verifier_.getAppDescriptor(out_offset);
+        }
+
+        /**
+         * Writes the remaining buffered data (only if the download was successful) and waits for all pending
+         * writes and erases to complete. Must be invoked before the backend is finalized, regardless of the outcome.
+         * If the download has failed, the progress made so far is journaled.
+         * @return 0 on success, negative on error
+         */
+        std::int16_t finalize(bool success)
+        {
+            StorageLocker slock(platform_);
+
+            std::int16_t result = success ? flush() : ErrOK;
+            while (pending_ > 0)
+            {
+                if (const auto res = completeOldestWrite(true); (res < 0) && (result >= 0))
+                {
+                    result = res;
+                }
+            }
+            if (erasing_sector_size_ > 0)
+            {
+                if (const auto res = completeSectorErase(true); (res < 0) && (result >= 0))
+                {
+                    result = res;
+                }
+            }
+            if (!success)
+            {
+                storeCheckpoint();
+            }
+            return result;
+        }
+    };
+
+public:
+    /// See @ref addStreamFilter().
+    static constexpr std::uint8_t MaxStreamFilters = 4;
+
+private:
+    using StreamFilters = std::array<IStreamFilter*, MaxStreamFilters>;
+
+    /**
+     * Gives the stream filters access to the installed image that is protected with the storage mutex.
+     */
+    class ReferenceImage final : public IReferenceImage
+    {
+        IPlatform& platform_;
+        const IROMBackend* const backend_;
+        const std::optional<AppInfo> app_info_;
+
+    public:
+        ReferenceImage(IPlatform& pl, const IROMBackend* back, const std::optional<AppInfo>& app_info) :
+            platform_(pl),
+            backend_(back),
+            app_info_((back != nullptr) ? app_info : std::optional<AppInfo>())
+        { }
+
+        std::optional<AppInfo> getAppInfo() const override { return app_info_; }
+
+        std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const override
+        {
+            if (!app_info_)
+            {
+                return -ErrInvalidState;
+            }
+            StorageLocker slock(platform_);
+            return backend_->read(offset, data, size);
+        }
+    };
+
+    /**
+     * Presents @ref UpgradeOptions::ram_buffer as a storage backend, so that the images are downloaded into it
+     * through the same pipeline as into the storage. Only the data written since beginUpgrade() can be read,
+     * so that a stale image left by an earlier download is never mistaken for the new one.
+     */
+    class RAMBuffer final : public IROMBackend
+    {
+        std::uint8_t* const data_;
+        const std::uint32_t capacity_;
+        std::size_t size_ = 0;                          ///< Everything below this offset has been written
+
+    public:
+        RAMBuffer(std::uint8_t* data, std::uint32_t capacity) :
+            data_(data),
+            capacity_((data != nullptr) ? capacity : 0U)
+        { }
+
+        std::uint32_t getCapacity() const { return capacity_; }
+
+        const std::uint8_t* getData() const { return data_; }
+
+        std::int16_t beginUpgrade() override
+        {
+            size_ = 0;
+            return ErrOK;
+        }
+
+        std::int16_t endUpgrade(bool success) override
+        {
+            (void) success;
+            return ErrOK;
+        }
+
+        std::int16_t write(std::size_t offset, const void* data, std::uint16_t size) override
+        {
+            if ((offset > size_) || ((offset + size) > capacity_))
+            {
+                return -ErrInvalidParams;
+            }
+            std::memcpy(&data_[offset], data, size);
+            size_ = std::max<std::size_t>(size_, offset + size);
+            return std::int16_t(size);
+        }
+
+        std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const override
+        {
+            if (offset >= size_)
+            {
+                return 0;
+            }
+            const auto n = std::uint16_t(std::min<std::size_t>(size, size_ - offset));
+            std::memcpy(data, &data_[offset], n);
+            return std::int16_t(n);
+        }
+    };
+
+    /**
+     * Recognizes encoded streams by their magic and routes them through the matching stream filter.
+     * The output of the filter is routed through the next dispatcher, which allows chaining the filters.
+     * Streams that do not begin with a known magic are passed through to the output as-is.
+     * The image size hint is held back until the stream is recognized, because it is not valid for encoded streams.
+     */
+    class StreamDispatcher : public IDownloadSink
+    {
+        const StreamFilters& filters_;
+        std::array<bool, MaxStreamFilters>& filters_in_use_;
+        const IReferenceImage& reference_;
+        IDownloadSink& output_;
+        ProxySink& storage_;                            ///< Same as the output, used to control the journaling
+        StreamDispatcher* const next_;                  ///< Receives the output of the filter; null at the last level
+
+        IStreamFilter* filter_ = nullptr;
+        bool recognized_ = false;
+        IStreamFilter::Magic header_{};
+        std::uint8_t header_size_ = 0;
+        std::optional<std::uint32_t> image_size_hint_;
+
+        std::uint32_t bytes_received_ = 0;
+
+        IDownloadSink& getSink() { return (filter_ != nullptr) ? static_cast<IDownloadSink&>(*filter_) : output_; }
+
+        std::int16_t recognize()
+        {
+            recognized_ = true;
+            for (std::uint8_t i = 0; (i < MaxStreamFilters) && (next_ != nullptr); i++)
+            {
+                if ((filters_[i] != nullptr) && !filters_in_use_[i] && (filters_[i]->getMagic() == header_))
+                {
+                    KOCHERGA_TRACE("Stream filter %u recognized\n", unsigned(i));
+                    filters_in_use_[i] = true;
+                    filter_ = filters_[i];
+                    storage_.disableJournal();
+                    return filter_->beginStream(*next_, reference_);
+                }
+            }
+            if (image_size_hint_)
+            {
+                return output_.handleImageSizeHint(*image_size_hint_);
+            }
+            return ErrOK;
+        }
 
         std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) final
         {
-            if (size > MaxDataBlockSize)
+            bytes_received_ += size;
+            if (recognized_)
+            {
+                return getSink().handleNextDataChunk(data, size);
+            }
+
+            const auto n = std::min<std::uint16_t>(size, std::uint16_t(header_.size() - header_size_));
+            std::memcpy(&header_[header_size_], data, n);
+            header_size_ = std::uint8_t(header_size_ + n);
+            if (header_size_ < header_.size())
+            {
+                return std::int16_t(size);
+            }
+
+            if (const auto res = recognize(); res < 0)
+            {
+                return res;
+            }
+            if (const auto res = getSink().handleNextDataChunk(header_.data(), header_size_); res < 0)
+            {
+                return res;
+            }
+            if (n < size)
+            {
+                const auto res = getSink().handleNextDataChunk(static_cast<const std::uint8_t*>(data) + n,
+                                                               std::uint16_t(size - n));
+                if (res < 0)
+                {
+                    return res;
+                }
+            }
+            return std::int16_t(size);
+        }
+
+        /**
+         * The region is provided by the sink the stream is routed to once it is recognized; until then, the header
+         * is collected from the chunks.
+         */
+        WritableDataSpan acquire(std::uint16_t max_size) final
+        {
+            return recognized_ ? getSink().acquire(max_size) : WritableDataSpan{};
+        }
+
+        std::int16_t commit(std::uint16_t size) final
+        {
+            if (!recognized_)
+            {
+                return -ErrInvalidState;
+            }
+            bytes_received_ += size;
+            return getSink().commit(size);
+        }
+
+        std::int16_t handleImageSizeHint(std::uint32_t image_size) final
+        {
+            if (recognized_)
+            {
+                return getSink().handleImageSizeHint(image_size);
+            }
+            image_size_hint_ = image_size;
+            return ErrOK;
+        }
+
+        std::int16_t handleNextDataChunks(const DataSpan* spans, std::uint8_t count) final
+        {
+            if (!recognized_)
+            {
+                return IDownloadSink::handleNextDataChunks(spans, count);  // The header may span several chunks
+            }
+            for (std::uint8_t i = 0; i < count; i++)
+            {
+                bytes_received_ += spans[i].size;
+            }
+            return getSink().handleNextDataChunks(spans, count);
+        }
+
+        std::int16_t handleHole(std::uint32_t size) final
+        {
+            if (recognized_)
+            {
+                return getSink().handleHole(size);
+            }
+            return IDownloadSink::handleHole(size);     // Delivered as data until the stream is recognized
+        }
+
+        /**
+         * Only streams that have not been recognized as encoded are journaled by the ProxySink, so a resumed stream
+         * is never encoded.
+         */
+        std::uint32_t getResumeOffset(std::uint64_t image_id) final
+        {
+            if (recognized_ || (header_size_ > 0) || image_size_hint_)
             {
-                return -ErrInvalidParams;
+                return 0;
             }
+            const auto offset = output_.getResumeOffset(image_id);
+            recognized_ = offset > 0;
+            return offset;
+        }
 
-            MutexLocker mlock(platform_);
+    public:
+        StreamDispatcher(const StreamFilters& filters,
+                         std::array<bool, MaxStreamFilters>& filters_in_use,
+                         const IReferenceImage& reference,
+                         ProxySink& output,
+                         StreamDispatcher* next) :
+            filters_(filters),
+            filters_in_use_(filters_in_use),
+            reference_(reference),
+            output_(output),
+            storage_(output),
+            next_(next)
+        { }
+
+        /**
+         * Completes the stream after a successful download; short streams are passed through here.
+         * @return 0 on success, negative on error
+         */
+        std::int16_t finalize()
+        {
+            if (!recognized_)
+            {
+                recognized_ = true;
+                if (image_size_hint_)
+                {
+                    if (const auto res = output_.handleImageSizeHint(*image_size_hint_); res < 0)
+                    {
+                        return res;
+                    }
+                }
+                if (header_size_ > 0)
+                {
+                    if (const auto res = output_.handleNextDataChunk(header_.data(), header_size_); res < 0)
+                    {
+                        return res;
+                    }
+                }
+                return ErrOK;
+            }
+            if (filter_ != nullptr)
+            {
+                if (const auto res = filter_->endStream(); res < 0)
+                {
+                    return res;
+                }
+                return next_->finalize();
+            }
+            return ErrOK;
+        }
+
+        /**
+         * Notifies the filters of every chaining level that the upgrade has failed, including those whose stream
+         * has not been finalized because an outer filter has failed; see @ref IStreamFilter::abortStream().
+         */
+        void abort()
+        {
+            if (filter_ != nullptr)
+            {
+                filter_->abortStream();
+                next_->abort();
+            }
+        }
+
+        std::uint32_t getBytesReceived() const { return bytes_received_; }
+    };
+
+    State state_{};                                 ///< Modified with both mutexes locked
+    IPlatform& platform_;
+    IROMBackend& backend_;
+    IROMBackend* const secondary_backend_;
+    const SecondaryROMRole secondary_role_;
+
+    const std::uint32_t max_application_image_size_;
+    const std::chrono::microseconds boot_delay_;
+    std::chrono::microseconds boot_delay_started_at_{};
+    const UpgradeOptions options_;
+    ISignatureVerifier* const signature_verifier_;  ///< Null if the images are not signed
+    UpgradeStatistics last_upgrade_statistics_{};
+
+    /// Larger buffer enables faster CRC verification, which is important, especially with large firmwares!
+    /// During the download it is also used for reading the storage back.
+    std::array<std::uint8_t, ProxySink::BufferSize> rom_buffer_{};
+
+    /// Download buffers are kept here rather than on the stack because they are large.
+    ProxySink::Buffers write_buffers_{};
+
+    /// The staged image is copied into the primary backend through this buffer; see @ref SecondaryROMRole::Staging.
+    std::array<std::uint8_t, ProxySink::BufferSize> staging_buffer_{};
+
+    RAMBuffer ram_buffer_;                          ///< See @ref UpgradeOptions::ram_buffer
+    PageCRCCache page_crc_cache_;                   ///< See @ref UpgradeOptions::page_crc_cache
+
+    StreamFilters stream_filters_{};
+
+    /// Caching is needed because app check can sometimes take a very long time (several seconds).
+    /// The cached app is modified with both mutexes locked; everything else is guarded by the storage mutex.
+    std::optional<AppInfo> cached_app_info_;
+    std::uint8_t app_slot_ = 0;                     ///< The slot where the cached app is located
+
+    /**
+     * A copy of the state and of the cached app info for the queries that do not lock the mutex,
+     * so that they are not blocked by the storage operations; see @ref publishStatus().
+     */
+    struct Status
+    {
+        AppInfo app_info;
+        State state{};
+        bool app_found = false;
+        std::uint8_t app_slot = 0;
+    };
+    Seqlock<Status> status_;
+
+    /**
+     * Shall be invoked with the mutex locked whenever the state or the cached app info are changed.
+     * The mutex serializes the writers.
+     * Intermediate changes made within one operation need not be published.
+     */
+    void publishStatus()
+    {
+        status_.store(Status{cached_app_info_.value_or(AppInfo{}), state_, cached_app_info_.has_value(), app_slot_});
+    }
+
+    void addToDigest(const void* data, std::size_t size)
+    {
+        if (signature_verifier_ != nullptr)
+        {
+            signature_verifier_->update(data, size);
+        }
+    }
+
+    /**
+     * Reads the signature that follows the image and checks it against the digest computed in the meantime.
+     * Always true if the images are not signed; see @ref ISignatureVerifier.
+     */
+    bool isSignatureValid(const IROMBackend& backend, std::uint32_t image_size)
+    {
+        if (signature_verifier_ == nullptr)
+        {
+            return true;
+        }
+        const auto size = signature_verifier_->getSignatureSize();
+        return (backend.read(image_size, rom_buffer_.data(), size) == std::int16_t(size)) &&
+               signature_verifier_->verify(rom_buffer_.data());
+    }
+
+    /**
+     * The size of the image together with the signature that follows it, if any.
+     */
+    std::uint32_t getStoredImageSize(const AppInfo& app_info) const
+    {
+        return app_info.image_size + ((signature_verifier_ != nullptr) ? signature_verifier_->getSignatureSize() : 0U);
+    }
+
+    /**
+     * Computes the CRC of the image with its CRC field zeroed, and the digest of the image as it is stored,
+     * if the images are signed. This is computationally expensive, so it has been carefully optimized for speed.
+     * The digest is computed from the same reads as the CRC, so the image is read only once.
+     * The image is processed page by page, and the partial CRCs of the pages are combined, so that the pages of
+     * the primary storage whose CRCs are cached are not read at all unless the digest is needed;
+     * see @ref UpgradeOptions::page_crc_cache. The CRC field is zeroed by removing its contribution
+     * from the partial CRC of its page, because the CRC is linear.
+     * @return empty if the image cannot be read or the CRC field is not within the image
+     */
+    std::optional<std::uint64_t> computeImageCRC(const IROMBackend& backend,
+                                                 std::size_t crc_offset,
+                                                 const AppInfo& app_info)
+    {
+        constexpr std::size_t PageSize = PageCRCCache::PageSize;
+        static_assert(PageSize == ProxySink::BufferSize, "A page is read into the ROM buffer at once");
+
+        const std::size_t image_size = app_info.image_size;
+        if ((crc_offset + sizeof(app_info.image_crc)) > image_size)
+        {
+            return {};
+        }
+
+        PageCRCCache* const cache = (signature_verifier_ == nullptr) ? getPageCRCCache(backend) : nullptr;
+        const auto page_shift_factor = CRC64::computeShiftFactor(PageSize);
+        CRC64 crc;
+        if (signature_verifier_ != nullptr)
+        {
+            signature_verifier_->reset();
+        }
+
+        for (std::size_t page = 0; page < image_size; page += PageSize)
+        {
+            const auto size = std::uint16_t(std::min(PageSize, image_size - page));
+
+            std::optional<std::uint64_t> partial;
+            if ((cache != nullptr) && (size == PageSize))
+            {
+                partial = cache->get(page);
+            }
+            if (!partial)
+            {
+                for (std::uint16_t i = 0; i < size;)
+                {
+                    const auto res = backend.read(page + i, &rom_buffer_[i], std::uint16_t(size - i));
+                    if (res <= 0)
+                    {
+                        return {};
+                    }
+                    i = std::uint16_t(i + res);
+                }
+                addToDigest(rom_buffer_.data(), size);      // The digest covers the actual CRC
+                partial = CRC64::computePartial(rom_buffer_.data(), size);
+                if ((cache != nullptr) && (size == PageSize))
+                {
+                    cache->put(page, *partial);
+                }
+            }
+
+            if ((crc_offset >= page) && (crc_offset < (page + size)))
+            {
+                const auto bytes_after_field = page + size - (crc_offset + sizeof(app_info.image_crc));
+                *partial ^= CRC64::multiply(CRC64::computePartial(&app_info.image_crc, sizeof(app_info.image_crc)),
+                                            CRC64::computeShiftFactor(bytes_after_field));
+            }
+
+            crc.combine(*partial, (size == PageSize) ? page_shift_factor : CRC64::computeShiftFactor(size));
+        }
+        return crc.get();
+    }
+
+    std::optional<AppDescriptor> locateAppDescriptor(const IROMBackend& backend)
+    {
+        constexpr auto Step = 8;
+
+        for (std::size_t offset = 0;; offset += Step)
+        {
+            // Reading the storage in 8 bytes increments until we've found the signature
+            {
+                std::uint8_t signature[Step] = {};
+                const auto res = backend.read(offset, signature, sizeof(signature));
+                if (res != std::int16_t(sizeof(signature)))
+                {
+                    break;
+                }
+                const auto reference = AppDescriptor::getSignatureValue();
+                if (!std::equal(std::begin(signature), std::end(signature), std::begin(reference)))
+                {
+                    continue;
+                }
+            }
+
+            // Reading the entire descriptor
+            AppDescriptor desc;
+            {
+                const auto res = backend.read(offset, &desc, sizeof(desc));
+                if (res != std::int16_t(sizeof(desc)))
+                {
+                    break;
+                }
+                if (!desc.isValid(max_application_image_size_))
+                {
+                    continue;
+                }
+            }
+
+            // Checking firmware CRC, and the signature if the images are signed.
+            // This block is computationally expensive; see computeImageCRC().
+            {
+                const auto crc_offset = offset + offsetof(AppDescriptor, app_info) + offsetof(AppInfo, image_crc);
+                const auto crc = computeImageCRC(backend, crc_offset, desc.app_info);
+                if (!crc || (*crc != desc.app_info.image_crc))
+                {
+                    KOCHERGA_TRACE("App descriptor found, but CRC is invalid\n");
+                    continue;       // Look further...
+                }
+
+                if (!isSignatureValid(backend, desc.app_info.image_size))
+                {
+                    KOCHERGA_TRACE("App descriptor found, but the signature is invalid\n");
+                    continue;
+                }
+            }
+
+            // Returning if the descriptor is correct
+            KOCHERGA_TRACE("App descriptor located at offset %x\n", unsigned(offset));
+            return {desc};
+        }
+
+        return {};
+    }
+
+    std::uint8_t getSlotCount() const
+    {
+        return ((secondary_backend_ != nullptr) && (secondary_role_ == SecondaryROMRole::AlternateSlot)) ? 2U : 1U;
+    }
+
+    bool isStaging() const
+    {
+        return (secondary_backend_ != nullptr) && (secondary_role_ == SecondaryROMRole::Staging);
+    }
+
+    bool isBufferedInRAM() const
+    {
+        return (ram_buffer_.getCapacity() > 0) && !isStaging();
+    }
+
+    IROMBackend& getSlotBackend(std::uint8_t slot)
+    {
+        assert(slot < getSlotCount());
+        return (slot == 0) ? backend_ : *secondary_backend_;
+    }
+
+    PageCRCCache* getPageCRCCache(const IROMBackend& backend)
+    {
+        return (&backend == &backend_) ? &page_crc_cache_ : nullptr;
+    }
+
+    /**
+     * Backends that erase the storage by themselves may modify any part of it from now on, so the cached CRCs
+     * of its pages cannot be trusted anymore.
+     */
+    std::int16_t beginUpgrade(IROMBackend& backend)
+    {
+        if ((&backend == &backend_) && (backend.getSectorSize(0) == 0))
+        {
+            page_crc_cache_.invalidateAll();
+        }
+        return backend.beginUpgrade();
+    }
+
+    /**
+     * New images are downloaded into the staging area or into the RAM buffer, if any; otherwise, into the slot.
+     */
+    IROMBackend& getDownloadBackend(std::uint8_t target_slot)
+    {
+        if (isStaging())
+        {
+            return *secondary_backend_;
+        }
+        return isBufferedInRAM() ? ram_buffer_ : getSlotBackend(target_slot);
+    }
+
+    std::uint32_t getMaxDownloadSize() const
+    {
+        return isBufferedInRAM() ? std::min(max_application_image_size_, ram_buffer_.getCapacity())
+                                 : max_application_image_size_;
+    }
 
-            if ((offset_ + size) <= max_image_size_)
+    /**
+     * Images are ordered by the version number; images of the same version are ordered by the build timestamp.
+     */
+    static bool isNewer(const AppInfo& a, const AppInfo& b)
+    {
+        const auto timestamp = [](const AppInfo& x) { return x.isBuildTimestampValid() ? x.build_timestamp_utc : 0U; };
+        if (a.major_version != b.major_version)
+        {
+            return a.major_version > b.major_version;
+        }
+        if (a.minor_version != b.minor_version)
+        {
+            return a.minor_version > b.minor_version;
+        }
+        return timestamp(a) > timestamp(b);
+    }
+
+    std::optional<AppDescriptor> locateNewestAppDescriptor(std::uint8_t& out_slot)
+    {
+        std::optional<AppDescriptor> newest;
+        for (std::uint8_t slot = 0; slot < getSlotCount(); slot++)
+        {
+            const auto appdesc = locateAppDescriptor(getSlotBackend(slot));
+            if (appdesc && (!newest || isNewer(appdesc->app_info, newest->app_info)))
+            {
+                newest = appdesc;
+                out_slot = slot;
+            }
+        }
+        return newest;
+    }
+
+    void updateState(const std::optional<AppInfo>& app_info, std::uint8_t slot, const State state_on_success)
+    {
+        MutexLocker mlock(platform_);
+        if (app_info)
+        {
+            cached_app_info_ = app_info;
+            app_slot_ = slot;
+            state_ = state_on_success;
+            boot_delay_started_at_ =
+                platform_.getMonotonicUptime();     // This only makes sense if the new state is BootDelay
+            KOCHERGA_TRACE("App found in slot %u; version %u.%u.%x, flags %u, built %u, %u bytes\n",
+                           unsigned(app_slot_),
+                           unsigned(app_info->major_version),
+                           unsigned(app_info->minor_version),
+                           unsigned(app_info->vcs_commit),
+                           unsigned(app_info->flags),
+                           unsigned(app_info->build_timestamp_utc),
+                           unsigned(app_info->image_size));
+        }
+        else
+        {
+            cached_app_info_.reset();
+            state_ = State::NoAppToBoot;
+            KOCHERGA_TRACE("App not found\n");
+        }
+        publishStatus();
+    }
+
+    void verifyAppAndUpdateState(const State state_on_success)
+    {
+        std::uint8_t slot = 0;
+        const auto appdesc = locateNewestAppDescriptor(slot);
+        updateState(appdesc ? appdesc->app_info : std::optional<AppInfo>(), slot, state_on_success);
+    }
+
+    /**
+     * Selects the app that has just been written into the slot, unless the app in the other slot is newer.
+     * If the new app has not been verified while it was being written, all slots are verified again.
+     */
+    void updateStateAfterUpgrade(const std::optional<AppInfo>& app_info, std::uint8_t slot)
+    {
+        if (app_info)
+        {
+            const bool keep_old = cached_app_info_ &&
+                (isNewer(*cached_app_info_, *app_info) ||
+                 (!isNewer(*app_info, *cached_app_info_) && (app_slot_ < slot)));   // Same order on ties
+            updateState(keep_old ? cached_app_info_ : app_info,
+                        keep_old ? app_slot_ : slot,
+                        State::BootDelay);
+        }
+        else
+        {
+            verifyAppAndUpdateState(State::BootDelay);
+        }
+    }
+
+    /**
+     * Returns info about the app that has just been downloaded into the slot if it has been verified while it
+     * was being written, and the readback policy is satisfied. See @ref UpgradeOptions::readback.
+     */
+    std::optional<AppInfo> confirmDownloadedApp(const ProxySink& sink, const IROMBackend& backend)
+    {
+        std::size_t offset = 0;
+        const auto appdesc = sink.getVerifiedAppDescriptor(offset);
+        if (!appdesc || (options_.readback == ReadbackPolicy::Full))
+        {
+            return {};
+        }
+        if (options_.readback == ReadbackPolicy::Descriptor)
+        {
+            AppDescriptor stored;
+            if ((backend.read(offset, &stored, sizeof(stored)) != std::int16_t(sizeof(stored))) ||
+                (std::memcmp(&stored, &*appdesc, sizeof(stored)) != 0))
+            {
+                KOCHERGA_TRACE("App descriptor readback mismatch\n");
+                return {};
+            }
+        }
+        return appdesc->app_info;
+    }
+
+    /**
+     * Copies the staged image into the primary backend through the same pipeline as the downloads, so that
+     * the large writes, the erasing ahead, and the journaling apply; see @ref SecondaryROMRole::Staging.
+     */
+    std::int16_t copyStagedApp(const AppInfo& staged_app, IDownloadSink& sink)
+    {
+        const auto image_size = getStoredImageSize(staged_app);     // The signature is copied as well
+        std::uint32_t offset = std::min(sink.getResumeOffset(staged_app.image_crc), image_size);
+        if (const auto res = sink.handleImageSizeHint(image_size); res < 0)
+        {
+            return res;
+        }
+        while (offset < image_size)
+        {
+            const auto size = std::uint16_t(std::min<std::size_t>(staging_buffer_.size(), image_size - offset));
+            const auto res = secondary_backend_->read(offset, staging_buffer_.data(), size);
+            if (res <= 0)
             {
-                const auto res = backend_.write(offset_, data, size);
-                if ((res >= 0) && (res != int(size)))
-                {
-                    return -ErrROMWriteFailure;
-                }
-
-                offset_ += size;
-                return res;
+                return (res < 0) ? res : -ErrROMReadFailure;
             }
-            else
+            if (const auto write_res = sink.handleNextDataChunk(staging_buffer_.data(), std::uint16_t(res));
+                write_res < 0)
             {
-                return -ErrAppImageTooLarge;
+                return write_res;
             }
+            offset += std::uint32_t(res);
         }
-
-    public:
-        ProxySink(IPlatform& pl,
-                  IROMBackend& back,
-                  std::size_t max_image_size) :
-            platform_(pl),
-            backend_(back),
-            max_image_size_(max_image_size)
-        { }
-    };
-
-    State state_{};
-    IPlatform& platform_;
-    IROMBackend& backend_;
-
-    const std::uint32_t max_application_image_size_;
-    const std::chrono::microseconds boot_delay_;
-    std::chrono::microseconds boot_delay_started_at_{};
-
-    /// Larger buffer enables faster CRC verification, which is important, especially with large firmwares!
-    std::array<std::uint8_t, 1024> rom_buffer_{};
-
-    /// Caching is needed because app check can sometimes take a very long time (several seconds)
-    std::optional<AppInfo> cached_app_info_;
+        return ErrOK;
+    }
 
     /**
-     * Refer to the Brickproof Bootloader specs.
-     * Note that the structure must be aligned at 8 bytes boundary, and the image must be padded to 8 bytes!
+     * Installs the image that has been verified in the staging area and updates the state accordingly.
+     * The primary storage is marked as being overwritten in the journal before it is modified; the mark is removed
+     * once the copy is complete. The storage mutex shall be locked; it is held during the copy.
+     * @return 0 on success, negative on error; the installation will be retried upon the next construction
      */
-    struct AppDescriptor
+    std::int16_t installStagedApp(const AppInfo& staged_app)
     {
-        static constexpr std::size_t ImagePaddingBytes = 8;
+        const auto journal = platform_.loadUpgradeJournal();
+        if (!journal || (journal->image_id != staged_app.image_crc))
+        {
+            platform_.storeUpgradeJournal(UpgradeJournal{staged_app.image_crc, 0, CRC64().get()});
+        }
 
-        alignas(8) std::array<std::uint8_t, 8> signature{};
-        alignas(8) AppInfo app_info;                            // Being explicit about expected memory layout
+        KOCHERGA_TRACE("Installing the staged app, %u bytes\n", unsigned(staged_app.image_size));
+        {
+            MutexLocker mlock(platform_);
+            state_ = State::AppUpgradeInProgress;
+            cached_app_info_.reset();
+            publishStatus();
+        }
 
-        static constexpr std::array<std::uint8_t, 8> getSignatureValue()
+        auto res = beginUpgrade(backend_);
+        if (res < 0)
         {
-            return {{'A','P','D','e','s','c','0','0'}};
+            verifyAppAndUpdateState(State::BootCancelled);
+            return res;
         }
 
-        bool isValid(const std::uint32_t max_application_image_size) const
+        UpgradeStatistics statistics;
+        ProxySink sink(platform_, backend_, max_application_image_size_, write_buffers_, rom_buffer_,
+                       options_, statistics, {}, true, signature_verifier_, getPageCRCCache(backend_));
+        res = copyStagedApp(staged_app, sink);
+        if (const auto flush_res = sink.finalize(res >= 0); res >= 0)
         {
-            const auto sgn = getSignatureValue();
-            return std::equal(std::begin(signature), std::end(signature), std::begin(sgn)) &&
-                   (app_info.image_size > 0) &&
-                   (app_info.image_size <= max_application_image_size) &&
-                   ((app_info.image_size % ImagePaddingBytes) == 0);
+            res = flush_res;
         }
-    };
-    static_assert(sizeof(AppDescriptor) == 32, "Invalid packing");
-    static_assert(std::is_standard_layout_v<AppDescriptor>, "AppInfo is not standard layout; check your compiler");
-    static_assert(offsetof(AppDescriptor, app_info) + offsetof(AppInfo, image_crc) == 8);
+        if (res >= 0)
+        {
+            res = backend_.endUpgrade(true);
+        }
+        else
+        {
+            (void)backend_.endUpgrade(false);
+        }
+        last_upgrade_statistics_.bytes_installed = statistics.bytes_decoded;
+        KOCHERGA_TRACE("Staged app installation finished with status %d\n", res);
 
-    std::optional<AppDescriptor> locateAppDescriptor()
-    {
-        constexpr auto Step = 8;
+        if (res < 0)
+        {
+            verifyAppAndUpdateState(State::BootCancelled);
+            return res;
+        }
 
-        for (std::size_t offset = 0;; offset += Step)
+        platform_.storeUpgradeJournal({});
+        if (const auto app_info = confirmDownloadedApp(sink, backend_))
         {
-            // Reading the storage in 8 bytes increments until we've found the signature
-            {
-                std::uint8_t signature[Step] = {};
-                const auto res = backend_.read(offset, signature, sizeof(signature));
-                if (res != std::int16_t(sizeof(signature)))
-                {
-                    break;
-                }
-                const auto reference = AppDescriptor::getSignatureValue();
-                if (!std::equal(std::begin(signature), std::end(signature), std::begin(reference)))
-                {
-                    continue;
-                }
-            }
+            updateState(app_info, 0, State::BootDelay);
+        }
+        else
+        {
+            verifyAppAndUpdateState(State::BootDelay);
+        }
+        return ErrOK;
+    }
 
-            // Reading the entire descriptor
-            AppDescriptor desc;
+    /**
+     * Feeds the buffered image to the sink in chunks that are multiples of the page size, so that the pages
+     * are written directly from the buffer if the backend is synchronous; see ProxySink::handleData().
+     */
+    std::int16_t copyBufferedApp(const AppInfo& buffered_app, IDownloadSink& sink)
+    {
+        constexpr std::uint32_t ChunkSize = (MaxDataBlockSize / ProxySink::BufferSize) * ProxySink::BufferSize;
+        const auto image_size = getStoredImageSize(buffered_app);   // The signature is installed as well
+        if (const auto res = sink.handleImageSizeHint(image_size); res < 0)
+        {
+            return res;
+        }
+        for (std::uint32_t offset = 0; offset < image_size; offset += ChunkSize)
+        {
+            const auto size = std::uint16_t(std::min(ChunkSize, image_size - offset));
+            if (const auto res = sink.handleNextDataChunk(ram_buffer_.getData() + offset, size); res < 0)
             {
-                const auto res = backend_.read(offset, &desc, sizeof(desc));
-                if (res != std::int16_t(sizeof(desc)))
-                {
-                    break;
-                }
-                if (!desc.isValid(max_application_image_size_))
-                {
-                    continue;
-                }
+                return res;
             }
+        }
+        return ErrOK;
+    }
 
-            // Checking firmware CRC.
-            // This block is computationally expensive, so it has been carefully optimized for speed.
+    /**
+     * Programs the image that has been downloaded and verified in the RAM buffer into the slot in one go, writing
+     * the pages directly from the buffer; see @ref UpgradeOptions::ram_buffer. The buffer does not survive a reset,
+     * so an interrupted installation cannot be resumed; the image has to be downloaded again then.
+     * The storage mutex shall be locked; it is held while the storage is written.
+     * @return 0 on success, negative on error
+     */
+    std::int16_t installBufferedApp(const AppInfo& buffered_app, std::uint8_t slot)
+    {
+        KOCHERGA_TRACE("Installing the buffered app into slot %u, %u bytes\n",
+                       unsigned(slot), unsigned(buffered_app.image_size));
+        {
+            MutexLocker mlock(platform_);
+            state_ = State::AppUpgradeInProgress;
+            if (app_slot_ == slot)
             {
-                const auto crc_offset = offset + offsetof(AppDescriptor, app_info) + offsetof(AppInfo, image_crc);
-                CRC64 crc;
-
-                // Read large chunks until the CRC field is reached (in most cases it will fit in just one chunk)
-                for (std::size_t i = 0; i < crc_offset;)
-                {
-                    const auto res =
-                        backend_.read(i, rom_buffer_.data(),
-                                      std::uint16_t(std::min<std::size_t>(rom_buffer_.size(), crc_offset - i)));
-                    if (res > 0)
-                    {
-                        i += std::size_t(res);
-                        crc.add(rom_buffer_.data(), std::size_t(res));
-                    }
-                    else
-                    {
-                        break;
-                    }
-                }
-
-                // Fill CRC with zero
-                {
-                    static const std::uint8_t dummy[8]{0};
-                    crc.add(&dummy[0], sizeof(dummy));
-                }
+                cached_app_info_.reset();               // Invalidate now, as we're going to modify the storage
+            }
+            publishStatus();
+        }
 
-                // Read the rest of the image in large chunks
-                for (std::size_t i = crc_offset + 8; i < desc.app_info.image_size;)
-                {
-                    const auto res = backend_.read(i, rom_buffer_.data(),
-                                                   std::uint16_t(std::min<std::size_t>(rom_buffer_.size(),
-                                                                                       desc.app_info.image_size - i)));
-                    if (res > 0)
-                    {
-                        i += std::size_t(res);
-                        crc.add(rom_buffer_.data(), std::size_t(res));
-                    }
-                    else
-                    {
-                        break;
-                    }
-                }
+        IROMBackend& backend = getSlotBackend(slot);
+        auto res = beginUpgrade(backend);
+        if (res < 0)
+        {
+            verifyAppAndUpdateState(State::BootCancelled);
+            return res;
+        }
 
-                if (crc.get() != desc.app_info.image_crc)
-                {
-                    KOCHERGA_TRACE("App descriptor found, but CRC is invalid\n");
-                    continue;       // Look further...
-                }
-            }
+        UpgradeStatistics statistics;
+        ProxySink sink(platform_, backend, max_application_image_size_, write_buffers_, rom_buffer_,
+                       options_, statistics, {}, true, signature_verifier_, getPageCRCCache(backend));
+        res = copyBufferedApp(buffered_app, sink);
+        if (const auto flush_res = sink.finalize(res >= 0); res >= 0)
+        {
+            res = flush_res;
+        }
+        if (res >= 0)
+        {
+            res = backend.endUpgrade(true);
+        }
+        else
+        {
+            (void)backend.endUpgrade(false);
+        }
+        last_upgrade_statistics_.bytes_installed = statistics.bytes_decoded;
+        KOCHERGA_TRACE("Buffered app installation finished with status %d\n", res);
 
-            // Returning if the descriptor is correct
-            KOCHERGA_TRACE("App descriptor located at offset %x\n", unsigned(offset));
-            return {desc};
+        if (res < 0)
+        {
+            verifyAppAndUpdateState(State::BootCancelled);
+            return res;
         }
 
-        return {};
+        updateStateAfterUpgrade(confirmDownloadedApp(sink, backend), slot);
+        return ErrOK;
     }
 
-    void verifyAppAndUpdateState(const State state_on_success)
+    /**
+     * If the installation of a staged image has been interrupted, it is resumed here.
+     * The journal may also belong to an interrupted download, in which case it is left alone.
+     */
+    void resumeStagedAppInstallation()
     {
-        if (const auto appdesc = locateAppDescriptor())
+        const auto journal = platform_.loadUpgradeJournal();
+        if (!isStaging() || !journal)
         {
-            cached_app_info_ = appdesc->app_info;
-            state_ = state_on_success;
-            boot_delay_started_at_ =
-                platform_.getMonotonicUptime();     // This only makes sense if the new state is BootDelay
-            KOCHERGA_TRACE("App found; version %u.%u.%x, flags %u, built %u, %u bytes\n",
-                           unsigned(appdesc->app_info.major_version),
-                           unsigned(appdesc->app_info.minor_version),
-                           unsigned(appdesc->app_info.vcs_commit),
-                           unsigned(appdesc->app_info.flags),
-                           unsigned(appdesc->app_info.build_timestamp_utc),
-                           unsigned(appdesc->app_info.image_size));
+            return;
         }
-        else
+        const auto staged = locateAppDescriptor(*secondary_backend_);
+        if (staged && (staged->app_info.image_crc == journal->image_id))
         {
-            cached_app_info_.reset();
-            state_ = State::NoAppToBoot;
-            KOCHERGA_TRACE("App not found\n");
+            KOCHERGA_TRACE("Resuming the interrupted installation of the staged app\n");
+            (void)installStagedApp(staged->app_info);
         }
     }
 
@@ -524,31 +3210,75 @@ public:
      * values early, greatly improving the worst case boot time.
      *
      * By default, the boot delay is set to zero; i.e., if the application is valid it will be launched immediately.
+     * The upgrade options are described in @ref UpgradeOptions.
      */
     BootloaderController(IPlatform& platform,
                          IROMBackend& rom_backend,
                          std::uint32_t max_application_image_size = 0xFFFFFFFFUL,
-                         std::chrono::microseconds boot_delay = std::chrono::microseconds(0)) :
+                         std::chrono::microseconds boot_delay = std::chrono::microseconds(0),
+                         const UpgradeOptions& options = {}) :
         platform_(platform),
         backend_(rom_backend),
+        secondary_backend_(nullptr),
+        secondary_role_(SecondaryROMRole::AlternateSlot),
         max_application_image_size_(max_application_image_size),
-        boot_delay_(boot_delay)
+        boot_delay_(boot_delay),
+        options_(options),
+        signature_verifier_(platform.getSignatureVerifier()),
+        ram_buffer_(options.ram_buffer, options.ram_buffer_size),
+        page_crc_cache_(options.page_crc_cache, options.page_crc_cache_size)
     {
-        MutexLocker mlock(platform_);
+        StorageLocker slock(platform_);
+        verifyAppAndUpdateState(State::BootDelay);
+    }
+
+    /**
+     * Same as above, but with a secondary ROM backend whose purpose is defined by @ref SecondaryROMRole.
+     * The max application image size applies to each backend individually.
+     * In the staging mode, an interrupted installation of a staged image is completed here.
+     */
+    BootloaderController(IPlatform& platform,
+                         IROMBackend& rom_backend,
+                         IROMBackend& secondary_rom_backend,
+                         SecondaryROMRole secondary_role,
+                         std::uint32_t max_application_image_size = 0xFFFFFFFFUL,
+                         std::chrono::microseconds boot_delay = std::chrono::microseconds(0),
+                         const UpgradeOptions& options = {}) :
+        platform_(platform),
+        backend_(rom_backend),
+        secondary_backend_(&secondary_rom_backend),
+        secondary_role_(secondary_role),
+        max_application_image_size_(max_application_image_size),
+        boot_delay_(boot_delay),
+        options_(options),
+        signature_verifier_(platform.getSignatureVerifier()),
+        ram_buffer_(options.ram_buffer, options.ram_buffer_size),
+        page_crc_cache_(options.page_crc_cache, options.page_crc_cache_size)
+    {
+        StorageLocker slock(platform_);
         verifyAppAndUpdateState(State::BootDelay);
+        resumeStagedAppInstallation();
     }
 
     /**
      * @ref State.
+     * The mutex is locked only during the boot delay, which is measured using the platform clock;
+     * in particular, this method never waits for the storage operations of an upgrade in progress.
      */
     State getState()
     {
+        if (const auto status = status_.load(); status.state != State::BootDelay)
+        {
+            return status.state;
+        }
+
         MutexLocker mlock(platform_);
         if ((state_ == State::BootDelay) &&
             ((platform_.getMonotonicUptime() - boot_delay_started_at_) >= boot_delay_))
         {
             KOCHERGA_TRACE("Boot delay expired\n");
             state_ = State::ReadyToBoot;
+            publishStatus();
         }
 
         return state_;
@@ -557,13 +3287,33 @@ public:
     /**
      * If there is a valid application in the ROM, returns info about it.
      * Otherwise returns an empty option.
+     * Does not lock the mutex.
      */
-    std::optional<AppInfo> getAppInfo()
+    std::optional<AppInfo> getAppInfo() const
     {
-        MutexLocker mlock(platform_);
-        if (cached_app_info_)
+        const auto status = status_.load();
+        if (status.app_found)
+        {
+            return status.app_info;
+        }
+        else
+        {
+            return {};
+        }
+    }
+
+    /**
+     * If there is a valid application in the ROM, returns the index of the slot where it is located: 0 for the
+     * primary backend, 1 for the secondary backend (see @ref SecondaryROMRole::AlternateSlot).
+     * This is the slot that should be booted. Otherwise returns an empty option.
+     * Does not lock the mutex.
+     */
+    std::optional<std::uint8_t> getAppSlot() const
+    {
+        const auto status = status_.load();
+        if (status.app_found)
         {
-            return *cached_app_info_;
+            return status.app_slot;
         }
         else
         {
@@ -583,6 +3333,7 @@ public:
         case State::ReadyToBoot:
         {
             state_ = State::BootCancelled;
+            publishStatus();
             KOCHERGA_TRACE("Boot cancelled\n");
             break;
         }
@@ -608,6 +3359,7 @@ public:
         case State::BootCancelled:
         {
             state_ = State::ReadyToBoot;
+            publishStatus();
             KOCHERGA_TRACE("Boot requested\n");
             break;
         }
@@ -622,36 +3374,59 @@ public:
 
     /**
      * Template method that implements all of the high-level steps of the application update procedure.
-     * Returns zero on success, negative on failure.
+     * Returns zero on success, negative on failure. If the image is already installed, returns
+     * @ref ResultAppUnchanged, which is also a success: the download is terminated early, the storage is not modified,
+     * and the installed application remains selected. Hence, the result shall be checked for being negative
+     * rather than non-zero.
      */
     std::int16_t upgradeApp(IProtocol& proto)
     {
         /*
          * Preparation stage.
-         * Note that access to the backend and all members is always protected with the mutex, this is important.
+         * Note that access to the backend and all members is always protected with the storage mutex, this is
+         * important. The mutex is locked only briefly when the state is changed, so that the state can be queried
+         * and boot requests are handled while the storage is being accessed.
          */
+        std::uint8_t target_slot = 0;
+        std::optional<AppInfo> reference_app;
+        std::optional<AppInfo> installed_app;
+        std::uint8_t installed_slot = 0;
         {
-            MutexLocker mlock(platform_);
-
-            switch (state_)
-            {
-            case State::BootDelay:
-            case State::BootCancelled:
-            case State::NoAppToBoot:
-            {
-                break;      // OK, continuing below
-            }
-            case State::ReadyToBoot:
-            case State::AppUpgradeInProgress:
+            StorageLocker slock(platform_);
             {
-                return -ErrInvalidState;
-            }
-            }
+                MutexLocker mlock(platform_);
 
-            state_ = State::AppUpgradeInProgress;
-            cached_app_info_.reset();                           // Invalidate now, as we're going to modify the storage
+                switch (state_)
+                {
+                case State::BootDelay:
+                case State::BootCancelled:
+                case State::NoAppToBoot:
+                {
+                    break;      // OK, continuing below
+                }
+                case State::ReadyToBoot:
+                case State::AppUpgradeInProgress:
+                {
+                    return -ErrInvalidState;
+                }
+                }
+
+                // With two slots, the one that contains the selected application is left intact
+                target_slot = (cached_app_info_ && (getSlotCount() > 1)) ? std::uint8_t(1U - app_slot_) : 0U;
+                installed_app = cached_app_info_;
+                installed_slot = app_slot_;
+                if ((getSlotCount() == 1) && !isStaging() && !isBufferedInRAM())
+                {
+                    cached_app_info_.reset();                   // Invalidate now, as we're going to modify the storage
+                }
+                reference_app = cached_app_info_;
+
+                state_ = State::AppUpgradeInProgress;
+                last_upgrade_statistics_ = UpgradeStatistics();
+                publishStatus();
+            }
 
-            const auto res = backend_.beginUpgrade();
+            const auto res = beginUpgrade(getDownloadBackend(target_slot));
             if (res < 0)
             {
                 verifyAppAndUpdateState(State::BootCancelled);  // The backend could have modified the storage
@@ -659,36 +3434,90 @@ public:
             }
         }
 
-        KOCHERGA_TRACE("Starting app upgrade...\n");
+        KOCHERGA_TRACE("Starting app upgrade into %s %u...\n",
+                       isStaging() ? "staging area" : (isBufferedInRAM() ? "RAM buffer for slot" : "slot"),
+                       unsigned(target_slot));
+        IROMBackend& backend = getDownloadBackend(target_slot);
 
         /*
          * Downloading stage.
          * New application is downloaded into the storage backend via the ProxySink proxy class.
-         * Every write() via the ProxySink is mutex-protected.
+         * Every write() via the ProxySink is protected with the storage mutex. If the backend supports asynchronous
+         * writes, the protocol receives the next chunk while the previous one is being programmed.
          */
-        ProxySink sink(platform_, backend_, max_application_image_size_);
+        ProxySink sink(platform_, backend, getMaxDownloadSize(), write_buffers_, rom_buffer_,
+                       options_, last_upgrade_statistics_, installed_app,
+                       !isStaging() && !isBufferedInRAM() && (installed_slot == target_slot), signature_verifier_,
+                       getPageCRCCache(backend));
 
-        auto res = proto.downloadImage(sink);
+        /*
+         * Encoded streams are decoded on the fly by the stream filters before they reach the ProxySink.
+         * There is one dispatcher per filter chaining level.
+         */
+        const ReferenceImage reference(platform_,
+                                       reference_app ? &getSlotBackend(app_slot_) : nullptr,
+                                       reference_app);
+        std::array<bool, MaxStreamFilters> filters_in_use{};
+        static_assert(MaxStreamFilters == 4, "Update the dispatcher chain below");
+        StreamDispatcher dispatcher_4(stream_filters_, filters_in_use, reference, sink, nullptr);
+        StreamDispatcher dispatcher_3(stream_filters_, filters_in_use, reference, sink, &dispatcher_4);
+        StreamDispatcher dispatcher_2(stream_filters_, filters_in_use, reference, sink, &dispatcher_3);
+        StreamDispatcher dispatcher_1(stream_filters_, filters_in_use, reference, sink, &dispatcher_2);
+        StreamDispatcher dispatcher(stream_filters_, filters_in_use, reference, sink, &dispatcher_1);
+
+        auto res = proto.downloadImage(dispatcher);
         KOCHERGA_TRACE("App download finished with status %d\n", res);
 
+        if (res >= 0)
+        {
+            res = dispatcher.finalize();
+        }
+
+        // Writing the remaining buffered data and waiting for the pending writes to complete
+        if (const auto flush_res = sink.finalize(res >= 0); res >= 0)
+        {
+            res = flush_res;
+        }
+
+        if (res < 0)
+        {
+            dispatcher.abort();                     // The filters release their resources, e.g., keys
+        }
+
         /*
          * Finalization stage.
          * Checking if the protocol has succeeded, checking if the backend is able to finalize successfully.
-         * Notice the mutex.
+         * Notice the storage mutex.
          */
-        MutexLocker mlock(platform_);
+        StorageLocker slock(platform_);
+        {
+            MutexLocker mlock(platform_);
+            assert(state_ == State::AppUpgradeInProgress);
+            state_ = State::NoAppToBoot;            // Default state until proven otherwise; published below
+        }
+        last_upgrade_statistics_.bytes_received = dispatcher.getBytesReceived();
+
+        if ((res >= 0) && sink.isJournaling())
+        {
+            platform_.storeUpgradeJournal({});      // The download is complete, nothing to resume
+        }
 
-        assert(state_ == State::AppUpgradeInProgress);
-        state_ = State::NoAppToBoot;                // Default state until proven otherwise
+        if (sink.isAppUnchanged())                  // Nothing has been written over the installed app
+        {
+            KOCHERGA_TRACE("App upgrade skipped, the image is already installed\n");
+            (void)backend.endUpgrade(false);
+            updateState(installed_app, installed_slot, State::BootDelay);
+            return ResultAppUnchanged;
+        }
 
         if (res < 0)                                // Download failed
         {
-            (void)backend_.endUpgrade(false);       // Making sure the backend is finalized; error is irrelevant
+            (void)backend.endUpgrade(false);        // Making sure the backend is finalized; error is irrelevant
             verifyAppAndUpdateState(State::BootCancelled);
             return res;
         }
 
-        res = backend_.endUpgrade(true);
+        res = backend.endUpgrade(true);
         if (res < 0)                                // Finalization failed
         {
             KOCHERGA_TRACE("App storage backend finalization failed (%d)\n", res);
@@ -700,12 +3529,61 @@ public:
          * Everything went well, checking if the application is valid and updating the state accordingly.
          * This method will report success even if the application image it just downloaded is not valid,
          * since that would be out of the scope of its responsibility.
+         * If the new image has been verified while it was being written, it is not read back again, and neither is
+         * the image in the other slot, if any, because it has not been modified.
+         * A staged or buffered image is installed only if it is valid; otherwise, the installed application
+         * remains intact.
          */
-        verifyAppAndUpdateState(State::BootDelay);
+        if (isStaging() || isBufferedInRAM())
+        {
+            auto new_app = confirmDownloadedApp(sink, backend);
+            if (!new_app)
+            {
+                const auto appdesc = locateAppDescriptor(backend);
+                new_app = appdesc ? appdesc->app_info : std::optional<AppInfo>();
+            }
+            if (!new_app)
+            {
+                KOCHERGA_TRACE("New app is invalid, not installing\n");
+                verifyAppAndUpdateState(State::BootDelay);
+                return ErrOK;
+            }
+            return isStaging() ? installStagedApp(*new_app) : installBufferedApp(*new_app, target_slot);
+        }
 
+        updateStateAfterUpgrade(confirmDownloadedApp(sink, backend), target_slot);
         return ErrOK;
     }
 
+    /**
+     * Registers a stream filter that will be used to decode the images downloaded by @ref upgradeApp() if they
+     * begin with its magic; see @ref IStreamFilter. The filter object must outlive the controller.
+     * No more than @ref MaxStreamFilters can be registered.
+     * @return true on success, false if the maximum number of filters is reached
+     */
+    bool addStreamFilter(IStreamFilter& filter)
+    {
+        StorageLocker slock(platform_);
+        for (auto& f : stream_filters_)
+        {
+            if (f == nullptr)
+            {
+                f = &filter;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Returns the statistics collected during the last application upgrade, successful or not.
+     */
+    UpgradeStatistics getLastUpgradeStatistics() const
+    {
+        StorageLocker slock(platform_);
+        return last_upgrade_statistics_;
+    }
+
     /**
      * Returns the uptime provided by the platform driver.
      * Just like any other public method, it is thread safe.
@@ -0,0 +1,540 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <kocherga.hpp>
+
+
+namespace kocherga_aes
+{
+/**
+ * Error codes specific to this module.
+ */
+static constexpr std::int16_t ErrOK                             = 0;
+static constexpr std::int16_t ErrInvalidImage                   = 10001;
+static constexpr std::int16_t ErrKeyNotAvailable                = 10002;
+static constexpr std::int16_t ErrCipherFailure                  = 10003;
+
+/**
+ * The size of the AES block, in bytes.
+ */
+static constexpr std::uint8_t BlockSize = 16;
+
+/**
+ * AES block encryption. Only the forward direction is needed, because the counter mode decrypts the data
+ * by encrypting the counter blocks. Implement this interface to use a hardware AES engine;
+ * @ref SoftwareCipher is the portable fallback.
+ */
+class IBlockCipher
+{
+public:
+    virtual ~IBlockCipher() = default;
+
+    /**
+     * @param key_size  16, 24, or 32 bytes for AES-128, AES-192, or AES-256, respectively
+     * @return true on success, false if the key size is not supported
+     */
+    virtual bool setKey(const std::uint8_t* key, std::uint8_t key_size) = 0;
+
+    /**
+     * Encrypts the specified number of consecutive blocks with the key set by setKey(); the input and the output
+     * never overlap. Up to @ref DecryptionFilter::BatchBlocks blocks are passed at once, so that an engine with
+     * DMA can process them without the involvement of the CPU.
+     * @return true on success, false on error
+     */
+    virtual bool encryptBlocks(const std::uint8_t* in, std::uint8_t* out, std::size_t count) = 0;
+
+    /**
+     * Erases the key and everything derived from it; encryptBlocks() fails until a new key is set.
+     * Invoked whenever a stream ends, successfully or not, so that the key does not stay in the memory.
+     */
+    virtual void clearKey() = 0;
+};
+
+namespace detail
+{
+
+constexpr std::uint8_t multiply(std::uint8_t a, std::uint8_t b)
+{
+    std::uint8_t out = 0;
+    for (std::uint8_t i = 0; i < 8; i++)
+    {
+        if ((b & 1U) != 0)
+        {
+            out = std::uint8_t(out ^ a);
+        }
+        a = std::uint8_t((a << 1U) ^ (((a >> 7U) & 1U) * 0x1BU));
+        b = std::uint8_t(b >> 1U);
+    }
+    return out;
+}
+
+constexpr std::uint8_t rotateLeft(std::uint8_t x, std::uint8_t n)
+{
+    return std::uint8_t((x << n) | (x >> (8U - n)));
+}
+
+/**
+ * The S-box is derived from its definition in FIPS-197 rather than typed in: the multiplicative inverse
+ * in GF(2^8), which is x^254, followed by the affine transformation.
+ */
+constexpr std::array<std::uint8_t, 256> makeSBox()
+{
+    std::array<std::uint8_t, 256> out{};
+    for (std::uint16_t x = 0; x < 256; x++)
+    {
+        std::uint8_t inverse = 1;
+        std::uint8_t power = std::uint8_t(x);
+        for (std::uint8_t exponent = 254; exponent > 0; exponent = std::uint8_t(exponent >> 1U))
+        {
+            if ((exponent & 1U) != 0)
+            {
+                inverse = multiply(inverse, power);
+            }
+            power = multiply(power, power);
+        }
+        inverse = (x == 0) ? 0 : inverse;
+        out[x] = std::uint8_t(inverse ^ rotateLeft(inverse, 1) ^ rotateLeft(inverse, 2) ^ rotateLeft(inverse, 3) ^
+                              rotateLeft(inverse, 4) ^ 0x63U);
+    }
+    return out;
+}
+
+constexpr std::array<std::uint8_t, 256> SBox = makeSBox();
+
+/**
+ * Combines SubBytes and MixColumns for one column; the other three tables of the classic T-table implementation
+ * are rotations of this one, which are computed on the fly to keep the ROM footprint at 1 KB.
+ */
+constexpr std::array<std::uint32_t, 256> makeTable()
+{
+    std::array<std::uint32_t, 256> out{};
+    for (std::uint16_t x = 0; x < 256; x++)
+    {
+        const auto s = SBox[x];
+        out[x] = (std::uint32_t(multiply(s, 2)) << 24U) | (std::uint32_t(s) << 16U) |
+                 (std::uint32_t(s) << 8U) | std::uint32_t(multiply(s, 3));
+    }
+    return out;
+}
+
+constexpr std::array<std::uint32_t, 256> Table = makeTable();
+
+/**
+ * Zeroes the memory in a way that is not optimized out, for the key material.
+ */
+inline void wipe(void* data, std::size_t size)
+{
+    auto bytes = static_cast<volatile std::uint8_t*>(data);
+    while (size --> 0)
+    {
+        *bytes++ = 0;
+    }
+}
+
+}
+
+/**
+ * Table-based software implementation of the AES block encryption; see @ref IBlockCipher.
+ * Uses 1 KB of constant tables and about 250 bytes of RAM for the key schedule.
+ */
+class SoftwareCipher final : public IBlockCipher
+{
+    static constexpr std::uint8_t MaxRounds = 14;
+
+    std::array<std::uint32_t, 4U * (MaxRounds + 1U)> round_keys_{};
+    std::uint8_t rounds_ = 0;
+
+    static std::uint32_t rotateRight(std::uint32_t x, std::uint8_t n)
+    {
+        return (x >> n) | (x << (32U - n));
+    }
+
+    static std::uint32_t subWord(std::uint32_t x)
+    {
+        return (std::uint32_t(detail::SBox[x >> 24U]) << 24U) |
+               (std::uint32_t(detail::SBox[(x >> 16U) & 0xFFU]) << 16U) |
+               (std::uint32_t(detail::SBox[(x >> 8U) & 0xFFU]) << 8U) |
+               std::uint32_t(detail::SBox[x & 0xFFU]);
+    }
+
+    static std::uint32_t load(const std::uint8_t* data)
+    {
+        return (std::uint32_t(data[0]) << 24U) | (std::uint32_t(data[1]) << 16U) |
+               (std::uint32_t(data[2]) << 8U) | std::uint32_t(data[3]);
+    }
+
+    static void store(std::uint32_t x, std::uint8_t* data)
+    {
+        data[0] = std::uint8_t(x >> 24U);
+        data[1] = std::uint8_t(x >> 16U);
+        data[2] = std::uint8_t(x >> 8U);
+        data[3] = std::uint8_t(x);
+    }
+
+    static std::uint32_t mixColumn(std::uint32_t a, std::uint32_t b, std::uint32_t c, std::uint32_t d)
+    {
+        return detail::Table[a >> 24U] ^
+               rotateRight(detail::Table[(b >> 16U) & 0xFFU], 8) ^
+               rotateRight(detail::Table[(c >> 8U) & 0xFFU], 16) ^
+               rotateRight(detail::Table[d & 0xFFU], 24);
+    }
+
+    static std::uint32_t substituteColumn(std::uint32_t a, std::uint32_t b, std::uint32_t c, std::uint32_t d)
+    {
+        return (std::uint32_t(detail::SBox[a >> 24U]) << 24U) |
+               (std::uint32_t(detail::SBox[(b >> 16U) & 0xFFU]) << 16U) |
+               (std::uint32_t(detail::SBox[(c >> 8U) & 0xFFU]) << 8U) |
+               std::uint32_t(detail::SBox[d & 0xFFU]);
+    }
+
+public:
+    bool setKey(const std::uint8_t* key, std::uint8_t key_size) override
+    {
+        if ((key_size != 16) && (key_size != 24) && (key_size != 32))
+        {
+            return false;
+        }
+        const std::uint8_t nk = std::uint8_t(key_size / 4U);
+        rounds_ = std::uint8_t(nk + 6U);
+        for (std::uint8_t i = 0; i < nk; i++)
+        {
+            round_keys_[i] = load(key + 4U * i);
+        }
+        std::uint8_t rcon = 1;
+        for (std::uint8_t i = nk; i < (4U * (rounds_ + 1U)); i++)
+        {
+            auto temp = round_keys_[i - 1U];
+            if ((i % nk) == 0)
+            {
+                temp = subWord(rotateRight(temp, 24)) ^ (std::uint32_t(rcon) << 24U);
+                rcon = detail::multiply(rcon, 2);
+            }
+            else if ((nk > 6) && ((i % nk) == 4))
+            {
+                temp = subWord(temp);
+            }
+            round_keys_[i] = round_keys_[i - nk] ^ temp;
+        }
+        return true;
+    }
+
+    void encryptBlock(const std::uint8_t* in, std::uint8_t* out) const
+    {
+        auto rk = round_keys_.data();
+        std::uint32_t s0 = load(in +  0) ^ rk[0];
+        std::uint32_t s1 = load(in +  4) ^ rk[1];
+        std::uint32_t s2 = load(in +  8) ^ rk[2];
+        std::uint32_t s3 = load(in + 12) ^ rk[3];
+        for (std::uint8_t round = 1; round < rounds_; round++)
+        {
+            rk += 4;
+            const auto t0 = mixColumn(s0, s1, s2, s3) ^ rk[0];
+            const auto t1 = mixColumn(s1, s2, s3, s0) ^ rk[1];
+            const auto t2 = mixColumn(s2, s3, s0, s1) ^ rk[2];
+            const auto t3 = mixColumn(s3, s0, s1, s2) ^ rk[3];
+            s0 = t0;
+            s1 = t1;
+            s2 = t2;
+            s3 = t3;
+        }
+        rk += 4;
+        store(substituteColumn(s0, s1, s2, s3) ^ rk[0], out +  0);
+        store(substituteColumn(s1, s2, s3, s0) ^ rk[1], out +  4);
+        store(substituteColumn(s2, s3, s0, s1) ^ rk[2], out +  8);
+        store(substituteColumn(s3, s0, s1, s2) ^ rk[3], out + 12);
+    }
+
+    bool encryptBlocks(const std::uint8_t* in, std::uint8_t* out, std::size_t count) override
+    {
+        if (rounds_ == 0)
+        {
+            return false;                       // No key
+        }
+        for (std::size_t i = 0; i < count; i++)
+        {
+            encryptBlock(in + i * BlockSize, out + i * BlockSize);
+        }
+        return true;
+    }
+
+    void clearKey() override
+    {
+        detail::wipe(round_keys_.data(), sizeof(round_keys_));
+        rounds_ = 0;
+    }
+};
+
+/**
+ * Decrypts images encrypted with AES in the counter mode (CTR) on the fly, so that the decrypted image never
+ * has to be kept anywhere but in the storage. The key is requested from @ref kocherga::IPlatform::getDecryptionKey()
+ * by the ID specified in the header of the image. Register an instance with
+ * @ref kocherga::BootloaderController::addStreamFilter(). The images are generated by the script pack_image.py.
+ *
+ * The format is as follows; all values are little-endian:
+ *
+ *      Offset  Type        Description
+ *      0       uint8[8]    Magic "KAESCTR0"
+ *      8       uint8       Key ID
+ *      9       uint8       Key size, in bytes: 16, 24, or 32
+ *      10      uint16      Reserved, zero
+ *      12      uint32      Size of the decrypted image, in bytes
+ *      16      uint8[16]   Initial counter block, incremented as a big-endian 128-bit integer after every block
+ *      32      uint8[]     The encrypted image
+ *
+ * The initial counter block shall never be reused with the same key, so it is generated randomly for every image.
+ * The counter mode provides confidentiality but not authenticity: the image is still verified by its CRC,
+ * which protects against corruption but not against deliberate modifications.
+ * The decrypted image may be encoded further, e.g., compressed; the images shall be compressed before they are
+ * encrypted, because the encrypted data is not compressible.
+ */
+class DecryptionFilter final : public kocherga::IStreamFilter
+{
+public:
+    /// The number of blocks of the key stream that are generated at once; see IBlockCipher::encryptBlocks().
+    static constexpr std::uint8_t BatchBlocks = 16;
+
+private:
+    static constexpr std::uint8_t HeaderSize = 32;
+    static constexpr std::uint16_t BatchSize = std::uint16_t(BatchBlocks * BlockSize);
+    static constexpr std::uint8_t MaxKeySize = 32;
+
+    enum class Stage : std::uint8_t
+    {
+        Header,
+        Payload,
+        Done
+    };
+
+    kocherga::IPlatform& platform_;
+    IBlockCipher& cipher_;
+
+    kocherga::IDownloadSink* output_ = nullptr;
+
+    Stage stage_ = Stage::Header;
+    std::array<std::uint8_t, HeaderSize> header_{};
+    std::uint8_t header_size_ = 0;
+
+    std::uint32_t output_size_ = 0;
+    std::uint32_t output_offset_ = 0;
+
+    std::array<std::uint8_t, BlockSize> counter_{};
+    std::array<std::uint8_t, BatchSize> counters_{};
+    std::array<std::uint8_t, BatchSize> key_stream_{};
+    std::uint16_t key_stream_offset_ = BatchSize;       ///< The key stream is used up to this offset
+    std::array<std::uint8_t, BatchSize> plaintext_{};
+
+    /**
+     * The key stream and the counter are wiped along with the key schedule when the stream ends, whether it has
+     * succeeded or not; see abortStream(). This is also done when the next stream begins, just in case.
+     */
+    void clearKey()
+    {
+        cipher_.clearKey();
+        detail::wipe(key_stream_.data(), key_stream_.size());
+        detail::wipe(counters_.data(), counters_.size());
+        detail::wipe(counter_.data(), counter_.size());
+        key_stream_offset_ = BatchSize;
+    }
+
+    void incrementCounter()
+    {
+        for (std::uint8_t i = BlockSize; i > 0; i--)
+        {
+            counter_[i - 1U]++;
+            if (counter_[i - 1U] != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    std::int16_t generateKeyStream()
+    {
+        const auto remaining = output_size_ - output_offset_;
+        const auto blocks = std::uint8_t(std::min<std::uint32_t>(BatchBlocks, (remaining + BlockSize - 1U) / BlockSize));
+        for (std::uint8_t i = 0; i < blocks; i++)
+        {
+            std::copy(counter_.begin(), counter_.end(), counters_.begin() + i * BlockSize);
+            incrementCounter();
+        }
+        if (!cipher_.encryptBlocks(counters_.data(), key_stream_.data(), blocks))
+        {
+            return -ErrCipherFailure;
+        }
+        key_stream_offset_ = std::uint16_t(BatchSize - blocks * BlockSize);
+        if (key_stream_offset_ > 0)             // The last batch is incomplete; moving it to the end
+        {
+            std::copy_backward(key_stream_.begin(), key_stream_.begin() + blocks * BlockSize, key_stream_.end());
+        }
+        return ErrOK;
+    }
+
+    std::int16_t processHeader()
+    {
+        const auto key_id = header_[8];
+        const auto key_size = header_[9];
+        output_size_ = 0;
+        for (std::uint8_t i = 0; i < 4; i++)
+        {
+            output_size_ |= std::uint32_t(header_[12U + i]) << (i * 8U);
+        }
+        std::copy(header_.begin() + 16, header_.end(), counter_.begin());
+        if (key_size > MaxKeySize)
+        {
+            return -ErrInvalidImage;
+        }
+
+        std::array<std::uint8_t, MaxKeySize> key{};
+        bool available = false;
+        {
+            kocherga::detail::MutexLocker mlock(platform_);
+            available = platform_.getDecryptionKey(key_id, key.data(), key_size);
+        }
+        const bool accepted = available && cipher_.setKey(key.data(), key_size);
+        detail::wipe(key.data(), key.size());
+        if (!accepted)
+        {
+            KOCHERGA_TRACE("Decryption key %u of %u bytes is not available\n", unsigned(key_id), unsigned(key_size));
+            return -ErrKeyNotAvailable;
+        }
+
+        stage_ = (output_size_ > 0) ? Stage::Payload : Stage::Done;
+        return output_->handleImageSizeHint(output_size_);
+    }
+
+    std::int16_t processPayload(const std::uint8_t* data, std::uint16_t size)
+    {
+        if (key_stream_offset_ >= BatchSize)
+        {
+            if (const auto res = generateKeyStream(); res < 0)
+            {
+                return res;
+            }
+        }
+        for (std::uint16_t i = 0; i < size; i++)
+        {
+            plaintext_[i] = std::uint8_t(data[i] ^ key_stream_[key_stream_offset_ + i]);
+        }
+        key_stream_offset_ = std::uint16_t(key_stream_offset_ + size);
+        output_offset_ += size;
+        if (output_offset_ >= output_size_)
+        {
+            stage_ = Stage::Done;
+        }
+        return output_->handleNextDataChunk(plaintext_.data(), size);
+    }
+
+    std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        const auto end = bytes + size;
+        while (bytes < end)
+        {
+            std::int16_t res = ErrOK;
+            switch (stage_)
+            {
+            case Stage::Header:
+            {
+                header_[header_size_++] = *bytes++;
+                if (header_size_ >= HeaderSize)
+                {
+                    res = processHeader();
+                }
+                break;
+            }
+            case Stage::Payload:
+            {
+                const auto key_stream_left = std::uint32_t((key_stream_offset_ < BatchSize) ?
+                                                           (BatchSize - key_stream_offset_) : BatchSize);
+                const auto n = std::uint16_t(std::min({key_stream_left,
+                                                       output_size_ - output_offset_,
+                                                       std::uint32_t(end - bytes)}));
+                res = processPayload(bytes, n);
+                bytes += n;
+                break;
+            }
+            case Stage::Done:
+            {
+                res = -ErrInvalidImage;         // Trailing garbage
+                break;
+            }
+            }
+
+            if (res < 0)
+            {
+                clearKey();
+                return res;
+            }
+        }
+        return std::int16_t(size);
+    }
+
+    std::int16_t handleImageSizeHint(std::uint32_t image_size) override
+    {
+        (void) image_size;                      // This is the size of the encrypted image, which is irrelevant
+        return ErrOK;
+    }
+
+public:
+    /**
+     * The cipher can be either a hardware AES engine or an instance of @ref SoftwareCipher.
+     */
+    DecryptionFilter(kocherga::IPlatform& platform, IBlockCipher& cipher) :
+        platform_(platform),
+        cipher_(cipher)
+    { }
+
+    Magic getMagic() const override
+    {
+        return {{'K', 'A', 'E', 'S', 'C', 'T', 'R', '0'}};
+    }
+
+    std::int16_t beginStream(kocherga::IDownloadSink& output, const kocherga::IReferenceImage& reference) override
+    {
+        (void) reference;
+        output_ = &output;
+        stage_ = Stage::Header;
+        header_size_ = 0;
+        output_size_ = 0;
+        output_offset_ = 0;
+        clearKey();
+        return ErrOK;
+    }
+
+    std::int16_t endStream() override
+    {
+        clearKey();
+        return (stage_ == Stage::Done) ? ErrOK : -ErrInvalidImage;
+    }
+
+    void abortStream() override
+    {
+        clearKey();
+    }
+};
+
+}
@@ -0,0 +1,254 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <kocherga.hpp>
+
+
+namespace kocherga_delta
+{
+/**
+ * Error codes specific to this module.
+ */
+static constexpr std::int16_t ErrOK                             = 0;
+static constexpr std::int16_t ErrInvalidPatch                   = 5001;
+static constexpr std::int16_t ErrBaseImageMismatch              = 5002;
+static constexpr std::int16_t ErrBaseImageReadFailure           = 5003;
+
+/**
+ * Applies a delta patch to the installed application image on the fly, so that only the differences between
+ * the images need to be transferred. Register an instance with @ref kocherga::BootloaderController::addStreamFilter().
+ * The patches are generated by the script pack_image.py.
+ *
+ * The installed image must remain intact while the new one is written, otherwise a power loss during the upgrade
+ * would leave the device with neither image; therefore, the patches can be applied only with the A/B dual-slot
+ * configuration (see @ref kocherga::SecondaryROMRole::AlternateSlot). The patch specifies the CRC of the image it
+ * was generated against, and it is rejected if the installed image is different.
+ * The memory footprint is bounded by the size of the copy buffer, regardless of the size of the image.
+ *
+ * The patch format is as follows; all values are little-endian:
+ *
+ *      Offset  Type        Description
+ *      0       uint8[8]    Magic "KDelta00"
+ *      8       uint64      CRC of the base image (AppInfo::image_crc)
+ *      16      uint32      Size of the resulting image, in bytes
+ *      20      uint32      Reserved, zero
+ *      24      records     Until the resulting image is complete
+ *
+ * Each record begins with an unsigned LEB128 varint (length << 1) | kind, where length is never zero:
+ *      kind 0 - literal, followed by the specified number of bytes of the resulting image;
+ *      kind 1 - copy, followed by a zigzag-encoded signed LEB128 varint that specifies the offset of the source data
+ *               in the base image relative to the current offset in the resulting image.
+ */
+class PatchFilter final : public kocherga::IStreamFilter
+{
+public:
+    static constexpr std::uint16_t CopyBufferSize = 256;
+
+private:
+    static constexpr std::uint8_t HeaderSize = 24;
+
+    enum class Stage : std::uint8_t
+    {
+        Header,
+        RecordTag,
+        CopyOffset,
+        Literal,
+        Done
+    };
+
+    kocherga::IDownloadSink* output_ = nullptr;
+    const kocherga::IReferenceImage* reference_ = nullptr;
+    std::uint32_t base_size_ = 0;
+
+    Stage stage_ = Stage::Header;
+    std::array<std::uint8_t, HeaderSize> header_{};
+    std::uint8_t header_size_ = 0;
+
+    kocherga::detail::RecordReader records_;
+
+    std::array<std::uint8_t, CopyBufferSize> copy_buffer_{};
+
+    template <typename T>
+    static T readLittleEndian(const std::uint8_t* ptr)
+    {
+        T out = 0;
+        for (std::uint8_t i = 0; i < sizeof(T); i++)
+        {
+            out = T(out | (T(ptr[i]) << (i * 8U)));
+        }
+        return out;
+    }
+
+    std::int16_t processHeader()
+    {
+        const auto base_crc = readLittleEndian<std::uint64_t>(&header_[8]);
+        const auto output_size = readLittleEndian<std::uint32_t>(&header_[16]);
+
+        const auto base = reference_->getAppInfo();
+        if (!base || (base->image_crc != base_crc))
+        {
+            return -ErrBaseImageMismatch;
+        }
+        base_size_ = base->image_size;
+
+        records_.reset(output_size);
+        stage_ = records_.isImageComplete() ? Stage::Done : Stage::RecordTag;
+        return output_->handleImageSizeHint(output_size);
+    }
+
+    std::int16_t processRecordTag()
+    {
+        if (!records_.beginRecord())
+        {
+            return -ErrInvalidPatch;
+        }
+        stage_ = (records_.getRecordKind() != 0) ? Stage::CopyOffset : Stage::Literal;
+        return ErrOK;
+    }
+
+    std::int16_t processCopy()
+    {
+        const auto length = records_.getRecordLength();
+        const auto zigzag = records_.takeVarint();
+        const auto magnitude = std::int64_t(zigzag >> 1U);
+        const auto relative_offset = ((zigzag & 1U) != 0) ? (-magnitude - 1) : magnitude;
+        const auto source = std::int64_t(records_.getOutputOffset()) + relative_offset;
+        if ((source < 0) || ((source + length) > std::int64_t(base_size_)))
+        {
+            return -ErrInvalidPatch;
+        }
+
+        for (std::uint32_t i = 0; i < length;)
+        {
+            const auto size = std::uint16_t(std::min<std::uint32_t>(CopyBufferSize, length - i));
+            const auto res = reference_->read(std::size_t(source) + i, copy_buffer_.data(), size);
+            if (res != std::int16_t(size))
+            {
+                return -ErrBaseImageReadFailure;
+            }
+            if (const auto out = output_->handleNextDataChunk(copy_buffer_.data(), size); out < 0)
+            {
+                return out;
+            }
+            i += size;
+        }
+
+        stage_ = records_.completeRecord() ? Stage::RecordTag : Stage::Done;
+        return ErrOK;
+    }
+
+    std::int16_t processLiteral(const std::uint8_t* data, std::uint16_t size)
+    {
+        records_.advance(size);
+        if (records_.getRecordLength() == 0)
+        {
+            stage_ = records_.completeRecord() ? Stage::RecordTag : Stage::Done;
+        }
+        return output_->handleNextDataChunk(data, size);
+    }
+
+    std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        const auto end = bytes + size;
+        while (bytes < end)
+        {
+            std::int16_t res = ErrOK;
+            switch (stage_)
+            {
+            case Stage::Header:
+            {
+                header_[header_size_++] = *bytes++;
+                if (header_size_ >= HeaderSize)
+                {
+                    res = processHeader();
+                }
+                break;
+            }
+            case Stage::RecordTag:
+            {
+                const auto varint = records_.accumulateVarint(*bytes++);
+                res = (varint < 0) ? -ErrInvalidPatch : ((varint > 0) ? processRecordTag() : ErrOK);
+                break;
+            }
+            case Stage::CopyOffset:
+            {
+                const auto varint = records_.accumulateVarint(*bytes++);
+                res = (varint < 0) ? -ErrInvalidPatch : ((varint > 0) ? processCopy() : ErrOK);
+                break;
+            }
+            case Stage::Literal:
+            {
+                const auto n = std::uint16_t(std::min(records_.getRecordLength(), std::uint32_t(end - bytes)));
+                res = processLiteral(bytes, n);
+                bytes += n;
+                break;
+            }
+            case Stage::Done:
+            {
+                res = -ErrInvalidPatch;         // Trailing garbage
+                break;
+            }
+            }
+
+            if (res < 0)
+            {
+                return res;
+            }
+        }
+        return std::int16_t(size);
+    }
+
+    std::int16_t handleImageSizeHint(std::uint32_t image_size) override
+    {
+        (void) image_size;                      // This is the size of the patch, which is irrelevant
+        return ErrOK;
+    }
+
+public:
+    Magic getMagic() const override
+    {
+        return {{'K', 'D', 'e', 'l', 't', 'a', '0', '0'}};
+    }
+
+    std::int16_t beginStream(kocherga::IDownloadSink& output, const kocherga::IReferenceImage& reference) override
+    {
+        output_ = &output;
+        reference_ = &reference;
+        stage_ = Stage::Header;
+        header_size_ = 0;
+        records_.reset(0);
+        return ErrOK;
+    }
+
+    std::int16_t endStream() override
+    {
+        return (stage_ == Stage::Done) ? ErrOK : -ErrInvalidPatch;
+    }
+};
+
+}
@@ -0,0 +1,616 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <kocherga.hpp>
+
+
+namespace kocherga_ed25519
+{
+/**
+ * SHA-512 as specified in FIPS 180-4. The message schedule is computed in place, so that only 128 bytes of it
+ * are kept on the stack.
+ */
+class SHA512 final
+{
+public:
+    static constexpr std::uint8_t BlockSize  = 128;
+    static constexpr std::uint8_t DigestSize = 64;
+
+    using Digest = std::array<std::uint8_t, DigestSize>;
+
+private:
+    static constexpr std::array<std::uint64_t, 8> InitialState{{
+        0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+        0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+    }};
+
+    static constexpr std::array<std::uint64_t, 80> RoundConstants{{
+        0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+        0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+        0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+        0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+        0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+        0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+        0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+        0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+        0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+        0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+        0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+        0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+        0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+        0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+        0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+        0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+        0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+        0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+        0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+        0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+    }};
+
+    std::array<std::uint64_t, 8> state_ = InitialState;
+    std::array<std::uint8_t, BlockSize> block_{};
+    std::uint8_t fill_ = 0;
+    std::uint64_t size_ = 0;
+
+    static std::uint64_t rotateRight(std::uint64_t x, std::uint8_t n)
+    {
+        return (x >> n) | (x << (64U - n));
+    }
+
+    void compress(const std::uint8_t* block)
+    {
+        std::array<std::uint64_t, 16> w{};
+        for (std::uint8_t i = 0; i < 16; i++)
+        {
+            for (std::uint8_t k = 0; k < 8; k++)
+            {
+                w[i] = (w[i] << 8U) | block[i * 8U + k];
+            }
+        }
+
+        auto s = state_;
+        for (std::uint8_t i = 0; i < 80; i++)
+        {
+            if (i >= 16)
+            {
+                const auto w2  = w[(i - 2U) & 15U];
+                const auto w15 = w[(i - 15U) & 15U];
+                w[i & 15U] += (rotateRight(w2, 19) ^ rotateRight(w2, 61) ^ (w2 >> 6U)) + w[(i - 7U) & 15U] +
+                              (rotateRight(w15, 1) ^ rotateRight(w15, 8) ^ (w15 >> 7U));
+            }
+            const auto t1 = s[7] + (rotateRight(s[4], 14) ^ rotateRight(s[4], 18) ^ rotateRight(s[4], 41)) +
+                            ((s[4] & s[5]) ^ (~s[4] & s[6])) + RoundConstants[i] + w[i & 15U];
+            const auto t2 = (rotateRight(s[0], 28) ^ rotateRight(s[0], 34) ^ rotateRight(s[0], 39)) +
+                            ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+            s[7] = s[6];
+            s[6] = s[5];
+            s[5] = s[4];
+            s[4] = s[3] + t1;
+            s[3] = s[2];
+            s[2] = s[1];
+            s[1] = s[0];
+            s[0] = t1 + t2;
+        }
+        for (std::uint8_t i = 0; i < 8; i++)
+        {
+            state_[i] += s[i];
+        }
+    }
+
+public:
+    void reset()
+    {
+        state_ = InitialState;
+        fill_ = 0;
+        size_ = 0;
+    }
+
+    void update(const void* data, std::size_t size)
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        size_ += size;
+        if (fill_ > 0)
+        {
+            const auto n = std::min<std::size_t>(size, BlockSize - fill_);
+            std::memcpy(&block_[fill_], bytes, n);
+            fill_ = std::uint8_t(fill_ + n);
+            bytes += n;
+            size -= n;
+            if (fill_ < BlockSize)
+            {
+                return;
+            }
+            compress(block_.data());
+            fill_ = 0;
+        }
+        for (; size >= BlockSize; size -= BlockSize)
+        {
+            compress(bytes);
+            bytes += BlockSize;
+        }
+        if (size > 0)
+        {
+            std::memcpy(block_.data(), bytes, size);
+            fill_ = std::uint8_t(size);
+        }
+    }
+
+    /**
+     * The object shall be reset before it is used again.
+     */
+    Digest finalize()
+    {
+        const std::uint64_t size_bits = size_ * 8U;
+        block_[fill_++] = 0x80;
+        if (fill_ > (BlockSize - 16U))
+        {
+            std::fill(block_.begin() + fill_, block_.end(), 0);
+            compress(block_.data());
+            fill_ = 0;
+        }
+        std::fill(block_.begin() + fill_, block_.end(), 0);
+        for (std::uint8_t i = 0; i < 8; i++)
+        {
+            block_[BlockSize - 1U - i] = std::uint8_t(size_bits >> (8U * i));
+        }
+        compress(block_.data());
+
+        Digest out{};
+        for (std::uint8_t i = 0; i < DigestSize; i++)
+        {
+            out[i] = std::uint8_t(state_[i / 8U] >> (56U - 8U * (i % 8U)));
+        }
+        return out;
+    }
+};
+
+namespace detail
+{
+/**
+ * The arithmetic follows TweetNaCl: an element of GF(2^255-19) is kept in sixteen signed 16-bit limbs,
+ * and the points of the curve in the extended twisted Edwards coordinates (X, Y, Z, T).
+ * The verification deals with public data only, so the code is not required to run in constant time.
+ */
+using FieldElement = std::array<std::int64_t, 16>;
+using Point = std::array<FieldElement, 4>;
+using Scalar = std::array<std::uint8_t, 32>;
+
+/// -121665/121666
+constexpr FieldElement D{{
+    0x78A3, 0x1359, 0x4DCA, 0x75EB, 0xD8AB, 0x4141, 0x0A4D, 0x0070,
+    0xE898, 0x7779, 0x4079, 0x8CC7, 0xFE73, 0x2B6F, 0x6CEE, 0x5203
+}};
+
+/// 2 * D
+constexpr FieldElement D2{{
+    0xF159, 0x26B2, 0x9B94, 0xEBD6, 0xB156, 0x8283, 0x149A, 0x00E0,
+    0xD130, 0xEEF3, 0x80F2, 0x198E, 0xFCE7, 0x56DF, 0xD9DC, 0x2406
+}};
+
+/// sqrt(-1)
+constexpr FieldElement SqrtMinusOne{{
+    0xA0B0, 0x4A0E, 0x1B27, 0xC4EE, 0xE478, 0xAD2F, 0x1806, 0x2F43,
+    0xD7A7, 0x3DFB, 0x0099, 0x2B4D, 0xDF0B, 0x4FC1, 0x2480, 0x2B83
+}};
+
+/// The base point
+constexpr FieldElement BaseX{{
+    0xD51A, 0x8F25, 0x2D60, 0xC956, 0xA7B2, 0x9525, 0xC760, 0x692C,
+    0xDC5C, 0xFDD6, 0xE231, 0xC0A4, 0x53FE, 0xCD6E, 0x36D3, 0x2169
+}};
+constexpr FieldElement BaseY{{
+    0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+    0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666
+}};
+
+/// The order of the base point, little-endian
+constexpr Scalar Order{{
+    0xED, 0xD3, 0xF5, 0x5C, 0x1A, 0x63, 0x12, 0x58, 0xD6, 0x9C, 0xF7, 0xA2, 0xDE, 0xF9, 0xDE, 0x14,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+}};
+
+inline void carry(FieldElement& o)
+{
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        o[i] += 0x10000;
+        const std::int64_t c = o[i] >> 16;      // Arithmetic shift
+        if (i < 15)
+        {
+            o[i + 1U] += c - 1;
+        }
+        else
+        {
+            o[0] += 38 * (c - 1);
+        }
+        o[i] -= c * 0x10000;
+    }
+}
+
+/**
+ * Swaps the elements if the bit is set.
+ */
+inline void conditionalSwap(FieldElement& p, FieldElement& q, std::int64_t bit)
+{
+    const std::int64_t mask = -bit;
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        const auto t = mask & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+/**
+ * Fully reduced little-endian encoding.
+ */
+inline Scalar pack(const FieldElement& n)
+{
+    FieldElement t = n;
+    carry(t);
+    carry(t);
+    carry(t);
+    for (std::uint8_t j = 0; j < 2; j++)
+    {
+        FieldElement m{};
+        m[0] = t[0] - 0xFFED;
+        for (std::uint8_t i = 1; i < 15; i++)
+        {
+            m[i] = t[i] - 0xFFFF - ((m[i - 1U] >> 16) & 1);
+            m[i - 1U] &= 0xFFFF;
+        }
+        m[15] = t[15] - 0x7FFF - ((m[14] >> 16) & 1);
+        const auto borrow = (m[15] >> 16) & 1;
+        m[14] &= 0xFFFF;
+        conditionalSwap(t, m, 1 - borrow);
+    }
+    Scalar out{};
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        out[2U * i] = std::uint8_t(t[i] & 0xFF);
+        out[2U * i + 1U] = std::uint8_t(t[i] >> 8);
+    }
+    return out;
+}
+
+inline FieldElement unpack(const std::uint8_t* n)
+{
+    FieldElement o{};
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        o[i] = n[2U * i] + (std::int64_t(n[2U * i + 1U]) << 8);
+    }
+    o[15] &= 0x7FFF;
+    return o;
+}
+
+inline bool isEqual(const FieldElement& a, const FieldElement& b)
+{
+    return pack(a) == pack(b);
+}
+
+inline std::uint8_t getParity(const FieldElement& a)
+{
+    return std::uint8_t(pack(a)[0] & 1U);
+}
+
+inline FieldElement add(const FieldElement& a, const FieldElement& b)
+{
+    FieldElement o{};
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        o[i] = a[i] + b[i];
+    }
+    return o;
+}
+
+inline FieldElement subtract(const FieldElement& a, const FieldElement& b)
+{
+    FieldElement o{};
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        o[i] = a[i] - b[i];
+    }
+    return o;
+}
+
+inline FieldElement multiply(const FieldElement& a, const FieldElement& b)
+{
+    std::array<std::int64_t, 31> t{};
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        for (std::uint8_t j = 0; j < 16; j++)
+        {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+    FieldElement o{};
+    for (std::uint8_t i = 0; i < 15; i++)
+    {
+        t[i] += 38 * t[i + 16U];
+    }
+    std::copy_n(t.begin(), o.size(), o.begin());
+    carry(o);
+    carry(o);
+    return o;
+}
+
+inline FieldElement square(const FieldElement& a)
+{
+    return multiply(a, a);
+}
+
+/**
+ * a^(p-2)
+ */
+inline FieldElement invert(const FieldElement& a)
+{
+    FieldElement c = a;
+    for (int i = 253; i >= 0; i--)
+    {
+        c = square(c);
+        if ((i != 2) && (i != 4))
+        {
+            c = multiply(c, a);
+        }
+    }
+    return c;
+}
+
+/**
+ * a^((p-5)/8)
+ */
+inline FieldElement raiseTo2523(const FieldElement& a)
+{
+    FieldElement c = a;
+    for (int i = 250; i >= 0; i--)
+    {
+        c = square(c);
+        if (i != 1)
+        {
+            c = multiply(c, a);
+        }
+    }
+    return c;
+}
+
+/**
+ * p += q
+ */
+inline void addPoints(Point& p, const Point& q)
+{
+    const auto a = multiply(subtract(p[1], p[0]), subtract(q[1], q[0]));
+    const auto b = multiply(add(p[0], p[1]), add(q[0], q[1]));
+    const auto c = multiply(multiply(p[3], q[3]), D2);
+    auto d = multiply(p[2], q[2]);
+    d = add(d, d);
+    const auto e = subtract(b, a);
+    const auto f = subtract(d, c);
+    const auto g = add(d, c);
+    const auto h = add(b, a);
+    p[0] = multiply(e, f);
+    p[1] = multiply(h, g);
+    p[2] = multiply(g, f);
+    p[3] = multiply(e, h);
+}
+
+inline Scalar packPoint(const Point& p)
+{
+    const auto zi = invert(p[2]);
+    auto out = pack(multiply(p[1], zi));
+    out[31] = std::uint8_t(out[31] ^ (getParity(multiply(p[0], zi)) << 7U));
+    return out;
+}
+
+/**
+ * Returns [s]q.
+ */
+inline Point multiplyPoint(Point q, const std::uint8_t* s)
+{
+    Point p{{{}, {{1}}, {{1}}, {}}};
+    for (int i = 255; i >= 0; i--)
+    {
+        const std::int64_t bit = (s[i / 8] >> (i & 7)) & 1;
+        for (std::uint8_t k = 0; k < 4; k++)
+        {
+            conditionalSwap(p[k], q[k], bit);
+        }
+        addPoints(q, p);
+        addPoints(p, p);
+        for (std::uint8_t k = 0; k < 4; k++)
+        {
+            conditionalSwap(p[k], q[k], bit);
+        }
+    }
+    return p;
+}
+
+/**
+ * Decodes the point and negates it.
+ * @return false if the encoding is not valid
+ */
+inline bool unpackNegated(Point& r, const std::uint8_t* p)
+{
+    const FieldElement one{{1}};
+    r[2] = one;
+    r[1] = unpack(p);
+    auto num = square(r[1]);
+    auto den = multiply(num, D);
+    num = subtract(num, r[2]);
+    den = add(r[2], den);
+
+    const auto den2 = square(den);
+    const auto den4 = square(den2);
+    const auto den6 = multiply(den4, den2);
+    auto t = multiply(multiply(den6, num), den);
+    t = raiseTo2523(t);
+    t = multiply(multiply(multiply(t, num), den), den);
+    r[0] = multiply(t, den);
+
+    if (!isEqual(multiply(square(r[0]), den), num))
+    {
+        r[0] = multiply(r[0], SqrtMinusOne);
+    }
+    if (!isEqual(multiply(square(r[0]), den), num))
+    {
+        return false;
+    }
+    if (getParity(r[0]) == (p[31] >> 7U))
+    {
+        r[0] = subtract(FieldElement{}, r[0]);
+    }
+    r[3] = multiply(r[0], r[1]);
+    return true;
+}
+
+/**
+ * Reduces a 512-bit little-endian number modulo the order of the base point.
+ */
+inline Scalar reduce(const std::uint8_t* in)
+{
+    std::array<std::int64_t, 64> x{};
+    for (std::uint8_t i = 0; i < 64; i++)
+    {
+        x[i] = in[i];
+    }
+    for (int i = 63; i >= 32; i--)
+    {
+        std::int64_t c = 0;
+        int j = i - 32;
+        for (; j < (i - 12); j++)
+        {
+            x[std::size_t(j)] += c - 16 * x[std::size_t(i)] * Order[std::size_t(j - (i - 32))];
+            c = (x[std::size_t(j)] + 128) >> 8;
+            x[std::size_t(j)] -= c * 256;
+        }
+        x[std::size_t(j)] += c;
+        x[std::size_t(i)] = 0;
+    }
+    std::int64_t c = 0;
+    for (std::uint8_t j = 0; j < 32; j++)
+    {
+        x[j] += c - (x[31] >> 4) * Order[j];
+        c = x[j] >> 8;
+        x[j] &= 255;
+    }
+    for (std::uint8_t j = 0; j < 32; j++)
+    {
+        x[j] -= c * Order[j];
+    }
+    Scalar out{};
+    for (std::uint8_t i = 0; i < 32; i++)
+    {
+        x[i + 1U] += x[i] >> 8;
+        out[i] = std::uint8_t(x[i] & 255);
+    }
+    return out;
+}
+
+/**
+ * The signatures with S >= L are malleable, so they are rejected as required by RFC 8032.
+ */
+inline bool isScalarCanonical(const std::uint8_t* s)
+{
+    for (int i = 31; i >= 0; i--)
+    {
+        if (s[i] != Order[std::size_t(i)])
+        {
+            return s[i] < Order[std::size_t(i)];
+        }
+    }
+    return false;
+}
+
+}
+
+/**
+ * Verifies the HashEdDSA signatures, i.e., Ed25519ph with an empty context as specified in RFC 8032, section 5.1.
+ * The image is hashed with SHA-512 as it streams in, so it is never buffered nor read again,
+ * and the signature is then computed over the 64-byte hash.
+ *
+ * The signature is a 64-byte trailer that follows the image; see @ref kocherga::ISignatureVerifier.
+ * The images can be signed using the script `pack_image.py`:
+ *
+ *      pack_image.py sign --key <32-byte private key, hex> firmware.bin signed.bin
+ *
+ * The verification takes about 3 KB of stack.
+ */
+class SignatureVerifier final : public kocherga::ISignatureVerifier
+{
+public:
+    static constexpr std::uint8_t PublicKeySize = 32;
+    static constexpr std::uint8_t SignatureSize = 64;
+
+    using PublicKey = std::array<std::uint8_t, PublicKeySize>;
+
+private:
+    const PublicKey public_key_;
+    SHA512 hash_;
+
+public:
+    explicit SignatureVerifier(const PublicKey& public_key) : public_key_(public_key) { }
+
+    std::uint8_t getSignatureSize() const override { return SignatureSize; }
+
+    void reset() override { hash_.reset(); }
+
+    void update(const void* data, std::size_t size) override { hash_.update(data, size); }
+
+    bool verify(const std::uint8_t* signature) override
+    {
+        const auto prehash = hash_.finalize();
+        hash_.reset();
+
+        const auto s = &signature[SignatureSize / 2U];
+        detail::Point a{};
+        if (!detail::isScalarCanonical(s) || !detail::unpackNegated(a, public_key_.data()))
+        {
+            return false;
+        }
+
+        // k = SHA-512(dom2(1, "") || R || A || PH(M))
+        static const std::uint8_t Domain[] = "SigEd25519 no Ed25519 collisions\x01";   // The null is the context size
+        SHA512 h;
+        h.update(&Domain[0], sizeof(Domain));
+        h.update(signature, SignatureSize / 2U);
+        h.update(public_key_.data(), public_key_.size());
+        h.update(prehash.data(), prehash.size());
+        const auto k = detail::reduce(h.finalize().data());
+
+        // [S]B - [k]A shall be equal to R
+        auto p = detail::multiplyPoint(a, k.data());
+        detail::addPoints(p, detail::multiplyPoint(detail::Point{{detail::BaseX,
+                                                                  detail::BaseY,
+                                                                  detail::FieldElement{{1}},
+                                                                  detail::multiply(detail::BaseX, detail::BaseY)}},
+                                                   s));
+        const auto r = detail::packPoint(p);
+        return std::equal(r.begin(), r.end(), signature);
+    }
+};
+
+}
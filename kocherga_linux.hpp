@@ -0,0 +1,309 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <kocherga.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <mtd/mtd-user.h>
+
+
+namespace kocherga_linux
+{
+/**
+ * Error codes specific to this module.
+ */
+static constexpr std::int16_t ErrOK                             = 0;
+static constexpr std::int16_t ErrOpenFailed                     = 8001;
+static constexpr std::int16_t ErrInvalidSize                    = 8002;
+static constexpr std::int16_t ErrIOFailure                      = 8003;
+static constexpr std::int16_t ErrSyncFailed                     = 8004;
+static constexpr std::int16_t ErrEraseFailed                    = 8005;
+
+/**
+ * ROM backend for embedded Linux systems that keeps the application image in a regular file, a block device,
+ * or an MTD character device (e.g., /dev/mtd3). The first size bytes of the file are used.
+ *
+ * The file descriptor is kept open between the operations. The storage is read through a read-only shared mapping
+ * of the file where the file supports it (MTD devices usually do not), otherwise with pread().
+ * The data is written with pwrite() and synchronized only once, in endUpgrade(), rather than after every write.
+ * If the power is lost before that, the unsynchronized data may be lost even if the upgrade journal refers to it;
+ * this is safe because the journaled data is read back and verified before the download is resumed.
+ *
+ * MTD devices are detected automatically. Their erase blocks are reported as sectors, so that the controller
+ * erases them before writing as required (see @ref kocherga::IROMBackend::getSectorSize()). The write size of
+ * the device (the NAND page size) shall not exceed the buffer size of the controller, which is 1 KiB.
+ * A non-zero erase block size can be passed to emulate the same behavior on a regular file for testing;
+ * the blocks are then erased by filling them with 0xFF.
+ */
+class ROMBackend final : public kocherga::IROMBackend
+{
+    const std::size_t size_;
+    std::size_t erase_block_size_;
+
+    int fd_ = -1;
+    bool mtd_ = false;
+    const std::uint8_t* mapping_ = nullptr;
+    bool dirty_ = false;                            ///< Written since the last synchronization
+
+    std::int16_t beginUpgrade() override
+    {
+        return (fd_ >= 0) ? ErrOK : -kocherga::ErrInvalidState;
+    }
+
+    std::int16_t endUpgrade(bool success) override
+    {
+        (void) success;                             // The data is synchronized either way to keep the progress
+        if (dirty_)
+        {
+            dirty_ = false;
+            if (::fdatasync(fd_) < 0)
+            {
+                return -ErrSyncFailed;
+            }
+        }
+        return ErrOK;
+    }
+
+    std::int16_t write(std::size_t offset, const void* data, std::uint16_t size) override
+    {
+        if ((offset + size) > size_)
+        {
+            return -kocherga::ErrInvalidParams;
+        }
+        dirty_ = true;
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        std::uint16_t written = 0;
+        while (written < size)
+        {
+            const auto res = ::pwrite(fd_, bytes + written, std::size_t(size - written), ::off_t(offset + written));
+            if (res < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -ErrIOFailure;
+            }
+            if (res == 0)
+            {
+                return -ErrIOFailure;
+            }
+            written = std::uint16_t(written + res);
+        }
+        return std::int16_t(written);
+    }
+
+    std::size_t getSectorSize(std::size_t offset) const override
+    {
+        if ((erase_block_size_ == 0) || (offset >= size_) || ((offset % erase_block_size_) != 0))
+        {
+            return 0;
+        }
+        return erase_block_size_;
+    }
+
+    std::int16_t eraseSector(std::size_t offset) override
+    {
+        if (getSectorSize(offset) == 0)
+        {
+            return -kocherga::ErrInvalidParams;
+        }
+        if (mtd_)
+        {
+            ::erase_info_user erase{};
+            erase.start = std::uint32_t(offset);
+            erase.length = std::uint32_t(erase_block_size_);
+            return (::ioctl(fd_, MEMERASE, &erase) == 0) ? ErrOK : -ErrEraseFailed;
+        }
+
+        std::array<std::uint8_t, 256> erased{};
+        erased.fill(0xFF);
+        for (std::size_t i = 0; i < erase_block_size_; i += erased.size())
+        {
+            const auto n = std::uint16_t(std::min(erased.size(), erase_block_size_ - i));
+            if (write(offset + i, erased.data(), n) != n)
+            {
+                return -ErrEraseFailed;
+            }
+        }
+        return ErrOK;
+    }
+
+public:
+    /**
+     * @param size                  the size of the storage area, in bytes
+     * @param erase_block_size      if non-zero, the erase blocks of this size are emulated on a regular file;
+     *                              ignored for MTD devices, which report their own erase block size
+     */
+    explicit ROMBackend(std::size_t size, std::size_t erase_block_size = 0) :
+        size_(size),
+        erase_block_size_(erase_block_size)
+    { }
+
+    ~ROMBackend() override
+    {
+        close();
+    }
+
+    ROMBackend(const ROMBackend&) = delete;
+    ROMBackend& operator=(const ROMBackend&) = delete;
+
+    /**
+     * Opens the storage file. Regular files that are shorter than the storage area are extended with zeros;
+     * block and MTD devices that are smaller than the storage area are rejected with @ref ErrInvalidSize.
+     * @return 0 on success, negative on error
+     */
+    std::int16_t open(const char* path)
+    {
+        close();
+
+        fd_ = ::open(path, O_RDWR | O_CLOEXEC);
+        if (fd_ < 0)
+        {
+            return -ErrOpenFailed;
+        }
+
+        std::int16_t res = ErrOK;
+        ::mtd_info_user info{};
+        if (::ioctl(fd_, MEMGETINFO, &info) == 0)
+        {
+            mtd_ = true;
+            erase_block_size_ = info.erasesize;
+            if ((size_ > info.size) || (info.writesize > 1024U))
+            {
+                res = -ErrInvalidSize;
+            }
+        }
+        else
+        {
+            struct ::stat st{};
+            if (::fstat(fd_, &st) < 0)
+            {
+                res = -ErrOpenFailed;
+            }
+            else if (S_ISREG(st.st_mode))
+            {
+                if ((std::size_t(st.st_size) < size_) && (::ftruncate(fd_, ::off_t(size_)) < 0))
+                {
+                    res = -ErrInvalidSize;
+                }
+            }
+            else if (S_ISBLK(st.st_mode))
+            {
+                std::uint64_t device_size = 0;
+                if ((::ioctl(fd_, BLKGETSIZE64, &device_size) < 0) || (device_size < size_))
+                {
+                    res = -ErrInvalidSize;          // Accessing the mapping past the end of the device raises SIGBUS
+                }
+            }
+        }
+        if ((res == ErrOK) && (erase_block_size_ > 0) && ((size_ % erase_block_size_) != 0))
+        {
+            res = -ErrInvalidSize;                  // The last erase block would be shared with something else
+        }
+        if (res < 0)
+        {
+            close();
+            return res;
+        }
+
+        void* const mapping = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (mapping != MAP_FAILED)
+        {
+            mapping_ = static_cast<const std::uint8_t*>(mapping);
+        }
+        KOCHERGA_TRACE("ROM backend opened %s: %s, erase block %u, %s\n", path, mtd_ ? "MTD" : "file",
+                       unsigned(erase_block_size_), (mapping_ != nullptr) ? "mapped" : "not mapped");
+        return ErrOK;
+    }
+
+    void close()
+    {
+        if (mapping_ != nullptr)
+        {
+            (void) ::munmap(const_cast<std::uint8_t*>(mapping_), size_);
+            mapping_ = nullptr;
+        }
+        if (fd_ >= 0)
+        {
+            if (dirty_)
+            {
+                (void) ::fdatasync(fd_);
+                dirty_ = false;
+            }
+            (void) ::close(fd_);
+            fd_ = -1;
+        }
+        mtd_ = false;
+    }
+
+    bool isMTD() const { return mtd_; }
+
+    bool isMapped() const { return mapping_ != nullptr; }
+
+    std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const override
+    {
+        if (fd_ < 0)
+        {
+            return -kocherga::ErrInvalidState;
+        }
+        size = std::uint16_t(std::min<std::size_t>(size, size_ - std::min(offset, size_)));
+        if (mapping_ != nullptr)
+        {
+            std::memcpy(data, mapping_ + offset, size);
+            return std::int16_t(size);
+        }
+
+        auto bytes = static_cast<std::uint8_t*>(data);
+        std::uint16_t done = 0;
+        while (done < size)
+        {
+            const auto res = ::pread(fd_, bytes + done, std::size_t(size - done), ::off_t(offset + done));
+            if (res < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -ErrIOFailure;
+            }
+            if (res == 0)
+            {
+                break;
+            }
+            done = std::uint16_t(done + res);
+        }
+        return std::int16_t(done);
+    }
+};
+
+}
@@ -0,0 +1,301 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <kocherga.hpp>
+
+
+namespace kocherga_lz
+{
+/**
+ * Error codes specific to this module.
+ */
+static constexpr std::int16_t ErrOK                             = 0;
+static constexpr std::int16_t ErrInvalidStream                  = 6001;
+static constexpr std::int16_t ErrWindowTooLarge                 = 6002;
+
+/**
+ * Decompresses LZSS-compressed images on the fly, so that less data needs to be transferred over slow links.
+ * Register an instance with @ref kocherga::BootloaderController::addStreamFilter().
+ * The compressed images are generated by the script pack_image.py.
+ *
+ * The decoder keeps the last 2**WindowBits bytes of the decompressed image in RAM; streams compressed with a larger
+ * window are rejected. Larger windows improve the compression ratio slightly.
+ *
+ * The stream format is as follows; all values are little-endian:
+ *
+ *      Offset  Type        Description
+ *      0       uint8[8]    Magic "KLZSS000"
+ *      8       uint32      Size of the decompressed image, in bytes
+ *      12      uint8       Window size W, base-two logarithm, [8, 13]
+ *      13      uint8[3]    Reserved, zero
+ *      16      groups      Until the decompressed image is complete
+ *
+ * Each group begins with a flag byte followed by up to eight items, one per flag bit, starting from the least
+ * significant one. If the bit is zero, the item is a literal byte; otherwise, it is a back-reference to the data
+ * in the window encoded as a uint16 token:
+ *      (distance - 1) << (16 - W) | (length - 3)
+ * If the length field of the token has all bits set, it is followed by one byte that is added to the length.
+ */
+template <std::uint8_t WindowBits = 11>
+class DecompressionFilter final : public kocherga::IStreamFilter
+{
+    static_assert((WindowBits >= 8) && (WindowBits <= 13), "Invalid window size");
+
+    static constexpr std::uint8_t HeaderSize = 16;
+    static constexpr std::uint16_t MinMatchLength = 3;
+    static constexpr std::uint32_t WindowSize = 1UL << WindowBits;
+    static constexpr std::uint32_t WindowMask = WindowSize - 1U;
+
+    enum class Stage : std::uint8_t
+    {
+        Header,
+        Flags,
+        Literal,
+        TokenLow,
+        TokenHigh,
+        LengthExtension,
+        Done
+    };
+
+    kocherga::IDownloadSink* output_ = nullptr;
+
+    Stage stage_ = Stage::Header;
+    std::array<std::uint8_t, HeaderSize> header_{};
+    std::uint8_t header_size_ = 0;
+
+    std::uint8_t length_bits_ = 0;
+    std::uint8_t flags_ = 0;
+    std::uint8_t items_left_ = 0;                   ///< In the current group
+    std::uint16_t token_ = 0;
+
+    std::uint32_t output_size_ = 0;
+    std::uint32_t produced_ = 0;                    ///< Written into the window
+    std::uint32_t flushed_ = 0;                     ///< Delivered to the output
+
+    std::array<std::uint8_t, WindowSize> window_{};
+
+    /**
+     * Delivers the data in the window that has not been delivered yet.
+     */
+    std::int16_t flush()
+    {
+        while (flushed_ < produced_)
+        {
+            const auto begin = flushed_ & WindowMask;
+            const auto size = std::min(produced_ - flushed_, WindowSize - begin);
+            if (const auto res = output_->handleNextDataChunk(&window_[begin], std::uint16_t(size)); res < 0)
+            {
+                return res;
+            }
+            flushed_ += size;
+        }
+        return ErrOK;
+    }
+
+    std::int16_t put(std::uint8_t byte)
+    {
+        if ((produced_ - flushed_) >= WindowSize)
+        {
+            if (const auto res = flush(); res < 0)
+            {
+                return res;
+            }
+        }
+        window_[produced_ & WindowMask] = byte;
+        produced_++;
+        return ErrOK;
+    }
+
+    void completeItem()
+    {
+        if (produced_ >= output_size_)
+        {
+            stage_ = Stage::Done;
+        }
+        else
+        {
+            stage_ = (items_left_ > 0) ? nextItemStage() : Stage::Flags;
+        }
+    }
+
+    Stage nextItemStage()
+    {
+        items_left_--;
+        const bool match = (flags_ & 1U) != 0;
+        flags_ = std::uint8_t(flags_ >> 1U);
+        return match ? Stage::TokenLow : Stage::Literal;
+    }
+
+    std::int16_t processHeader()
+    {
+        output_size_ = std::uint32_t(header_[8]) | (std::uint32_t(header_[9]) << 8U) |
+                       (std::uint32_t(header_[10]) << 16U) | (std::uint32_t(header_[11]) << 24U);
+        const auto window_bits = header_[12];
+        if (window_bits < 8)
+        {
+            return -ErrInvalidStream;
+        }
+        if (window_bits > WindowBits)
+        {
+            return -ErrWindowTooLarge;
+        }
+        length_bits_ = std::uint8_t(16U - window_bits);
+
+        stage_ = (output_size_ > 0) ? Stage::Flags : Stage::Done;
+        return output_->handleImageSizeHint(output_size_);
+    }
+
+    std::int16_t copyMatch(std::uint16_t extension)
+    {
+        const auto length_mask = std::uint16_t((1U << length_bits_) - 1U);
+        const auto length = std::uint32_t(MinMatchLength + (token_ & length_mask) + extension);
+        const auto distance = std::uint32_t(token_ >> length_bits_) + 1U;
+        if ((distance > produced_) || (length > (output_size_ - produced_)))
+        {
+            return -ErrInvalidStream;
+        }
+
+        for (std::uint32_t i = 0; i < length; i++)
+        {
+            if (const auto res = put(window_[(produced_ - distance) & WindowMask]); res < 0)
+            {
+                return res;
+            }
+        }
+        completeItem();
+        return ErrOK;
+    }
+
+    std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        for (std::uint16_t i = 0; i < size; i++)
+        {
+            const auto byte = bytes[i];
+            std::int16_t res = ErrOK;
+            switch (stage_)
+            {
+            case Stage::Header:
+            {
+                header_[header_size_++] = byte;
+                if (header_size_ >= HeaderSize)
+                {
+                    res = processHeader();
+                }
+                break;
+            }
+            case Stage::Flags:
+            {
+                flags_ = byte;
+                items_left_ = 8;
+                stage_ = nextItemStage();
+                break;
+            }
+            case Stage::Literal:
+            {
+                res = put(byte);
+                completeItem();
+                break;
+            }
+            case Stage::TokenLow:
+            {
+                token_ = byte;
+                stage_ = Stage::TokenHigh;
+                break;
+            }
+            case Stage::TokenHigh:
+            {
+                token_ = std::uint16_t(token_ | (byte << 8U));
+                const auto length_mask = std::uint16_t((1U << length_bits_) - 1U);
+                if ((token_ & length_mask) == length_mask)
+                {
+                    stage_ = Stage::LengthExtension;
+                }
+                else
+                {
+                    res = copyMatch(0);
+                }
+                break;
+            }
+            case Stage::LengthExtension:
+            {
+                res = copyMatch(byte);
+                break;
+            }
+            case Stage::Done:
+            {
+                res = -ErrInvalidStream;        // Trailing garbage
+                break;
+            }
+            }
+
+            if (res < 0)
+            {
+                return res;
+            }
+        }
+
+        if (const auto res = flush(); res < 0)
+        {
+            return res;
+        }
+        return std::int16_t(size);
+    }
+
+    std::int16_t handleImageSizeHint(std::uint32_t image_size) override
+    {
+        (void) image_size;                      // This is the size of the compressed stream, which is irrelevant
+        return ErrOK;
+    }
+
+public:
+    Magic getMagic() const override
+    {
+        return {{'K', 'L', 'Z', 'S', 'S', '0', '0', '0'}};
+    }
+
+    std::int16_t beginStream(kocherga::IDownloadSink& output, const kocherga::IReferenceImage& reference) override
+    {
+        (void) reference;
+        output_ = &output;
+        stage_ = Stage::Header;
+        header_size_ = 0;
+        flags_ = 0;
+        items_left_ = 0;
+        output_size_ = 0;
+        produced_ = 0;
+        flushed_ = 0;
+        return ErrOK;
+    }
+
+    std::int16_t endStream() override
+    {
+        return (stage_ == Stage::Done) ? flush() : -ErrInvalidStream;
+    }
+};
+
+}
@@ -0,0 +1,636 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <kocherga.hpp>
+
+
+namespace kocherga_partitions
+{
+/**
+ * Error codes specific to this module.
+ */
+static constexpr std::int16_t ErrOK                             = 0;
+static constexpr std::int16_t ErrInvalidTable                   = 9001;
+static constexpr std::int16_t ErrUnknownPartition               = 9002;
+static constexpr std::int16_t ErrPartitionTooLarge              = 9003;
+static constexpr std::int16_t ErrPartitionCRCMismatch           = 9004;
+static constexpr std::int16_t ErrInvalidImage                   = 9005;
+
+/**
+ * The descriptor of a partition, as listed in the partition table and stored in the partition region.
+ */
+struct PartitionInfo
+{
+    std::uint64_t crc = 0;                  ///< CRC-64-WE of the contents of the partition
+    std::uint32_t size = 0;                 ///< Size of the contents, in bytes; a multiple of eight
+    std::uint8_t major_version = 0;
+    std::uint8_t minor_version = 0;
+
+    bool operator==(const PartitionInfo& rhs) const
+    {
+        return (crc == rhs.crc) && (size == rhs.size) &&
+               (major_version == rhs.major_version) && (minor_version == rhs.minor_version);
+    }
+
+    bool operator!=(const PartitionInfo& rhs) const { return !operator==(rhs); }
+};
+
+/**
+ * Decodes images that consist of several partitions, e.g., the application, a large read-only asset blob and
+ * a configuration region, and routes each partition into its own region.
+ * The application partition is delivered to the storage of the controller, like an ordinary image;
+ * the other partitions are written into the ROM backends registered with addPartition().
+ * Register an instance with @ref kocherga::BootloaderController::addStreamFilter().
+ * The images are generated by the script pack_image.py.
+ *
+ * The format is as follows; all values are little-endian:
+ *
+ *      Offset  Type        Description
+ *      0       uint8[8]    Magic "KPart000"
+ *      8       uint32      Number of partitions in the table, [1, MaxPartitions]
+ *      12      uint32      Reserved, zero
+ *      16      entry[]     The partition table
+ *      ...     uint8[]     The contents of the partitions, in the order of the table
+ *
+ * Each entry of the partition table is as follows:
+ *
+ *      Offset  Type        Description
+ *      0       uint8       Partition ID; 0 is the application
+ *      1       uint8       Major version number
+ *      2       uint8       Minor version number
+ *      3       uint8       Reserved, zero
+ *      4       uint32      Size of the contents, in bytes; a multiple of eight
+ *      8       uint64      CRC-64-WE of the contents; for the application, the CRC from its app descriptor
+ *
+ * The application partition is mandatory and it must be the last one, because the download is terminated early
+ * if the application is unchanged (see @ref kocherga::ResultAppUnchanged).
+ * The other partitions may be omitted, in which case their regions are not modified.
+ *
+ * The last DescriptorSize bytes of each region hold the descriptor of the partition it contains:
+ *
+ *      Offset  Type        Description
+ *      0       uint8[8]    Eight constant ASCII characters: "PTDesc00"
+ *      8       uint64      CRC-64-WE of the contents
+ *      16      uint32      Size of the contents, in bytes
+ *      20      uint8       Major version number
+ *      21      uint8       Minor version number
+ *      22      uint8[2]    Reserved, zero
+ *
+ * If the descriptor matches the entry of the partition table, the partition is skipped: its contents are
+ * discarded as they are received, without being written or verified. Otherwise the descriptor is invalidated
+ * before the region is written, and the new one is written only after the contents are read back and verified,
+ * so that an interrupted upgrade never leaves a valid descriptor of corrupted contents behind.
+ * The regions shall be larger than the partitions by at least DescriptorSize bytes, and their sizes shall be
+ * multiples of eight.
+ */
+class PartitionFilter final : public kocherga::IStreamFilter
+{
+public:
+    static constexpr std::uint8_t MaxPartitions = 8;
+    static constexpr std::uint8_t DescriptorSize = 24;
+
+private:
+    static constexpr std::uint8_t HeaderSize = 16;
+    static constexpr std::uint8_t EntrySize = 16;
+    static constexpr std::uint16_t PageSize = 256;      ///< Writes into the regions are coalesced into pages
+    static constexpr std::uint8_t ApplicationID = 0;
+
+    static constexpr std::array<std::uint8_t, 8> DescriptorSignature{{'P', 'T', 'D', 'e', 's', 'c', '0', '0'}};
+
+    struct Region
+    {
+        kocherga::IROMBackend* backend = nullptr;
+        std::size_t size = 0;
+        std::uint8_t id = 0;
+    };
+
+    struct Entry
+    {
+        PartitionInfo info;
+        std::uint8_t id = 0;
+    };
+
+    enum class Stage : std::uint8_t
+    {
+        Header,
+        Table,
+        Contents,
+        Done
+    };
+
+    std::array<Region, MaxPartitions> regions_{};
+    std::uint8_t num_regions_ = 0;
+
+    kocherga::IDownloadSink* output_ = nullptr;
+
+    Stage stage_ = Stage::Header;
+    std::array<std::uint8_t, HeaderSize> header_{};
+    std::uint8_t header_size_ = 0;
+
+    std::array<Entry, MaxPartitions> table_{};
+    std::uint8_t table_size_ = 0;
+
+    // The partition whose contents are being received
+    std::uint8_t current_ = 0;
+    std::uint32_t offset_ = 0;
+    const Region* region_ = nullptr;           ///< Null if the partition is skipped or it is the application
+    bool upgrade_in_progress_ = false;
+    std::size_t erased_until_ = 0;
+    std::optional<std::size_t> descriptor_sector_;
+    kocherga::CRC64 crc_;
+    alignas(8) std::array<std::uint8_t, PageSize> page_{};
+    std::uint16_t page_fill_ = 0;
+
+    template <typename T>
+    static T unpack(const std::uint8_t* data)
+    {
+        T out = 0;
+        for (std::uint8_t i = 0; i < sizeof(T); i++)
+        {
+            out = T(out | (T(data[i]) << (i * 8U)));
+        }
+        return out;
+    }
+
+    template <typename T>
+    static void pack(T value, std::uint8_t* data)
+    {
+        for (std::uint8_t i = 0; i < sizeof(T); i++)
+        {
+            data[i] = std::uint8_t(value >> (i * 8U));
+        }
+    }
+
+    const Region* findRegion(std::uint8_t id) const
+    {
+        for (std::uint8_t i = 0; i < num_regions_; i++)
+        {
+            if (regions_[i].id == id)
+            {
+                return &regions_[i];
+            }
+        }
+        return nullptr;
+    }
+
+    static std::optional<PartitionInfo> readDescriptor(const Region& region)
+    {
+        std::array<std::uint8_t, DescriptorSize> buf{};
+        if (region.backend->read(region.size - DescriptorSize, buf.data(), DescriptorSize) != DescriptorSize)
+        {
+            return {};
+        }
+        if (!std::equal(DescriptorSignature.begin(), DescriptorSignature.end(), buf.begin()))
+        {
+            return {};
+        }
+        PartitionInfo info;
+        info.crc = unpack<std::uint64_t>(&buf[8]);
+        info.size = unpack<std::uint32_t>(&buf[16]);
+        info.major_version = buf[20];
+        info.minor_version = buf[21];
+        return info;
+    }
+
+    std::int16_t finishRegionUpgrade(bool success)
+    {
+        if (!upgrade_in_progress_)
+        {
+            return ErrOK;
+        }
+        upgrade_in_progress_ = false;
+        const auto res = region_->backend->endUpgrade(success);
+        return (res < 0) ? res : ErrOK;
+    }
+
+    /**
+     * Erases the sectors of the region up to the specified offset, if the erasing is managed by the filter.
+     */
+    std::int16_t eraseUntil(std::size_t end)
+    {
+        auto& backend = *region_->backend;
+        while (erased_until_ < end)
+        {
+            const auto sector_size = backend.getSectorSize(erased_until_);
+            if (sector_size == 0)
+            {
+                break;                                  // The erasing is not managed by us
+            }
+            if (erased_until_ != descriptor_sector_)    // Already erased in beginRegionUpgrade()
+            {
+                if (const auto res = backend.eraseSector(erased_until_); res < 0)
+                {
+                    return res;
+                }
+            }
+            erased_until_ += sector_size;
+        }
+        return ErrOK;
+    }
+
+    /**
+     * Prepares the region for writing and invalidates the descriptor stored in it.
+     */
+    std::int16_t beginRegionUpgrade()
+    {
+        auto& backend = *region_->backend;
+        if (const auto res = backend.beginUpgrade(); res < 0)
+        {
+            return res;
+        }
+        upgrade_in_progress_ = true;
+        erased_until_ = 0;
+        descriptor_sector_.reset();
+
+        const std::size_t descriptor_offset = region_->size - DescriptorSize;
+        if (backend.getSectorSize(0) > 0)
+        {
+            std::size_t sector = 0;
+            while (true)
+            {
+                const auto sector_size = backend.getSectorSize(sector);
+                if (sector_size == 0)
+                {
+                    return -kocherga::ErrInvalidParams;         // The region does not match the sectors
+                }
+                if ((sector + sector_size) > descriptor_offset)
+                {
+                    break;
+                }
+                sector += sector_size;
+            }
+            descriptor_sector_ = sector;
+            return backend.eraseSector(sector);
+        }
+
+        // If the backend erases the storage by itself, the descriptor is already gone; otherwise, overwrite it
+        if (readDescriptor(*region_))
+        {
+            static constexpr std::array<std::uint8_t, DescriptorSize> Zeros{};
+            if (backend.write(descriptor_offset, Zeros.data(), DescriptorSize) != DescriptorSize)
+            {
+                return -kocherga::ErrROMWriteFailure;
+            }
+        }
+        return ErrOK;
+    }
+
+    std::int16_t flushPage()
+    {
+        if (page_fill_ == 0)
+        {
+            return ErrOK;
+        }
+        const std::size_t page_offset = offset_ - page_fill_;
+        if (const auto res = eraseUntil(page_offset + page_fill_); res < 0)
+        {
+            return res;
+        }
+        if (region_->backend->write(page_offset, page_.data(), page_fill_) != page_fill_)
+        {
+            return -kocherga::ErrROMWriteFailure;
+        }
+        page_fill_ = 0;
+        return ErrOK;
+    }
+
+    /**
+     * Reads the partition back to make sure it has been written correctly, then stores the descriptor.
+     */
+    std::int16_t completeRegionUpgrade(const PartitionInfo& info)
+    {
+        auto& backend = *region_->backend;
+        kocherga::CRC64 crc;
+        for (std::size_t pos = 0; pos < info.size;)
+        {
+            const auto n = std::uint16_t(std::min<std::size_t>(PageSize, info.size - pos));
+            if (backend.read(pos, page_.data(), n) != n)
+            {
+                return -kocherga::ErrROMReadFailure;
+            }
+            crc.add(page_.data(), n);
+            pos += n;
+        }
+        if (crc.get() != info.crc)
+        {
+            return -ErrPartitionCRCMismatch;
+        }
+
+        std::array<std::uint8_t, DescriptorSize> buf{};
+        std::copy(DescriptorSignature.begin(), DescriptorSignature.end(), buf.begin());
+        pack(info.crc, &buf[8]);
+        pack(info.size, &buf[16]);
+        buf[20] = info.major_version;
+        buf[21] = info.minor_version;
+        if (backend.write(region_->size - DescriptorSize, buf.data(), DescriptorSize) != DescriptorSize)
+        {
+            return -kocherga::ErrROMWriteFailure;
+        }
+        KOCHERGA_TRACE("Partition %u v%u.%u installed, %u bytes\n", unsigned(table_[current_].id),
+                       unsigned(info.major_version), unsigned(info.minor_version), unsigned(info.size));
+        return finishRegionUpgrade(true);
+    }
+
+    std::int16_t processHeader()
+    {
+        const auto count = unpack<std::uint32_t>(&header_[8]);
+        if ((count == 0) || (count > MaxPartitions))
+        {
+            return -ErrInvalidTable;
+        }
+        table_size_ = std::uint8_t(count);
+        header_size_ = 0;
+        current_ = 0;
+        stage_ = Stage::Table;
+        return ErrOK;
+    }
+
+    std::int16_t processEntry()
+    {
+        auto& entry = table_[current_];
+        entry.id = header_[0];
+        entry.info.major_version = header_[1];
+        entry.info.minor_version = header_[2];
+        entry.info.size = unpack<std::uint32_t>(&header_[4]);
+        entry.info.crc = unpack<std::uint64_t>(&header_[8]);
+        header_size_ = 0;
+
+        if ((entry.info.size == 0) || ((entry.info.size % 8U) != 0))
+        {
+            return -ErrInvalidTable;
+        }
+        for (std::uint8_t i = 0; i < current_; i++)
+        {
+            if (table_[i].id == entry.id)
+            {
+                return -ErrInvalidTable;
+            }
+        }
+        const bool last = (current_ + 1U) >= table_size_;
+        if ((entry.id == ApplicationID) != last)
+        {
+            return -ErrInvalidTable;            // The application shall be the last partition
+        }
+        if (entry.id != ApplicationID)
+        {
+            const auto region = findRegion(entry.id);
+            if (region == nullptr)
+            {
+                return -ErrUnknownPartition;
+            }
+            if ((entry.info.size + std::size_t(DescriptorSize)) > region->size)
+            {
+                return -ErrPartitionTooLarge;
+            }
+        }
+
+        if (last)
+        {
+            current_ = 0;
+            stage_ = Stage::Contents;
+            return beginPartition();
+        }
+        current_++;
+        return ErrOK;
+    }
+
+    std::int16_t beginPartition()
+    {
+        const auto& entry = table_[current_];
+        offset_ = 0;
+        page_fill_ = 0;
+        crc_ = kocherga::CRC64();
+        region_ = nullptr;
+
+        if (entry.id == ApplicationID)
+        {
+            return output_->handleImageSizeHint(entry.info.size);
+        }
+
+        const auto region = findRegion(entry.id);
+        if (readDescriptor(*region) == entry.info)
+        {
+            KOCHERGA_TRACE("Partition %u is up to date, skipped\n", unsigned(entry.id));
+            return ErrOK;
+        }
+        region_ = region;
+        return beginRegionUpgrade();
+    }
+
+    std::int16_t endPartition()
+    {
+        const auto& entry = table_[current_];
+        if (region_ != nullptr)
+        {
+            if (const auto res = flushPage(); res < 0)
+            {
+                return res;
+            }
+            if (crc_.get() != entry.info.crc)
+            {
+                return -ErrPartitionCRCMismatch;
+            }
+            if (const auto res = completeRegionUpgrade(entry.info); res < 0)
+            {
+                return res;
+            }
+        }
+        region_ = nullptr;
+
+        current_++;
+        if (current_ >= table_size_)
+        {
+            stage_ = Stage::Done;
+            return ErrOK;
+        }
+        return beginPartition();
+    }
+
+    std::int16_t processContents(const std::uint8_t* data, std::uint16_t size)
+    {
+        const auto& entry = table_[current_];
+        if (entry.id == ApplicationID)
+        {
+            if (const auto res = output_->handleNextDataChunk(data, size); res < 0)
+            {
+                return res;
+            }
+        }
+        else if (region_ != nullptr)
+        {
+            crc_.add(data, size);
+            while (size > 0)
+            {
+                const auto n = std::uint16_t(std::min<std::uint32_t>(PageSize - page_fill_, size));
+                std::copy_n(data, n, page_.begin() + page_fill_);
+                page_fill_ = std::uint16_t(page_fill_ + n);
+                offset_ += n;
+                data += n;
+                size = std::uint16_t(size - n);
+                if (page_fill_ >= PageSize)
+                {
+                    if (const auto res = flushPage(); res < 0)
+                    {
+                        return res;
+                    }
+                }
+            }
+            return ErrOK;
+        }
+        offset_ += size;
+        return ErrOK;
+    }
+
+    std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        const auto end = bytes + size;
+        std::int16_t res = ErrOK;
+        while ((bytes < end) && (res >= 0))
+        {
+            switch (stage_)
+            {
+            case Stage::Header:
+            {
+                header_[header_size_++] = *bytes++;
+                if (header_size_ >= HeaderSize)
+                {
+                    res = processHeader();
+                }
+                break;
+            }
+            case Stage::Table:
+            {
+                header_[header_size_++] = *bytes++;
+                if (header_size_ >= EntrySize)
+                {
+                    res = processEntry();
+                }
+                break;
+            }
+            case Stage::Contents:
+            {
+                const auto remaining = table_[current_].info.size - offset_;
+                const auto n = std::uint16_t(std::min<std::uint32_t>(remaining, std::uint32_t(end - bytes)));
+                res = processContents(bytes, n);
+                bytes += n;
+                if ((res >= 0) && (offset_ >= table_[current_].info.size))
+                {
+                    res = endPartition();
+                }
+                break;
+            }
+            case Stage::Done:
+            {
+                res = -ErrInvalidImage;         // Trailing garbage
+                break;
+            }
+            }
+        }
+
+        if (res < 0)
+        {
+            (void) finishRegionUpgrade(false);
+            return res;
+        }
+        return std::int16_t(size);
+    }
+
+    std::int16_t handleImageSizeHint(std::uint32_t image_size) override
+    {
+        (void) image_size;                      // This is the size of the entire stream, which is irrelevant
+        return ErrOK;
+    }
+
+public:
+    /**
+     * Registers the region that the partition with the specified ID is written into.
+     * The ID shall not be zero, which is reserved for the application.
+     * The region begins at the offset zero of the backend; if the erasing is managed by the filter
+     * (see @ref kocherga::IROMBackend::getSectorSize()), the sectors are erased on first touch like in the storage
+     * of the controller.
+     * @return true on success, false if the ID is invalid or already registered, or if the region is too small
+     */
+    bool addPartition(std::uint8_t id, kocherga::IROMBackend& backend, std::size_t region_size)
+    {
+        if ((id == ApplicationID) || (findRegion(id) != nullptr) || (num_regions_ >= MaxPartitions) ||
+            (region_size <= DescriptorSize) || ((region_size % 8U) != 0))
+        {
+            return false;
+        }
+        regions_[num_regions_++] = Region{&backend, region_size, id};
+        return true;
+    }
+
+    /**
+     * Returns the descriptor of the partition that is currently stored in the region, if it is valid.
+     * This is the way for the application to find out which version of a partition is installed.
+     * Invoking this method while an upgrade is in progress is not allowed.
+     */
+    std::optional<PartitionInfo> getPartitionInfo(std::uint8_t id) const
+    {
+        const auto region = findRegion(id);
+        return (region != nullptr) ? readDescriptor(*region) : std::optional<PartitionInfo>{};
+    }
+
+    Magic getMagic() const override
+    {
+        return {{'K', 'P', 'a', 'r', 't', '0', '0', '0'}};
+    }
+
+    std::int16_t beginStream(kocherga::IDownloadSink& output, const kocherga::IReferenceImage& reference) override
+    {
+        (void) reference;
+        assert(!upgrade_in_progress_);          // Finalized by endStream() or abortStream()
+        output_ = &output;
+        stage_ = Stage::Header;
+        header_size_ = 0;
+        table_size_ = 0;
+        current_ = 0;
+        offset_ = 0;
+        region_ = nullptr;
+        page_fill_ = 0;
+        return ErrOK;
+    }
+
+    std::int16_t endStream() override
+    {
+        if (stage_ != Stage::Done)
+        {
+            (void) finishRegionUpgrade(false);
+            return -ErrInvalidImage;
+        }
+        return ErrOK;
+    }
+
+    void abortStream() override
+    {
+        (void) finishRegionUpgrade(false);      // The descriptor of the region remains invalid
+    }
+};
+
+}
@@ -348,6 +348,14 @@ class PopcopProtocol final : private kocherga::IProtocol
                         resp.image_data = req.image_data;
                         upgrade_status_code_ = 0;
                     }
+                    else if (result == -kocherga::ErrAppAlreadyInstalled)
+                    {
+                        // The chunk is acknowledged, and the status response that follows the upgrade tells the
+                        // remote that the download is over and the application is ready to boot.
+                        resp.image_data = req.image_data;
+                        upgrade_status_code_ = result;
+                        download_sink_ = nullptr;
+                    }
                     else
                     {
                         upgrade_status_code_ = result;
@@ -0,0 +1,192 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+#pragma once
+
+#include <kocherga.hpp>
+
+
+namespace kocherga_sparse
+{
+/**
+ * Error codes specific to this module.
+ */
+static constexpr std::int16_t ErrOK                             = 0;
+static constexpr std::int16_t ErrInvalidImage                   = 7001;
+
+/**
+ * Decodes sparse images, where the regions filled with 0xFF (e.g., the padding between the sections of the image)
+ * are replaced with hole records, so that they are neither transferred nor written; see
+ * @ref kocherga::IDownloadSink::handleHole(). Register an instance with
+ * @ref kocherga::BootloaderController::addStreamFilter(). The images are generated by the script pack_image.py.
+ *
+ * The format is as follows; all values are little-endian:
+ *
+ *      Offset  Type        Description
+ *      0       uint8[8]    Magic "KSparse0"
+ *      8       uint32      Size of the resulting image, in bytes
+ *      12      uint32      Reserved, zero
+ *      16      records     Until the resulting image is complete
+ *
+ * Each record is an unsigned LEB128 varint (length << 1) | kind, where length is never zero:
+ *      kind 0 - literal, followed by the specified number of bytes of the resulting image;
+ *      kind 1 - hole, the specified number of bytes of the resulting image are 0xFF.
+ */
+class SparseFilter final : public kocherga::IStreamFilter
+{
+    static constexpr std::uint8_t HeaderSize = 16;
+
+    enum class Stage : std::uint8_t
+    {
+        Header,
+        RecordTag,
+        Literal,
+        Done
+    };
+
+    kocherga::IDownloadSink* output_ = nullptr;
+
+    Stage stage_ = Stage::Header;
+    std::array<std::uint8_t, HeaderSize> header_{};
+    std::uint8_t header_size_ = 0;
+
+    kocherga::detail::RecordReader records_;
+
+    std::int16_t processHeader()
+    {
+        std::uint32_t output_size = 0;
+        for (std::uint8_t i = 0; i < 4; i++)
+        {
+            output_size |= std::uint32_t(header_[8U + i]) << (i * 8U);
+        }
+        records_.reset(output_size);
+        stage_ = records_.isImageComplete() ? Stage::Done : Stage::RecordTag;
+        return output_->handleImageSizeHint(output_size);
+    }
+
+    std::int16_t processRecordTag()
+    {
+        if (!records_.beginRecord())
+        {
+            return -ErrInvalidImage;
+        }
+        if (records_.getRecordKind() == 0)
+        {
+            stage_ = Stage::Literal;
+            return ErrOK;
+        }
+        if (const auto res = output_->handleHole(records_.getRecordLength()); res < 0)
+        {
+            return res;
+        }
+        stage_ = records_.completeRecord() ? Stage::RecordTag : Stage::Done;
+        return ErrOK;
+    }
+
+    std::int16_t processLiteral(const std::uint8_t* data, std::uint16_t size)
+    {
+        records_.advance(size);
+        if (records_.getRecordLength() == 0)
+        {
+            stage_ = records_.completeRecord() ? Stage::RecordTag : Stage::Done;
+        }
+        return output_->handleNextDataChunk(data, size);
+    }
+
+    std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        const auto end = bytes + size;
+        while (bytes < end)
+        {
+            std::int16_t res = ErrOK;
+            switch (stage_)
+            {
+            case Stage::Header:
+            {
+                header_[header_size_++] = *bytes++;
+                if (header_size_ >= HeaderSize)
+                {
+                    res = processHeader();
+                }
+                break;
+            }
+            case Stage::RecordTag:
+            {
+                const auto varint = records_.accumulateVarint(*bytes++);
+                res = (varint < 0) ? -ErrInvalidImage : ((varint > 0) ? processRecordTag() : ErrOK);
+                break;
+            }
+            case Stage::Literal:
+            {
+                const auto n = std::uint16_t(std::min(records_.getRecordLength(), std::uint32_t(end - bytes)));
+                res = processLiteral(bytes, n);
+                bytes += n;
+                break;
+            }
+            case Stage::Done:
+            {
+                res = -ErrInvalidImage;         // Trailing garbage
+                break;
+            }
+            }
+
+            if (res < 0)
+            {
+                return res;
+            }
+        }
+        return std::int16_t(size);
+    }
+
+    std::int16_t handleImageSizeHint(std::uint32_t image_size) override
+    {
+        (void) image_size;                      // This is the size of the sparse image, which is irrelevant
+        return ErrOK;
+    }
+
+public:
+    Magic getMagic() const override
+    {
+        return {{'K', 'S', 'p', 'a', 'r', 's', 'e', '0'}};
+    }
+
+    std::int16_t beginStream(kocherga::IDownloadSink& output, const kocherga::IReferenceImage& reference) override
+    {
+        (void) reference;
+        output_ = &output;
+        stage_ = Stage::Header;
+        header_size_ = 0;
+        records_.reset(0);
+        return ErrOK;
+    }
+
+    std::int16_t endStream() override
+    {
+        return (stage_ == Stage::Done) ? ErrOK : -ErrInvalidImage;
+    }
+};
+
+}
@@ -221,6 +221,7 @@ using LogMessage                = MessageTypeInfo<16383U, 0xd654a48e0c049d75ULL,
 using GetNodeInfo               = ServiceTypeInfo<    1U, 0xee468a8121c46a9eULL,     0U,  3015U>;
 using BeginFirmwareUpdate       = ServiceTypeInfo<   40U, 0xb7d725df72724126ULL,  1616U,  1031U>;
 using FileRead                  = ServiceTypeInfo<   48U, 0x8dcdca939f33f678ULL,  1648U,  2073U>;
+using FileGetInfo               = ServiceTypeInfo<   45U, 0x5004891ee8a27531ULL,  1608U,    64U>;
 using RestartNode               = ServiceTypeInfo<    5U, 0x569e05394a3017f0ULL,    40U,     1U>;
 
 
@@ -289,10 +290,15 @@ class BootloaderNode final : private ::kocherga::IProtocol
     std::uint8_t node_id_allocation_transfer_id_ = 0;
     std::uint8_t log_message_transfer_id_ = 0;
     std::uint8_t file_read_transfer_id_ = 0;
+    std::uint8_t file_get_info_transfer_id_ = 0;
 
     std::array<std::uint8_t, 256> read_buffer_{};
+    std::uint8_t* read_target_ = read_buffer_.data();  ///< Points into the download sink if it provides the space
     std::int16_t read_result_ = 0;
 
+    std::optional<std::uint64_t> file_size_;
+    bool file_get_info_response_received_ = false;
+
 
     std::uint64_t getMonotonicUptimeInMicroseconds() const
     {
@@ -735,7 +741,11 @@ class BootloaderNode final : private ::kocherga::IProtocol
             if (result >= 0)
             {
                 vendor_specific_status_ = 0;
-                if (bootloader_.getState() == kocherga::State::NoAppToBoot)
+                if (result == kocherga::ResultAppUnchanged)
+                {
+                    sendLog(LogLevel::Info, "OK, already installed");
+                }
+                else if (bootloader_.getState() == kocherga::State::NoAppToBoot)
                 {
                     sendLog(LogLevel::Error, "Downloaded image is invalid");
                 }
@@ -763,6 +773,46 @@ class BootloaderNode final : private ::kocherga::IProtocol
         platform_.resetWatchdog();
     }
 
+    /**
+     * Asks the file server about the size of the firmware file.
+     * Returns an empty option if the server did not respond or reported an error; this is not fatal.
+     */
+    std::optional<std::uint64_t> requestFileSize()
+    {
+        using namespace impl_;
+
+        std::uint8_t buffer[dsdl::FileGetInfo::MaxSizeBytesRequest]{};
+        std::copy(firmware_file_path_.begin(), firmware_file_path_.end(), &buffer[0]);
+
+        const auto res = ::canardRequestOrRespond(&canard_,
+                                                  remote_server_node_id_,
+                                                  dsdl::FileGetInfo::DataTypeSignature,
+                                                  dsdl::FileGetInfo::DataTypeID,
+                                                  &file_get_info_transfer_id_,
+                                                  CANARD_TRANSFER_PRIORITY_LOW,
+                                                  ::CanardRequest,
+                                                  buffer,
+                                                  std::uint16_t(firmware_file_path_.size()));
+        if (res < 0)
+        {
+            KOCHERGA_UAVCAN_LOG("File info req err %d\n", res);
+            return {};
+        }
+
+        const std::chrono::microseconds response_deadline =
+            bootloader_.getMonotonicUptime() + DefaultServiceRequestTimeout;
+
+        file_size_.reset();
+        file_get_info_response_received_ = false;
+        while (!file_get_info_response_received_ && (bootloader_.getMonotonicUptime() <= response_deadline))
+        {
+            poll();
+        }
+
+        platform_.resetWatchdog();
+        return file_size_;
+    }
+
     std::int16_t downloadImage(kocherga::IDownloadSink& sink) override
     {
         using namespace impl_;
@@ -772,6 +822,36 @@ class BootloaderNode final : private ::kocherga::IProtocol
 
         sendNodeStatus();       // Announcing the new state of the bootloader ASAP
 
+        /*
+         * Let the sink know the size of the image early, if the server can tell it.
+         * Older servers may not support this service, so the failure is not fatal.
+         * The image is identified by the server, the path, and the size, which allows the sink to resume
+         * an interrupted download of the same image. Without the size, the identity is too weak to rely on.
+         */
+        if (const auto file_size = requestFileSize())
+        {
+            KOCHERGA_UAVCAN_LOG("File size %u\n", unsigned(*file_size));
+            {
+                kocherga::CRC64 image_id;
+                image_id.add(&remote_server_node_id_, sizeof(remote_server_node_id_));
+                image_id.add(firmware_file_path_.c_str(), firmware_file_path_.size());
+                image_id.add(&*file_size, sizeof(*file_size));
+
+                offset = sink.getResumeOffset(image_id.get());
+                if (offset > 0)
+                {
+                    KOCHERGA_UAVCAN_LOG("Resuming from %u\n", unsigned(offset));
+                }
+            }
+
+            const auto res = sink.handleImageSizeHint(std::uint32_t(std::min<std::uint64_t>(*file_size,
+                                                                                            0xFFFFFFFFULL)));
+            if (res < 0)
+            {
+                return res;
+            }
+        }
+
         while (true)
         {
             platform_.resetWatchdog();
@@ -781,6 +861,16 @@ class BootloaderNode final : private ::kocherga::IProtocol
                 return -ErrInterrupted;
             }
 
+            /*
+             * The response is received directly into the sink if it can provide the space for the longest one;
+             * see IDownloadSink::acquire().
+             */
+            {
+                const auto span = sink.acquire(std::uint16_t(read_buffer_.size()));
+                read_target_ = (span.size >= read_buffer_.size()) ? static_cast<std::uint8_t*>(span.data) :
+                                                                    read_buffer_.data();
+            }
+
             /*
              * Send request
              */
@@ -800,6 +890,7 @@ class BootloaderNode final : private ::kocherga::IProtocol
                                                           std::uint16_t(firmware_file_path_.size() + 5U));
                 if (res < 0)
                 {
+                    read_target_ = read_buffer_.data();
                     KOCHERGA_UAVCAN_LOG("File req err %d\n", res);
                     return std::int16_t(res);
                 }
@@ -815,14 +906,17 @@ class BootloaderNode final : private ::kocherga::IProtocol
             constexpr auto InvalidReadResult = std::numeric_limits<std::int16_t>::max();
             read_result_ = InvalidReadResult;
 
-            while (read_result_ == InvalidReadResult)
+            while ((read_result_ == InvalidReadResult) && (bootloader_.getMonotonicUptime() <= response_deadline))
             {
                 poll();
+            }
 
-                if (bootloader_.getMonotonicUptime() > response_deadline)
-                {
-                    return -ErrTimeout;
-                }
+            // A late response must not be written into the sink after the download is finished
+            const bool zero_copy = read_target_ != read_buffer_.data();
+            read_target_ = read_buffer_.data();
+            if (read_result_ == InvalidReadResult)
+            {
+                return -ErrTimeout;
             }
 
             platform_.resetWatchdog();
@@ -841,7 +935,8 @@ class BootloaderNode final : private ::kocherga::IProtocol
             {
                 offset = offset + std::uint64_t(read_result_);
 
-                const auto res = sink.handleNextDataChunk(read_buffer_.data(), std::uint16_t(read_result_));
+                const auto res = zero_copy ? sink.commit(std::uint16_t(read_result_)) :
+                                 sink.handleNextDataChunk(read_buffer_.data(), std::uint16_t(read_result_));
                 if (res < 0)
                 {
                     platform_.resetWatchdog();
@@ -1117,10 +1212,28 @@ class BootloaderNode final : private ::kocherga::IProtocol
                                                 std::uint32_t(16 + i * 8),
                                                 8U,
                                                 false,
-                                                &read_buffer_[std::uint32_t(i)]);
+                                                &read_target_[i]);
                 }
             }
         }
+
+        /*
+         * File info response.
+         */
+        if ((transfer->transfer_type == ::CanardTransferTypeResponse) &&
+            (transfer->data_type_id == dsdl::FileGetInfo::DataTypeID) &&
+            (((transfer->transfer_id + 1U) & 31U) == file_get_info_transfer_id_))
+        {
+            std::uint64_t size = 0;
+            std::int16_t error = 0;
+            (void) ::canardDecodeScalar(transfer,  0, 40, false, &size);
+            (void) ::canardDecodeScalar(transfer, 40, 16, true,  &error);
+            if (error == 0)
+            {
+                file_size_ = size;
+            }
+            file_get_info_response_received_ = true;
+        }
     }
 
     bool shouldAcceptTransfer(std::uint64_t* out_data_type_signature,
@@ -1168,6 +1281,14 @@ class BootloaderNode final : private ::kocherga::IProtocol
                 return true;
             }
 
+            // FileGetInfo RESPONSE
+            if ((transfer_type == ::CanardTransferTypeResponse) &&
+                (data_type_id == FileGetInfo::DataTypeID))
+            {
+                *out_data_type_signature = FileGetInfo::DataTypeSignature;
+                return true;
+            }
+
             // RestartNode REQUEST
             if ((transfer_type == ::CanardTransferTypeRequest) &&
                 (data_type_id == RestartNode::DataTypeID))
@@ -110,7 +110,6 @@ class YModemProtocol final : public kocherga::IProtocol
 {
     static constexpr std::uint16_t BlockSizeXModem = 128;
     static constexpr std::uint16_t BlockSize1K     = 1024;
-    static constexpr std::uint16_t WorstCaseBlockSizeWithCRC = BlockSize1K + 2;
 
     /// The timeouts are according to the YMODEM specification
     static constexpr std::chrono::microseconds SendTimeout          {1'000'000};    // NOLINT
@@ -131,8 +130,19 @@ class YModemProtocol final : public kocherga::IProtocol
         static constexpr std::uint8_t CAN = 0x18;
     };
 
+    /// Receives the rest of the file after the download has been terminated; see @ref processDownloadedBlock().
+    class DiscardingSink final : public kocherga::IDownloadSink
+    {
+        std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+        {
+            (void) data;
+            return std::int16_t(size);
+        }
+    };
+
     IYModemPlatform& platform_;
-    std::uint8_t buffer_[WorstCaseBlockSizeWithCRC]{};
+    std::uint8_t buffer_[BlockSize1K]{};            ///< Used if the sink cannot provide the space for the payload
+    DiscardingSink discarding_sink_;
 
 
     static std::uint8_t computeChecksum(const void* data, std::uint16_t size)
@@ -227,11 +237,16 @@ class YModemProtocol final : public kocherga::IProtocol
 
     /**
      * Reads a block from the channel. This function does not transmit anything.
+     * The payload is received directly into the sink if it can provide the space for it (see
+     * @ref kocherga::IDownloadSink::acquire()); otherwise, into the buffer of the protocol. Either way, it is not
+     * delivered to the sink here; see @ref processDownloadedBlock().
      * @return First component: @ref BlockReceptionResult
      *         Second component: system error code, if applicable
      */
-    std::pair<BlockReceptionResult, std::int16_t> receiveBlock(std::uint16_t& out_size,
-                                                               std::uint8_t& out_sequence)
+    std::pair<BlockReceptionResult, std::int16_t> receiveBlock(kocherga::IDownloadSink& sink,
+                                                               std::uint16_t& out_size,
+                                                               std::uint8_t& out_sequence,
+                                                               std::uint8_t*& out_payload)
     {
         // Header byte
         std::uint8_t header_byte = 0;
@@ -293,22 +308,32 @@ class YModemProtocol final : public kocherga::IProtocol
         out_sequence = sequence_id_bytes[0];
 
         // Payload
-        constexpr auto ChecksumSize = 1;
-        const auto block_size_with_checksum = std::uint16_t(out_size + ChecksumSize);
-        res = receive(buffer_, block_size_with_checksum, BlockPayloadTimeout);
+        const auto span = sink.acquire(out_size);
+        out_payload = (span.size >= out_size) ? static_cast<std::uint8_t*>(span.data) : &buffer_[0];
+        res = receive(out_payload, out_size, BlockPayloadTimeout);
         if (res < 0)
         {
             return { BlockReceptionResult::SystemError, res };
         }
-        if (std::uint16_t(res) != block_size_with_checksum)
+        if (std::uint16_t(res) != out_size)
         {
             return { BlockReceptionResult::Timeout, 0 };
         }
 
         // Checksum validation
-        if (computeChecksum(buffer_, out_size) != buffer_[out_size])
+        std::uint8_t checksum = 0;
+        res = receive(&checksum, 1, BlockPayloadTimeout);
+        if (res < 0)
+        {
+            return { BlockReceptionResult::SystemError, res };
+        }
+        if (res != 1)
         {
-            KOCHERGA_TRACE("YMODEM checksum error, not %d\n", buffer_[out_size]);
+            return { BlockReceptionResult::Timeout, 0 };
+        }
+        if (computeChecksum(out_payload, out_size) != checksum)
+        {
+            KOCHERGA_TRACE("YMODEM checksum error, not %d\n", checksum);
             return { BlockReceptionResult::ProtocolError, 0 };
         }
 
@@ -366,10 +391,25 @@ class YModemProtocol final : public kocherga::IProtocol
         return true;
     }
 
-    static std::int16_t processDownloadedBlock(kocherga::IDownloadSink& sink, void* data, std::uint16_t size)
+    /**
+     * The payload that has been received directly into the sink is committed there; see @ref receiveBlock().
+     * If the sink terminates the download because the image is already installed, the output is switched to
+     * the discarding sink: the rest of the file is acknowledged and dropped, so that the transfer ends normally.
+     * Cancelling it instead would make the sender report a failure, although the outcome is a success.
+     */
+    std::int16_t processDownloadedBlock(kocherga::IDownloadSink*& output,
+                                        const std::uint8_t* payload,
+                                        std::uint16_t size)
     {
         KOCHERGA_TRACE("YMODEM received block of %d bytes\n", size);
-        return sink.handleNextDataChunk(data, size);
+        const auto res = (payload != &buffer_[0]) ? output->commit(size) : output->handleNextDataChunk(payload, size);
+        if (res == -kocherga::ErrAppAlreadyInstalled)
+        {
+            KOCHERGA_TRACE("YMODEM image already installed, discarding the rest of the file\n");
+            output = &discarding_sink_;
+            return ErrOK;
+        }
+        return res;
     }
 
 public:
@@ -397,6 +437,7 @@ public:
         } flusher_{platform_};
 
         // State variables
+        kocherga::IDownloadSink* output = &sink;             // Replaced if the download is terminated early
         std::uint32_t remaining_file_size = 0;
         bool file_size_known{};
         std::uint8_t expected_sequence_id = 123;             // Arbitrary invalid value
@@ -432,7 +473,8 @@ public:
 
             // Receiving the block
             std::uint16_t size = 0;
-            const auto block_rx_res = receiveBlock(size, expected_sequence_id);
+            std::uint8_t* payload = nullptr;
+            const auto block_rx_res = receiveBlock(*output, size, expected_sequence_id, payload);
             if (block_rx_res.first == BlockReceptionResult::Success)
             {
                 ;
@@ -461,7 +503,7 @@ public:
                 mode = Mode::YModem;
 
                 bool is_null_block = true;
-                const bool zero_block_valid = tryParseZeroBlock(buffer_, size, is_null_block, remaining_file_size);
+                const bool zero_block_valid = tryParseZeroBlock(payload, size, is_null_block, remaining_file_size);
 
                 KOCHERGA_TRACE("YMODEM zero block: valid=%d null=%d size=%u\n",
                                zero_block_valid, is_null_block, unsigned(remaining_file_size));
@@ -482,6 +524,16 @@ public:
                 }
                 file_size_known = remaining_file_size > 0;
 
+                // Letting the sink know the size early, so that it could reject the image before it is transferred
+                if (file_size_known)
+                {
+                    if (const auto res = sink.handleImageSizeHint(remaining_file_size); res < 0)
+                    {
+                        abort();
+                        return res;
+                    }
+                }
+
                 // The zero block requires a dedicated ACK, sending it now
                 if (const auto res = send(ControlCharacters::ACK); res < 0)
                 {
@@ -494,7 +546,7 @@ public:
                 mode = Mode::XModem;
                 KOCHERGA_TRACE("YMODEM zero block skipped (XMODEM mode)\n");
 
-                if (const auto res = processDownloadedBlock(sink, buffer_, size); res < 0)
+                if (const auto res = processDownloadedBlock(output, payload, size); res < 0)
                 {
                     abort();
                     return res;
@@ -540,7 +592,8 @@ public:
             // Receiving the block
             std::uint16_t size = 0;
             std::uint8_t sequence_id = 0;
-            const auto block_rx_res = receiveBlock(size, sequence_id);
+            std::uint8_t* payload = nullptr;
+            const auto block_rx_res = receiveBlock(*output, size, sequence_id, payload);
             if (block_rx_res.first == BlockReceptionResult::Success)
             {
                 ;
@@ -609,7 +662,7 @@ public:
             }
 
             // Sending the block over
-            if (const auto res = processDownloadedBlock(sink, buffer_, size); res < 0)
+            if (const auto res = processDownloadedBlock(output, payload, size); res < 0)
             {
                 abort();
                 return res;
@@ -633,7 +686,8 @@ public:
             abort();
         }
 
-        return ErrOK;
+        // The transfer has been completed normally, but the image has not been delivered to the sink in full
+        return (output == &discarding_sink_) ? -kocherga::ErrAppAlreadyInstalled : ErrOK;
     }
 };
 
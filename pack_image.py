@@ -0,0 +1,706 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2018 Zubax Robotics <info@zubax.com>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+# the Software, and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+# FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+# COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+# IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+
+"""
+Encodes application images produced by populate_app_descriptor.py into the stream formats that are decoded
+by the Kocherga stream filters on the fly, and decodes them back for verification.
+
+The encodings can be layered, e.g., a delta patch can be compressed.
+The images can also be signed with Ed25519ph; the signature is appended to the image, which can be encoded then.
+
+Usage examples:
+    pack_image.py compress new.application.bin compressed.bin
+    pack_image.py delta --base old.application.bin new.application.bin patch.bin
+    pack_image.py sparse padded.application.bin sparse.bin
+    pack_image.py encrypt --key-id 1 --key 000102030405060708090a0b0c0d0e0f compressed.bin encrypted.bin
+    pack_image.py partitions --partition 1:2.0:assets.bin --partition 2:1.3:config.bin new.application.bin update.bin
+    pack_image.py sign --key $(cat private.key) new.application.bin signed.bin
+    pack_image.py decode --base old.application.bin patch.bin new.application.bin
+"""
+
+import os
+import sys
+import struct
+import hashlib
+import argparse
+
+
+DESCRIPTOR_SIGNATURE = b'APDesc00'
+
+
+def find_app_descriptor(image):
+    """
+    Returns the CRC and the size from the app descriptor of the image, like the bootloader finds it.
+    """
+    for offset in range(0, len(image) - 32 + 1, 8):
+        if image[offset:offset + 8] == DESCRIPTOR_SIGNATURE:
+            crc, size = struct.unpack_from('<QL', image, offset + 8)
+            if 0 < size <= len(image) and size % 8 == 0:
+                return crc, size
+    raise ValueError('App descriptor not found; is the image processed with populate_app_descriptor.py?')
+
+
+def find_image_crc(image):
+    return find_app_descriptor(image)[0]
+
+
+def _make_crc64_table():
+    table = []
+    for index in range(256):
+        crc = index << 56
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x42F0E1EBA9EA3693) if crc & (1 << 63) else (crc << 1)
+        table.append(crc & 0xFFFFFFFFFFFFFFFF)
+    return table
+
+
+CRC64_TABLE = _make_crc64_table()
+
+
+def crc64(data):
+    """
+    CRC-64-WE, like kocherga::CRC64.
+    """
+    crc = 0xFFFFFFFFFFFFFFFF
+    for byte in data:
+        crc = CRC64_TABLE[((crc >> 56) ^ byte) & 0xFF] ^ ((crc << 8) & 0xFFFFFFFFFFFFFFFF)
+    return crc ^ 0xFFFFFFFFFFFFFFFF
+
+
+def encode_varint(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def decode_varint(data, offset):
+    value, shift = 0, 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+
+#
+# Delta patches; see kocherga_delta.hpp
+#
+DELTA_MAGIC = b'KDelta00'
+DELTA_BLOCK = 8             # Granularity of the base image index
+DELTA_MIN_COPY = 12         # Shorter matches are cheaper to send as literals
+DELTA_MAX_COPY = 32768      # Limits the time the bootloader spends on a single record
+
+
+def _match_length(a, a_offset, b, b_offset, limit):
+    length = 0
+    step = 64
+    while length < limit:
+        n = min(step, limit - length)
+        if a[a_offset + length:a_offset + length + n] == b[b_offset + length:b_offset + length + n]:
+            length += n
+        elif step > 1:
+            step //= 8
+        else:
+            break
+    return length
+
+
+def encode_delta(base, image):
+    index = {}
+    for offset in range(len(base) - DELTA_BLOCK + 1):
+        index.setdefault(base[offset:offset + DELTA_BLOCK], offset)
+
+    out = bytearray(DELTA_MAGIC + struct.pack('<QLL', find_image_crc(base), len(image), 0))
+    literal = bytearray()
+    relative_offset = 0         # Most matches follow the previous one, e.g., when the code has shifted
+    position = 0
+
+    def emit_literal():
+        if literal:
+            out.extend(encode_varint(len(literal) << 1) + literal)
+            literal.clear()
+
+    while position < len(image):
+        limit = min(DELTA_MAX_COPY, len(image) - position)
+        candidates = [position + relative_offset, index.get(image[position:position + DELTA_BLOCK])]
+        best_source, best_length = None, 0
+        for source in candidates:
+            if source is not None and 0 <= source < len(base):
+                length = _match_length(base, source, image, position, min(limit, len(base) - source))
+                if length > best_length:
+                    best_source, best_length = source, length
+
+        if best_length >= DELTA_MIN_COPY:
+            emit_literal()
+            relative_offset = best_source - position
+            zigzag = (relative_offset << 1) if relative_offset >= 0 else (((-relative_offset - 1) << 1) | 1)
+            out.extend(encode_varint((best_length << 1) | 1) + encode_varint(zigzag))
+            position += best_length
+        else:
+            literal.append(image[position])
+            position += 1
+
+    emit_literal()
+    return bytes(out)
+
+
+def decode_delta(stream, base):
+    crc, size, _ = struct.unpack_from('<QLL', stream, 8)
+    if crc != find_image_crc(base):
+        raise ValueError('The patch was generated for a different base image')
+    out = bytearray()
+    offset = 24
+    while len(out) < size:
+        tag, offset = decode_varint(stream, offset)
+        length = tag >> 1
+        if tag & 1:
+            zigzag, offset = decode_varint(stream, offset)
+            source = len(out) + ((-(zigzag >> 1) - 1) if zigzag & 1 else (zigzag >> 1))
+            out += base[source:source + length]
+        else:
+            out += stream[offset:offset + length]
+            offset += length
+    if len(out) != size or offset != len(stream):
+        raise ValueError('Malformed patch')
+    return bytes(out)
+
+
+#
+# LZSS compression; see kocherga_lz.hpp
+#
+LZSS_MAGIC = b'KLZSS000'
+LZSS_MIN_MATCH = 3
+LZSS_MAX_CHAIN = 64         # Candidates examined per position; affects the speed of the encoder, not the decoder
+
+
+def encode_lzss(image, window_bits):
+    if not 8 <= window_bits <= 13:
+        raise ValueError('Window size out of range')
+    length_bits = 16 - window_bits
+    max_code = (1 << length_bits) - 1
+    max_length = LZSS_MIN_MATCH + max_code + 255
+
+    out = bytearray(LZSS_MAGIC + struct.pack('<LB3x', len(image), window_bits))
+    chains = {}
+    group = []
+
+    def emit(flag, item):
+        group.append((flag, item))
+        if len(group) == 8:
+            emit_group()
+
+    def emit_group():
+        if group:
+            out.append(sum(flag << i for i, (flag, _) in enumerate(group)))
+            for _, item in group:
+                out.extend(item)
+            group.clear()
+
+    position = 0
+    while position < len(image):
+        best_length, best_distance = 0, 0
+        limit = min(max_length, len(image) - position)
+        for source in reversed(chains.get(image[position:position + LZSS_MIN_MATCH], [])[-LZSS_MAX_CHAIN:]):
+            distance = position - source
+            if distance > (1 << window_bits):
+                break
+            length = _match_length(image, source, image, position, limit)
+            if length > best_length:
+                best_length, best_distance = length, distance
+                if length == limit:
+                    break
+
+        if best_length >= LZSS_MIN_MATCH:
+            code = min(best_length - LZSS_MIN_MATCH, max_code)
+            item = struct.pack('<H', ((best_distance - 1) << length_bits) | code)
+            if code == max_code:
+                item += bytes([best_length - LZSS_MIN_MATCH - max_code])
+            emit(1, item)
+        else:
+            best_length = 1
+            emit(0, image[position:position + 1])
+
+        for p in range(position, position + best_length):
+            chains.setdefault(image[p:p + LZSS_MIN_MATCH], []).append(p)
+        position += best_length
+
+    emit_group()
+    return bytes(out)
+
+
+def decode_lzss(stream):
+    size, window_bits = struct.unpack_from('<LB', stream, 8)
+    length_bits = 16 - window_bits
+    max_code = (1 << length_bits) - 1
+    out = bytearray()
+    offset = 16
+    while len(out) < size:
+        flags = stream[offset]
+        offset += 1
+        for i in range(8):
+            if len(out) >= size:
+                break
+            if flags & (1 << i):
+                token, = struct.unpack_from('<H', stream, offset)
+                offset += 2
+                length = LZSS_MIN_MATCH + (token & max_code)
+                if token & max_code == max_code:
+                    length += stream[offset]
+                    offset += 1
+                distance = (token >> length_bits) + 1
+                for _ in range(length):
+                    out.append(out[-distance])
+            else:
+                out.append(stream[offset])
+                offset += 1
+    if len(out) != size or offset != len(stream):
+        raise ValueError('Malformed compressed stream')
+    return bytes(out)
+
+
+#
+# Sparse images; see kocherga_sparse.hpp
+#
+SPARSE_MAGIC = b'KSparse0'
+SPARSE_FILL = 0xFF          # The value the erased flash reads as
+
+
+def encode_sparse(image, min_hole):
+    out = bytearray(SPARSE_MAGIC + struct.pack('<LL', len(image), 0))
+    position = 0
+    literal_start = 0
+
+    def emit(kind, length):
+        out.extend(encode_varint((length << 1) | kind))
+
+    while position < len(image):
+        if image[position] != SPARSE_FILL:
+            position += 1
+            continue
+        end = position
+        while end < len(image) and image[end] == SPARSE_FILL:
+            end += 1
+        if end - position >= min_hole:
+            if position > literal_start:
+                emit(0, position - literal_start)
+                out.extend(image[literal_start:position])
+            emit(1, end - position)
+            literal_start = end
+        position = end
+    if position > literal_start:
+        emit(0, position - literal_start)
+        out.extend(image[literal_start:position])
+    return bytes(out)
+
+
+def decode_sparse(stream):
+    size, = struct.unpack_from('<L', stream, 8)
+    offset = 16
+    out = bytearray()
+    while len(out) < size:
+        tag, offset = decode_varint(stream, offset)
+        length = tag >> 1
+        if length == 0 or len(out) + length > size:
+            raise ValueError('Malformed sparse image')
+        if tag & 1:
+            out.extend(bytes([SPARSE_FILL]) * length)
+        else:
+            out.extend(stream[offset:offset + length])
+            offset += length
+    if len(out) != size or offset != len(stream):
+        raise ValueError('Malformed sparse image')
+    return bytes(out)
+
+
+#
+# Partitioned images; see kocherga_partitions.hpp
+#
+PARTITION_MAGIC = b'KPart000'
+PARTITION_ENTRY = struct.Struct('<BBBxLQ')
+APPLICATION_PARTITION = 0
+
+
+def parse_partitions(stream):
+    """
+    Returns the list of (id, major, minor, size, crc, contents) in the order of the partition table.
+    """
+    count, = struct.unpack_from('<L', stream, 8)
+    offset = 16 + count * PARTITION_ENTRY.size
+    out = []
+    for index in range(count):
+        entry = PARTITION_ENTRY.unpack_from(stream, 16 + index * PARTITION_ENTRY.size)
+        size = entry[3]
+        out.append(entry + (stream[offset:offset + size],))
+        offset += size
+    if offset != len(stream) or not out or out[-1][0] != APPLICATION_PARTITION:
+        raise ValueError('Malformed partitioned image')
+    return out
+
+
+def encode_partitions(image, partitions, base=None):
+    """
+    The partitions are (id, major, minor, contents); the application image is appended as the last partition.
+    The partitions that are the same in the base, which is the partitioned image installed on the device,
+    are omitted, so that they are not transferred at all.
+    """
+    installed = set()
+    if base is not None:
+        installed = {entry[:5] for entry in parse_partitions(base)}
+
+    entries = []
+    for pid, major, minor, contents in partitions:
+        if pid == APPLICATION_PARTITION or not 0 <= pid <= 255:
+            raise ValueError('Invalid partition ID: %d' % pid)
+        contents = contents + b'\xFF' * (-len(contents) % 8)
+        entry = (pid, major, minor, len(contents), crc64(contents))
+        if entry in installed:
+            print('Partition %d is unchanged, omitted' % pid, file=sys.stderr)
+        else:
+            entries.append(entry + (contents,))
+    entries.append((APPLICATION_PARTITION, 0, 0, len(image), find_image_crc(image), image))
+
+    out = bytearray(PARTITION_MAGIC + struct.pack('<LL', len(entries), 0))
+    for entry in entries:
+        out.extend(PARTITION_ENTRY.pack(*entry[:5]))
+    for entry in entries:
+        out.extend(entry[5])
+    return bytes(out)
+
+
+def decode_partitions(stream):
+    """
+    Returns the application partition, which is what the bootloader writes into its storage.
+    """
+    for pid, _major, _minor, _size, crc, contents in parse_partitions(stream):
+        if pid != APPLICATION_PARTITION and crc != crc64(contents):
+            raise ValueError('CRC mismatch in partition %d' % pid)
+    return parse_partitions(stream)[-1][5]
+
+
+def parse_partition_argument(text):
+    pid, version, file_name = text.split(':', 2)
+    major, minor = version.split('.')
+    with open(file_name, 'rb') as f:
+        return int(pid), int(major), int(minor), f.read()
+
+
+#
+# AES-CTR encryption; see kocherga_aes.hpp
+#
+AES_MAGIC = b'KAESCTR0'
+
+
+def _gf_multiply(a, b):
+    out = 0
+    for _ in range(8):
+        if b & 1:
+            out ^= a
+        a = ((a << 1) ^ (0x1B if a & 0x80 else 0)) & 0xFF
+        b >>= 1
+    return out
+
+
+def _make_aes_sbox():
+    sbox = []
+    for x in range(256):
+        inverse = 0
+        if x:
+            inverse = 1
+            for _ in range(254):
+                inverse = _gf_multiply(inverse, x)
+        rotated = [((inverse << n) | (inverse >> (8 - n))) & 0xFF for n in range(1, 5)]
+        sbox.append(inverse ^ rotated[0] ^ rotated[1] ^ rotated[2] ^ rotated[3] ^ 0x63)
+    return sbox
+
+
+AES_SBOX = _make_aes_sbox()
+
+
+def aes_expand_key(key):
+    if len(key) not in (16, 24, 32):
+        raise ValueError('The key shall be 16, 24, or 32 bytes long')
+    nk = len(key) // 4
+    rounds = nk + 6
+    words = [list(key[4 * i:4 * i + 4]) for i in range(nk)]
+    rcon = 1
+    for i in range(nk, 4 * (rounds + 1)):
+        temp = list(words[i - 1])
+        if i % nk == 0:
+            temp = [AES_SBOX[b] for b in temp[1:] + temp[:1]]
+            temp[0] ^= rcon
+            rcon = _gf_multiply(rcon, 2)
+        elif nk > 6 and i % nk == 4:
+            temp = [AES_SBOX[b] for b in temp]
+        words.append([a ^ b for a, b in zip(words[i - nk], temp)])
+    return [sum(words[4 * r:4 * r + 4], []) for r in range(rounds + 1)]
+
+
+def aes_encrypt_block(round_keys, block):
+    state = [a ^ b for a, b in zip(block, round_keys[0])]
+    for index, round_key in enumerate(round_keys[1:], 1):
+        state = [AES_SBOX[b] for b in state]
+        state = [state[(i + 4 * (i % 4)) % 16] for i in range(16)]      # ShiftRows; the state is column-major
+        if index < len(round_keys) - 1:
+            mixed = []
+            for c in range(4):
+                a = state[4 * c:4 * c + 4]
+                for r in range(4):
+                    mixed.append(_gf_multiply(a[r], 2) ^ _gf_multiply(a[(r + 1) % 4], 3) ^
+                                 a[(r + 2) % 4] ^ a[(r + 3) % 4])
+            state = mixed
+        state = [a ^ b for a, b in zip(state, round_key)]
+    return bytes(state)
+
+
+def aes_ctr(key, counter, data):
+    """
+    Encryption and decryption are the same operation in the counter mode.
+    """
+    round_keys = aes_expand_key(key)
+    counter = int.from_bytes(counter, 'big')
+    out = bytearray()
+    for offset in range(0, len(data), 16):
+        key_stream = aes_encrypt_block(round_keys, counter.to_bytes(16, 'big'))
+        counter = (counter + 1) % (1 << 128)
+        out.extend(a ^ b for a, b in zip(data[offset:offset + 16], key_stream))
+    return bytes(out)
+
+
+def encrypt_aes(image, key, key_id, counter=None):
+    counter = counter or os.urandom(16)
+    return AES_MAGIC + struct.pack('<BBHL', key_id, len(key), 0, len(image)) + counter + aes_ctr(key, counter, image)
+
+
+def decode_aes(stream, key):
+    key_id, key_size, _, size = struct.unpack_from('<BBHL', stream, 8)
+    if key is None or len(key) != key_size:
+        raise ValueError('The key %d of %d bytes is required to decrypt the image' % (key_id, key_size))
+    if len(stream) != 32 + size:
+        raise ValueError('Malformed encrypted image')
+    return aes_ctr(key, stream[16:32], stream[32:])
+
+
+#
+# Ed25519ph signatures (RFC 8032); see kocherga_ed25519.hpp
+#
+ED25519_P = 2 ** 255 - 19
+ED25519_L = 2 ** 252 + 27742317777372353535851937790883648493
+ED25519_D = -121665 * pow(121666, ED25519_P - 2, ED25519_P) % ED25519_P
+ED25519_DOMAIN = b'SigEd25519 no Ed25519 collisions' + bytes([1, 0])      # Ed25519ph with an empty context
+
+
+def _ed25519_add(a, b):
+    p = ED25519_P
+    x = (a[1] - a[0]) * (b[1] - b[0]) % p
+    y = (a[1] + a[0]) * (b[1] + b[0]) % p
+    t = 2 * a[3] * b[3] * ED25519_D % p
+    z = 2 * a[2] * b[2] % p
+    e, f, g, h = y - x, z - t, z + t, y + x
+    return e * f % p, g * h % p, f * g % p, e * h % p
+
+
+def _ed25519_multiply(scalar, point):
+    out = (0, 1, 1, 0)
+    while scalar:
+        if scalar & 1:
+            out = _ed25519_add(out, point)
+        point = _ed25519_add(point, point)
+        scalar >>= 1
+    return out
+
+
+def _ed25519_compress(point):
+    z = pow(point[2], ED25519_P - 2, ED25519_P)
+    x, y = point[0] * z % ED25519_P, point[1] * z % ED25519_P
+    return (y | ((x & 1) << 255)).to_bytes(32, 'little')
+
+
+def _ed25519_base_point():
+    p = ED25519_P
+    y = 4 * pow(5, p - 2, p) % p
+    xx = (y * y - 1) * pow(ED25519_D * y * y + 1, p - 2, p) % p
+    x = pow(xx, (p + 3) // 8, p)
+    if (x * x - xx) % p:
+        x = x * pow(2, (p - 1) // 4, p) % p
+    if x & 1:
+        x = p - x
+    return x, y, 1, x * y % p
+
+
+def _ed25519_hash(*parts):
+    return int.from_bytes(hashlib.sha512(ED25519_DOMAIN + b''.join(parts)).digest(), 'little') % ED25519_L
+
+
+def ed25519ph_sign(private_key, message):
+    """
+    Returns the public key and the signature of the message.
+    """
+    if len(private_key) != 32:
+        raise ValueError('The private key shall be 32 bytes long')
+    h = hashlib.sha512(private_key).digest()
+    a = (int.from_bytes(h[:32], 'little') & ((1 << 254) - 8)) | (1 << 254)
+    base = _ed25519_base_point()
+    public_key = _ed25519_compress(_ed25519_multiply(a, base))
+    prehash = hashlib.sha512(message).digest()
+    r = _ed25519_hash(h[32:], prehash)
+    rs = _ed25519_compress(_ed25519_multiply(r, base))
+    s = (r + _ed25519_hash(rs, public_key, prehash) * a) % ED25519_L
+    return public_key, rs + s.to_bytes(32, 'little')
+
+
+def sign_image(image, private_key):
+    """
+    The signature covers the image as it is stored, including its CRC, and is appended right after it.
+    """
+    _, size = find_app_descriptor(image)
+    return ed25519ph_sign(private_key, image[:size])
+
+
+def decode_layer(stream, base=None, key=None):
+    """
+    Decodes one layer of encoding; returns None if the stream is not recognized as encoded.
+    """
+    magic = stream[:8]
+    if magic == DELTA_MAGIC:
+        if base is None:
+            raise ValueError('The base image is required to decode a delta patch')
+        return decode_delta(stream, base)
+    if magic == LZSS_MAGIC:
+        return decode_lzss(stream)
+    if magic == SPARSE_MAGIC:
+        return decode_sparse(stream)
+    if magic == PARTITION_MAGIC:
+        return decode_partitions(stream)
+    if magic == AES_MAGIC:
+        return decode_aes(stream, key)
+    return None
+
+
+def decode(stream, base=None, key=None):
+    """
+    Decodes the stream repeatedly until it is not recognized as encoded, like the bootloader does.
+    """
+    while True:
+        decoded = decode_layer(stream, base, key)
+        if decoded is None:
+            return stream
+        stream = decoded
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command')
+
+    compress = commands.add_parser('compress', help='compress the image')
+    compress.add_argument('--window-bits', type=int, default=11,
+                          help='base-two logarithm of the window size; the bootloader must support it')
+    compress.add_argument('input')
+    compress.add_argument('output')
+
+    delta = commands.add_parser('delta', help='generate a patch that turns the base image into the new image')
+    delta.add_argument('--base', required=True, help='the image that is installed on the device')
+    delta.add_argument('input', help='the new image')
+    delta.add_argument('output')
+
+    sparse = commands.add_parser('sparse', help='replace the regions filled with 0xFF with holes')
+    sparse.add_argument('--min-hole', type=int, default=64,
+                        help='shorter runs of 0xFF are sent as is; a hole costs a few bytes in the stream')
+    sparse.add_argument('input')
+    sparse.add_argument('output')
+
+    enc = commands.add_parser('encrypt', help='encrypt the image with AES-CTR')
+    enc.add_argument('--key', required=True, help='the key in hex; 16, 24, or 32 bytes')
+    enc.add_argument('--key-id', type=int, default=0, help='the ID the bootloader finds the key by')
+    enc.add_argument('--counter', help='the initial counter block in hex; random by default, never reuse it')
+    enc.add_argument('input')
+    enc.add_argument('output')
+
+    part = commands.add_parser('partitions', help='pack the image together with other partitions')
+    part.add_argument('--partition', action='append', default=[], metavar='ID:MAJOR.MINOR:FILE',
+                      type=parse_partition_argument, help='a partition to include; the ID shall not be zero')
+    part.add_argument('--base', help='the partitioned image that is installed on the device; '
+                                     'the partitions that are unchanged are omitted')
+    part.add_argument('input', help='the application image')
+    part.add_argument('output')
+
+    sign = commands.add_parser('sign', help='append the Ed25519ph signature to the image')
+    sign.add_argument('--key', required=True, help='the 32-byte private key in hex; keep it secret')
+    sign.add_argument('input', help='the image processed with populate_app_descriptor.py')
+    sign.add_argument('output')
+
+    dec = commands.add_parser('decode', help='decode a stream produced by this script')
+    dec.add_argument('--base', help='the base image, required for delta patches')
+    dec.add_argument('--key', help='the key in hex, required for encrypted images')
+    dec.add_argument('input')
+    dec.add_argument('output')
+
+    args = parser.parse_args()
+    if not args.command:
+        parser.print_help()
+        return 1
+
+    with open(args.input, 'rb') as f:
+        data = f.read()
+    base = None
+    if getattr(args, 'base', None):
+        with open(args.base, 'rb') as f:
+            base = f.read()
+    key = bytes.fromhex(args.key) if getattr(args, 'key', None) else None
+
+    if args.command == 'decode':
+        out = decode(data, base, key)
+    elif args.command == 'sign':
+        public_key, signature = sign_image(data, key)
+        out = data[:find_app_descriptor(data)[1]] + signature
+        print('sign: public key %s' % public_key.hex(), file=sys.stderr)
+    else:
+        if args.command == 'compress':
+            out = encode_lzss(data, args.window_bits)
+        elif args.command == 'sparse':
+            out = encode_sparse(data, args.min_hole)
+        elif args.command == 'partitions':
+            out = encode_partitions(data, args.partition, base)
+        elif args.command == 'encrypt':
+            counter = bytes.fromhex(args.counter) if args.counter else None
+            out = encrypt_aes(data, key, args.key_id, counter)
+        else:
+            out = encode_delta(base, data)
+        if decode_layer(out, base, key) != data:
+            raise AssertionError('Self-check failed')
+        print('%s: %d bytes -> %d bytes (%.1f%%)' % (args.command, len(data), len(out), 100.0 * len(out) / len(data)),
+              file=sys.stderr)
+
+    with open(args.output, 'wb') as f:
+        f.write(out)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -30,6 +30,11 @@
 #include <vector>
 #include <utility>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <bitset>
+#include <optional>
+#include <algorithm>
 #include <functional>
 
 
@@ -54,6 +59,15 @@ class Platform : public kocherga::IPlatform
     std::int64_t mutex_lock_nesting_ = 0;
     std::recursive_mutex mutex_;
 
+    std::uint64_t storage_mutex_lock_count_ = 0;
+    std::int64_t storage_mutex_lock_nesting_ = 0;
+    std::recursive_mutex storage_mutex_;
+
+    std::optional<kocherga::UpgradeJournal> upgrade_journal_;
+    std::uint64_t upgrade_journal_store_count_ = 0;
+    std::map<std::uint8_t, std::vector<std::uint8_t>> decryption_keys_;
+    kocherga::ISignatureVerifier* signature_verifier_ = nullptr;
+
     void lockMutex() final
     {
         mutex_.lock();
@@ -77,11 +91,38 @@ class Platform : public kocherga::IPlatform
         mutex_.unlock();
     }
 
+    void lockStorageMutex() final
+    {
+        storage_mutex_.lock();
+        storage_mutex_lock_nesting_++;
+        storage_mutex_lock_count_++;
+
+        if (storage_mutex_lock_nesting_ > 10)
+        {
+            throw BadUsageException("Storage mutex usage bug: unhealthy locking habits");
+        }
+    }
+
+    void unlockStorageMutex() final
+    {
+        if (storage_mutex_lock_nesting_ <= 0)
+        {
+            throw BadUsageException("Storage mutex usage bug: cannot unlock mutex that is not locked");
+        }
+
+        storage_mutex_lock_nesting_--;
+        storage_mutex_.unlock();
+    }
+
 public:
     bool isMutexLocked() const { return mutex_lock_nesting_ > 0; }
 
     std::uint64_t getMutexLockCount() const { return mutex_lock_count_; }
 
+    bool isStorageMutexLocked() const { return storage_mutex_lock_nesting_ > 0; }
+
+    std::uint64_t getStorageMutexLockCount() const { return storage_mutex_lock_count_; }
+
     std::chrono::microseconds getMonotonicUptime() const final
     {
         // The library guarantees that the uptime can only be requested when the mutex is locked.
@@ -94,6 +135,53 @@ public:
         return std::chrono::duration_cast<std::chrono::microseconds>
             (std::chrono::steady_clock::now().time_since_epoch());
     }
+
+    std::optional<kocherga::UpgradeJournal> loadUpgradeJournal() final
+    {
+        if (storage_mutex_lock_nesting_ <= 0)
+        {
+            throw BadUsageException("Upgrade journal usage bug: storage mutex not locked");
+        }
+        return upgrade_journal_;
+    }
+
+    void storeUpgradeJournal(const std::optional<kocherga::UpgradeJournal>& journal) final
+    {
+        if (storage_mutex_lock_nesting_ <= 0)
+        {
+            throw BadUsageException("Upgrade journal usage bug: storage mutex not locked");
+        }
+        upgrade_journal_ = journal;
+        upgrade_journal_store_count_++;
+    }
+
+    bool getDecryptionKey(std::uint8_t key_id, std::uint8_t* key, std::uint8_t key_size) final
+    {
+        if (mutex_lock_nesting_ <= 0)
+        {
+            throw BadUsageException("Decryption key usage bug: mutex not locked");
+        }
+        const auto it = decryption_keys_.find(key_id);
+        if ((it == decryption_keys_.end()) || (it->second.size() != key_size))
+        {
+            return false;
+        }
+        std::copy(it->second.begin(), it->second.end(), key);
+        return true;
+    }
+
+    kocherga::ISignatureVerifier* getSignatureVerifier() final { return signature_verifier_; }
+
+    /// The journal persists across the controller instances that use this platform, like a non-volatile memory.
+    std::optional<kocherga::UpgradeJournal> getUpgradeJournal() const { return upgrade_journal_; }
+    void setUpgradeJournal(const std::optional<kocherga::UpgradeJournal>& journal) { upgrade_journal_ = journal; }
+
+    std::uint64_t getUpgradeJournalStoreCount() const { return upgrade_journal_store_count_; }
+
+    void setDecryptionKey(std::uint8_t key_id, const std::vector<std::uint8_t>& key) { decryption_keys_[key_id] = key; }
+
+    /// Takes effect for the controllers constructed afterwards.
+    void setSignatureVerifier(kocherga::ISignatureVerifier* verifier) { signature_verifier_ = verifier; }
 };
 
 /**
@@ -287,6 +375,536 @@ public:
 };
 
 
+/**
+ * Durations of flash operations for @ref FlashSimulator; the defaults are typical for a small NOR flash.
+ */
+struct FlashTimings
+{
+    std::chrono::microseconds sector_erase{80'000};     ///< Typical for small sectors; large ones take longer
+    std::chrono::microseconds page_program{40};         ///< Per page program operation, in addition to the bytes
+    std::chrono::microseconds program_per_byte{4};
+    std::chrono::nanoseconds read_per_byte{25};
+};
+
+/**
+ * In-memory NOR flash model with a virtual clock, used for evaluating the timing of the upgrade process on the host.
+ * Each operation advances the clock by the time it would take on real hardware; the time spent elsewhere
+ * (e.g., receiving data over the link) is accounted for by the test using advanceTime(), or by @ref LinkProtocol.
+ *
+ * The flash controller can do only one thing at a time, so a read or a write waits for the erase in progress
+ * to complete. Writes are split into page program operations at the page boundaries.
+ * Programming can only change the bits from 1 to 0; an attempt to change a bit from 0 to 1 without erasing
+ * the sector first is treated as usage error, unless allowed with setOverprogrammingAllowed(), in which case
+ * the bit silently remains 0 like on the real hardware.
+ * The erase cycles are counted per sector. A sector that has reached the endurance limit cannot be erased anymore.
+ */
+class FlashSimulator : public kocherga::IROMBackend
+{
+    const std::size_t sector_size_;
+    const std::size_t page_size_;
+    const FlashTimings timings_;
+    std::vector<std::uint8_t> rom_;
+    std::vector<std::uint32_t> sector_erase_counts_;
+
+    mutable std::chrono::nanoseconds now_{};
+    mutable std::uint64_t read_bytes_ = 0;
+    std::chrono::nanoseconds busy_until_{};
+    std::optional<std::size_t> erasing_;                    ///< Offset of the sector being erased, if any
+    std::uint64_t erase_count_ = 0;
+    std::uint64_t written_bytes_ = 0;
+    std::uint64_t page_programs_ = 0;
+    std::uint64_t overprogrammed_bits_ = 0;
+
+    bool overprogramming_allowed_ = false;
+    std::uint32_t endurance_ = std::numeric_limits<std::uint32_t>::max();
+    std::function<std::int16_t (std::int16_t)> failure_injector_;   ///< Applied to writes
+
+    bool upgrade_in_progress_ = false;
+
+    void waitUntilIdle() const
+    {
+        now_ = std::max(now_, busy_until_);
+    }
+
+    bool isBeingErased(std::size_t offset, std::size_t size) const
+    {
+        return erasing_ && (offset < (*erasing_ + sector_size_)) && ((offset + size) > *erasing_);
+    }
+
+    std::int16_t beginUpgrade() override
+    {
+        if (upgrade_in_progress_)
+        {
+            throw BadUsageException("beginUpgrade() called twice");
+        }
+        upgrade_in_progress_ = true;
+        return 0;
+    }
+
+    std::int16_t endUpgrade(bool success) override
+    {
+        (void) success;
+        if (!upgrade_in_progress_)
+        {
+            throw BadUsageException("endUpgrade() called twice");
+        }
+        if (erasing_)
+        {
+            throw BadUsageException("Upgrade finalized while an erase is in progress");
+        }
+        upgrade_in_progress_ = false;
+        return 0;
+    }
+
+    void programPage(std::size_t offset, const std::uint8_t* data, std::size_t size)
+    {
+        for (std::size_t i = 0; i < size; i++)
+        {
+            auto& cell = rom_.at(offset + i);
+            if (const auto stuck = std::uint8_t(data[i] & ~cell); stuck != 0)
+            {
+                if (!overprogramming_allowed_)
+                {
+                    throw BadUsageException("Programming a bit from 0 to 1 without an erase");
+                }
+                overprogrammed_bits_ += std::uint64_t(std::bitset<8>(stuck).count());
+            }
+            cell = std::uint8_t(cell & data[i]);
+        }
+        now_ += timings_.page_program + timings_.program_per_byte * size;
+        page_programs_++;
+    }
+
+    std::int16_t write(std::size_t offset, const void* data, std::uint16_t size) override
+    {
+        if (!upgrade_in_progress_)
+        {
+            throw BadUsageException("Upgrade is not in progress!");
+        }
+        if ((offset + size) > rom_.size())
+        {
+            throw BadUsageException("Write out of range");
+        }
+        if (isBeingErased(offset, size))
+        {
+            throw BadUsageException("Writing into a sector that is being erased");
+        }
+
+        waitUntilIdle();
+
+        // Checking the failure generator before we modify the storage!
+        if (failure_injector_)
+        {
+            if (const auto res = failure_injector_(std::int16_t(size)); res != size)
+            {
+                return res;
+            }
+        }
+
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        for (std::size_t done = 0; done < size;)
+        {
+            const auto n = std::min<std::size_t>(size - done, page_size_ - ((offset + done) % page_size_));
+            programPage(offset + done, bytes + done, n);
+            done += n;
+        }
+        written_bytes_ += size;
+        return std::int16_t(size);
+    }
+
+    std::size_t getSectorSize(std::size_t offset) const override
+    {
+        return ((offset < rom_.size()) && ((offset % sector_size_) == 0)) ? sector_size_ : 0;
+    }
+
+    std::int16_t eraseSector(std::size_t offset) override
+    {
+        if (const auto res = startSectorErase(offset); res < 0)
+        {
+            return res;
+        }
+        return awaitSectorErase(true);
+    }
+
+    std::int16_t startSectorErase(std::size_t offset) override
+    {
+        if (!upgrade_in_progress_ || erasing_ || (getSectorSize(offset) == 0))
+        {
+            throw BadUsageException("Bad sector erase");
+        }
+        waitUntilIdle();
+        auto& cycles = sector_erase_counts_.at(offset / sector_size_);
+        if (cycles >= endurance_)
+        {
+            return -kocherga::ErrROMWriteFailure;   // Worn out
+        }
+        cycles++;
+        std::fill_n(rom_.begin() + std::ptrdiff_t(offset), sector_size_, std::uint8_t(0xFF));
+        erasing_ = offset;
+        busy_until_ = now_ + timings_.sector_erase;
+        return 0;
+    }
+
+    std::int16_t awaitSectorErase(bool blocking) override
+    {
+        if (!erasing_)
+        {
+            throw BadUsageException("No erase in progress");
+        }
+        if (!blocking && (now_ < busy_until_))
+        {
+            return 0;
+        }
+        waitUntilIdle();
+        erasing_.reset();
+        erase_count_++;
+        return 1;
+    }
+
+public:
+    /**
+     * The storage is initially filled with zeros rather than 0xFF to simulate a previously written image.
+     */
+    FlashSimulator(std::size_t rom_size,
+                   std::size_t sector_size,
+                   std::size_t page_size = 256,
+                   FlashTimings timings = {}) :
+        sector_size_(sector_size),
+        page_size_(page_size),
+        timings_(timings),
+        rom_(rom_size, 0),
+        sector_erase_counts_(rom_size / sector_size, 0)
+    {
+        if ((page_size_ == 0) || ((sector_size_ % page_size_) != 0) || ((rom_size % sector_size_) != 0))
+        {
+            throw BadUsageException("Invalid flash geometry");
+        }
+    }
+
+    std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const override
+    {
+        if (isBeingErased(offset, size))
+        {
+            throw BadUsageException("Reading from a sector that is being erased");
+        }
+        waitUntilIdle();
+        size = std::uint16_t(std::min<std::size_t>(size, rom_.size() - std::min(offset, rom_.size())));
+        std::memcpy(data, rom_.data() + offset, size);
+        now_ += timings_.read_per_byte * size;
+        read_bytes_ += size;
+        return std::int16_t(size);
+    }
+
+    /// Used by the test to account for the time that the controller spends elsewhere.
+    void advanceTime(std::chrono::microseconds duration) { now_ += duration; }
+
+    std::chrono::microseconds getTime() const { return std::chrono::duration_cast<std::chrono::microseconds>(now_); }
+
+    void setOverprogrammingAllowed(bool allowed) { overprogramming_allowed_ = allowed; }
+
+    void setFailureInjector(std::function<std::int16_t (std::int16_t)> injector)
+    {
+        failure_injector_ = injector;
+    }
+
+    /// The number of erase cycles after which a sector cannot be erased anymore; unlimited by default.
+    void setEndurance(std::uint32_t cycles) { endurance_ = cycles; }
+
+    std::uint64_t getEraseCount() const { return erase_count_; }
+
+    std::uint32_t getSectorEraseCount(std::size_t sector_index) const { return sector_erase_counts_.at(sector_index); }
+
+    std::uint32_t getMaxSectorEraseCount() const
+    {
+        return *std::max_element(sector_erase_counts_.begin(), sector_erase_counts_.end());
+    }
+
+    std::uint64_t getWrittenByteCount() const { return written_bytes_; }
+
+    std::uint64_t getReadByteCount() const { return read_bytes_; }
+
+    std::uint64_t getPageProgramCount() const { return page_programs_; }
+
+    /// The number of bits that could not be changed from 0 to 1; see setOverprogrammingAllowed().
+    std::uint64_t getOverprogrammedBitCount() const { return overprogrammed_bits_; }
+
+    bool isUpgradeInProgress() const { return upgrade_in_progress_; }
+
+    bool isSameImage(const void* reference, std::size_t reference_size) const
+    {
+        return (reference_size <= rom_.size()) && (std::memcmp(reference, rom_.data(), reference_size) == 0);
+    }
+};
+
+/**
+ * Delivers the image in chunks of the specified size, modeling the time it takes to transfer each chunk
+ * over a specific protocol and physical link. The transfer time is accounted for using the virtual clock
+ * of the flash simulator, so that the end-to-end upgrade time can be measured deterministically.
+ */
+class LinkProtocol : public kocherga::IProtocol
+{
+    const std::vector<std::uint8_t>& data_;
+    const std::uint16_t chunk_size_;
+    const std::chrono::microseconds chunk_time_;
+    FlashSimulator& flash_;
+
+    std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+    {
+        (void) sink.handleImageSizeHint(std::uint32_t(data_.size()));
+        for (std::size_t offset = 0; offset < data_.size(); offset += chunk_size_)
+        {
+            flash_.advanceTime(chunk_time_);
+            const auto size = std::uint16_t(std::min<std::size_t>(chunk_size_, data_.size() - offset));
+            if (const auto res = sink.handleNextDataChunk(&data_[offset], size); res < 0)
+            {
+                return res;
+            }
+        }
+        return 0;
+    }
+
+public:
+    LinkProtocol(const std::vector<std::uint8_t>& data,
+                 std::uint16_t chunk_size,
+                 std::chrono::microseconds chunk_time,
+                 FlashSimulator& flash) :
+        data_(data),
+        chunk_size_(chunk_size),
+        chunk_time_(chunk_time),
+        flash_(flash)
+    { }
+};
+
+/**
+ * A simple mock protocol that just downloads the specified image from memory.
+ */
+class Protocol : public kocherga::IProtocol
+{
+    static constexpr std::uint16_t BlockSize = 103;     ///< Using a weird prime block size intentionally
+
+    const std::uint8_t* ptr_;
+    std::size_t remaining_size_;
+    const std::function<void ()> chunk_callback_;
+
+    std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+    {
+        while (remaining_size_ > 0)
+        {
+            if (chunk_callback_)
+            {
+                chunk_callback_();
+            }
+
+            const std::uint16_t bs = std::uint16_t(std::min<std::size_t>(remaining_size_, BlockSize));
+
+            const auto result = sink.handleNextDataChunk(ptr_, bs);
+            if (result != bs)
+            {
+                if (result < 0)
+                {
+                    return result;
+                }
+                else
+                {
+                    return kocherga::ErrROMWriteFailure;
+                }
+            }
+
+            ptr_ += bs;
+            remaining_size_ -= bs;
+        }
+
+        return 0;
+    }
+
+public:
+    Protocol(const void* data,
+                 std::size_t size,
+                 std::function<void ()> callback_per_chunk = {}) :
+        ptr_(static_cast<const std::uint8_t*>(data)),
+        remaining_size_(size),
+        chunk_callback_(std::move(callback_per_chunk))
+    { }
+};
+
+/**
+ * Delivers the beginning of the image like @ref Protocol, then fails as if the link has been lost.
+ */
+class InterruptedProtocol : public kocherga::IProtocol
+{
+    static constexpr std::uint16_t BlockSize = 103;
+
+    const std::uint8_t* ptr_;
+    std::size_t remaining_size_;
+
+    std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+    {
+        while (remaining_size_ > 0)
+        {
+            const std::uint16_t bs = std::uint16_t(std::min<std::size_t>(remaining_size_, BlockSize));
+            if (const auto result = sink.handleNextDataChunk(ptr_, bs); result < 0)
+            {
+                return result;
+            }
+            ptr_ += bs;
+            remaining_size_ -= bs;
+        }
+        return ErrLinkLost;
+    }
+
+public:
+    static constexpr std::int16_t ErrLinkLost = -30000;
+
+    /**
+     * @param data              the image
+     * @param delivered_size    the number of bytes of the image that are delivered before the failure
+     */
+    InterruptedProtocol(const void* data, std::size_t delivered_size) :
+        ptr_(static_cast<const std::uint8_t*>(data)),
+        remaining_size_(delivered_size)
+    { }
+};
+
+/**
+ * Receives the data directly into the sink where possible, like the serial protocols do; see IDownloadSink::acquire().
+ * Every third block is received twice, as if the first copy were damaged, so it is not committed.
+ */
+class ZeroCopyProtocol : public kocherga::IProtocol
+{
+    static constexpr std::uint16_t BlockSize = 103;
+
+    const std::uint8_t* ptr_;
+    std::size_t remaining_size_;
+    std::size_t committed_size_ = 0;
+    std::size_t block_count_ = 0;
+
+    std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+    {
+        while (remaining_size_ > 0)
+        {
+            const std::uint16_t bs = std::uint16_t(std::min<std::size_t>(remaining_size_, BlockSize));
+
+            auto span = sink.acquire(bs);
+            if (((++block_count_ % 3) == 0) && (span.size > 0))
+            {
+                std::memset(span.data, 0xA5, span.size);
+                span = sink.acquire(bs);
+            }
+
+            std::int16_t result = 0;
+            if (span.size > 0)
+            {
+                const auto n = std::min(span.size, bs);
+                std::memcpy(span.data, ptr_, n);
+                result = sink.commit(n);
+                if (result >= 0)
+                {
+                    result = std::int16_t(n);
+                    committed_size_ += n;
+                }
+            }
+            else
+            {
+                result = sink.handleNextDataChunk(ptr_, bs);
+            }
+            if (result < 0)
+            {
+                return result;
+            }
+
+            ptr_ += result;
+            remaining_size_ -= std::size_t(result);
+        }
+
+        return 0;
+    }
+
+public:
+    ZeroCopyProtocol(const void* data, std::size_t size) :
+        ptr_(static_cast<const std::uint8_t*>(data)),
+        remaining_size_(size)
+    { }
+
+    /// The amount of data that has been received directly into the sink
+    std::size_t getCommittedSize() const { return committed_size_; }
+};
+
+/**
+ * Reports the image size before sending the data, like YMODEM does.
+ */
+class SizeHintingProtocol : public kocherga::IProtocol
+{
+    Protocol inner_;
+    const std::uint32_t reported_size_;
+
+    std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+    {
+        if (const auto res = sink.handleImageSizeHint(reported_size_); res < 0)
+        {
+            return res;
+        }
+        return static_cast<kocherga::IProtocol&>(inner_).downloadImage(sink);
+    }
+
+public:
+    SizeHintingProtocol(const void* data,
+                        std::size_t size,
+                        std::uint32_t reported_size,
+                        std::function<void ()> callback_per_chunk = {}) :
+        inner_(data, size, std::move(callback_per_chunk)),
+        reported_size_(reported_size)
+    { }
+};
+
+/**
+ * Identifies the image and starts the download from the offset requested by the sink, like UAVCAN does.
+ * The download can be interrupted at the specified offset to simulate a loss of the link.
+ */
+class ResumableProtocol : public kocherga::IProtocol
+{
+    static constexpr std::uint16_t BlockSize = 256;
+
+    const std::uint8_t* const data_;
+    const std::size_t size_;
+    const std::uint64_t image_id_;
+    const std::size_t interrupt_at_;
+
+    std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+    {
+        std::size_t offset = sink.getResumeOffset(image_id_);
+        if (const auto res = sink.handleImageSizeHint(std::uint32_t(size_)); res < 0)
+        {
+            return res;
+        }
+        while (offset < size_)
+        {
+            if (offset >= interrupt_at_)
+            {
+                return -kocherga::ErrInvalidState;
+            }
+            const auto bs = std::uint16_t(std::min<std::size_t>(size_ - offset, BlockSize));
+            if (const auto res = sink.handleNextDataChunk(data_ + offset, bs); res < 0)
+            {
+                return res;
+            }
+            offset += bs;
+        }
+        return 0;
+    }
+
+public:
+    ResumableProtocol(const void* data,
+                      std::size_t size,
+                      std::uint64_t image_id,
+                      std::size_t interrupt_at = std::numeric_limits<std::size_t>::max()) :
+        data_(static_cast<const std::uint8_t*>(data)),
+        size_(size),
+        image_id_(image_id),
+        interrupt_at_(interrupt_at)
+    { }
+};
+
+
 static_assert(32767 == kocherga::MaxDataBlockSize);
 
 }
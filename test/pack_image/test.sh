@@ -0,0 +1,83 @@
+#!/bin/bash
+
+set -e
+
+PACK=../../pack_image.py
+trap 'rm -f *.tmp' EXIT
+
+# A synthetic image with a descriptor; the contents are pseudo-random so that the diff is not trivial
+python3 - <<'PY'
+import random, struct
+random.seed(42)
+body = bytes(random.getrandbits(8) for _ in range(64 * 1024))
+descriptor = b'APDesc00' + struct.pack('<QLLBBBxL', 0x0123456789ABCDEF, 64 * 1024 + 32, 0, 1, 0, 1, 1)
+base = descriptor + body
+# Code inserted in the middle shifts everything after it; a few constants are changed elsewhere
+new = bytearray(base[:20000] + bytes(range(100)) + base[20000:])
+new[40000:40004] = b'\xAA\xBB\xCC\xDD'
+new[8] ^= 1                                 # The CRC is different, too
+open('base.tmp', 'wb').write(base)
+open('new.tmp', 'wb').write(new)
+PY
+
+# Delta patch round trip
+$PACK delta --base base.tmp new.tmp patch.tmp
+$PACK decode --base base.tmp patch.tmp decoded.tmp
+cmp new.tmp decoded.tmp
+[ $(stat --printf="%s" patch.tmp) -lt 1000 ]
+
+# A patch cannot be applied to a different image
+! $PACK decode --base new.tmp patch.tmp decoded.tmp 2>/dev/null
+
+# Compression round trip with different window sizes
+for bits in 8 11 13; do
+    $PACK compress --window-bits $bits new.tmp compressed.tmp
+    $PACK decode compressed.tmp decoded.tmp
+    cmp new.tmp decoded.tmp
+done
+
+# Compressed delta patch
+$PACK compress patch.tmp compressed.tmp
+$PACK decode --base base.tmp compressed.tmp decoded.tmp
+cmp new.tmp decoded.tmp
+
+# Sparse image: the padding between the sections becomes holes
+python3 - <<'PY2'
+data = open('new.tmp', 'rb').read()
+open('padded.tmp', 'wb').write(data[:30000] + b'\xFF' * 50000 + data[30000:] + b'\xFF' * 20000)
+PY2
+$PACK sparse padded.tmp sparse.tmp
+$PACK decode sparse.tmp decoded.tmp
+cmp padded.tmp decoded.tmp
+[ $(stat --printf="%s" sparse.tmp) -lt $(( $(stat --printf="%s" new.tmp) + 100 )) ]
+
+# Compressed sparse image
+$PACK compress sparse.tmp compressed.tmp
+$PACK decode compressed.tmp decoded.tmp
+cmp padded.tmp decoded.tmp
+
+# Partitioned image; the partitions that are unchanged since the base are omitted
+head -c 20000 base.tmp > assets.tmp
+head -c 1001 new.tmp > config.tmp
+$PACK partitions --partition 1:1.0:assets.tmp --partition 2:0.1:config.tmp new.tmp partitions.tmp
+$PACK decode partitions.tmp decoded.tmp
+cmp new.tmp decoded.tmp
+echo 'changed' >> config.tmp
+$PACK partitions --partition 1:1.0:assets.tmp --partition 2:0.2:config.tmp --base partitions.tmp new.tmp update.tmp
+$PACK decode update.tmp decoded.tmp
+cmp new.tmp decoded.tmp
+[ $(stat --printf="%s" update.tmp) -lt $(( $(stat --printf="%s" partitions.tmp) - 20000 )) ]
+
+# Encrypted compressed sparse image; it cannot be decoded without the key
+KEY=000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f
+$PACK encrypt --key-id 3 --key $KEY compressed.tmp encrypted.tmp
+$PACK decode --key $KEY encrypted.tmp decoded.tmp
+cmp padded.tmp decoded.tmp
+! $PACK decode encrypted.tmp decoded.tmp 2>/dev/null
+
+# Signed image; the signature follows the image, which is left as is
+$PACK sign --key $KEY base.tmp signed.tmp
+[ $(stat --printf="%s" signed.tmp) -eq $(( $(stat --printf="%s" base.tmp) + 64 )) ]
+cmp -n $(stat --printf="%s" base.tmp) base.tmp signed.tmp
+
+echo OK
@@ -0,0 +1,319 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+// We want to ensure that assertion checks are enabled when tests are run, for extra safety
+#ifdef NDEBUG
+# undef NDEBUG
+#endif
+
+#define KOCHERGA_TRACE std::printf
+
+// The library headers must be included first to make sure that they don't have any hidden include dependencies.
+#include <kocherga_aes.hpp>
+#include <kocherga_lz.hpp>
+
+#include "catch.hpp"
+#include "mocks.hpp"
+#include "images.hpp"
+#include "util.hpp"
+
+#include <iostream>
+#include <iomanip>
+
+
+namespace
+{
+
+std::vector<std::uint8_t> fromHex(const std::string& hex)
+{
+    std::vector<std::uint8_t> out;
+    for (std::size_t i = 0; i < hex.size(); i += 2)
+    {
+        out.push_back(std::uint8_t(std::stoul(hex.substr(i, 2), nullptr, 16)));
+    }
+    return out;
+}
+
+const std::string KeyHex = "2b7e151628aed2a6abf7158809cf4f3c";
+
+/// Counts the calls to make sure that the key stream is generated in batches and that the key is cleared
+class CountingCipher : public kocherga_aes::IBlockCipher
+{
+    kocherga_aes::SoftwareCipher cipher_;
+    std::size_t calls_ = 0;
+    std::size_t blocks_ = 0;
+    bool has_key_ = false;
+
+    bool setKey(const std::uint8_t* key, std::uint8_t key_size) override
+    {
+        has_key_ = cipher_.setKey(key, key_size);
+        return has_key_;
+    }
+
+    bool encryptBlocks(const std::uint8_t* in, std::uint8_t* out, std::size_t count) override
+    {
+        REQUIRE(count > 0);
+        REQUIRE(count <= kocherga_aes::DecryptionFilter::BatchBlocks);
+        calls_++;
+        blocks_ += count;
+        return cipher_.encryptBlocks(in, out, count);
+    }
+
+    void clearKey() override
+    {
+        cipher_.clearKey();
+        has_key_ = false;
+    }
+
+public:
+    std::size_t getCallCount() const { return calls_; }
+    std::size_t getBlockCount() const { return blocks_; }
+    bool hasKey() const { return has_key_; }
+};
+
+class NullReference : public kocherga::IReferenceImage
+{
+    std::optional<kocherga::AppInfo> getAppInfo() const override { return {}; }
+
+    std::int16_t read(std::size_t, void*, std::uint16_t) const override { return -kocherga::ErrInvalidState; }
+};
+
+class CollectingSink : public kocherga::IDownloadSink
+{
+    std::vector<std::uint8_t> data_;
+
+    std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+    {
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        data_.insert(data_.end(), bytes, bytes + size);
+        return std::int16_t(size);
+    }
+
+public:
+    const std::vector<std::uint8_t>& getData() const { return data_; }
+
+    void clear() { data_.clear(); }
+};
+
+}
+
+
+TEST_CASE("AES-SoftwareCipher")
+{
+    // FIPS-197, appendix C
+    const auto plaintext = fromHex("00112233445566778899aabbccddeeff");
+    const std::vector<std::pair<std::string, std::string>> vectors{
+        {"000102030405060708090a0b0c0d0e0f", "69c4e0d86a7b0430d8cdb78070b4c55a"},
+        {"000102030405060708090a0b0c0d0e0f1011121314151617", "dda97ca4864cdfe06eaf70a0ec0d7191"},
+        {"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "8ea2b7ca516745bfeafc49904b496089"},
+    };
+    for (const auto& v : vectors)
+    {
+        kocherga_aes::SoftwareCipher cipher;
+        const auto key = fromHex(v.first);
+        REQUIRE(cipher.setKey(key.data(), std::uint8_t(key.size())));
+        std::array<std::uint8_t, 32> out{};
+        std::vector<std::uint8_t> in = plaintext;
+        in.insert(in.end(), plaintext.begin(), plaintext.end());
+        REQUIRE(cipher.encryptBlocks(in.data(), out.data(), 2));
+        REQUIRE(std::vector<std::uint8_t>(out.begin(), out.begin() + 16) == fromHex(v.second));
+        REQUIRE(std::vector<std::uint8_t>(out.begin() + 16, out.end()) == fromHex(v.second));
+        cipher.clearKey();
+        REQUIRE(!cipher.encryptBlocks(in.data(), out.data(), 2));
+    }
+
+    kocherga_aes::SoftwareCipher cipher;
+    std::array<std::uint8_t, 16> block{};
+    REQUIRE(!cipher.encryptBlocks(block.data(), block.data(), 1));     // No key
+    REQUIRE(!cipher.setKey(block.data(), 8));
+}
+
+
+TEST_CASE("AES-Decryption")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    const std::vector<std::uint8_t> image(images::AppValid2.begin(), images::AppValid2.end());
+
+    // NIST SP 800-38A, F.5.1; the stream is decrypted the same way regardless of the chunk sizes
+    {
+        mocks::Platform platform;
+        platform.setDecryptionKey(7, fromHex(KeyHex));
+        kocherga_aes::SoftwareCipher cipher;
+        kocherga_aes::DecryptionFilter filter(platform, cipher);
+        kocherga::IStreamFilter& stream = filter;
+
+        auto encrypted = fromHex("4b41455343545230" "07100000" "20000000" "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff"
+                                 "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff");
+        const auto expected = fromHex("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51");
+        for (std::uint16_t chunk = 1; chunk <= encrypted.size(); chunk++)
+        {
+            NullReference reference;
+            CollectingSink sink;
+            REQUIRE(0 == stream.beginStream(sink, reference));
+            for (std::size_t offset = 0; offset < encrypted.size(); offset += chunk)
+            {
+                const auto n = std::uint16_t(std::min<std::size_t>(chunk, encrypted.size() - offset));
+                REQUIRE(n == stream.handleNextDataChunk(&encrypted[offset], n));
+            }
+            REQUIRE(0 == stream.endStream());
+            REQUIRE(sink.getData() == expected);
+            REQUIRE(!cipher.encryptBlocks(encrypted.data(), encrypted.data(), 1));    // The key is cleared
+        }
+
+        // The key is also cleared if the stream is aborted
+        NullReference reference;
+        CollectingSink sink;
+        REQUIRE(0 == stream.beginStream(sink, reference));
+        REQUIRE(40 == stream.handleNextDataChunk(encrypted.data(), 40));
+        std::array<std::uint8_t, 16> block{};
+        REQUIRE(cipher.encryptBlocks(block.data(), block.data(), 1));
+        stream.abortStream();
+        REQUIRE(!cipher.encryptBlocks(block.data(), block.data(), 1));
+    }
+
+    mocks::Platform platform;
+    platform.setDecryptionKey(1, fromHex(KeyHex));
+    mocks::FileMappedROMBackend rom("aes-test-rom.tmp", ROMSize);
+    CountingCipher cipher;
+    kocherga_aes::DecryptionFilter filter(platform, cipher);
+    kocherga_lz::DecompressionFilter<11> decompressor;
+    kocherga::BootloaderController blc(platform, rom, ROMSize);
+    REQUIRE(blc.addStreamFilter(filter));
+    REQUIRE(blc.addStreamFilter(decompressor));
+
+    // The counter wraps around in the middle of the image
+    const auto encrypted = util::packImage("encrypt --key-id 1 --key " + KeyHex +
+                                           " --counter ffffffffffffffffffffffffffffff00", image);
+    REQUIRE(encrypted.size() == image.size() + 32U);
+    {
+        mocks::Protocol proto(encrypted.data(), encrypted.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(rom.isSameImage(image.data(), image.size()));
+        REQUIRE(cipher.getBlockCount() == (image.size() + 15U) / 16U);
+        REQUIRE(cipher.getCallCount() == (cipher.getBlockCount() + 15U) / 16U);
+        REQUIRE(!cipher.hasKey());
+        REQUIRE(!platform.isMutexLocked());
+    }
+
+    // Compressed, then encrypted
+    {
+        const auto compressed = util::packImage("compress", image);
+        const auto layered = util::packImage("encrypt --key-id 1 --key " + KeyHex, compressed);
+        blc.cancelBoot();
+        mocks::Protocol proto(layered.data(), layered.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_decoded == image.size());
+    }
+
+    // The key is not available
+    {
+        const auto other = util::packImage("encrypt --key-id 2 --key " + KeyHex, image);
+        blc.cancelBoot();
+        mocks::Protocol proto(other.data(), other.size());
+        REQUIRE(-kocherga_aes::ErrKeyNotAvailable == blc.upgradeApp(proto));
+    }
+
+    // Wrong key; the image is decrypted into garbage, which is rejected
+    {
+        const auto wrong = util::packImage("encrypt --key-id 1 --key 000102030405060708090a0b0c0d0e0f", image);
+        blc.cancelBoot();
+        mocks::Protocol proto(wrong.data(), wrong.size());
+        blc.upgradeApp(proto);
+        REQUIRE(!blc.getAppInfo());
+    }
+
+    // Truncated stream and trailing garbage
+    {
+        auto trailing = encrypted;
+        trailing.push_back(0);
+        mocks::Protocol proto_trailing(trailing.data(), trailing.size());
+        REQUIRE(-kocherga_aes::ErrInvalidImage == blc.upgradeApp(proto_trailing));
+        REQUIRE(!cipher.hasKey());
+        mocks::Protocol proto_truncated(encrypted.data(), encrypted.size() - 1U);
+        REQUIRE(-kocherga_aes::ErrInvalidImage == blc.upgradeApp(proto_truncated));
+        REQUIRE(!cipher.hasKey());
+    }
+
+    // The key is cleared if the protocol fails, and if the download is terminated because the image is installed
+    {
+        mocks::FlashSimulator flash(ROMSize, 4096);
+        kocherga::BootloaderController flash_blc(platform, flash, ROMSize);
+        REQUIRE(flash_blc.addStreamFilter(filter));
+
+        mocks::InterruptedProtocol interrupted(encrypted.data(), encrypted.size() / 2U);
+        REQUIRE(mocks::InterruptedProtocol::ErrLinkLost == flash_blc.upgradeApp(interrupted));
+        REQUIRE(!cipher.hasKey());
+
+        mocks::Protocol proto(encrypted.data(), encrypted.size());
+        REQUIRE(0 == flash_blc.upgradeApp(proto));
+        flash_blc.cancelBoot();
+        mocks::Protocol again(encrypted.data(), encrypted.size());
+        REQUIRE(kocherga::ResultAppUnchanged == flash_blc.upgradeApp(again));
+        REQUIRE(!cipher.hasKey());
+        REQUIRE(!platform.isMutexLocked());
+    }
+}
+
+
+TEST_CASE("AES-Benchmark", "[.benchmark]")
+{
+    static constexpr std::uint32_t ImageSize = 1024 * 1024;
+
+    std::vector<std::uint8_t> encrypted = fromHex("4b41455343545230" "01100000" "00001000");
+    encrypted.resize(32 + ImageSize);
+    for (std::size_t i = 32; i < encrypted.size(); i++)
+    {
+        encrypted[i] = std::uint8_t(i * 7U + (i >> 8U));
+    }
+
+    mocks::Platform platform;
+    platform.setDecryptionKey(1, fromHex(KeyHex));
+    kocherga_aes::SoftwareCipher cipher;
+    kocherga_aes::DecryptionFilter filter(platform, cipher);
+    kocherga::IStreamFilter& stream = filter;
+
+    std::cout << "Decrypting " << ImageSize << " bytes with AES-128-CTR in software" << std::endl;
+    std::cout << std::setw(16) << std::left << "Chunk, bytes" << std::setw(16) << std::right << "MB/s" << std::endl;
+    for (const auto chunk : std::array<std::uint16_t, 5>{{32, 128, 256, 1024, 4096}})
+    {
+        NullReference reference;
+        CollectingSink sink;
+        const auto started_at = std::chrono::steady_clock::now();
+        REQUIRE(0 == stream.beginStream(sink, reference));
+        for (std::size_t offset = 0; offset < encrypted.size(); offset += chunk)
+        {
+            const auto n = std::uint16_t(std::min<std::size_t>(chunk, encrypted.size() - offset));
+            REQUIRE(n == stream.handleNextDataChunk(&encrypted[offset], n));
+        }
+        REQUIRE(0 == stream.endStream());
+        const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                                                   started_at);
+        REQUIRE(sink.getData().size() == ImageSize);
+        std::cout << std::setw(16) << std::left << chunk << std::setw(16) << std::right
+                  << double(ImageSize) / double(std::max<std::int64_t>(elapsed.count(), 1)) << std::endl;
+    }
+}
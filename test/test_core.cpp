@@ -36,66 +36,177 @@
 #include "catch.hpp"
 #include "mocks.hpp"
 #include "images.hpp"
+#include "util.hpp"
 
 #include <thread>
+#include <atomic>
+#include <mutex>
 #include <numeric>
+#include <iostream>
+#include <string>
+#include <vector>
 #include <functional>
 
 
 namespace
 {
 /**
- * A simple mock protocol that just downloads the specified image from memory.
+ * Turns a synchronous backend into an asynchronous one; a write is completed only when it is awaited.
+ * Makes sure that the controller keeps the submitted buffers intact until the writes are completed.
  */
-class MockProtocol : public kocherga::IProtocol
+class AsyncROMBackend : public kocherga::IROMBackend
 {
-    static constexpr std::uint16_t BlockSize = 103;     ///< Using a weird prime block size intentionally
+    struct PendingWrite
+    {
+        std::size_t offset;
+        const void* data;
+        std::vector<std::uint8_t> snapshot;
+    };
 
-    const std::uint8_t* ptr_;
-    std::size_t remaining_size_;
-    const std::function<void ()> chunk_callback_;
+    kocherga::IROMBackend& target_;
+    const std::uint8_t max_pending_writes_;
+    std::vector<PendingWrite> pending_;
+    std::size_t max_observed_pending_ = 0;
 
-    std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+    std::int16_t beginUpgrade() final { return target_.beginUpgrade(); }
+
+    std::int16_t endUpgrade(bool success) final
     {
-        while (remaining_size_ > 0)
+        if (!pending_.empty())
         {
-            if (chunk_callback_)
-            {
-                chunk_callback_();
-            }
+            throw mocks::BadUsageException("Writes are still pending");
+        }
+        return target_.endUpgrade(success);
+    }
 
-            const std::uint16_t bs = std::uint16_t(std::min<std::size_t>(remaining_size_, BlockSize));
+    std::int16_t write(std::size_t, const void*, std::uint16_t) final
+    {
+        throw mocks::BadUsageException("Synchronous write used with an asynchronous backend");
+    }
 
-            const auto result = sink.handleNextDataChunk(ptr_, bs);
-            if (result != bs)
-            {
-                if (result < 0)
-                {
-                    return result;
-                }
-                else
-                {
-                    return kocherga::ErrROMWriteFailure;
-                }
-            }
+    std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const final
+    {
+        return target_.read(offset, data, size);
+    }
 
-            ptr_ += bs;
-            remaining_size_ -= bs;
-        }
+    std::uint8_t getMaxPendingWrites() const final { return max_pending_writes_; }
 
+    std::int16_t submitWrite(std::size_t offset, const void* data, std::uint16_t size) final
+    {
+        if (pending_.size() >= max_pending_writes_)
+        {
+            throw mocks::BadUsageException("Too many pending writes");
+        }
+        auto bytes = static_cast<const std::uint8_t*>(data);
+        pending_.push_back({offset, data, std::vector<std::uint8_t>(bytes, bytes + size)});
+        max_observed_pending_ = std::max(max_observed_pending_, pending_.size());
         return 0;
     }
 
+    std::int16_t awaitWrite(bool blocking) final
+    {
+        if (pending_.empty())
+        {
+            throw mocks::BadUsageException("Nothing to await");
+        }
+        if (!blocking)
+        {
+            return 0;                   // Pretending that the flash is very slow
+        }
+        const auto pw = pending_.front();
+        pending_.erase(pending_.begin());
+        if (std::memcmp(pw.data, pw.snapshot.data(), pw.snapshot.size()) != 0)
+        {
+            throw mocks::BadUsageException("Buffer modified while the write was pending");
+        }
+        return target_.write(pw.offset, pw.snapshot.data(), std::uint16_t(pw.snapshot.size()));
+    }
+
 public:
-    MockProtocol(const void* data,
-                 std::size_t size,
-                 std::function<void ()> callback_per_chunk = {}) :
-        ptr_(static_cast<const std::uint8_t*>(data)),
-        remaining_size_(size),
-        chunk_callback_(std::move(callback_per_chunk))
+    AsyncROMBackend(kocherga::IROMBackend& target, std::uint8_t max_pending_writes) :
+        target_(target),
+        max_pending_writes_(max_pending_writes)
     { }
+
+    std::size_t getMaxObservedPendingWrites() const { return max_observed_pending_; }
 };
 
+/**
+ * Every write takes the specified time, during which the storage mutex is held by the controller.
+ */
+class SlowROMBackend : public kocherga::IROMBackend
+{
+    kocherga::IROMBackend& target_;
+    const std::chrono::microseconds write_duration_;
+
+    std::int16_t beginUpgrade() final { return target_.beginUpgrade(); }
+
+    std::int16_t endUpgrade(bool success) final { return target_.endUpgrade(success); }
+
+    std::int16_t write(std::size_t offset, const void* data, std::uint16_t size) final
+    {
+        std::this_thread::sleep_for(write_duration_);
+        return target_.write(offset, data, size);
+    }
+
+    std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const final
+    {
+        return target_.read(offset, data, size);
+    }
+
+public:
+    SlowROMBackend(kocherga::IROMBackend& target, std::chrono::microseconds write_duration) :
+        target_(target),
+        write_duration_(write_duration)
+    { }
+};
+
+struct QueryLatency
+{
+    std::chrono::steady_clock::duration worst{};
+    std::uint64_t num_queries = 0;
+};
+
+/**
+ * Upgrades the app in a separate thread while the queries and the boot requests are issued from this one,
+ * all of which lock the mutex of the controller.
+ */
+QueryLatency measureQueryLatencyDuringUpgrade(kocherga::IPlatform& platform, std::chrono::microseconds write_duration)
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+
+    mocks::FileMappedROMBackend flash("core-storage-lock-test-rom.tmp", ROMSize);
+    SlowROMBackend rom(flash, write_duration);
+    kocherga::BootloaderController blc(platform, rom, ROMSize, std::chrono::seconds(10));
+
+    std::atomic<bool> done{false};
+    std::int16_t result = -1;
+    std::thread upgrader([&]()
+    {
+        mocks::Protocol proto(images::AppValid2.data(), images::AppValid2.size());
+        result = blc.upgradeApp(proto);
+        done = true;
+    });
+
+    QueryLatency out;
+    while (!done)
+    {
+        const auto started_at = std::chrono::steady_clock::now();
+        blc.cancelBoot();
+        blc.requestBoot();
+        (void) blc.getState();
+        (void) blc.getMonotonicUptime();
+        out.worst = std::max(out.worst, std::chrono::steady_clock::now() - started_at);
+        out.num_queries++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    upgrader.join();
+
+    REQUIRE(result == 0);
+    REQUIRE(blc.getAppInfo());
+    return out;
+}
+
 }
 
 
@@ -120,29 +231,30 @@ TEST_CASE("Core-Basic")
     REQUIRE((ROMSize / 8) + 1 == rom_backend.getReadCount());
     REQUIRE(0 == rom_backend.getWriteCount());
 
+    // The read-only queries do not take the mutex
     REQUIRE(2 == platform.getMutexLockCount());
     REQUIRE(kocherga::State::NoAppToBoot == blc.getState());
-    REQUIRE(3 == platform.getMutexLockCount());
+    REQUIRE(2 == platform.getMutexLockCount());
     REQUIRE(!blc.getAppInfo());
-    REQUIRE(4 == platform.getMutexLockCount());
+    REQUIRE(2 == platform.getMutexLockCount());
 
     // Boot request ignored - nothing to boot
-    REQUIRE(4 == platform.getMutexLockCount());
+    REQUIRE(2 == platform.getMutexLockCount());
     blc.requestBoot();
-    REQUIRE(5 == platform.getMutexLockCount());
+    REQUIRE(3 == platform.getMutexLockCount());
     REQUIRE(kocherga::State::NoAppToBoot == blc.getState());
-    REQUIRE(6 == platform.getMutexLockCount());
+    REQUIRE(3 == platform.getMutexLockCount());
     REQUIRE(!blc.getAppInfo());
-    REQUIRE(7 == platform.getMutexLockCount());
+    REQUIRE(3 == platform.getMutexLockCount());
 
     // Boot cancellation ignored - nothing to cancel
-    REQUIRE(7 == platform.getMutexLockCount());
+    REQUIRE(3 == platform.getMutexLockCount());
     blc.cancelBoot();
-    REQUIRE(8 == platform.getMutexLockCount());
+    REQUIRE(4 == platform.getMutexLockCount());
     REQUIRE(kocherga::State::NoAppToBoot == blc.getState());
-    REQUIRE(9 == platform.getMutexLockCount());
+    REQUIRE(4 == platform.getMutexLockCount());
     REQUIRE(!blc.getAppInfo());
-    REQUIRE(10 == platform.getMutexLockCount());
+    REQUIRE(4 == platform.getMutexLockCount());
 
     // Up to this point we did not write the ROM, making sure it's true
     REQUIRE(0 == rom_backend.getWriteCount());
@@ -152,12 +264,13 @@ TEST_CASE("Core-Basic")
     {
         REQUIRE(!platform.isMutexLocked());
 
-        MockProtocol proto(images::AppValid.data(),
+        mocks::Protocol proto(images::AppValid.data(),
                            images::AppValid.size(),
                            [&]() { REQUIRE(blc.getState() == kocherga::State::AppUpgradeInProgress); });
         REQUIRE(0 == blc.upgradeApp(proto));
 
-        REQUIRE(12 < platform.getMutexLockCount());
+        REQUIRE(12 < platform.getStorageMutexLockCount());
+        REQUIRE(!platform.isStorageMutexLocked());
         REQUIRE(!platform.isMutexLocked());
 
         REQUIRE(kocherga::State::BootDelay == blc.getState());
@@ -184,7 +297,7 @@ TEST_CASE("Core-Basic")
     // Uploading a valid image but making it fail; the previously written image is VALID
     {
         REQUIRE(!platform.isMutexLocked());
-        MockProtocol proto(images::AppValid.data(),
+        mocks::Protocol proto(images::AppValid.data(),
                            images::AppValid.size(),
                            [&]() { REQUIRE(blc.getState() == kocherga::State::AppUpgradeInProgress); });
 
@@ -208,12 +321,13 @@ TEST_CASE("Core-Basic")
     {
         REQUIRE(!platform.isMutexLocked());
 
-        MockProtocol proto(images::AppWithInvalidDescriptor.data(),
+        mocks::Protocol proto(images::AppWithInvalidDescriptor.data(),
                            images::AppWithInvalidDescriptor.size(),
                            [&]() { REQUIRE(blc.getState() == kocherga::State::AppUpgradeInProgress); });
         REQUIRE(0 == blc.upgradeApp(proto));
 
-        REQUIRE(20 < platform.getMutexLockCount());
+        REQUIRE(20 < platform.getStorageMutexLockCount());
+        REQUIRE(!platform.isStorageMutexLocked());
         REQUIRE(!platform.isMutexLocked());
 
         REQUIRE(kocherga::State::NoAppToBoot == blc.getState());
@@ -224,7 +338,7 @@ TEST_CASE("Core-Basic")
     // The failure is generated by returning larger size than requested
     {
         REQUIRE(!platform.isMutexLocked());
-        MockProtocol proto(images::AppValid.data(),
+        mocks::Protocol proto(images::AppValid.data(),
                            images::AppValid.size(),
                            [&]() { REQUIRE(blc.getState() == kocherga::State::AppUpgradeInProgress); });
 
@@ -261,11 +375,1186 @@ TEST_CASE("Core-Basic")
 }
 
 
+TEST_CASE("Core-AsyncWrite")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend file_backend("core-async-test-rom.tmp", ROMSize);
+    AsyncROMBackend rom_backend(file_backend, 4);
+
+    kocherga::BootloaderController blc(platform, rom_backend, ROMSize);
+    REQUIRE(kocherga::State::NoAppToBoot == blc.getState());
+
+    mocks::Protocol proto(images::AppValid2.data(), images::AppValid2.size());
+    REQUIRE(0 == blc.upgradeApp(proto));
+    REQUIRE(!platform.isMutexLocked());
+
+    // Double buffering: one buffer is being filled while the other one is being programmed
+    REQUIRE(1 == rom_backend.getMaxObservedPendingWrites());
+    REQUIRE(file_backend.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+    REQUIRE(kocherga::State::ReadyToBoot == blc.getState());
+    REQUIRE(blc.getAppInfo());
+
+    // Failed download must not leave pending writes behind
+    blc.cancelBoot();
+    mocks::Protocol truncated(images::AppValid2.data(), images::AppValid2.size(),
+                           [&]() { file_backend.setFailureInjector([](std::int16_t) { return -42; }); });
+    REQUIRE(-42 == blc.upgradeApp(truncated));
+    REQUIRE(!platform.isMutexLocked());
+    file_backend.setFailureInjector({});
+}
+
+
+TEST_CASE("Core-ZeroCopy")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend file_backend("core-zero-copy-test-rom.tmp", ROMSize);
+
+    // The first block is needed to recognize the stream, so it is delivered through the buffer of the protocol
+    {
+        kocherga::BootloaderController blc(platform, file_backend, ROMSize);
+        mocks::ZeroCopyProtocol proto(images::AppValid2.data(), images::AppValid2.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(!platform.isMutexLocked());
+        REQUIRE(proto.getCommittedSize() >= images::AppValid2.size() - 103U);
+        REQUIRE(file_backend.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+        REQUIRE(kocherga::State::ReadyToBoot == blc.getState());
+    }
+
+    // The buffer being filled is never the one being written
+    {
+        AsyncROMBackend rom_backend(file_backend, 4);
+        kocherga::BootloaderController blc(platform, rom_backend, ROMSize);
+        const auto image = util::setImageVersion(images::AppValid2, 3, 0);
+        mocks::ZeroCopyProtocol proto(image.data(), image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(proto.getCommittedSize() >= image.size() - 103U);
+        REQUIRE(file_backend.isSameImage(image.data(), image.size()));
+        REQUIRE(kocherga::State::ReadyToBoot == blc.getState());
+    }
+
+    // The region never extends past the end of the ROM
+    {
+        kocherga::BootloaderController blc(platform, file_backend, 1024);
+        mocks::ZeroCopyProtocol proto(images::AppValid2.data(), images::AppValid2.size());
+        REQUIRE(-kocherga::ErrAppImageTooLarge == blc.upgradeApp(proto));
+        REQUIRE(proto.getCommittedSize() <= 1024);
+        REQUIRE(!platform.isMutexLocked());
+    }
+}
+
+
+TEST_CASE("Core-LockFreeStatus")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr auto WriteDuration = std::chrono::milliseconds(20);
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend flash("core-lock-free-test-rom.tmp", ROMSize);
+    SlowROMBackend rom(flash, WriteDuration);
+    kocherga::BootloaderController blc(platform, rom, ROMSize, std::chrono::seconds(10));
+    REQUIRE(blc.getState() == kocherga::State::NoAppToBoot);
+
+    std::atomic<bool> done{false};
+    std::int16_t result = -1;
+    std::thread upgrader([&]()
+    {
+        mocks::Protocol proto(images::AppValid2.data(), images::AppValid2.size());
+        result = blc.upgradeApp(proto);
+        done = true;
+    });
+
+    // The status queries are answered while the storage is being written
+    bool upgrade_observed = false;
+    std::chrono::steady_clock::duration worst_latency{};
+    while (!done)
+    {
+        const auto started_at = std::chrono::steady_clock::now();
+        const auto state = blc.getState();
+        const auto app_info = blc.getAppInfo();
+        worst_latency = std::max(worst_latency, std::chrono::steady_clock::now() - started_at);
+        upgrade_observed = upgrade_observed || ((state == kocherga::State::AppUpgradeInProgress) && !app_info);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    upgrader.join();
+
+    REQUIRE(result == 0);
+    REQUIRE(upgrade_observed);
+    REQUIRE(worst_latency < (WriteDuration / 2));
+    REQUIRE(blc.getState() == kocherga::State::BootDelay);
+    REQUIRE(blc.getAppInfo()->image_size == images::AppValid2.size());
+    REQUIRE(*blc.getAppSlot() == 0);
+}
+
+
+TEST_CASE("Core-StorageLock")
+{
+    static constexpr auto WriteDuration = std::chrono::milliseconds(20);
+
+    mocks::Platform platform;
+    const auto latency = measureQueryLatencyDuringUpgrade(platform, WriteDuration);
+
+    REQUIRE(latency.num_queries > 10);
+    REQUIRE(latency.worst < (WriteDuration / 2));
+    REQUIRE(!platform.isStorageMutexLocked());
+    REQUIRE(!platform.isMutexLocked());
+}
+
+
+TEST_CASE("Core-StorageLock-Benchmark", "[.benchmark]")
+{
+    static constexpr auto WriteDuration = std::chrono::milliseconds(20);
+
+    /// Does not implement the storage mutex, so the same mutex is used for everything
+    class SingleMutexPlatform : public kocherga::IPlatform
+    {
+        std::recursive_mutex mutex_;
+
+        void lockMutex() final   { mutex_.lock(); }
+        void unlockMutex() final { mutex_.unlock(); }
+
+        std::chrono::microseconds getMonotonicUptime() const final
+        {
+            return std::chrono::duration_cast<std::chrono::microseconds>
+                (std::chrono::steady_clock::now().time_since_epoch());
+        }
+    };
+
+    mocks::Platform separate;
+    SingleMutexPlatform single;
+    const auto with_separate = measureQueryLatencyDuringUpgrade(separate, WriteDuration);
+    const auto with_single = measureQueryLatencyDuringUpgrade(single, WriteDuration);
+
+    const auto us = [](std::chrono::steady_clock::duration d)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    std::cout << "Worst-case latency of the queries during an upgrade with "
+              << std::chrono::microseconds(WriteDuration).count() << " us writes" << std::endl;
+    std::cout << "Separate storage mutex: " << us(with_separate.worst) << " us, "
+              << with_separate.num_queries << " queries" << std::endl;
+    std::cout << "Single mutex:           " << us(with_single.worst) << " us, "
+              << with_single.num_queries << " queries" << std::endl;
+}
+
+
+TEST_CASE("Core-SkipUnchangedPages")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::uint32_t NumPages = (images::AppValid2.size() + 1023U) / 1024U;
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend rom_backend("core-skip-test-rom.tmp", ROMSize);
+
+    kocherga::UpgradeOptions options;
+    options.skip_unchanged_pages = true;
+    kocherga::BootloaderController blc(platform, rom_backend, ROMSize, std::chrono::seconds(10), options);
+
+    // Fresh storage, everything is written
+    mocks::Protocol proto(images::AppValid2.data(), images::AppValid2.size());
+    REQUIRE(0 == blc.upgradeApp(proto));
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_received == images::AppValid2.size());
+    REQUIRE(blc.getLastUpgradeStatistics().pages_written  == NumPages);
+    REQUIRE(blc.getLastUpgradeStatistics().pages_skipped  == 0);
+    REQUIRE(NumPages == rom_backend.getWriteCount());
+
+    // Same image again, nothing is written
+    mocks::Protocol same(images::AppValid2.data(), images::AppValid2.size());
+    REQUIRE(0 == blc.upgradeApp(same));
+    REQUIRE(blc.getLastUpgradeStatistics().pages_written == 0);
+    REQUIRE(blc.getLastUpgradeStatistics().pages_skipped == NumPages);
+    REQUIRE(NumPages == rom_backend.getWriteCount());
+    REQUIRE(kocherga::State::BootDelay == blc.getState());
+
+    // One page differs, only that page is written
+    auto modified = images::AppValid2;
+    modified[5000] = std::uint8_t(~modified[5000]);
+    mocks::Protocol different(modified.data(), modified.size());
+    REQUIRE(0 == blc.upgradeApp(different));
+    REQUIRE(blc.getLastUpgradeStatistics().pages_written == 1);
+    REQUIRE(blc.getLastUpgradeStatistics().pages_skipped == NumPages - 1);
+    REQUIRE(rom_backend.isSameImage(modified.data(), modified.size()));
+    REQUIRE(kocherga::State::NoAppToBoot == blc.getState());        // The CRC is wrong now
+}
+
+
+TEST_CASE("Core-WriteVerify")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::size_t BadPageOffset = 2048;
+
+    /// Corrupts the specified number of the next writes at the bad page, like a flash that programs bits wrong
+    class FaultyROMBackend : public kocherga::IROMBackend
+    {
+        kocherga::IROMBackend& target_;
+        std::uint32_t faults_ = 0;
+
+        std::int16_t beginUpgrade() final { return target_.beginUpgrade(); }
+
+        std::int16_t endUpgrade(bool success) final { return target_.endUpgrade(success); }
+
+        std::int16_t write(std::size_t offset, const void* data, std::uint16_t size) final
+        {
+            if ((offset != BadPageOffset) || (faults_ == 0))
+            {
+                return target_.write(offset, data, size);
+            }
+            faults_--;
+            auto bytes = static_cast<const std::uint8_t*>(data);
+            std::vector<std::uint8_t> corrupted(bytes, bytes + size);
+            corrupted.at(100) ^= 0x10U;
+            return target_.write(offset, corrupted.data(), size);   // The failure is not reported
+        }
+
+        std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const final
+        {
+            return target_.read(offset, data, size);
+        }
+
+    public:
+        explicit FaultyROMBackend(kocherga::IROMBackend& target) : target_(target) { }
+
+        void setFaults(std::uint32_t count) { faults_ = count; }
+    };
+
+    mocks::FileMappedROMBackend file_backend("core-verify-test-rom.tmp", ROMSize);
+    FaultyROMBackend faulty(file_backend);
+
+    // Without the write verification, the bad page is found only by the final verification
+    {
+        mocks::Platform platform;
+        kocherga::BootloaderController blc(platform, faulty, ROMSize);
+        faulty.setFaults(1);
+        mocks::Protocol proto(images::AppValid2.data(), images::AppValid2.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(kocherga::State::NoAppToBoot == blc.getState());
+    }
+
+    // The bad page is written again right away
+    kocherga::UpgradeOptions options;
+    options.write_verify_attempts = 3;
+    {
+        mocks::Platform platform;
+        kocherga::BootloaderController blc(platform, faulty, ROMSize, std::chrono::seconds(10), options);
+        faulty.setFaults(2);
+        mocks::Protocol proto(images::AppValid2.data(), images::AppValid2.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(file_backend.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+        REQUIRE(blc.getLastUpgradeStatistics().pages_rewritten == 2);
+
+        // The attempts are exhausted
+        blc.cancelBoot();
+        faulty.setFaults(3);
+        mocks::Protocol proto_again(images::AppValid2.data(), images::AppValid2.size());
+        REQUIRE(-kocherga::ErrROMWriteFailure == blc.upgradeApp(proto_again));
+        REQUIRE(blc.getLastUpgradeStatistics().pages_rewritten == 2);
+    }
+
+    // The asynchronous writes are verified once they are completed
+    {
+        mocks::Platform platform;
+        AsyncROMBackend async_backend(faulty, 2);
+        kocherga::BootloaderController blc(platform, async_backend, ROMSize, std::chrono::seconds(10), options);
+        faulty.setFaults(1);
+        mocks::Protocol proto(images::AppValid2.data(), images::AppValid2.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(file_backend.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+        REQUIRE(blc.getLastUpgradeStatistics().pages_rewritten == 1);
+    }
+}
+
+
+TEST_CASE("Core-LazyErase")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    /*
+     * Exposes a uniform sector layout on top of the file backend; erasing fills the sector with 0xFF.
+     */
+    class SectorROMBackend : public kocherga::IROMBackend
+    {
+        kocherga::IROMBackend& target_;
+
+        std::int16_t beginUpgrade() final { return target_.beginUpgrade(); }
+        std::int16_t endUpgrade(bool success) final { return target_.endUpgrade(success); }
+
+        std::int16_t write(std::size_t offset, const void* data, std::uint16_t size) final
+        {
+            const auto sector = offset / SectorSize;
+            if ((sector >= erased.size()) || !erased[sector] || (((offset + size - 1U) / SectorSize) != sector))
+            {
+                throw mocks::BadUsageException("Writing into a sector that is not erased");
+            }
+            return target_.write(offset, data, size);
+        }
+
+        std::int16_t read(std::size_t offset, void* data, std::uint16_t size) const final
+        {
+            return target_.read(offset, data, size);
+        }
+
+        std::size_t getSectorSize(std::size_t offset) const final
+        {
+            return (offset < ROMSize) ? SectorSize : 0;
+        }
+
+        std::int16_t eraseSector(std::size_t offset) final
+        {
+            if (((offset % SectorSize) != 0) || erased.at(offset / SectorSize))
+            {
+                throw mocks::BadUsageException("Bad sector erase");
+            }
+            erased.at(offset / SectorSize) = true;
+            const std::vector<std::uint8_t> empty(SectorSize, 0xFF);
+            return (target_.write(offset, empty.data(), SectorSize) == SectorSize) ? 0 : -1;
+        }
+
+        void handleImageSizeHint(std::size_t image_size) final { size_hint = image_size; }
+
+    public:
+        std::vector<bool> erased = std::vector<bool>(ROMSize / SectorSize, false);
+        std::size_t size_hint = 0;
+
+        explicit SectorROMBackend(kocherga::IROMBackend& target) : target_(target) { }
+    };
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend file_backend("core-erase-test-rom.tmp", ROMSize);
+    SectorROMBackend rom_backend(file_backend);
+
+    kocherga::BootloaderController blc(platform, rom_backend, ROMSize);
+
+    // Only the sectors touched by the image are erased
+    mocks::SizeHintingProtocol proto(images::AppValid2.data(), images::AppValid2.size(), images::AppValid2.size());
+    REQUIRE(0 == blc.upgradeApp(proto));
+    REQUIRE(rom_backend.size_hint == images::AppValid2.size());
+    REQUIRE(blc.getLastUpgradeStatistics().sectors_erased == 3);
+    REQUIRE(std::count(rom_backend.erased.begin(), rom_backend.erased.end(), true) == 3);
+    REQUIRE(file_backend.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+    REQUIRE(blc.getAppInfo());
+
+    // Too large images are rejected before anything is written
+    blc.cancelBoot();
+    std::fill(rom_backend.erased.begin(), rom_backend.erased.end(), false);
+    mocks::SizeHintingProtocol too_large(images::AppValid2.data(), images::AppValid2.size(), ROMSize + 1U);
+    REQUIRE(-kocherga::ErrAppImageTooLarge == blc.upgradeApp(too_large));
+    REQUIRE(blc.getLastUpgradeStatistics().sectors_erased == 0);
+    REQUIRE(blc.getAppInfo());                      // The old image is intact
+}
+
+
+TEST_CASE("Core-EraseAhead")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+    static constexpr auto ByteTransferTime = std::chrono::microseconds(87);    // 115200 baud, 8N1
+
+    const auto run = [](std::uint8_t erase_ahead_sectors)
+    {
+        mocks::Platform platform;
+        mocks::FlashSimulator flash(ROMSize, SectorSize);
+
+        kocherga::UpgradeOptions options;
+        options.erase_ahead_sectors = erase_ahead_sectors;
+        kocherga::BootloaderController blc(platform, flash, ROMSize, std::chrono::seconds(0), options);
+
+        // The link is slower than the flash, as is usually the case with serial interfaces
+        mocks::SizeHintingProtocol proto(images::AppValid2.data(), images::AppValid2.size(), images::AppValid2.size(),
+                                         [&flash]() { flash.advanceTime(ByteTransferTime * 103); });
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(flash.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(blc.getLastUpgradeStatistics().sectors_erased == 3);
+        REQUIRE(flash.getEraseCount() == 3);            // Never past the end of the image
+        return flash.getTime();
+    };
+
+    const auto erase_time = mocks::FlashTimings().sector_erase;
+
+    const auto on_first_touch = run(0);
+    const auto ahead = run(1);
+    REQUIRE((on_first_touch - ahead) == (erase_time * 3));  // The erase latency is hidden behind the reception
+    REQUIRE(run(2) == ahead);
+}
+
+
+TEST_CASE("Core-ResumeUpgrade")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+    static constexpr std::uint64_t ImageID = 0x0123456789ABCDEFULL;
+
+    const auto& image = images::AppValid2;
+    mocks::Platform platform;
+    mocks::FlashSimulator flash(ROMSize, SectorSize);
+
+    // The link is lost in the third sector; the two sectors below are journaled
+    {
+        kocherga::BootloaderController blc(platform, flash, ROMSize);
+        mocks::ResumableProtocol proto(image.data(), image.size(), ImageID, 9000);
+        REQUIRE(0 > blc.upgradeApp(proto));
+        REQUIRE(!blc.getAppInfo());
+        REQUIRE(platform.getUpgradeJournal());
+        REQUIRE(platform.getUpgradeJournal()->image_id == ImageID);
+        REQUIRE(platform.getUpgradeJournal()->offset == 2 * SectorSize);
+        REQUIRE(platform.getUpgradeJournal()->crc == [&image]() {
+            kocherga::CRC64 crc;
+            crc.add(image.data(), 2 * SectorSize);
+            return crc.get();
+        }());
+    }
+
+    // A different image is not resumed
+    {
+        const auto journal = platform.getUpgradeJournal();
+        kocherga::BootloaderController blc(platform, flash, ROMSize);
+        mocks::ResumableProtocol proto(image.data(), image.size(), ImageID + 1, 100);
+        REQUIRE(0 > blc.upgradeApp(proto));
+        REQUIRE(blc.getLastUpgradeStatistics().resume_offset == 0);
+        REQUIRE(platform.getUpgradeJournal()->offset == journal->offset);     // Nothing new to journal
+    }
+
+    // After a restart the same image is resumed from the last journaled sector boundary
+    {
+        kocherga::UpgradeOptions options;
+        options.readback = kocherga::ReadbackPolicy::None;  // The resumed part is verified when the journal is
+        kocherga::BootloaderController blc(platform, flash, ROMSize, std::chrono::seconds(0), options);
+        mocks::ResumableProtocol proto(image.data(), image.size(), ImageID);
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(flash.isSameImage(image.data(), image.size()));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(blc.getLastUpgradeStatistics().resume_offset == 2 * SectorSize);
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_received == (image.size() - 2 * SectorSize));
+        REQUIRE(!platform.getUpgradeJournal());                           // Cleared once complete
+    }
+
+    // The journal is not trusted if the storage does not match it
+    {
+        const auto other = util::setImageVersion(image, 1, 0);             // Not the installed one
+        platform.setUpgradeJournal(kocherga::UpgradeJournal{ImageID, SectorSize, 0xBADC0FFEE});
+        kocherga::BootloaderController blc(platform, flash, ROMSize);
+        mocks::ResumableProtocol proto(other.data(), other.size(), ImageID);
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getLastUpgradeStatistics().resume_offset == 0);
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_received == other.size());
+        REQUIRE(flash.isSameImage(other.data(), other.size()));
+        REQUIRE(!platform.getUpgradeJournal());
+    }
+}
+
+
+TEST_CASE("Core-StreamingVerification")
+{
+    static constexpr std::uint32_t ROMSize = 1024 * 1024;
+
+    const auto run = [](kocherga::ReadbackPolicy readback, const std::vector<std::uint8_t>& image)
+    {
+        mocks::Platform platform;
+        mocks::FileMappedROMBackend rom("core-verify-test-rom.tmp", ROMSize);
+        kocherga::UpgradeOptions options;
+        options.readback = readback;
+        kocherga::BootloaderController blc(platform, rom, ROMSize, std::chrono::seconds(1), options);
+
+        const auto reads_before = rom.getReadCount();
+        mocks::Protocol proto(image.data(), image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(rom.isSameImage(image.data(), image.size()));
+        return std::make_pair(blc.getAppInfo(), rom.getReadCount() - reads_before);
+    };
+
+    const std::vector<std::uint8_t> valid(images::AppValid2.begin(), images::AppValid2.end());
+
+    const auto [full_info, full_reads] = run(kocherga::ReadbackPolicy::Full, valid);
+    const auto [desc_info, desc_reads] = run(kocherga::ReadbackPolicy::Descriptor, valid);
+    const auto [none_info, none_reads] = run(kocherga::ReadbackPolicy::None, valid);
+    REQUIRE(full_info);
+    REQUIRE(full_info->image_size == images::AppValid2.size());
+    REQUIRE(full_info->vcs_commit == images::AppValid2VCSCommit);
+    REQUIRE(desc_info);
+    REQUIRE(std::memcmp(&*desc_info, &*full_info, sizeof(kocherga::AppInfo)) == 0);
+    REQUIRE(none_info);
+    REQUIRE(std::memcmp(&*none_info, &*full_info, sizeof(kocherga::AppInfo)) == 0);
+    REQUIRE(full_reads > 10);
+    REQUIRE(desc_reads == 1);
+    REQUIRE(none_reads == 0);
+
+    // Data past the end of the image is not covered by the CRC
+    {
+        auto padded = valid;
+        padded.resize(padded.size() + 100U, 0xAA);
+        const auto [info, reads] = run(kocherga::ReadbackPolicy::None, padded);
+        REQUIRE(info);
+        REQUIRE(info->image_size == images::AppValid2.size());
+        REQUIRE(reads == 0);
+    }
+
+    // Images that cannot be verified while streaming are read back
+    {
+        const std::vector<std::uint8_t> invalid(images::AppWithInvalidDescriptor.begin(),
+                                                images::AppWithInvalidDescriptor.end());
+        const auto [info, reads] = run(kocherga::ReadbackPolicy::None, invalid);
+        REQUIRE(!info);
+        REQUIRE(reads > 0);
+
+        auto corrupted = valid;
+        corrupted.back() ^= 1U;
+        const auto [corrupted_info, corrupted_reads] = run(kocherga::ReadbackPolicy::None, corrupted);
+        REQUIRE(!corrupted_info);
+        REQUIRE(corrupted_reads > 0);
+    }
+
+    // With two slots, the newest image is selected without reading either of them
+    {
+        const auto v1 = util::setImageVersion(images::AppValid2, 1, 0);
+        const auto v2 = util::setImageVersion(images::AppValid2, 2, 0);
+
+        mocks::Platform platform;
+        mocks::FileMappedROMBackend slot_a("core-slot-a-test-rom.tmp", ROMSize);
+        mocks::FileMappedROMBackend slot_b("core-slot-b-test-rom.tmp", ROMSize);
+        kocherga::UpgradeOptions options;
+        options.readback = kocherga::ReadbackPolicy::None;
+        kocherga::BootloaderController blc(platform, slot_a, slot_b, kocherga::SecondaryROMRole::AlternateSlot,
+                                           ROMSize, std::chrono::seconds(1), options);
+
+        mocks::Protocol proto_v2(v2.data(), v2.size());
+        REQUIRE(0 == blc.upgradeApp(proto_v2));
+        REQUIRE(*blc.getAppSlot() == 0);
+
+        const auto reads_before = slot_a.getReadCount() + slot_b.getReadCount();
+        blc.cancelBoot();
+        mocks::Protocol proto_v1(v1.data(), v1.size());
+        REQUIRE(0 == blc.upgradeApp(proto_v1));
+        REQUIRE(*blc.getAppSlot() == 0);                    // The older image does not take over
+        REQUIRE(blc.getAppInfo()->major_version == 2);
+        REQUIRE(slot_b.isSameImage(v1.data(), v1.size()));
+        REQUIRE(slot_a.getReadCount() + slot_b.getReadCount() == reads_before);
+    }
+}
+
+
+TEST_CASE("Core-EarlyRejection")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    class Platform final : public mocks::Platform
+    {
+        bool isAppCompatible(const kocherga::AppInfo& app_info) override
+        {
+            return app_info.major_version < 2;      // Say, version 2 requires a newer hardware revision
+        }
+    };
+
+    const auto v1 = util::setImageVersion(images::AppValid2, 1, 0);
+    const auto v2 = util::setImageVersion(images::AppValid2, 2, 0);
+
+    Platform platform;
+    mocks::FlashSimulator flash(ROMSize, SectorSize);
+    kocherga::UpgradeOptions options;
+    options.app_descriptor_search_limit = 4096;
+    kocherga::BootloaderController blc(platform, flash, ROMSize, std::chrono::seconds(0), options);
+
+    mocks::Protocol proto_v1(v1.data(), v1.size());
+    REQUIRE(0 == blc.upgradeApp(proto_v1));
+    REQUIRE(blc.getAppInfo()->major_version == 1);
+
+    // Rejected before anything is written, so the installed image remains intact
+    mocks::Protocol proto_v2(v2.data(), v2.size());
+    REQUIRE(-kocherga::ErrAppImageRejected == blc.upgradeApp(proto_v2));
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_received < 2048);
+    REQUIRE(blc.getLastUpgradeStatistics().pages_written == 0);
+    REQUIRE(blc.getState() == kocherga::State::BootCancelled);
+    REQUIRE(blc.getAppInfo()->major_version == 1);
+
+    // Not an application image at all
+    const std::vector<std::uint8_t> garbage(64 * 1024, 0x55);
+    mocks::Protocol proto_garbage(garbage.data(), garbage.size());
+    REQUIRE(-kocherga::ErrAppDescriptorNotFound == blc.upgradeApp(proto_garbage));
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_received < 8192);
+
+    // The image is larger than the storage allows
+    {
+        kocherga::BootloaderController small(platform, flash, 8192);
+        mocks::Protocol proto(v1.data(), v1.size());
+        REQUIRE(-kocherga::ErrAppImageTooLarge == small.upgradeApp(proto));
+        REQUIRE(small.getLastUpgradeStatistics().bytes_received < 2048);
+    }
+}
+
+
+TEST_CASE("Core-SameImage")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    const auto& image = images::AppValid2;
+
+    // Single slot: nothing is erased or written if the same image is uploaded again
+    {
+        mocks::Platform platform;
+        mocks::FlashSimulator flash(ROMSize, SectorSize);
+        kocherga::UpgradeOptions options;
+        options.erase_ahead_sectors = 2;
+        kocherga::BootloaderController blc(platform, flash, ROMSize, std::chrono::seconds(0), options);
+
+        mocks::SizeHintingProtocol proto(image.data(), image.size(), image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        const auto erase_count = flash.getEraseCount();
+
+        mocks::SizeHintingProtocol again(image.data(), image.size(), image.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(again));
+        REQUIRE(blc.getState() == kocherga::State::ReadyToBoot);
+        REQUIRE(blc.getAppInfo()->image_size == image.size());
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_received < 2048);
+        REQUIRE(blc.getLastUpgradeStatistics().pages_written == 0);
+        REQUIRE(flash.getEraseCount() == erase_count);
+
+        // A different image is written as usual
+        blc.cancelBoot();
+        const auto other = util::setImageVersion(image, 1, 0);
+        mocks::SizeHintingProtocol proto_other(other.data(), other.size(), std::uint32_t(other.size()));
+        REQUIRE(0 == blc.upgradeApp(proto_other));
+        REQUIRE(blc.getAppInfo()->major_version == 1);
+    }
+
+    // Two slots: the other slot is left alone
+    {
+        mocks::Platform platform;
+        mocks::FileMappedROMBackend slot_a("core-slot-a-test-rom.tmp", ROMSize);
+        mocks::FileMappedROMBackend slot_b("core-slot-b-test-rom.tmp", ROMSize);
+        kocherga::BootloaderController blc(platform, slot_a, slot_b, kocherga::SecondaryROMRole::AlternateSlot,
+                                           ROMSize, std::chrono::seconds(1));
+
+        mocks::Protocol proto(image.data(), image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(*blc.getAppSlot() == 0);
+
+        blc.cancelBoot();
+        const auto writes = slot_b.getWriteCount();
+        mocks::Protocol again(image.data(), image.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(again));
+        REQUIRE(blc.getState() == kocherga::State::BootDelay);
+        REQUIRE(*blc.getAppSlot() == 0);
+        REQUIRE(slot_b.getWriteCount() == writes);
+    }
+}
+
+
+TEST_CASE("Core-GatherWrite")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    static constexpr std::uint32_t NumPages = (images::AppValid2.size() + 1023U) / 1024U;
+    static constexpr std::uint16_t FrameSize = 61;
+    static constexpr std::uint8_t FramesPerMessage = 7;
+
+    /// Delivers the image in messages of several frames each without reassembling them
+    class FramedProtocol : public kocherga::IProtocol
+    {
+        std::int16_t downloadImage(kocherga::IDownloadSink& sink) final
+        {
+            const auto& image = images::AppValid2;
+            std::size_t offset = 0;
+            while (offset < image.size())
+            {
+                std::array<kocherga::DataSpan, FramesPerMessage> frames{};
+                std::uint8_t count = 0;
+                while ((count < FramesPerMessage) && (offset < image.size()))
+                {
+                    const auto size = std::uint16_t(std::min<std::size_t>(FrameSize, image.size() - offset));
+                    frames[count++] = kocherga::DataSpan{&image[offset], size};
+                    offset += size;
+                }
+                if (const auto res = sink.handleNextDataChunks(frames.data(), count); res < 0)
+                {
+                    return res;
+                }
+            }
+            return 0;
+        }
+    };
+
+    class GatherROMBackend : public mocks::FileMappedROMBackend
+    {
+        std::uint64_t gather_count_ = 0;
+
+        std::uint8_t getMaxWriteSpans() const override { return 2; }
+
+        std::int16_t writeGather(std::size_t offset, const kocherga::DataSpan* spans, std::uint8_t count) override
+        {
+            REQUIRE(count <= 2);
+            gather_count_++;
+            return IROMBackend::writeGather(offset, spans, count);
+        }
+
+    public:
+        using mocks::FileMappedROMBackend::FileMappedROMBackend;
+
+        std::uint64_t getGatherCount() const { return gather_count_; }
+    };
+
+    // The pages are written contiguously unless the backend supports gather writes
+    {
+        mocks::Platform platform;
+        mocks::FileMappedROMBackend rom("core-gather-test-rom.tmp", ROMSize);
+        kocherga::BootloaderController blc(platform, rom, ROMSize);
+
+        FramedProtocol proto;
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(rom.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_received == images::AppValid2.size());
+        REQUIRE(rom.getWriteCount() == NumPages);
+    }
+
+    {
+        mocks::Platform platform;
+        GatherROMBackend rom("core-gather-test-rom.tmp", ROMSize);
+        kocherga::BootloaderController blc(platform, rom, ROMSize);
+
+        FramedProtocol proto;
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(rom.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+        REQUIRE(blc.getLastUpgradeStatistics().pages_written == NumPages);
+        REQUIRE(rom.getGatherCount() > 0);
+        REQUIRE(rom.getGatherCount() < NumPages);       // The last page is incomplete, so it is buffered
+    }
+}
+
+
+TEST_CASE("Core-Staging")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    const std::vector<std::uint8_t> image(images::AppValid2.begin(), images::AppValid2.end());
+    const auto image_v1 = util::setImageVersion(image, 1, 0);
+    const auto image_v2 = util::setImageVersion(image, 2, 0);
+
+    mocks::Platform platform;
+    mocks::FlashSimulator flash(ROMSize, SectorSize);
+    mocks::FileMappedROMBackend staging("core-staging-test-rom.tmp", ROMSize);
+
+    {
+        kocherga::BootloaderController blc(platform, flash, staging, kocherga::SecondaryROMRole::Staging,
+                                           ROMSize, std::chrono::seconds(1));
+        REQUIRE(blc.getState() == kocherga::State::NoAppToBoot);
+
+        // The image is downloaded into the staging area, then installed
+        mocks::Protocol proto(image.data(), image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getState() == kocherga::State::BootDelay);
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(*blc.getAppSlot() == 0);
+        REQUIRE(flash.isSameImage(image.data(), image.size()));
+        REQUIRE(staging.isSameImage(image.data(), image.size()));
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_installed == image.size());
+        REQUIRE(!platform.getUpgradeJournal());
+
+        // An invalid image is not installed
+        blc.cancelBoot();
+        auto corrupted = image_v1;
+        corrupted[5000] = std::uint8_t(~corrupted[5000]);
+        mocks::Protocol proto_corrupted(corrupted.data(), corrupted.size());
+        const auto writes = flash.getWrittenByteCount();
+        REQUIRE(0 == blc.upgradeApp(proto_corrupted));
+        REQUIRE(blc.getState() == kocherga::State::BootDelay);
+        REQUIRE(blc.getAppInfo()->major_version == 0);
+        REQUIRE(flash.getWrittenByteCount() == writes);
+
+        // The installation is interrupted after the first sector
+        blc.cancelBoot();
+        std::uint32_t write_count = 0;
+        flash.setFailureInjector([&write_count](std::int16_t res) -> std::int16_t
+                                 { return (++write_count > 6) ? std::int16_t(-42) : res; });
+        mocks::Protocol proto_v1(image_v1.data(), image_v1.size());
+        REQUIRE(-42 == blc.upgradeApp(proto_v1));
+        REQUIRE(blc.getState() == kocherga::State::NoAppToBoot);
+        REQUIRE(platform.getUpgradeJournal());
+        REQUIRE(platform.getUpgradeJournal()->offset == SectorSize);
+        flash.setFailureInjector({});
+    }
+
+    // The installation is resumed upon the next boot
+    {
+        const auto writes = flash.getWrittenByteCount();
+        kocherga::BootloaderController blc(platform, flash, staging, kocherga::SecondaryROMRole::Staging,
+                                           ROMSize, std::chrono::seconds(1));
+        REQUIRE(blc.getState() == kocherga::State::BootDelay);
+        REQUIRE(blc.getAppInfo()->major_version == 1);
+        REQUIRE(flash.isSameImage(image_v1.data(), image_v1.size()));
+        REQUIRE(flash.getWrittenByteCount() - writes == image_v1.size() - SectorSize);
+        REQUIRE(!platform.getUpgradeJournal());
+    }
+
+    // The power is lost before the first sector is complete, so the installation restarts from the beginning
+    {
+        kocherga::BootloaderController blc(platform, flash, staging, kocherga::SecondaryROMRole::Staging,
+                                           ROMSize, std::chrono::seconds(1));
+        blc.cancelBoot();
+        std::uint32_t write_count = 0;
+        flash.setFailureInjector([&write_count](std::int16_t res) -> std::int16_t
+                                 { return (++write_count > 2) ? std::int16_t(-42) : res; });
+        mocks::Protocol proto_v2(image_v2.data(), image_v2.size());
+        REQUIRE(-42 == blc.upgradeApp(proto_v2));
+        REQUIRE(platform.getUpgradeJournal()->offset == 0);
+        flash.setFailureInjector({});
+    }
+    {
+        kocherga::BootloaderController blc(platform, flash, staging, kocherga::SecondaryROMRole::Staging,
+                                           ROMSize, std::chrono::seconds(1));
+        REQUIRE(blc.getAppInfo()->major_version == 2);
+        REQUIRE(flash.isSameImage(image_v2.data(), image_v2.size()));
+        REQUIRE(!platform.getUpgradeJournal());
+
+        // Nothing to do if the installation is complete
+        const auto writes = flash.getWrittenByteCount();
+        kocherga::BootloaderController again(platform, flash, staging, kocherga::SecondaryROMRole::Staging,
+                                             ROMSize, std::chrono::seconds(1));
+        REQUIRE(again.getAppInfo()->major_version == 2);
+        REQUIRE(flash.getWrittenByteCount() == writes);
+    }
+}
+
+
+TEST_CASE("Core-RAMBuffer")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    const std::vector<std::uint8_t> image(images::AppValid2.begin(), images::AppValid2.end());
+    const auto image_v1 = util::setImageVersion(image, 1, 0);
+    const auto image_v2 = util::setImageVersion(image, 2, 0);
+
+    std::vector<std::uint8_t> ram(ROMSize);
+    kocherga::UpgradeOptions options;
+    options.ram_buffer = ram.data();
+    options.ram_buffer_size = std::uint32_t(ram.size());
+
+    mocks::Platform platform;
+    mocks::FlashSimulator flash(ROMSize, SectorSize);
+    kocherga::BootloaderController blc(platform, flash, ROMSize, std::chrono::seconds(1), options);
+    REQUIRE(blc.getState() == kocherga::State::NoAppToBoot);
+
+    // The storage is not touched until the image is downloaded entirely
+    {
+        std::uint64_t writes_during_download = 0;
+        mocks::Protocol proto(image_v1.data(), image_v1.size(),
+                              [&]() { writes_during_download += flash.getWrittenByteCount(); });
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(writes_during_download == 0);
+        REQUIRE(blc.getState() == kocherga::State::BootDelay);
+        REQUIRE(blc.getAppInfo()->major_version == 1);
+        REQUIRE(flash.isSameImage(image_v1.data(), image_v1.size()));
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_installed == image_v1.size());
+    }
+
+    // The installed app remains bootable while the new image is being downloaded
+    {
+        blc.cancelBoot();
+        const auto writes = flash.getWrittenByteCount();
+        bool app_available = true;
+        mocks::Protocol proto(image_v2.data(), image_v2.size(),
+                              [&]() { app_available = app_available && (flash.getWrittenByteCount() == writes); });
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(app_available);
+        REQUIRE(blc.getAppInfo()->major_version == 2);
+        REQUIRE(flash.isSameImage(image_v2.data(), image_v2.size()));
+    }
+
+    // Invalid, truncated, unchanged, and too large images leave the storage intact
+    {
+        const auto writes = flash.getWrittenByteCount();
+
+        blc.cancelBoot();
+        mocks::Protocol proto_same(image_v2.data(), image_v2.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(proto_same));
+        REQUIRE(blc.getAppInfo()->major_version == 2);
+
+        blc.cancelBoot();
+        auto corrupted = image_v1;
+        corrupted[5000] = std::uint8_t(~corrupted[5000]);
+        mocks::Protocol proto_corrupted(corrupted.data(), corrupted.size());
+        REQUIRE(0 == blc.upgradeApp(proto_corrupted));
+        REQUIRE(blc.getState() == kocherga::State::BootDelay);
+        REQUIRE(blc.getAppInfo()->major_version == 2);
+
+        blc.cancelBoot();
+        mocks::Protocol proto_truncated(image_v1.data(), image_v1.size() / 2);
+        REQUIRE(0 == blc.upgradeApp(proto_truncated));
+        REQUIRE(blc.getAppInfo()->major_version == 2);
+
+        std::vector<std::uint8_t> small_ram(image.size() / 2);
+        kocherga::UpgradeOptions small_options;
+        small_options.ram_buffer = small_ram.data();
+        small_options.ram_buffer_size = std::uint32_t(small_ram.size());
+        kocherga::BootloaderController small(platform, flash, ROMSize, std::chrono::seconds(1), small_options);
+        REQUIRE(small.getAppInfo()->major_version == 2);
+        small.cancelBoot();
+        mocks::Protocol proto_large(image_v1.data(), image_v1.size());
+        REQUIRE(-kocherga::ErrAppImageTooLarge == small.upgradeApp(proto_large));
+        REQUIRE(small.getAppInfo()->major_version == 2);
+
+        REQUIRE(flash.getWrittenByteCount() == writes);
+        REQUIRE(flash.isSameImage(image_v2.data(), image_v2.size()));
+    }
+}
+
+
+TEST_CASE("Core-DualSlot")
+{
+    static constexpr std::uint32_t ROMSize = 16 * 1024;
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend slot_a("core-slot-a-test-rom.tmp", ROMSize);
+    mocks::FileMappedROMBackend slot_b("core-slot-b-test-rom.tmp", ROMSize);
+
+    const auto v1 = util::setImageVersion(images::AppValid, 1, 0);
+    const auto v2 = util::setImageVersion(images::AppValid2, 1, 1);
+    const auto v3 = util::setImageVersion(images::AppValid, 2, 0);
+
+    kocherga::BootloaderController blc(platform, slot_a, slot_b, kocherga::SecondaryROMRole::AlternateSlot, ROMSize,
+                                       std::chrono::seconds(1));
+    REQUIRE(blc.getState() == kocherga::State::NoAppToBoot);
+    REQUIRE(!blc.getAppSlot());
+
+    // The first image goes into the first slot
+    mocks::Protocol proto_v1(v1.data(), v1.size());
+    REQUIRE(0 == blc.upgradeApp(proto_v1));
+    REQUIRE(blc.getState() == kocherga::State::BootDelay);
+    REQUIRE(*blc.getAppSlot() == 0);
+    REQUIRE(blc.getAppInfo()->major_version == 1);
+    REQUIRE(slot_a.isSameImage(v1.data(), v1.size()));
+
+    // The next one goes into the other slot; the old image remains available during the upgrade
+    blc.cancelBoot();
+    mocks::Protocol proto_v2(v2.data(), v2.size(), [&blc]() {
+        REQUIRE(blc.getState() == kocherga::State::AppUpgradeInProgress);
+        REQUIRE(*blc.getAppSlot() == 0);
+    });
+    REQUIRE(0 == blc.upgradeApp(proto_v2));
+    REQUIRE(blc.getState() == kocherga::State::BootDelay);
+    REQUIRE(*blc.getAppSlot() == 1);
+    REQUIRE(blc.getAppInfo()->minor_version == 1);
+    REQUIRE(slot_a.isSameImage(v1.data(), v1.size()));
+    REQUIRE(slot_b.isSameImage(v2.data(), v2.size()));
+
+    // A failed upgrade overwrites the older image, the newer one is still bootable
+    blc.cancelBoot();
+    slot_a.setFailureInjector([](std::int16_t x) { return (x > 0) ? std::int16_t(-1) : x; });
+    mocks::Protocol proto_v3(v3.data(), v3.size());
+    REQUIRE(-1 == blc.upgradeApp(proto_v3));
+    REQUIRE(blc.getState() == kocherga::State::BootCancelled);
+    REQUIRE(*blc.getAppSlot() == 1);
+
+    // The newest valid image is selected after restart
+    slot_a.setFailureInjector({});
+    {
+        kocherga::BootloaderController restarted(platform, slot_a, slot_b,
+                                                 kocherga::SecondaryROMRole::AlternateSlot, ROMSize);
+        REQUIRE(*restarted.getAppSlot() == 1);
+        REQUIRE(restarted.getState() == kocherga::State::ReadyToBoot);
+    }
+    mocks::Protocol proto_v3_retry(v3.data(), v3.size());
+    REQUIRE(0 == blc.upgradeApp(proto_v3_retry));
+    REQUIRE(*blc.getAppSlot() == 0);
+    REQUIRE(blc.getAppInfo()->major_version == 2);
+    {
+        kocherga::BootloaderController restarted(platform, slot_a, slot_b,
+                                                 kocherga::SecondaryROMRole::AlternateSlot, ROMSize);
+        REQUIRE(*restarted.getAppSlot() == 0);
+        REQUIRE(restarted.getAppInfo()->major_version == 2);
+    }
+}
+
+
 TEST_CASE("Core-CRC64")
 {
     kocherga::CRC64 crc;
     crc.add("123456789", 9);
     REQUIRE(crc.get() == 0x62EC59E3F1A4F00AULL);
+
+    // The CRC assembled from the partial CRCs of the parts is the same
+    const std::string data = "The quick brown fox jumps over the lazy dog";
+    for (std::size_t split = 0; split <= data.size(); split++)
+    {
+        kocherga::CRC64 combined;
+        combined.combine(kocherga::CRC64::computePartial(data.data(), split),
+                         kocherga::CRC64::computeShiftFactor(split));
+        combined.combine(kocherga::CRC64::computePartial(data.data() + split, data.size() - split),
+                         kocherga::CRC64::computeShiftFactor(data.size() - split));
+        kocherga::CRC64 reference;
+        reference.add(data.data(), data.size());
+        REQUIRE(combined.get() == reference.get());
+    }
+}
+
+
+TEST_CASE("Core-PageCRCCache")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    static constexpr std::uint32_t SectorSize = 1024;       // Otherwise, the unchanged pages would be erased anyway
+    static constexpr std::uint32_t ImageSize = 40 * 1024;
+
+    // A larger image, so that the difference is noticeable
+    std::vector<std::uint8_t> base(images::AppValid2.begin(), images::AppValid2.end());
+    for (std::size_t i = base.size(); i < ImageSize; i++)
+    {
+        base.push_back(std::uint8_t(i * 7U));
+    }
+    const auto descriptor = std::size_t(std::search(base.begin(), base.end(), std::begin("APDesc00"),
+                                                    std::end("APDesc00") - 1) - base.begin());
+    std::memcpy(&base.at(descriptor + 16), &ImageSize, sizeof(ImageSize));
+    const auto image_v1 = util::setImageVersion(base, 1, 0);
+    base.at(30000) ^= 0xFFU;
+    const auto image_v2 = util::setImageVersion(base, 2, 0);
+
+    // Returns the number of bytes read while the image is upgraded from v1 to v2
+    const auto run = [&](bool cached)
+    {
+        std::vector<std::uint64_t> cache(ROMSize / 1024U);
+        kocherga::UpgradeOptions options;
+        options.skip_unchanged_pages = true;
+        options.page_crc_cache = cached ? cache.data() : nullptr;
+        options.page_crc_cache_size = std::uint32_t(cache.size());
+
+        mocks::Platform platform;
+        mocks::FlashSimulator flash(ROMSize, SectorSize);
+        kocherga::BootloaderController blc(platform, flash, ROMSize, std::chrono::seconds(1), options);
+
+        mocks::Protocol proto_v1(image_v1.data(), image_v1.size());
+        REQUIRE(0 == blc.upgradeApp(proto_v1));
+        REQUIRE(blc.getAppInfo()->major_version == 1);
+
+        // The stale CRCs of the pages that are written must not be used
+        blc.cancelBoot();
+        auto corrupted = image_v2;
+        corrupted.at(20000) ^= 1U;
+        mocks::Protocol proto_corrupted(corrupted.data(), corrupted.size());
+        REQUIRE(0 == blc.upgradeApp(proto_corrupted));
+        REQUIRE(blc.getState() == kocherga::State::NoAppToBoot);
+
+        mocks::Protocol proto_v1_again(image_v1.data(), image_v1.size());
+        REQUIRE(0 == blc.upgradeApp(proto_v1_again));
+        REQUIRE(blc.getAppInfo()->major_version == 1);
+
+        blc.cancelBoot();
+        const auto reads_before = flash.getReadByteCount();
+        mocks::Protocol proto_v2(image_v2.data(), image_v2.size());
+        REQUIRE(0 == blc.upgradeApp(proto_v2));
+        REQUIRE(blc.getAppInfo()->major_version == 2);
+        REQUIRE(flash.isSameImage(image_v2.data(), image_v2.size()));
+        return flash.getReadByteCount() - reads_before;
+    };
+
+    // Only the two modified pages are read again: the one with the descriptor and the one with the change
+    const auto uncached_reads = run(false);
+    const auto cached_reads = run(true);
+    REQUIRE((uncached_reads - cached_reads) == (ImageSize - 2 * SectorSize));
+}
+
+
+namespace
+{
+
+/// Strips its magic and passes the rest of the stream through; records the calls of the IStreamFilter methods
+class PassThroughFilter : public kocherga::IStreamFilter
+{
+    const Magic magic_;
+    const bool fail_end_;
+    kocherga::IDownloadSink* output_ = nullptr;
+    std::uint8_t magic_remaining_ = 0;
+    std::string calls_;
+
+    Magic getMagic() const override { return magic_; }
+
+    std::int16_t beginStream(kocherga::IDownloadSink& output, const kocherga::IReferenceImage&) override
+    {
+        calls_ += "b";
+        output_ = &output;
+        magic_remaining_ = MagicSize;
+        return kocherga::ErrOK;
+    }
+
+    std::int16_t handleNextDataChunk(const void* data, std::uint16_t size) override
+    {
+        const auto skip = std::min<std::uint16_t>(magic_remaining_, size);
+        magic_remaining_ = std::uint8_t(magic_remaining_ - skip);
+        if (size == skip)
+        {
+            return std::int16_t(size);
+        }
+        return output_->handleNextDataChunk(static_cast<const std::uint8_t*>(data) + skip,
+                                            std::uint16_t(size - skip));
+    }
+
+    std::int16_t endStream() override
+    {
+        calls_ += "e";
+        return fail_end_ ? -kocherga::ErrInvalidState : kocherga::ErrOK;
+    }
+
+    void abortStream() override { calls_ += "a"; }
+
+public:
+    PassThroughFilter(const char* magic, bool fail_end) :
+        magic_([magic]() { Magic m{}; std::copy_n(magic, MagicSize, m.begin()); return m; }()),
+        fail_end_(fail_end)
+    { }
+
+    /// Returns the calls since the last invocation: b - beginStream(), e - endStream(), a - abortStream()
+    std::string takeCalls() { return std::exchange(calls_, {}); }
+};
+
+}
+
+
+TEST_CASE("Core-StreamFilterAbort")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+
+    std::vector<std::uint8_t> stream;
+    for (const char* magic : {"Outer000", "Inner000"})
+    {
+        stream.insert(stream.end(), magic, magic + kocherga::IStreamFilter::MagicSize);
+    }
+    stream.insert(stream.end(), images::AppValid.begin(), images::AppValid.end());
+
+    for (const bool fail_end : {false, true})
+    {
+        mocks::Platform platform;
+        mocks::FlashSimulator flash(ROMSize, 1024);
+        kocherga::BootloaderController blc(platform, flash, ROMSize);
+        PassThroughFilter outer("Outer000", fail_end);
+        PassThroughFilter inner("Inner000", false);
+        REQUIRE(blc.addStreamFilter(inner));
+        REQUIRE(blc.addStreamFilter(outer));
+
+        // The filters are finalized if the download succeeds; if the outer one fails, the inner one is aborted
+        mocks::Protocol proto(stream.data(), stream.size());
+        REQUIRE((fail_end ? -kocherga::ErrInvalidState : 0) == blc.upgradeApp(proto));
+        REQUIRE(outer.takeCalls() == (fail_end ? "bea" : "be"));
+        REQUIRE(inner.takeCalls() == (fail_end ? "ba" : "be"));
+
+        // Every level is aborted if the protocol fails
+        blc.cancelBoot();
+        mocks::InterruptedProtocol interrupted(stream.data(), stream.size() / 2U);
+        REQUIRE(mocks::InterruptedProtocol::ErrLinkLost == blc.upgradeApp(interrupted));
+        REQUIRE(outer.takeCalls() == "ba");
+        REQUIRE(inner.takeCalls() == "ba");
+
+        // Streams that are not recognized by a filter are not reported to it
+        mocks::InterruptedProtocol plain(images::AppValid.data(), images::AppValid.size() / 2U);
+        REQUIRE(mocks::InterruptedProtocol::ErrLinkLost == blc.upgradeApp(plain));
+        REQUIRE(outer.takeCalls().empty());
+        REQUIRE(inner.takeCalls().empty());
+    }
 }
 
 
@@ -0,0 +1,202 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+// We want to ensure that assertion checks are enabled when tests are run, for extra safety
+#ifdef NDEBUG
+# undef NDEBUG
+#endif
+
+#define KOCHERGA_TRACE std::printf
+
+// The library headers must be included first to make sure that they don't have any hidden include dependencies.
+#include <kocherga_delta.hpp>
+
+#include "catch.hpp"
+#include "mocks.hpp"
+#include "images.hpp"
+#include "util.hpp"
+
+
+namespace
+{
+
+/**
+ * Generates the patch using the host tool.
+ */
+std::vector<std::uint8_t> makePatch(const std::vector<std::uint8_t>& base, const std::vector<std::uint8_t>& image)
+{
+    util::writeFile("delta-base.tmp", base);
+    return util::packImage("delta --base delta-base.tmp", image);
+}
+
+/**
+ * Builds a patch by hand, for testing malformed patches.
+ */
+std::vector<std::uint8_t> makePatchHeader(std::uint64_t base_crc, std::uint32_t image_size)
+{
+    std::vector<std::uint8_t> out{'K', 'D', 'e', 'l', 't', 'a', '0', '0'};
+    for (std::uint8_t i = 0; i < 8; i++)
+    {
+        out.push_back(std::uint8_t(base_crc >> (i * 8U)));
+    }
+    for (std::uint8_t i = 0; i < 8; i++)
+    {
+        out.push_back((i < 4) ? std::uint8_t(image_size >> (i * 8U)) : 0);
+    }
+    return out;
+}
+
+void appendVarint(std::vector<std::uint8_t>& out, std::uint32_t value)
+{
+    while (value >= 0x80U)
+    {
+        out.push_back(std::uint8_t(value | 0x80U));
+        value >>= 7U;
+    }
+    out.push_back(std::uint8_t(value));
+}
+
+}
+
+
+TEST_CASE("Delta-Patch")
+{
+    static constexpr std::uint32_t ROMSize = 16 * 1024;
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend slot_a("delta-slot-a-test-rom.tmp", ROMSize);
+    mocks::FileMappedROMBackend slot_b("delta-slot-b-test-rom.tmp", ROMSize);
+
+    kocherga_delta::PatchFilter patch_filter;
+    kocherga::BootloaderController blc(platform, slot_a, slot_b, kocherga::SecondaryROMRole::AlternateSlot, ROMSize);
+    REQUIRE(blc.addStreamFilter(patch_filter));
+
+    // Regular images are not affected by the filter
+    const auto base = util::setImageVersion(images::AppValid2, 1, 0);
+    mocks::Protocol proto_base(base.data(), base.size());
+    REQUIRE(0 == blc.upgradeApp(proto_base));
+    REQUIRE(*blc.getAppSlot() == 0);
+    REQUIRE(slot_a.isSameImage(base.data(), base.size()));
+
+    // The new image has some code inserted in the middle, which shifts the rest of the image
+    std::vector<std::uint8_t> modified(images::AppValid2.begin(), images::AppValid2.end());
+    for (std::uint8_t i = 0; i < 16; i++)
+    {
+        modified.insert(modified.begin() + 4096 + i, i);
+    }
+    modified.resize(images::AppValid2.size());
+    const auto image = util::setImageVersion(modified, 1, 1);
+
+    const auto patch = makePatch(base, image);
+    REQUIRE(patch.size() < (image.size() / 20));
+
+    blc.cancelBoot();
+    mocks::SizeHintingProtocol proto_patch(patch.data(), patch.size(), std::uint32_t(patch.size()));
+    REQUIRE(0 == blc.upgradeApp(proto_patch));
+    REQUIRE(*blc.getAppSlot() == 1);
+    REQUIRE(blc.getAppInfo()->minor_version == 1);
+    REQUIRE(slot_b.isSameImage(image.data(), image.size()));
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_received == patch.size());
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_decoded == image.size());
+
+    // The patch cannot be applied to the other image, which is now the installed one
+    blc.cancelBoot();
+    mocks::Protocol proto_again(patch.data(), patch.size());
+    REQUIRE(-kocherga_delta::ErrBaseImageMismatch == blc.upgradeApp(proto_again));
+    REQUIRE(*blc.getAppSlot() == 1);
+
+    const auto installed_crc = blc.getAppInfo()->image_crc;
+
+    // Copying past the end of the base image
+    {
+        auto bad = makePatchHeader(installed_crc, 64);
+        appendVarint(bad, (64U << 1U) | 1U);
+        appendVarint(bad, std::uint32_t(images::AppValid2.size()) << 1U);
+        mocks::Protocol proto(bad.data(), bad.size());
+        REQUIRE(-kocherga_delta::ErrInvalidPatch == blc.upgradeApp(proto));
+    }
+
+    // Literal record longer than the image
+    {
+        auto bad = makePatchHeader(installed_crc, 8);
+        bad.insert(bad.end(), {9U << 1U, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+        mocks::Protocol proto(bad.data(), bad.size());
+        REQUIRE(-kocherga_delta::ErrInvalidPatch == blc.upgradeApp(proto));
+    }
+
+    // Copy offset that does not fit into 32 bits; it would be zero if the excess bits were discarded
+    {
+        auto bad = makePatchHeader(installed_crc, 64);
+        appendVarint(bad, (64U << 1U) | 1U);
+        bad.insert(bad.end(), {0x80, 0x80, 0x80, 0x80, 0x10});
+        mocks::Protocol proto(bad.data(), bad.size());
+        REQUIRE(-kocherga_delta::ErrInvalidPatch == blc.upgradeApp(proto));
+    }
+
+    // Record tag longer than five bytes
+    {
+        auto bad = makePatchHeader(installed_crc, 8);
+        bad.insert(bad.end(), {8U << 1U | 0x80U, 0x80, 0x80, 0x80, 0x80, 0x00});
+        mocks::Protocol proto(bad.data(), bad.size());
+        REQUIRE(-kocherga_delta::ErrInvalidPatch == blc.upgradeApp(proto));
+    }
+
+    // Truncated patch
+    {
+        auto bad = makePatchHeader(installed_crc, 16);
+        bad.insert(bad.end(), {16U << 1U, 1, 2, 3, 4, 5, 6, 7, 8});
+        mocks::Protocol proto(bad.data(), bad.size());
+        REQUIRE(-kocherga_delta::ErrInvalidPatch == blc.upgradeApp(proto));
+    }
+
+    // The installed image is never affected
+    REQUIRE(*blc.getAppSlot() == 1);
+    REQUIRE(slot_b.isSameImage(image.data(), image.size()));
+}
+
+
+TEST_CASE("Delta-SingleSlot")
+{
+    static constexpr std::uint32_t ROMSize = 16 * 1024;
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend rom("delta-single-test-rom.tmp", ROMSize);
+
+    kocherga_delta::PatchFilter patch_filter;
+    kocherga::BootloaderController blc(platform, rom, ROMSize);
+    REQUIRE(blc.addStreamFilter(patch_filter));
+
+    mocks::Protocol proto_base(images::AppValid2.data(), images::AppValid2.size());
+    REQUIRE(0 == blc.upgradeApp(proto_base));
+    const auto installed_crc = blc.getAppInfo()->image_crc;
+
+    // The installed image would be overwritten while being patched, so this is not allowed
+    blc.cancelBoot();
+    auto patch = makePatchHeader(installed_crc, std::uint32_t(images::AppValid2.size()));
+    appendVarint(patch, (std::uint32_t(images::AppValid2.size()) << 1U) | 1U);     // Copy the entire image
+    appendVarint(patch, 0);
+    mocks::Protocol proto_patch(patch.data(), patch.size());
+    REQUIRE(-kocherga_delta::ErrBaseImageMismatch == blc.upgradeApp(proto_patch));
+}
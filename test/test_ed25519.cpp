@@ -0,0 +1,329 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+// We want to ensure that assertion checks are enabled when tests are run, for extra safety
+#ifdef NDEBUG
+# undef NDEBUG
+#endif
+
+#define KOCHERGA_TRACE std::printf
+
+// The library headers must be included first to make sure that they don't have any hidden include dependencies.
+#include <kocherga_ed25519.hpp>
+#include <kocherga_lz.hpp>
+
+#include "catch.hpp"
+#include "mocks.hpp"
+#include "images.hpp"
+#include "util.hpp"
+
+#include <iostream>
+#include <iomanip>
+
+
+namespace
+{
+
+std::vector<std::uint8_t> fromHex(const std::string& hex)
+{
+    std::vector<std::uint8_t> out;
+    for (std::size_t i = 0; i < hex.size(); i += 2)
+    {
+        out.push_back(std::uint8_t(std::stoul(hex.substr(i, 2), nullptr, 16)));
+    }
+    return out;
+}
+
+template <std::size_t Size>
+std::array<std::uint8_t, Size> toArray(const std::vector<std::uint8_t>& v)
+{
+    REQUIRE(v.size() == Size);
+    std::array<std::uint8_t, Size> out{};
+    std::copy(v.begin(), v.end(), out.begin());
+    return out;
+}
+
+/// RFC 8032, section 7.3
+const std::string PrivateKeyHex = "833fe62409237b9d62ec77587520911e9a759cec1d19755b7da901b96dca3d42";
+const std::string PublicKeyHex  = "ec172b93ad5e563bf4932c70e1245034c35467ef2efd4d64ebf819683467e2bf";
+
+/// Counts the data hashed, to make sure that the image is not read again just to check the signature
+class CountingVerifier : public kocherga::ISignatureVerifier
+{
+    kocherga_ed25519::SignatureVerifier verifier_;
+    std::size_t bytes_hashed_ = 0;
+    std::size_t verifications_ = 0;
+
+    std::uint8_t getSignatureSize() const override { return verifier_.getSignatureSize(); }
+
+    void reset() override { verifier_.reset(); }
+
+    void update(const void* data, std::size_t size) override
+    {
+        bytes_hashed_ += size;
+        verifier_.update(data, size);
+    }
+
+    bool verify(const std::uint8_t* signature) override
+    {
+        verifications_++;
+        return verifier_.verify(signature);
+    }
+
+public:
+    explicit CountingVerifier(const kocherga_ed25519::SignatureVerifier::PublicKey& public_key) :
+        verifier_(public_key)
+    { }
+
+    std::size_t getHashedByteCount() const { return bytes_hashed_; }
+    std::size_t getVerificationCount() const { return verifications_; }
+
+    void resetCounters()
+    {
+        bytes_hashed_ = 0;
+        verifications_ = 0;
+    }
+};
+
+}
+
+
+TEST_CASE("Ed25519-SHA512")
+{
+    const auto digest = [](const std::vector<std::uint8_t>& data, std::size_t chunk)
+    {
+        kocherga_ed25519::SHA512 hash;
+        for (std::size_t offset = 0; offset < data.size(); offset += chunk)
+        {
+            hash.update(&data[offset], std::min(chunk, data.size() - offset));
+        }
+        const auto out = hash.finalize();
+        return std::vector<std::uint8_t>(out.begin(), out.end());
+    };
+    const auto pattern = [](std::size_t size)
+    {
+        std::vector<std::uint8_t> out(size);
+        for (std::size_t i = 0; i < size; i++)
+        {
+            out[i] = std::uint8_t(i * 7U + 3U);
+        }
+        return out;
+    };
+
+    REQUIRE(digest({}, 1) == fromHex("cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+                                     "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e"));
+    REQUIRE(digest({'a', 'b', 'c'}, 1) == fromHex("ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+                                                  "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f"));
+
+    // The sizes around the block boundary exercise the padding
+    const std::map<std::size_t, std::string> vectors{
+        {111, "68cffa6d0d76f309c9ce0d35280939f8e25990c43b7b086ccdf709be35b07d4d"
+              "dba599541ff2b1c19d34ea49aeafb9659adb7ac3c0b078bb30a22d57fc6687ef"},
+        {112, "d0865c524d1dddf7c23b799c413f5adcd7caefd3f66a9b49750ec81066012c25"
+              "a8bcf94ddea6dc525691673097ca40e0101e897fc97218cfdb0704084e2bef4b"},
+        {127, "e0b6a20f1c0c88970a9340152cd5a1c1ecf3d3b8de5510274187943807947354"
+              "0133b812706e5dbec322c8c9523b6fc8c6d16ee626e87ad5fe3d2916afedc369"},
+        {128, "99b16f17aa0b969a5b8f08f367719d516e330ccd2660b6f0688ec031dbc783de"
+              "50a1cd185a2568dba75070a2403d17d4741d163578515dfd2ff756ddfe4d47b1"},
+        {1000, "00e36fccf193e59697a92b5ab24666ce6326d7fa16bf10832d0991ddc591112e"
+               "9dfa6a636950ed9c4d67344a760654c2ff7785e1d60094d651038735b5dccabd"},
+    };
+    for (const auto& v : vectors)
+    {
+        for (const std::size_t chunk : std::array<std::size_t, 6>{{1, 7, 64, 128, 129, 1000}})
+        {
+            REQUIRE(digest(pattern(v.first), chunk) == fromHex(v.second));
+        }
+    }
+}
+
+
+TEST_CASE("Ed25519-Verification")
+{
+    const auto public_key = toArray<32>(fromHex(PublicKeyHex));
+    const auto signature = fromHex("98a70222f0b8121aa9d30f813d683f809e462b469c7ff87639499bb94e6dae41"
+                                   "31f85042463c2a355a2003d062adf5aaa10b8c61e636062aaad11c2a26083406");
+    kocherga_ed25519::SignatureVerifier verifier(public_key);
+    kocherga::ISignatureVerifier& iface = verifier;
+    REQUIRE(iface.getSignatureSize() == 64);
+
+    const auto check = [&iface](const std::string& message, const std::vector<std::uint8_t>& sig)
+    {
+        iface.reset();
+        iface.update(message.data(), message.size());
+        return iface.verify(sig.data());
+    };
+
+    // RFC 8032, section 7.3; the verifier is reusable
+    REQUIRE(check("abc", signature));
+    REQUIRE(check("abc", signature));
+    REQUIRE(!check("abd", signature));
+    REQUIRE(!check("", signature));
+
+    // Any corruption of the signature is detected
+    for (std::size_t i = 0; i < signature.size(); i++)
+    {
+        auto corrupted = signature;
+        corrupted[i] = std::uint8_t(corrupted[i] ^ (1U << (i % 8U)));
+        REQUIRE(!check("abc", corrupted));
+    }
+
+    // S + L is the same signature mathematically, but it is not canonical
+    {
+        auto malleated = signature;
+        const auto order = kocherga_ed25519::detail::Order;
+        unsigned carry = 0;
+        for (std::size_t i = 0; i < 32; i++)
+        {
+            const unsigned sum = malleated[32 + i] + order[i] + carry;
+            malleated[32 + i] = std::uint8_t(sum);
+            carry = sum >> 8U;
+        }
+        REQUIRE(carry == 0);
+        REQUIRE(!check("abc", malleated));
+    }
+
+    // Another key
+    {
+        auto other_key = public_key;
+        other_key[0] = std::uint8_t(other_key[0] ^ 1U);
+        kocherga_ed25519::SignatureVerifier other(other_key);
+        other.reset();
+        other.update("abc", 3);
+        REQUIRE(!other.verify(signature.data()));
+    }
+}
+
+
+TEST_CASE("Ed25519-SignedImages")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+
+    const std::vector<std::uint8_t> image(images::AppValid2.begin(), images::AppValid2.end());
+    const auto signed_image = util::packImage("sign --key " + PrivateKeyHex, image);
+    REQUIRE(signed_image.size() == image.size() + 64U);
+    REQUIRE(std::equal(image.begin(), image.end(), signed_image.begin()));
+
+    CountingVerifier verifier(toArray<32>(fromHex(PublicKeyHex)));
+    mocks::Platform platform;
+    platform.setSignatureVerifier(&verifier);
+    mocks::FileMappedROMBackend rom("ed25519-test-rom.tmp", ROMSize);
+
+    kocherga::UpgradeOptions options;
+    options.readback = kocherga::ReadbackPolicy::None;
+    kocherga_lz::DecompressionFilter<11> decompressor;
+    kocherga::BootloaderController blc(platform, rom, ROMSize, std::chrono::microseconds(0), options);
+    REQUIRE(blc.addStreamFilter(decompressor));
+    REQUIRE(!blc.getAppInfo());
+
+    // The signature is checked while the image is being written, so the image is hashed only once
+    {
+        verifier.resetCounters();
+        mocks::Protocol proto(signed_image.data(), signed_image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(rom.isSameImage(signed_image.data(), signed_image.size()));
+        REQUIRE(verifier.getHashedByteCount() == image.size());
+        REQUIRE(verifier.getVerificationCount() == 1);
+        REQUIRE(!platform.isMutexLocked());
+    }
+
+    // Upon boot, the digest is computed in the same pass as the CRC
+    {
+        verifier.resetCounters();
+        kocherga::BootloaderController again(platform, rom, ROMSize);
+        REQUIRE(again.getAppInfo());
+        REQUIRE(verifier.getHashedByteCount() == image.size());
+        REQUIRE(verifier.getVerificationCount() == 1);
+    }
+
+    // Signed, then compressed
+    {
+        const auto compressed = util::packImage("compress", signed_image);
+        blc.cancelBoot();
+        mocks::Protocol proto(compressed.data(), compressed.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+    }
+
+    // Unsigned images and images with a wrong signature are never booted, even though their CRC is correct
+    {
+        const auto unsigned_image = util::setImageVersion(image, 1, 0);
+        blc.cancelBoot();
+        mocks::Protocol proto(unsigned_image.data(), unsigned_image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(!blc.getAppInfo());
+        REQUIRE(blc.getState() == kocherga::State::NoAppToBoot);
+
+        const auto other = util::packImage("sign --key " + std::string(64, '1'), image);
+        mocks::Protocol proto_other(other.data(), other.size());
+        verifier.resetCounters();
+        REQUIRE(0 == blc.upgradeApp(proto_other));
+        REQUIRE(!blc.getAppInfo());
+        REQUIRE(verifier.getVerificationCount() == 2);      // Downloaded, then read back because it is invalid
+
+        kocherga::BootloaderController again(platform, rom, ROMSize);
+        REQUIRE(!again.getAppInfo());
+    }
+
+    // The signature is not needed if the images are not signed
+    {
+        platform.setSignatureVerifier(nullptr);
+        kocherga::BootloaderController unsigned_blc(platform, rom, ROMSize);
+        REQUIRE(unsigned_blc.getAppInfo());
+    }
+}
+
+
+TEST_CASE("Ed25519-SignedStaging")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    const std::vector<std::uint8_t> image(images::AppValid2.begin(), images::AppValid2.end());
+    const auto signed_image = util::packImage("sign --key " + PrivateKeyHex, image);
+
+    kocherga_ed25519::SignatureVerifier verifier(toArray<32>(fromHex(PublicKeyHex)));
+    mocks::Platform platform;
+    platform.setSignatureVerifier(&verifier);
+    mocks::FlashSimulator flash(ROMSize, SectorSize);
+    mocks::FileMappedROMBackend staging("ed25519-staging-test-rom.tmp", ROMSize);
+    kocherga::BootloaderController blc(platform, flash, staging, kocherga::SecondaryROMRole::Staging, ROMSize);
+
+    // The signature is installed together with the image
+    mocks::Protocol proto(signed_image.data(), signed_image.size());
+    REQUIRE(0 == blc.upgradeApp(proto));
+    REQUIRE(blc.getAppInfo());
+    REQUIRE(flash.isSameImage(signed_image.data(), signed_image.size()));
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_installed == signed_image.size());
+
+    // An unsigned image is not installed
+    blc.cancelBoot();
+    const auto unsigned_image = util::setImageVersion(image, 1, 0);
+    mocks::Protocol proto_unsigned(unsigned_image.data(), unsigned_image.size());
+    REQUIRE(0 == blc.upgradeApp(proto_unsigned));
+    REQUIRE(blc.getAppInfo()->major_version == 0);
+    REQUIRE(flash.isSameImage(signed_image.data(), signed_image.size()));
+}
@@ -0,0 +1,177 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+// We want to ensure that assertion checks are enabled when tests are run, for extra safety
+#ifdef NDEBUG
+# undef NDEBUG
+#endif
+
+#define KOCHERGA_TRACE std::printf
+
+// The library headers must be included first to make sure that they don't have any hidden include dependencies.
+#include <kocherga_linux.hpp>
+
+#include "catch.hpp"
+#include "mocks.hpp"
+#include "images.hpp"
+#include "util.hpp"
+
+#include <iostream>
+#include <iomanip>
+
+
+namespace
+{
+
+std::vector<std::uint8_t> readAll(const kocherga::IROMBackend& backend, std::size_t size)
+{
+    std::vector<std::uint8_t> out(size);
+    for (std::size_t offset = 0; offset < size;)
+    {
+        const auto res = backend.read(offset, &out[offset], std::uint16_t(std::min<std::size_t>(size - offset, 1024)));
+        REQUIRE(res > 0);
+        offset += std::size_t(res);
+    }
+    return out;
+}
+
+}
+
+
+TEST_CASE("Linux-ROMBackend")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    static constexpr std::uint32_t EraseBlockSize = 4096;
+    const std::vector<std::uint8_t> image(images::AppValid2.begin(), images::AppValid2.end());
+
+    util::writeFile("linux-test-rom.tmp", std::vector<std::uint8_t>(ROMSize / 2, 0));
+
+    kocherga_linux::ROMBackend missing(ROMSize);
+    REQUIRE(-kocherga_linux::ErrOpenFailed == missing.open("linux-test-nonexistent.tmp"));
+
+    // The file is extended as necessary
+    {
+        mocks::Platform platform;
+        kocherga_linux::ROMBackend rom(ROMSize);
+        REQUIRE(0 == rom.open("linux-test-rom.tmp"));
+        REQUIRE(!rom.isMTD());
+        REQUIRE(rom.isMapped());
+        REQUIRE(util::readFile("linux-test-rom.tmp").size() == ROMSize);
+
+        kocherga::BootloaderController blc(platform, rom, ROMSize);
+        REQUIRE(!blc.getAppInfo());
+        mocks::Protocol proto(image.data(), image.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(blc.getLastUpgradeStatistics().sectors_erased == 0);
+    }
+
+    // The image persists; now with the erase blocks emulated
+    {
+        mocks::Platform platform;
+        kocherga_linux::ROMBackend rom(ROMSize, EraseBlockSize);
+        REQUIRE(0 == rom.open("linux-test-rom.tmp"));
+
+        const auto contents = util::readFile("linux-test-rom.tmp");
+        REQUIRE(std::equal(image.begin(), image.end(), contents.begin()));
+        REQUIRE(readAll(rom, image.size()) == image);
+
+        kocherga::BootloaderController blc(platform, rom, ROMSize);
+        REQUIRE(blc.getAppInfo());
+
+        blc.cancelBoot();
+        const auto other = util::setImageVersion(image, 1, 0);
+        mocks::Protocol proto(other.data(), other.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo()->major_version == 1);
+        REQUIRE(blc.getLastUpgradeStatistics().sectors_erased == (other.size() + EraseBlockSize - 1U) / EraseBlockSize);
+
+        // The remainder of the last erase block is erased, the rest is intact
+        const auto after = readAll(rom, ROMSize);
+        REQUIRE(std::equal(other.begin(), other.end(), after.begin()));
+        REQUIRE(after.at(other.size()) == 0xFF);
+        REQUIRE(after.at(ROMSize - 1U) == 0);
+    }
+
+    // The storage area must consist of whole erase blocks
+    kocherga_linux::ROMBackend misaligned(ROMSize - 1U, EraseBlockSize);
+    REQUIRE(-kocherga_linux::ErrInvalidSize == misaligned.open("linux-test-rom.tmp"));
+}
+
+
+TEST_CASE("Linux-ROMBackend-Benchmark", "[.benchmark]")
+{
+    static constexpr std::uint32_t ROMSize = 1024 * 1024;
+    static constexpr std::uint16_t PageSize = 1024;
+
+    std::vector<std::uint8_t> data(ROMSize);
+    for (std::size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = std::uint8_t(i * 7U + (i >> 8U));
+    }
+
+    /// Writes the data in pages like the controller does, then reads it back; returns the times in microseconds
+    const auto run = [&data](kocherga::IROMBackend& backend)
+    {
+        const auto started_at = std::chrono::steady_clock::now();
+        REQUIRE(0 == backend.beginUpgrade());
+        for (std::size_t offset = 0; offset < data.size(); offset += PageSize)
+        {
+            REQUIRE(PageSize == backend.write(offset, &data[offset], PageSize));
+        }
+        REQUIRE(0 == backend.endUpgrade(true));
+        const auto written_at = std::chrono::steady_clock::now();
+        REQUIRE(readAll(backend, data.size()) == data);
+        const auto read_at = std::chrono::steady_clock::now();
+        return std::make_pair(std::chrono::duration_cast<std::chrono::microseconds>(written_at - started_at),
+                              std::chrono::duration_cast<std::chrono::microseconds>(read_at - written_at));
+    };
+
+    const auto mb_per_s = [](std::chrono::microseconds time)
+    {
+        return double(ROMSize) / double(std::max<std::int64_t>(time.count(), 1));     // Bytes per us = MB/s
+    };
+
+    mocks::FileMappedROMBackend mock("linux-bench-mock-rom.tmp", ROMSize);
+    const auto mock_time = run(mock);
+
+    util::writeFile("linux-bench-rom.tmp", std::vector<std::uint8_t>(ROMSize, 0xFF));
+    kocherga_linux::ROMBackend rom(ROMSize);
+    REQUIRE(0 == rom.open("linux-bench-rom.tmp"));
+    const auto rom_time = run(rom);
+
+    REQUIRE(rom_time.first < mock_time.first);
+    REQUIRE(rom_time.second < mock_time.second);
+
+    std::cout << "Writing and reading back " << ROMSize << " bytes in " << PageSize << "-byte blocks" << std::endl;
+    std::cout << std::setw(24) << std::left << "Backend"
+              << std::setw(16) << std::right << "Write, MB/s" << std::setw(16) << "Read, MB/s" << std::endl;
+    std::cout << std::setw(24) << std::left << "FileMappedROMBackend"
+              << std::setw(16) << std::right << mb_per_s(mock_time.first)
+              << std::setw(16) << mb_per_s(mock_time.second) << std::endl;
+    std::cout << std::setw(24) << std::left << "kocherga_linux"
+              << std::setw(16) << std::right << mb_per_s(rom_time.first)
+              << std::setw(16) << mb_per_s(rom_time.second) << std::endl;
+}
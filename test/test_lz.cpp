@@ -0,0 +1,149 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+// We want to ensure that assertion checks are enabled when tests are run, for extra safety
+#ifdef NDEBUG
+# undef NDEBUG
+#endif
+
+#define KOCHERGA_TRACE std::printf
+
+// The library headers must be included first to make sure that they don't have any hidden include dependencies.
+#include <kocherga_lz.hpp>
+
+#include "catch.hpp"
+#include "mocks.hpp"
+#include "images.hpp"
+#include "util.hpp"
+
+#include <iostream>
+#include <iomanip>
+
+
+namespace
+{
+
+const std::vector<std::uint8_t> Image(images::AppValid2.begin(), images::AppValid2.end());    // NOLINT
+
+}
+
+
+TEST_CASE("LZ-Decompression")
+{
+    static constexpr std::uint32_t ROMSize = 16 * 1024;
+
+    mocks::Platform platform;
+    mocks::FileMappedROMBackend rom("lz-test-rom.tmp", ROMSize);
+
+    kocherga_lz::DecompressionFilter<11> filter;
+    kocherga::BootloaderController blc(platform, rom, ROMSize);
+    REQUIRE(blc.addStreamFilter(filter));
+
+    const auto compressed = util::packImage("compress", Image);
+    REQUIRE(compressed.size() < (Image.size() * 3 / 4));
+
+    mocks::SizeHintingProtocol proto(compressed.data(), compressed.size(), std::uint32_t(compressed.size()));
+    REQUIRE(0 == blc.upgradeApp(proto));
+    REQUIRE(blc.getAppInfo());
+    REQUIRE(rom.isSameImage(Image.data(), Image.size()));
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_received == compressed.size());
+    REQUIRE(blc.getLastUpgradeStatistics().bytes_decoded == Image.size());
+
+    // The window is too large for this decoder
+    blc.cancelBoot();
+    const auto large_window = util::packImage("compress --window-bits 12", Image);
+    mocks::Protocol proto_large_window(large_window.data(), large_window.size());
+    REQUIRE(-kocherga_lz::ErrWindowTooLarge == blc.upgradeApp(proto_large_window));
+
+    // Truncated stream
+    mocks::Protocol proto_truncated(compressed.data(), compressed.size() - 1U);
+    REQUIRE(-kocherga_lz::ErrInvalidStream == blc.upgradeApp(proto_truncated));
+
+    // Reference to the data before the beginning of the image
+    std::vector<std::uint8_t> bad(compressed.begin(), compressed.begin() + 16);
+    bad.insert(bad.end(), {0x02, 'A', 0x00, 0x10});         // Literal, then a match with distance 2
+    mocks::Protocol proto_bad(bad.data(), bad.size());
+    REQUIRE(-kocherga_lz::ErrInvalidStream == blc.upgradeApp(proto_bad));
+}
+
+
+TEST_CASE("LZ-Benchmark", "[.benchmark]")
+{
+    static constexpr std::uint32_t ROMSize = 16 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    /*
+     * Chunk sizes and the time per chunk include the protocol overhead:
+     *  - YMODEM-1K at 115200 baud: 1024 bytes of payload in 1029-byte blocks plus the ACK, 10 bits per byte.
+     *  - UAVCAN at 250 kbps: 256 bytes per file read response (38 CAN frames) plus the request (4 frames),
+     *    about 135 bits per frame including the bit stuffing.
+     *  - Popcop at 115200 baud: 256 bytes per frame with about 10 bytes of framing and escaping overhead.
+     */
+    struct Link
+    {
+        const char* name;
+        std::uint16_t chunk_size;
+        std::chrono::microseconds chunk_time;
+    };
+    static const std::array<Link, 3> Links{{
+        {"YMODEM-1K, UART 115200",  1024, std::chrono::microseconds(1030 * 10 * 1'000'000LL / 115'200)},
+        {"UAVCAN, CAN 250k",        256,  std::chrono::microseconds(42 * 135 * 1'000'000LL / 250'000)},
+        {"Popcop, UART 115200",     256,  std::chrono::microseconds(266 * 10 * 1'000'000LL / 115'200)},
+    }};
+
+    const auto compressed = util::packImage("compress", Image);
+
+    const auto run = [](const Link& link, const std::vector<std::uint8_t>& stream)
+    {
+        mocks::Platform platform;
+        mocks::FlashSimulator flash(ROMSize, SectorSize);
+        kocherga_lz::DecompressionFilter<11> filter;
+        kocherga::BootloaderController blc(platform, flash, ROMSize);
+        REQUIRE(blc.addStreamFilter(filter));
+
+        mocks::LinkProtocol proto(stream, link.chunk_size, link.chunk_time, flash);
+        const auto started_at = std::chrono::steady_clock::now();
+        REQUIRE(0 == blc.upgradeApp(proto));
+        const auto host_time = std::chrono::steady_clock::now() - started_at;
+        REQUIRE(flash.isSameImage(Image.data(), Image.size()));
+        return std::make_pair(flash.getTime(), std::chrono::duration_cast<std::chrono::microseconds>(host_time));
+    };
+
+    std::cout << "Image " << Image.size() << " bytes, compressed " << compressed.size() << " bytes" << std::endl;
+    std::cout << std::setw(24) << std::left << "Protocol"
+              << std::setw(12) << std::right << "Raw, ms" << std::setw(16) << "Compressed, ms"
+              << std::setw(10) << "Saved" << std::setw(20) << "Host CPU time, us" << std::endl;
+    for (auto& link : Links)
+    {
+        const auto raw = run(link, Image);
+        const auto lz = run(link, compressed);
+        REQUIRE(lz.first < raw.first);
+        std::cout << std::setw(24) << std::left << link.name
+                  << std::setw(12) << std::right << raw.first.count() / 1000
+                  << std::setw(16) << lz.first.count() / 1000
+                  << std::setw(9) << (100 * (raw.first - lz.first).count() / raw.first.count()) << "%"
+                  << std::setw(20) << lz.second.count() << std::endl;
+    }
+}
@@ -155,3 +155,72 @@ TEST_CASE("Mocks-ROM")
     REQUIRE(9 == back.getReadCount());
     REQUIRE(4 == back.getWriteCount());
 }
+
+
+TEST_CASE("Mocks-FlashSimulator")
+{
+    using namespace mocks;
+    using std::chrono::microseconds;
+
+    FlashTimings timings;
+    timings.sector_erase = microseconds(1000);
+    timings.page_program = microseconds(10);
+    timings.program_per_byte = microseconds(1);
+    timings.read_per_byte = std::chrono::nanoseconds(1000);
+
+    FlashSimulator flash(4096, 1024, 256, timings);
+    auto& interface = static_cast<kocherga::IROMBackend&>(flash);
+
+    REQUIRE(interface.getSectorSize(0) == 1024);
+    REQUIRE(interface.getSectorSize(1024) == 1024);
+    REQUIRE(interface.getSectorSize(100) == 0);
+    REQUIRE(interface.getSectorSize(4096) == 0);
+
+    std::array<std::uint8_t, 1024> buf{};
+    REQUIRE_THROWS_AS(interface.write(0, buf.data(), 1), BadUsageException);
+    REQUIRE(0 == interface.beginUpgrade());
+
+    // The initial contents are zeros, so nothing but zeros can be written before the sector is erased
+    buf.fill(0xA5);
+    REQUIRE_THROWS_AS(interface.write(0, buf.data(), 16), BadUsageException);
+    REQUIRE(0 == flash.getPageProgramCount());
+
+    // The erase takes time; the sector cannot be accessed meanwhile, and other operations wait for its completion
+    REQUIRE(0 == interface.startSectorErase(0));
+    REQUIRE(0 == interface.awaitSectorErase(false));
+    REQUIRE_THROWS_AS(interface.read(0, buf.data(), 1), BadUsageException);
+    REQUIRE(1 == interface.read(1024, buf.data(), 1));
+    REQUIRE(flash.getTime() == microseconds(1001));
+    REQUIRE(1 == interface.awaitSectorErase(false));
+    REQUIRE(1 == flash.getEraseCount());
+    REQUIRE(1 == flash.getSectorEraseCount(0));
+    REQUIRE(0 == flash.getSectorEraseCount(1));
+
+    // Writes are split at the page boundaries
+    buf.fill(0xA5);
+    REQUIRE(300 == interface.write(200, buf.data(), 300));
+    REQUIRE(2 == flash.getPageProgramCount());
+    REQUIRE(flash.getTime() == microseconds(1001 + 20 + 300));
+
+    // Bits can be cleared without an erase, but not set
+    buf.fill(0x21);
+    REQUIRE(4 == interface.write(200, buf.data(), 4));
+    buf.fill(0xFF);
+    REQUIRE_THROWS_AS(interface.write(200, buf.data(), 4), BadUsageException);
+    flash.setOverprogrammingAllowed(true);
+    REQUIRE(4 == interface.write(200, buf.data(), 4));
+    REQUIRE(flash.getOverprogrammedBitCount() == 4 * 6);
+    REQUIRE(4 == interface.read(200, buf.data(), 4));
+    REQUIRE(std::all_of(buf.begin(), buf.begin() + 4, [](auto x) { return x == 0x21; }));
+
+    // Wear
+    flash.setEndurance(3);
+    REQUIRE(1 == interface.eraseSector(0));
+    REQUIRE(1 == interface.eraseSector(0));
+    REQUIRE(-kocherga::ErrROMWriteFailure == interface.eraseSector(0));
+    REQUIRE(1 == interface.eraseSector(3072));
+    REQUIRE(3 == flash.getMaxSectorEraseCount());
+    REQUIRE(1 == flash.getSectorEraseCount(3));
+
+    REQUIRE(0 == interface.endUpgrade(true));
+}
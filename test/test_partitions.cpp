@@ -0,0 +1,210 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+// We want to ensure that assertion checks are enabled when tests are run, for extra safety
+#ifdef NDEBUG
+# undef NDEBUG
+#endif
+
+#define KOCHERGA_TRACE std::printf
+
+// The library headers must be included first to make sure that they don't have any hidden include dependencies.
+#include <kocherga_partitions.hpp>
+
+#include "catch.hpp"
+#include "mocks.hpp"
+#include "images.hpp"
+#include "util.hpp"
+
+
+namespace
+{
+
+std::vector<std::uint8_t> makeBlob(std::size_t size, std::uint32_t seed)
+{
+    std::vector<std::uint8_t> out(size);
+    for (auto& x : out)
+    {
+        seed = seed * 1103515245U + 12345U;
+        x = std::uint8_t(seed >> 16U);
+    }
+    return out;
+}
+
+std::vector<std::uint8_t> packPartitions(const std::string& config_version,
+                                         const std::vector<std::uint8_t>& assets,
+                                         const std::vector<std::uint8_t>& config,
+                                         const std::string& arguments = "")
+{
+    util::writeFile("partitions-assets.tmp", assets);
+    util::writeFile("partitions-config.tmp", config);
+    return util::packImage("partitions --partition 1:1.0:partitions-assets.tmp "
+                           "--partition 2:" + config_version + ":partitions-config.tmp " + arguments,
+                           {images::AppValid2.begin(), images::AppValid2.end()});
+}
+
+}
+
+
+TEST_CASE("Partitions-Routing")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    static constexpr std::uint32_t AssetsRegionSize = 32 * 1024;
+    static constexpr std::uint32_t ConfigRegionSize = 8 * 1024;
+
+    const auto assets = makeBlob(20000, 1);
+    const auto config = makeBlob(1000, 2);
+    auto new_config = config;
+    new_config.at(500) ^= 0xFFU;
+
+    mocks::Platform platform;
+    mocks::FlashSimulator flash(ROMSize, 4096);
+    mocks::FileMappedROMBackend assets_rom("partitions-assets-rom.tmp", AssetsRegionSize);
+    mocks::FlashSimulator config_rom(ConfigRegionSize, 1024);
+
+    kocherga_partitions::PartitionFilter filter;
+    REQUIRE(filter.addPartition(1, assets_rom, AssetsRegionSize));
+    REQUIRE(filter.addPartition(2, config_rom, ConfigRegionSize));
+    REQUIRE(!filter.addPartition(2, config_rom, ConfigRegionSize));     // Duplicate
+    REQUIRE(!filter.addPartition(0, config_rom, ConfigRegionSize));     // Reserved for the application
+    REQUIRE(!filter.getPartitionInfo(1));
+    REQUIRE(!filter.getPartitionInfo(2));
+
+    kocherga::BootloaderController blc(platform, flash, ROMSize);
+    REQUIRE(blc.addStreamFilter(filter));
+
+    // All partitions are written into their regions
+    const auto full = packPartitions("0.1", assets, config);
+    {
+        mocks::Protocol proto(full.data(), full.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(flash.isSameImage(images::AppValid2.data(), images::AppValid2.size()));
+        REQUIRE(assets_rom.isSameImage(assets.data(), assets.size()));
+        REQUIRE(config_rom.isSameImage(config.data(), config.size()));
+
+        const auto info = filter.getPartitionInfo(1);
+        REQUIRE(info);
+        REQUIRE(info->size == assets.size());
+        REQUIRE(info->major_version == 1);
+        REQUIRE(info->minor_version == 0);
+        kocherga::CRC64 crc;
+        crc.add(assets.data(), assets.size());
+        REQUIRE(info->crc == crc.get());
+        REQUIRE(filter.getPartitionInfo(2)->minor_version == 1);
+        // Only the sectors of the partition and the one of its descriptor are erased
+        REQUIRE(config_rom.getEraseCount() == 2);
+    }
+
+    // Nothing is written if nothing has changed; the download is terminated early when the app is reached
+    {
+        const auto assets_writes = assets_rom.getWriteCount();
+        const auto config_writes = config_rom.getWrittenByteCount();
+        blc.cancelBoot();
+        mocks::Protocol proto(full.data(), full.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(proto));
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_received < full.size());
+        REQUIRE(assets_rom.getWriteCount() == assets_writes);
+        REQUIRE(config_rom.getWrittenByteCount() == config_writes);
+        REQUIRE(config_rom.getEraseCount() == 2);
+    }
+
+    // Only the changed partition is written
+    {
+        const auto assets_writes = assets_rom.getWriteCount();
+        const auto update = packPartitions("0.2", assets, new_config);
+        blc.cancelBoot();
+        mocks::Protocol proto(update.data(), update.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(proto));
+        REQUIRE(assets_rom.getWriteCount() == assets_writes);
+        REQUIRE(config_rom.isSameImage(new_config.data(), new_config.size()));
+        REQUIRE(filter.getPartitionInfo(2)->minor_version == 2);
+        REQUIRE(blc.getAppInfo());
+    }
+
+    // The unchanged partitions are omitted from the image if the installed one is known
+    {
+        util::writeFile("partitions-base.tmp", full);
+        const auto update = packPartitions("0.3", assets, config, "--base partitions-base.tmp");
+        REQUIRE(update.size() < (full.size() - assets.size()));
+        blc.cancelBoot();
+        mocks::Protocol proto(update.data(), update.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(proto));
+        REQUIRE(config_rom.isSameImage(config.data(), config.size()));
+        REQUIRE(filter.getPartitionInfo(1)->major_version == 1);
+        REQUIRE(filter.getPartitionInfo(2)->minor_version == 3);
+    }
+
+    // Corrupted contents are detected, and the descriptor of the region remains invalid
+    {
+        auto corrupted = packPartitions("0.4", assets, new_config);
+        corrupted.at(corrupted.size() - images::AppValid2.size() - 10U) ^= 1U;
+        blc.cancelBoot();
+        mocks::Protocol proto(corrupted.data(), corrupted.size());
+        REQUIRE(-kocherga_partitions::ErrPartitionCRCMismatch == blc.upgradeApp(proto));
+        REQUIRE(!filter.getPartitionInfo(2));
+        REQUIRE(filter.getPartitionInfo(1));
+    }
+
+    // Truncated stream; the upgrade of the region is finalized nevertheless
+    {
+        const auto update = packPartitions("0.5", assets, config);
+        blc.cancelBoot();
+        mocks::Protocol proto(update.data(), 100);
+        REQUIRE(-kocherga_partitions::ErrInvalidImage == blc.upgradeApp(proto));
+        REQUIRE(!filter.getPartitionInfo(2));
+
+        mocks::Protocol proto_full(update.data(), update.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(proto_full));
+        REQUIRE(config_rom.isSameImage(config.data(), config.size()));
+        REQUIRE(filter.getPartitionInfo(2)->minor_version == 5);
+    }
+
+    // The protocol fails in the middle of a partition; the upgrade of the region is finalized right away
+    {
+        const auto update = packPartitions("0.6", assets, new_config);
+        blc.cancelBoot();
+        mocks::InterruptedProtocol proto(update.data(), update.size() - images::AppValid2.size() - 500U);
+        REQUIRE(mocks::InterruptedProtocol::ErrLinkLost == blc.upgradeApp(proto));
+        REQUIRE(!config_rom.isUpgradeInProgress());
+        REQUIRE(!filter.getPartitionInfo(2));
+
+        mocks::Protocol proto_full(update.data(), update.size());
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(proto_full));
+        REQUIRE(config_rom.isSameImage(new_config.data(), new_config.size()));
+        REQUIRE(filter.getPartitionInfo(2)->minor_version == 6);
+    }
+
+    // Unknown partition
+    {
+        kocherga_partitions::PartitionFilter other;
+        REQUIRE(other.addPartition(2, config_rom, ConfigRegionSize));
+        mocks::Platform other_platform;
+        kocherga::BootloaderController other_blc(other_platform, flash, ROMSize);
+        REQUIRE(other_blc.addStreamFilter(other));
+        mocks::Protocol proto(full.data(), full.size());
+        REQUIRE(-kocherga_partitions::ErrUnknownPartition == other_blc.upgradeApp(proto));
+    }
+}
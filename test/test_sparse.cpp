@@ -0,0 +1,153 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Zubax Robotics
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Author: Pavel Kirienko <pavel.kirienko@zubax.com>
+ */
+
+// We want to ensure that assertion checks are enabled when tests are run, for extra safety
+#ifdef NDEBUG
+# undef NDEBUG
+#endif
+
+#define KOCHERGA_TRACE std::printf
+
+// The library headers must be included first to make sure that they don't have any hidden include dependencies.
+#include <kocherga_sparse.hpp>
+
+#include "catch.hpp"
+#include "mocks.hpp"
+#include "images.hpp"
+#include "util.hpp"
+
+
+namespace
+{
+
+/**
+ * Returns a copy of the image with blank regions inserted at the specified offset and appended at the end,
+ * like the padding between the sections of the image; the app descriptor is updated accordingly.
+ */
+std::vector<std::uint8_t> makePaddedImage(const std::vector<std::uint8_t>& image,
+                                          std::size_t gap_offset,
+                                          std::size_t gap_size,
+                                          std::size_t tail_size)
+{
+    static const std::string Signature = "APDesc00";
+    std::vector<std::uint8_t> out(image.begin(), image.begin() + std::ptrdiff_t(gap_offset));
+    out.insert(out.end(), gap_size, 0xFF);
+    out.insert(out.end(), image.begin() + std::ptrdiff_t(gap_offset), image.end());
+    out.insert(out.end(), tail_size, 0xFF);
+
+    const auto desc = std::size_t(std::search(out.begin(), out.end(), Signature.begin(), Signature.end()) -
+                                  out.begin());
+    if (desc >= gap_offset)
+    {
+        throw std::runtime_error("App descriptor not found");
+    }
+    for (std::size_t i = 0; i < 4; i++)
+    {
+        out.at(desc + 16 + i) = std::uint8_t(out.size() >> (i * 8U));
+    }
+    std::fill_n(out.begin() + std::ptrdiff_t(desc + 8), 8, 0);
+    kocherga::CRC64 crc;
+    crc.add(out.data(), out.size());
+    const auto value = crc.get();
+    for (std::size_t i = 0; i < 8; i++)
+    {
+        out.at(desc + 8 + i) = std::uint8_t(value >> (i * 8U));
+    }
+    return out;
+}
+
+const std::vector<std::uint8_t> Image = makePaddedImage({images::AppValid2.begin(), images::AppValid2.end()},   // NOLINT
+                                                        4096, 20 * 1024, 12 * 1024);
+
+}
+
+
+TEST_CASE("Sparse-Holes")
+{
+    static constexpr std::uint32_t ROMSize = 64 * 1024;
+    static constexpr std::uint32_t SectorSize = 4096;
+
+    const auto sparse = util::packImage("sparse", Image);
+    REQUIRE(sparse.size() < images::AppValid2.size() + 100U);
+
+    // The holes are erased but not written
+    {
+        mocks::Platform platform;
+        mocks::FlashSimulator flash(ROMSize, SectorSize);
+        kocherga_sparse::SparseFilter filter;
+        kocherga::BootloaderController blc(platform, flash, ROMSize);
+        REQUIRE(blc.addStreamFilter(filter));
+
+        mocks::SizeHintingProtocol proto(sparse.data(), sparse.size(), std::uint32_t(sparse.size()));
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(blc.getAppInfo());
+        REQUIRE(blc.getAppInfo()->image_size == Image.size());
+        REQUIRE(flash.isSameImage(Image.data(), Image.size()));
+
+        const auto& stat = blc.getLastUpgradeStatistics();
+        REQUIRE(stat.bytes_received == sparse.size());
+        REQUIRE(stat.bytes_decoded == Image.size());
+        REQUIRE(stat.pages_in_holes > 0);
+        REQUIRE(flash.getWrittenByteCount() < images::AppValid2.size() + 2U * SectorSize);
+    }
+
+    // If the erasing is not managed by the controller, the holes are written like any other data
+    {
+        mocks::Platform platform;
+        mocks::FileMappedROMBackend rom("sparse-test-rom.tmp", ROMSize);
+        kocherga_sparse::SparseFilter filter;
+        kocherga::BootloaderController blc(platform, rom, ROMSize);
+        REQUIRE(blc.addStreamFilter(filter));
+
+        mocks::Protocol proto(sparse.data(), sparse.size());
+        REQUIRE(0 == blc.upgradeApp(proto));
+        REQUIRE(rom.isSameImage(Image.data(), Image.size()));
+        REQUIRE(blc.getLastUpgradeStatistics().pages_in_holes == 0);
+
+        // Truncated stream
+        blc.cancelBoot();
+        mocks::Protocol proto_truncated(sparse.data(), sparse.size() - 1U);
+        REQUIRE(-kocherga_sparse::ErrInvalidImage == blc.upgradeApp(proto_truncated));
+
+        // The hole extends past the end of the image
+        std::vector<std::uint8_t> bad(sparse.begin(), sparse.begin() + 16);
+        bad.insert(bad.end(), {0x03, 0x80, 0x80, 0x80, 0x01});
+        mocks::Protocol proto_bad(bad.data(), bad.size());
+        REQUIRE(-kocherga_sparse::ErrInvalidImage == blc.upgradeApp(proto_bad));
+
+        // Record tag that does not fit into 32 bits; it would be a valid hole if the excess bits were discarded
+        std::vector<std::uint8_t> overlong(sparse.begin(), sparse.begin() + 8);
+        overlong.insert(overlong.end(), {1, 0, 0, 0, 0, 0, 0, 0});                // The image is one byte long
+        overlong.insert(overlong.end(), {0x83, 0x80, 0x80, 0x80, 0x10});
+        mocks::Protocol proto_overlong(overlong.data(), overlong.size());
+        REQUIRE(-kocherga_sparse::ErrInvalidImage == blc.upgradeApp(proto_overlong));
+
+        // Trailing garbage after the end of the image
+        auto trailing = sparse;
+        trailing.push_back(0);
+        mocks::Protocol proto_trailing(trailing.data(), trailing.size());
+        REQUIRE(-kocherga_sparse::ErrInvalidImage == blc.upgradeApp(proto_trailing));
+    }
+}
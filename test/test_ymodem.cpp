@@ -43,6 +43,8 @@
 #include <functional>
 #include <iostream>
 #include <utility>
+#include <deque>
+#include <string>
 #include <poll.h>
 
 
@@ -178,6 +180,97 @@ struct ControlCharacters
     static constexpr std::uint8_t C   = 0x43;
 };
 
+/**
+ * A YMODEM-1K sender that runs in the same process instead of 'sz', so that the tests can see how the transfer
+ * has ended from the point of view of the sender. It replies to the receiver immediately.
+ */
+class SenderPort final : public kocherga_ymodem::IYModemPlatform
+{
+    static constexpr std::size_t BlockSize = 1024;
+
+    const std::vector<std::uint8_t> file_;
+    std::deque<std::uint8_t> output_;           ///< Bytes that are yet to be received by the receiver
+    std::size_t current_block_ = 0;             ///< The zero block contains the file name and size
+    bool eot_sent_ = false;
+    bool completed_ = false;
+    bool cancelled_ = false;
+
+    void sendBlock(std::uint8_t sequence_id, std::vector<std::uint8_t> payload, std::uint8_t padding)
+    {
+        payload.resize(BlockSize, padding);
+        output_.push_back(ControlCharacters::STX);
+        output_.push_back(sequence_id);
+        output_.push_back(std::uint8_t(~sequence_id));
+        output_.insert(output_.end(), payload.begin(), payload.end());
+        output_.push_back(std::uint8_t(std::accumulate(payload.begin(), payload.end(), 0)));
+    }
+
+    void sendCurrentBlock()
+    {
+        const auto offset = (current_block_ - 1U) * BlockSize;
+        if (current_block_ == 0)
+        {
+            const auto header = std::string("image.bin") + '\0' + std::to_string(file_.size());
+            sendBlock(0, {header.begin(), header.end()}, 0);
+        }
+        else if (offset < file_.size())
+        {
+            const auto end = file_.begin() + std::ptrdiff_t(std::min(offset + BlockSize, file_.size()));
+            sendBlock(std::uint8_t(current_block_), {file_.begin() + std::ptrdiff_t(offset), end}, 0x1A);
+        }
+        else
+        {
+            output_.push_back(ControlCharacters::EOT);
+            eot_sent_ = true;
+        }
+    }
+
+public:
+    explicit SenderPort(std::vector<std::uint8_t> file) : file_(std::move(file)) { }
+
+    Result emit(std::uint8_t byte, std::chrono::microseconds) final
+    {
+        if (byte == ControlCharacters::NAK)
+        {
+            output_.clear();
+            sendCurrentBlock();
+        }
+        else if (byte == ControlCharacters::ACK)
+        {
+            completed_ = completed_ || eot_sent_;
+            if (!completed_ && (current_block_++ > 0))  // The first data block is requested with NAK
+            {
+                sendCurrentBlock();
+            }
+        }
+        else if (byte == ControlCharacters::CAN)
+        {
+            cancelled_ = cancelled_ || !completed_;     // After the file, CAN means that no more files are wanted
+        }
+        return Result::Success;
+    }
+
+    Result receive(std::uint8_t& out_byte, std::chrono::microseconds) final
+    {
+        if (output_.empty())
+        {
+            return Result::Timeout;
+        }
+        out_byte = output_.front();
+        output_.pop_front();
+        return Result::Success;
+    }
+
+    std::chrono::microseconds getMonotonicUptime() const final
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch());
+    }
+
+    /// True if the transfer has ended normally, as far as the sender can tell
+    bool isSuccessful() const { return completed_ && !cancelled_; }
+};
+
 }
 
 
@@ -317,3 +410,34 @@ TEST_CASE("YModem-Timeout-slow")
         REQUIRE(seconds < 70);
     }
 }
+
+
+TEST_CASE("YModem-AlreadyInstalled")
+{
+    static constexpr std::uint32_t ROMSize = 128 * 1024;
+    const std::vector<std::uint8_t> image(images::AppValid2.begin(), images::AppValid2.end());
+
+    mocks::Platform platform;
+    mocks::FlashSimulator flash(ROMSize, 4096);
+    kocherga::BootloaderController blc(platform, flash, ROMSize);
+    {
+        SenderPort port(image);
+        kocherga_ymodem::YModemProtocol ym(port);
+        REQUIRE(0 == blc.upgradeApp(ym));
+        REQUIRE(port.isSuccessful());
+        REQUIRE(flash.isSameImage(image.data(), image.size()));
+    }
+
+    // The rest of the file is received and discarded, so that the sender reports a success rather than a cancellation
+    blc.cancelBoot();
+    {
+        const auto written = flash.getWrittenByteCount();
+        SenderPort port(image);
+        kocherga_ymodem::YModemProtocol ym(port);
+        REQUIRE(kocherga::ResultAppUnchanged == blc.upgradeApp(ym));
+        REQUIRE(port.isSuccessful());
+        REQUIRE(blc.getLastUpgradeStatistics().bytes_received < image.size());
+        REQUIRE(flash.getWrittenByteCount() == written);
+        REQUIRE(blc.getAppInfo());
+    }
+}
@@ -25,10 +25,17 @@
 
 #pragma once
 
+#include <kocherga.hpp>
 #include <cstdlib>
 #include <sstream>
 #include <iomanip>
 #include <cstdint>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <iterator>
 
 
 namespace util
@@ -105,4 +112,71 @@ inline std::string makeHexDump(const Container& cont)
     return makeHexDump(std::begin(cont), std::end(cont));
 }
 
+/**
+ * Returns a copy of the application image with the specified version number in the app descriptor,
+ * and with the CRC updated accordingly.
+ */
+template <typename Container>
+inline std::vector<std::uint8_t> setImageVersion(const Container& image,
+                                                 std::uint8_t major_version,
+                                                 std::uint8_t minor_version)
+{
+    static const std::string Signature = "APDesc00";
+    std::vector<std::uint8_t> out(std::begin(image), std::end(image));
+    const auto desc = std::size_t(std::search(out.begin(), out.end(), Signature.begin(), Signature.end()) -
+                                  out.begin());
+    if (desc >= out.size())
+    {
+        throw std::runtime_error("App descriptor not found");
+    }
+
+    out.at(desc + 8 + 16) = major_version;
+    out.at(desc + 8 + 17) = minor_version;
+
+    std::fill_n(out.begin() + std::ptrdiff_t(desc + 8), 8, 0);
+    kocherga::CRC64 crc;
+    crc.add(out.data(), out.size());
+    const auto value = crc.get();
+    for (std::size_t i = 0; i < 8; i++)
+    {
+        out.at(desc + 8 + i) = std::uint8_t(value >> (i * 8U));
+    }
+    return out;
+}
+
+inline void writeFile(const std::string& name, const std::vector<std::uint8_t>& data)
+{
+    std::ofstream f(name, std::ios::binary | std::ios::out | std::ios::trunc);
+    f.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+    if (!f)
+    {
+        throw std::runtime_error("Could not write " + name);
+    }
+}
+
+inline std::vector<std::uint8_t> readFile(const std::string& name)
+{
+    std::ifstream f(name, std::ios::binary | std::ios::in);
+    if (!f)
+    {
+        throw std::runtime_error("Could not read " + name);
+    }
+    return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+/**
+ * Encodes the image using the host tool pack_image.py; the arguments are inserted before the file names.
+ */
+inline std::vector<std::uint8_t> packImage(const std::string& arguments, const std::vector<std::uint8_t>& image)
+{
+    writeFile("pack-image-input.tmp", image);
+    const std::string command = std::string("python3 ") + KOCHERGA_TEST_SOURCE_DIR + "/../pack_image.py " +
+                                arguments + " pack-image-input.tmp pack-image-output.tmp";
+    if (std::system(command.c_str()) != 0)
+    {
+        throw std::runtime_error("Command failed: " + command);
+    }
+    return readFile("pack-image-output.tmp");
+}
+
 }  // namespace util